@@ -172,6 +172,62 @@ atomic_dec_64_nv(volatile uint64_t *p)
     return r;
 }
 
+uint64_t
+atomic_add_64_nv(volatile uint64_t *p, uint64_t v)
+{
+    uint64_t r;
+
+    ANNOTATE_HAPPENS_AFTER(*p);
+#ifdef HAVE___ATOMIC
+    r = __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST);
+#elif defined(HAVE___SYNC)
+    r = __sync_fetch_and_add(p, v) + v;
+#elif defined(WIN32)
+    r = InterlockedExchangeAdd64(p, v) + v;
+#elif defined(HAVE_INTEL_INTRINSICS)
+    r = _InterlockedExchangeAdd64((volatile int64_t *)p, v) + v;
+#elif defined(HAVE_PTHREAD)
+    (void) pthread_mutex_lock(&atomic_lock);
+    r = (*p += v);
+    (void) pthread_mutex_unlock(&atomic_lock);
+#else
+    r = (*p += v);
+#endif
+
+    ANNOTATE_HAPPENS_BEFORE(*p);
+    return r;
+}
+
+void *
+atomic_swap_ptr(volatile void **p, void *newval)
+{
+    void *r;
+
+    ANNOTATE_HAPPENS_AFTER(*p);
+#ifdef HAVE___ATOMIC
+    r = (void *)(uintptr_t)/*drop volatile*/__atomic_exchange_n(p, newval, __ATOMIC_SEQ_CST);
+#elif defined(HAVE___SYNC)
+    /* __sync_lock_test_and_set() is only an acquire barrier */
+    __sync_synchronize();
+    r = (void *)(uintptr_t)__sync_lock_test_and_set(p, newval);
+#elif defined(WIN32)
+    r = InterlockedExchangePointer(p, newval);
+#elif defined(HAVE_INTEL_INTRINSICS)
+    r = _InterlockedExchangePointer(p, newval);
+#elif defined(HAVE_PTHREAD)
+    (void) pthread_mutex_lock(&atomic_lock);
+    r = (void *)/*drop volatile*/*p;
+    *p = newval;
+    (void) pthread_mutex_unlock(&atomic_lock);
+#else
+    r = (void *)/*drop volatile*/*p;
+    *p = newval;
+#endif
+
+    ANNOTATE_HAPPENS_BEFORE(*p);
+    return r;
+}
+
 void *
 atomic_cas_ptr(volatile void **p, void *oldval, void *newval)
 {
@@ -33,13 +33,15 @@
 
 #include <stdint.h>
 
-/* Increment, decrement, and CAS with sequentally consisten ordering */
+/* Increment, decrement, add, swap, and CAS with sequentally consisten ordering */
 uint32_t atomic_inc_32_nv(volatile uint32_t *);
 uint32_t atomic_dec_32_nv(volatile uint32_t *);
 
 uint64_t atomic_inc_64_nv(volatile uint64_t *);
 uint64_t atomic_dec_64_nv(volatile uint64_t *);
+uint64_t atomic_add_64_nv(volatile uint64_t *, uint64_t);
 
+void *atomic_swap_ptr(volatile void **, void *);
 void *atomic_cas_ptr(volatile void **, void *, void *);
 uint32_t atomic_cas_32(volatile uint32_t *, uint32_t, uint32_t);
 uint64_t atomic_cas_64(volatile uint64_t *, uint64_t, uint64_t);
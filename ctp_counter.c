@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A striped counter; see ctp_counter.h.
+ *
+ * The cells follow the counter's header in one cache line-aligned
+ * allocation.  There's a power of 2 number of them, at least as many
+ * as there are CPUs (up to MAX_CELLS), so that on Linux each CPU has
+ * its own.  Threads can be preempted and migrated between picking a
+ * cell and adding to it, so adds are atomic all the same, but they're
+ * uncontended unless that happens.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE     /* sched_getcpu() */
+#endif
+
+#include <sys/types.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ctp_counter.h"
+#include "atomics.h"
+
+#define CACHE_LINE      64
+#define MAX_CELLS       256
+
+struct counter_cell {
+    volatile uint64_t   value;  /* atomic */
+    char                pad[CACHE_LINE - sizeof(uint64_t)];
+};
+
+struct ctp_counter_s {
+    uint32_t            mask;   /* number of cells - 1 */
+    char                pad[CACHE_LINE - sizeof(uint32_t)];
+    struct counter_cell cells[];
+};
+
+/*
+ * Pick the caller's cell: its CPU's, or else one picked by hashing the
+ * address of its stack.
+ */
+static struct counter_cell *
+counter_cell(ctp_counter c)
+{
+    uint64_t h;
+#ifdef __linux__
+    int cpu = sched_getcpu();
+
+    if (cpu >= 0)
+        return &c->cells[cpu & c->mask];
+#endif
+    h = ((uintptr_t)&h >> 12) * 0x9E3779B97F4A7C15ULL;
+    return &c->cells[(h >> 32) & c->mask];
+}
+
+/**
+ * Initialize a striped counter to zero
+ *
+ * @param [out] cp The new counter
+ *
+ * @return Zero on success, else a system error number
+ */
+int
+ctp_counter_init(ctp_counter *cp)
+{
+    ctp_counter c;
+    uint32_t ncells = 1;
+    long ncpus;
+    void *p;
+    int err;
+
+    *cp = NULL;
+    ncpus = sysconf(_SC_NPROCESSORS_CONF);
+    while (ncells < MAX_CELLS && ncells < ncpus)
+        ncells <<= 1;
+    err = posix_memalign(&p, CACHE_LINE,
+                         sizeof(*c) + ncells * sizeof(c->cells[0]));
+    if (err != 0)
+        return err;
+    c = p;
+    c->mask = ncells - 1;
+    while (ncells-- > 0)
+        c->cells[ncells].value = 0;
+    *cp = c;
+    return 0;
+}
+
+/**
+ * Destroy a striped counter
+ *
+ * @param [in] c A counter no thread is using
+ */
+void
+ctp_counter_destroy(ctp_counter c)
+{
+    free(c);
+}
+
+/**
+ * Add to a striped counter
+ *
+ * @param [in] c A counter
+ * @param [in] n The amount to add
+ */
+void
+ctp_counter_add(ctp_counter c, uint64_t n)
+{
+    (void) atomic_add_64_nv(&counter_cell(c)->value, n);
+}
+
+/**
+ * Read a striped counter
+ *
+ * @param [in] c A counter
+ *
+ * @return The sum of the amounts added to the counter
+ */
+uint64_t
+ctp_counter_read(ctp_counter c)
+{
+    uint64_t sum = 0;
+    uint32_t i;
+
+    for (i = 0; i <= c->mask; i++)
+        sum += atomic_read_64(&c->cells[i].value);
+    return sum;
+}
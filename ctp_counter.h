@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CTP_COUNTER_H
+#define CTP_COUNTER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A ctp_counter is a striped counter for events that many threads
+ * count at high rates (e.g., requests served per configuration
+ * version).  It has a cache line-sized cell per CPU, and adding to it
+ * is an atomic add to the cell of the CPU the caller is running on, so
+ * threads on different CPUs don't bounce a cache line between them.
+ * Reading it sums the cells, so reads are O(CPUs) and, with concurrent
+ * adds, not a snapshot of any one instant; they are meant to be rare.
+ *
+ * Where the CPU number is not available cells are picked by thread.
+ */
+typedef struct ctp_counter_s *ctp_counter;
+
+int      ctp_counter_init(ctp_counter *);
+void     ctp_counter_destroy(ctp_counter);
+
+void     ctp_counter_add(ctp_counter, uint64_t);
+uint64_t ctp_counter_read(ctp_counter);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CTP_COUNTER_H */
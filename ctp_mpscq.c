@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * An intrusive MPSC queue; see ctp_mpscq.h.
+ *
+ * The queue is a singly-linked list from tail (the oldest node, where
+ * the consumer pops) to head (the newest, where producers push), always
+ * holding at least one node, so that producers never deal with an
+ * empty list.  That's the stub node at first, and it's pushed again
+ * whenever the consumer would otherwise have to take the last node.
+ *
+ * A producer swaps its node in as the head, then links the previous
+ * head to it.  Until it does, the list is cut at the previous head:
+ * the consumer sees that node's next as NULL though head has moved on,
+ * and reports the queue empty rather than wait.
+ *
+ * Producers and the consumer write different cache lines.
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ctp_mpscq.h"
+#include "atomics.h"
+
+#define CACHE_LINE      64
+
+struct ctp_mpscq_s {
+    struct ctp_mpscq_node   *head;      /* atomic; producers swap */
+    char                    pad[CACHE_LINE - sizeof(void *)];
+    struct ctp_mpscq_node   *tail;      /* consumer only */
+    struct ctp_mpscq_node   stub;
+};
+
+/**
+ * Initialize an MPSC queue
+ *
+ * @param [out] qp The new, empty queue
+ *
+ * @return Zero on success, else a system error number
+ */
+int
+ctp_mpscq_init(ctp_mpscq *qp)
+{
+    ctp_mpscq q;
+    void *p;
+    int err;
+
+    *qp = NULL;
+    if ((err = posix_memalign(&p, CACHE_LINE, sizeof(*q))) != 0)
+        return err;
+    q = p;
+    q->stub.next = NULL;
+    q->head = q->tail = &q->stub;
+    *qp = q;
+    return 0;
+}
+
+/**
+ * Destroy an MPSC queue
+ *
+ * Nodes still in the queue are not touched.
+ *
+ * @param [in] q A queue no thread is using
+ */
+void
+ctp_mpscq_destroy(ctp_mpscq q)
+{
+    free(q);
+}
+
+/**
+ * Push a node onto an MPSC queue; any thread may do this
+ *
+ * @param [in] q A queue
+ * @param [in] n A node not already in a queue
+ */
+void
+ctp_mpscq_push(ctp_mpscq q, struct ctp_mpscq_node *n)
+{
+    struct ctp_mpscq_node *prev;
+
+    n->next = NULL;
+    prev = atomic_swap_ptr((volatile void **)&q->head, n);
+    atomic_write_ptr((volatile void **)&prev->next, n);
+}
+
+/**
+ * Pop the oldest node from an MPSC queue; only the consumer may do this
+ *
+ * @param [in] q A queue
+ *
+ * @return The oldest node, or NULL if the queue is empty or a push is
+ *         half-way done
+ */
+struct ctp_mpscq_node *
+ctp_mpscq_pop(ctp_mpscq q)
+{
+    struct ctp_mpscq_node *tail = q->tail;
+    struct ctp_mpscq_node *next;
+
+    next = atomic_read_ptr((volatile void **)&tail->next);
+    if (tail == &q->stub) {
+        if (next == NULL)
+            return NULL;
+        q->tail = tail = next;
+        next = atomic_read_ptr((volatile void **)&tail->next);
+    }
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+
+    /* tail is the last node we can see; is it the last one? */
+    if (tail != atomic_read_ptr((volatile void **)&q->head))
+        return NULL;    /* a producer is linking in the next one */
+
+    /* Put the stub back behind it so we can take it */
+    ctp_mpscq_push(q, &q->stub);
+    next = atomic_read_ptr((volatile void **)&tail->next);
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;        /* another producer got in before the stub */
+}
+
+/**
+ * Pop up to max of the oldest nodes from an MPSC queue; only the
+ * consumer may do this
+ *
+ * @param [in] q A queue
+ * @param [out] nodes Array of at least max node pointers
+ * @param [in] max Maximum number of nodes to pop
+ *
+ * @return The number of nodes popped into nodes[], oldest first
+ */
+size_t
+ctp_mpscq_pop_batch(ctp_mpscq q, struct ctp_mpscq_node **nodes, size_t max)
+{
+    size_t n;
+
+    for (n = 0; n < max; n++) {
+        if ((nodes[n] = ctp_mpscq_pop(q)) == NULL)
+            break;
+    }
+    return n;
+}
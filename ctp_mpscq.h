@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CTP_MPSCQ_H
+#define CTP_MPSCQ_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A ctp_mpscq is an intrusive multi-producer, single-consumer FIFO
+ * queue (after Dmitry Vyukov's), for handing work off from threads
+ * that must not block (e.g., readers deferring destruction) to one
+ * thread that does it.
+ *
+ * Callers embed a struct ctp_mpscq_node in their items (its next is
+ * private) and recover the items from dequeued nodes.  An item must
+ * not be pushed again until it has been popped.
+ *
+ * Pushing is wait-free: one atomic swap and one store, no matter what
+ * other producers or the consumer are doing.  Only one thread at a
+ * time may pop.  A pop can come up empty even though the queue isn't
+ * while a producer is between its swap and its store, in which case
+ * that producer's node and any pushed after it become available once
+ * the store is done.
+ */
+struct ctp_mpscq_node {
+    struct ctp_mpscq_node   *next;
+};
+
+typedef struct ctp_mpscq_s *ctp_mpscq;
+
+int    ctp_mpscq_init(ctp_mpscq *);
+void   ctp_mpscq_destroy(ctp_mpscq);
+
+void   ctp_mpscq_push(ctp_mpscq, struct ctp_mpscq_node *);
+struct ctp_mpscq_node *ctp_mpscq_pop(ctp_mpscq);
+size_t ctp_mpscq_pop_batch(ctp_mpscq, struct ctp_mpscq_node **, size_t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CTP_MPSCQ_H */
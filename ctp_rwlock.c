@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A reader-biased read-write lock; see ctp_rwlock.h.
+ *
+ * The protocol, from BRAVO:
+ *
+ *  - a reader that sees rbias set claims its visible readers table slot
+ *    with a CAS (a full barrier) and then re-checks rbias; if it's still
+ *    set the reader has the lock, else it gives the slot back and takes
+ *    the underlying lock for reading
+ *
+ *  - a writer takes the underlying lock for writing, and if rbias is set
+ *    clears it (also a full barrier) and then waits for every slot of
+ *    the table holding this lock to be cleared
+ *
+ * Either the writer's scan sees a reader's slot, or the reader sees the
+ * bias revoked.  The table is shared by all locks, and slot collisions
+ * just send readers down the slow path.
+ *
+ * Revocation costs the writer a scan of the whole table, so after one a
+ * lock stays unbiased for INHIBIT_MULT times as long as the scan took,
+ * after which the next slow-path reader restores the bias.
+ */
+
+#include <sys/types.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ctp_rwlock.h"
+#include "atomics.h"
+
+#define VR_SIZE         4096    /* visible readers table size; power of 2 */
+#define INHIBIT_MULT    9
+
+struct ctp_rwlock_s {
+    pthread_rwlock_t    lock;           /* the underlying lock */
+    volatile uint32_t   rbias;          /* atomic; readers may use slots */
+    volatile uint64_t   inhibit_until;  /* atomic; no bias before (ns) */
+};
+
+static volatile void *visible_readers[VR_SIZE];
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Pick this thread's slot for this lock.  Threads are told apart by
+ * their stacks' addresses, which is cheaper (and more portable) than
+ * hashing a pthread_t.
+ */
+static volatile void **
+vr_slot(ctp_rwlock l)
+{
+    uint64_t h = ((uintptr_t)&h >> 12) ^ ((uintptr_t)l >> 4);
+
+    h *= 0x9E3779B97F4A7C15ULL;
+    return &visible_readers[(h >> 32) & (VR_SIZE - 1)];
+}
+
+/**
+ * Initialize a reader-biased read-write lock
+ *
+ * @param [out] lp The new lock
+ *
+ * @return Zero on success, else a system error number
+ */
+int
+ctp_rwlock_init(ctp_rwlock *lp)
+{
+    ctp_rwlock l;
+    int err;
+
+    *lp = NULL;
+    if ((l = calloc(1, sizeof(*l))) == NULL)
+        return ENOMEM;
+    if ((err = pthread_rwlock_init(&l->lock, NULL)) != 0) {
+        free(l);
+        return err;
+    }
+    l->rbias = 1;
+    *lp = l;
+    return 0;
+}
+
+/**
+ * Destroy a reader-biased read-write lock
+ *
+ * @param [in] l A lock that no thread holds
+ */
+void
+ctp_rwlock_destroy(ctp_rwlock l)
+{
+    if (l == NULL)
+        return;
+    (void) pthread_rwlock_destroy(&l->lock);
+    free(l);
+}
+
+/**
+ * Acquire a reader-biased read-write lock for reading
+ *
+ * @param [in] l A lock
+ * @param [out] cookiep Cookie for ctp_rwlock_rdunlock()
+ *
+ * @return Zero on success, else a system error number
+ */
+int
+ctp_rwlock_rdlock(ctp_rwlock l, void **cookiep)
+{
+    volatile void **slot;
+    int err;
+
+    *cookiep = NULL;
+    if (atomic_read_32(&l->rbias)) {
+        slot = vr_slot(l);
+        if (atomic_cas_ptr(slot, NULL, l) == NULL) {
+            if (atomic_read_32(&l->rbias)) {
+                *cookiep = (void *)slot;
+                return 0;   /* fast path */
+            }
+            atomic_write_ptr(slot, NULL);   /* a writer revoked the bias */
+        }
+    }
+
+    if ((err = pthread_rwlock_rdlock(&l->lock)) != 0)
+        return err;
+    if (!atomic_read_32(&l->rbias) &&
+        now_ns() >= atomic_read_64(&l->inhibit_until))
+        atomic_write_32(&l->rbias, 1);
+    return 0;
+}
+
+/**
+ * Release a reader-biased read-write lock held for reading
+ *
+ * @param [in] l A lock
+ * @param [in] cookie The cookie output by ctp_rwlock_rdlock()
+ *
+ * @return Zero on success, else a system error number
+ */
+int
+ctp_rwlock_rdunlock(ctp_rwlock l, void *cookie)
+{
+    if (cookie == NULL)
+        return pthread_rwlock_unlock(&l->lock);
+    atomic_write_ptr((volatile void **)cookie, NULL);
+    return 0;
+}
+
+/**
+ * Acquire a reader-biased read-write lock for writing
+ *
+ * @param [in] l A lock
+ *
+ * @return Zero on success, else a system error number
+ */
+int
+ctp_rwlock_wrlock(ctp_rwlock l)
+{
+    uint64_t start, end;
+    size_t i;
+    int err;
+
+    if ((err = pthread_rwlock_wrlock(&l->lock)) != 0)
+        return err;
+    if (!atomic_read_32(&l->rbias))
+        return 0;
+
+    /* Revoke the bias, then wait for fast-path readers to leave */
+    (void) atomic_cas_32(&l->rbias, 1, 0);
+    start = now_ns();
+    for (i = 0; i < VR_SIZE; i++) {
+        while (atomic_read_ptr(&visible_readers[i]) == (void *)l)
+            sched_yield();
+    }
+    end = now_ns();
+    atomic_write_64(&l->inhibit_until, end + (end - start) * INHIBIT_MULT);
+    return 0;
+}
+
+/**
+ * Release a reader-biased read-write lock held for writing
+ *
+ * @param [in] l A lock
+ *
+ * @return Zero on success, else a system error number
+ */
+int
+ctp_rwlock_wrunlock(ctp_rwlock l)
+{
+    return pthread_rwlock_unlock(&l->lock);
+}
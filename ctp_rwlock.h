@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CTP_RWLOCK_H
+#define CTP_RWLOCK_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A ctp_rwlock is a reader-biased read-write lock (after BRAVO, Dice &
+ * Kogan, 2019) for data that must be mutated in place rather than
+ * copied and published with a thread_safe_var.
+ *
+ * While the lock is biased towards readers, readers don't touch the
+ * lock at all: each publishes the lock's address in a slot of a global
+ * "visible readers" table, picked by hashing the thread and the lock,
+ * so readers of the same lock write to different cache lines.  A writer
+ * revokes the bias, then waits for the readers in the table to leave.
+ * Readers that find their slot taken, or the bias revoked, use an
+ * ordinary read-write lock.  The bias is restored by a later reader
+ * once enough time has passed, proportional to what the last revocation
+ * cost, so that write-heavy locks don't pay for revocations often.
+ *
+ * ctp_rwlock_rdlock() outputs a cookie to pass to ctp_rwlock_rdunlock().
+ */
+typedef struct ctp_rwlock_s *ctp_rwlock;
+
+int  ctp_rwlock_init(ctp_rwlock *);
+void ctp_rwlock_destroy(ctp_rwlock);
+
+int  ctp_rwlock_rdlock(ctp_rwlock, void **);
+int  ctp_rwlock_rdunlock(ctp_rwlock, void *);
+int  ctp_rwlock_wrlock(ctp_rwlock);
+int  ctp_rwlock_wrunlock(ctp_rwlock);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CTP_RWLOCK_H */
@@ -0,0 +1,1624 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Tests for thread_safe_var API features, as opposed to the stress test
+ * in t.c.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _BSD_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "thread_safe_global.h"
+#include "ctp_counter.h"
+#include "atomics.h"
+
+#define NREADERS    4
+#define NWRITES     2000
+
+#define STATIC_THREADS  4
+#define STATIC_VERSIONS 3
+
+static uint32_t live_vals;      /* values not yet destroyed */
+static uint32_t writer_done;
+
+static uint64_t *
+new_u64(uint64_t v)
+{
+    uint64_t *p;
+
+    if ((p = malloc(sizeof(*p))) == NULL)
+        err(1, "malloc() failed");
+    *p = v;
+    atomic_inc_32_nv(&live_vals);
+    return p;
+}
+
+static void
+u64_dtor(void *p)
+{
+    atomic_dec_32_nv(&live_vals);
+    free(p);
+}
+
+static void
+notified(struct thread_safe_var_waiter *w, uint64_t version)
+{
+    *(uint64_t *)(w + 1) = version;
+}
+
+static void *
+set_if_test(void *data)
+{
+    struct {
+        struct thread_safe_var_waiter w;
+        uint64_t version;
+    } waiter;
+    thread_safe_var vp;
+    uint64_t version;
+    uint64_t *v;
+
+    if ((errno = thread_safe_var_init(&vp, u64_dtor)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    if (thread_safe_var_version(vp) != 0)
+        errx(1, "set_if: a new var should have version 0");
+
+    memset(&waiter, 0, sizeof(waiter));
+    waiter.w.after = 1;
+    waiter.w.notify = notified;
+    if ((errno = thread_safe_var_notify(vp, &waiter.w)) != 0)
+        err(1, "thread_safe_var_notify() failed");
+
+    if ((errno = thread_safe_var_set_if(vp, new_u64(1), 0, &version)) != 0)
+        err(1, "thread_safe_var_set_if() failed");
+    if (version != 1 || thread_safe_var_version(vp) != 1)
+        errx(1, "set_if: wrong version");
+    if (waiter.version != 0)
+        errx(1, "set_if: waiter notified too soon");
+
+    v = new_u64(2);
+    if (thread_safe_var_set_if(vp, v, 0, &version) != EAGAIN)
+        errx(1, "set_if: stale version should fail");
+    if ((errno = thread_safe_var_set_if(vp, v, 1, &version)) != 0)
+        err(1, "thread_safe_var_set_if() failed");
+    if (version != 2 || waiter.version != 2)
+        errx(1, "set_if: waiter not notified");
+
+    thread_safe_var_destroy(vp);
+    return data;
+}
+
+#define NOTIFY_WAITERS  4
+#define NOTIFY_ROUNDS   500
+
+struct notify_waiter {
+    struct thread_safe_var_waiter   w;
+    uint32_t                        calls;
+    uint64_t                        version;
+};
+
+static uint32_t notify_done;
+
+static void
+notify_count(struct thread_safe_var_waiter *w, uint64_t version)
+{
+    struct notify_waiter *nw = (struct notify_waiter *)w;
+
+    atomic_write_64(&nw->version, version);
+    atomic_inc_32_nv(&nw->calls);
+}
+
+/*
+ * Register a waiter over and over while the writer publishes, so that
+ * registrations race with notify_waiters() requeueing the same waiter.
+ */
+static void *
+notify_waiter(void *data)
+{
+    thread_safe_var vp = data;
+    struct notify_waiter nw;
+    uint32_t i;
+
+    memset(&nw, 0, sizeof(nw));
+    nw.w.notify = notify_count;
+    for (i = 0; i < NOTIFY_ROUNDS; i++) {
+        nw.w.after = thread_safe_var_version(vp);
+        if ((errno = thread_safe_var_notify(vp, &nw.w)) != 0)
+            err(1, "thread_safe_var_notify() failed");
+        while (atomic_read_32(&nw.calls) == i)
+            sched_yield();
+        if (atomic_read_32(&nw.calls) != i + 1)
+            errx(1, "notify: waiter notified more than once");
+        if (atomic_read_64(&nw.version) <= nw.w.after)
+            errx(1, "notify: waiter notified of an old version");
+    }
+    atomic_inc_32_nv(&notify_done);
+    return NULL;
+}
+
+static void *
+notify_test(void *data)
+{
+    pthread_t waiters[NOTIFY_WAITERS];
+    thread_safe_var vp;
+    uint64_t n = 0;
+    size_t i;
+
+    if ((errno = thread_safe_var_init(&vp, u64_dtor)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    notify_done = 0;
+    for (i = 0; i < NOTIFY_WAITERS; i++) {
+        if ((errno = pthread_create(&waiters[i], NULL, notify_waiter,
+                                    vp)) != 0)
+            err(1, "pthread_create() failed");
+    }
+
+    /* Every registration is after some version, so keep publishing */
+    while (atomic_read_32(&notify_done) < NOTIFY_WAITERS) {
+        if ((errno = thread_safe_var_set(vp, new_u64(n++), NULL)) != 0)
+            err(1, "thread_safe_var_set() failed");
+    }
+
+    for (i = 0; i < NOTIFY_WAITERS; i++) {
+        if ((errno = pthread_join(waiters[i], NULL)) != 0)
+            err(1, "pthread_join() failed");
+    }
+    thread_safe_var_destroy(vp);
+    return data;
+}
+
+/*
+ * Combining: park a writer in eq (called with the write lock held),
+ * queue setters behind it, and check that the next writer to get the
+ * lock publishes all of their requests at once.  An even number of
+ * setters makes the slot-pair implementation round up the versions it
+ * skips.
+ */
+#define COMBINE_SETTERS 4
+#define COMBINE_BASE    100     /* setters' values */
+
+static pthread_mutex_t combine_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t combine_cv = PTHREAD_COND_INITIALIZER;
+static int combine_park;        /* the next eq call parks */
+static int combine_parked;
+static uint32_t combine_hashed;
+static uint32_t combine_destroyed[COMBINE_SETTERS];
+
+struct combine_setter {
+    thread_safe_var vp;
+    uint64_t        value;
+    uint64_t        version;
+};
+
+static uint64_t
+combine_hash(const void *v)
+{
+    (void) v;
+    atomic_inc_32_nv(&combine_hashed);
+    return 0;   /* so eq is always called */
+}
+
+static int
+combine_eq(const void *a, const void *b)
+{
+    (void) a;
+    (void) b;
+    (void) pthread_mutex_lock(&combine_lock);
+    if (combine_park) {
+        combine_park = 0;
+        combine_parked = 1;
+        (void) pthread_cond_broadcast(&combine_cv);
+        while (combine_parked)
+            (void) pthread_cond_wait(&combine_cv, &combine_lock);
+    }
+    (void) pthread_mutex_unlock(&combine_lock);
+    return 0;
+}
+
+static void
+combine_dtor(void *p)
+{
+    uint64_t v = *(uint64_t *)p;
+
+    if (v >= COMBINE_BASE)
+        atomic_inc_32_nv(&combine_destroyed[v - COMBINE_BASE]);
+    u64_dtor(p);
+}
+
+static void *
+combine_setter(void *data)
+{
+    struct combine_setter *s = data;
+
+    if ((errno = thread_safe_var_set(s->vp, new_u64(s->value),
+                                     &s->version)) != 0)
+        err(1, "thread_safe_var_set() failed");
+    return NULL;
+}
+
+static void *
+combine_test(void *data)
+{
+    struct combine_setter holder;
+    struct combine_setter setters[COMBINE_SETTERS];
+    pthread_t threads[COMBINE_SETTERS + 1];
+    thread_safe_var_attr attr;
+    thread_safe_var vp;
+    uint64_t version, expected, min;
+    uint64_t *cur;
+    uint32_t hashed;
+    size_t i, k, live = 0;
+
+    thread_safe_var_attr_init(&attr);
+    attr.eq = combine_eq;
+    attr.hash = combine_hash;
+    if ((errno = thread_safe_var_init_attr(&vp, combine_dtor, &attr)) != 0)
+        err(1, "thread_safe_var_init_attr() failed");
+    if ((errno = thread_safe_var_set(vp, new_u64(0), &version)) != 0)
+        err(1, "thread_safe_var_set() failed");
+
+    /* Park a writer with the lock held */
+    combine_park = 1;
+    holder.vp = vp;
+    holder.value = 1;
+    if ((errno = pthread_create(&threads[0], NULL, combine_setter,
+                                &holder)) != 0)
+        err(1, "pthread_create() failed");
+    (void) pthread_mutex_lock(&combine_lock);
+    while (!combine_parked)
+        (void) pthread_cond_wait(&combine_cv, &combine_lock);
+    (void) pthread_mutex_unlock(&combine_lock);
+
+    /* Queue setters behind it; they hash just before posting */
+    hashed = atomic_read_32(&combine_hashed);
+    for (i = 0; i < COMBINE_SETTERS; i++) {
+        setters[i].vp = vp;
+        setters[i].value = COMBINE_BASE + i;
+        if ((errno = pthread_create(&threads[i + 1], NULL, combine_setter,
+                                    &setters[i])) != 0)
+            err(1, "pthread_create() failed");
+    }
+    while (atomic_read_32(&combine_hashed) - hashed < COMBINE_SETTERS)
+        (void) usleep(1000);
+    (void) usleep(100000);
+
+    (void) pthread_mutex_lock(&combine_lock);
+    combine_parked = 0;
+    (void) pthread_cond_broadcast(&combine_cv);
+    (void) pthread_mutex_unlock(&combine_lock);
+    for (i = 0; i < COMBINE_SETTERS + 1; i++) {
+        if ((errno = pthread_join(threads[i], NULL)) != 0)
+            err(1, "pthread_join() failed");
+    }
+
+    if (holder.version != version + 1)
+        errx(1, "combine: the lock holder got the wrong version");
+
+    /*
+     * One publication for all the setters, numbered as if each had been
+     * published, the newest (current) one last.
+     */
+    expected = holder.version + COMBINE_SETTERS;
+#ifdef USE_TSV_SLOT_PAIR_DESIGN
+    if ((COMBINE_SETTERS - 1) & 0x1)
+        expected++;     /* the version skipped for parity */
+#endif
+    if (thread_safe_var_version(vp) != expected)
+        errx(1, "combine: published version %ju, expected %ju",
+             (uintmax_t)thread_safe_var_version(vp), (uintmax_t)expected);
+    min = expected - (COMBINE_SETTERS - 1);
+    for (i = 0; i < COMBINE_SETTERS; i++) {
+        if (setters[i].version < min || setters[i].version > expected)
+            errx(1, "combine: setter got version %ju, not in [%ju, %ju]",
+                 (uintmax_t)setters[i].version, (uintmax_t)min,
+                 (uintmax_t)expected);
+        for (k = 0; k < i; k++) {
+            if (setters[k].version == setters[i].version)
+                errx(1, "combine: two setters got version %ju",
+                     (uintmax_t)setters[i].version);
+        }
+    }
+
+    /* Superseded values are destroyed by their setters; one is current */
+    if ((errno = thread_safe_var_get(vp, (void **)&cur, &version)) != 0)
+        err(1, "thread_safe_var_get() failed");
+    for (i = 0; i < COMBINE_SETTERS; i++) {
+        if (atomic_read_32(&combine_destroyed[i]) > 1)
+            errx(1, "combine: value destroyed twice");
+        if (atomic_read_32(&combine_destroyed[i]) == 1)
+            continue;
+        live++;
+        if (*cur != COMBINE_BASE + i || setters[i].version != expected)
+            errx(1, "combine: a superseded value was not destroyed");
+    }
+    if (live != 1 || version != expected)
+        errx(1, "combine: wrong current value");
+    thread_safe_var_release(vp);
+    thread_safe_var_destroy(vp);
+    return data;
+}
+
+/* Fixed-size values recycled by the var's slab */
+#define SLAB_VALUE_SIZE 4096
+#define SLAB_CACHE      4
+
+struct slab_value {
+    uint64_t    gen;
+    uint64_t    *ext;   /* something the destructor must release */
+    char        pad[SLAB_VALUE_SIZE - 2 * sizeof(uint64_t)];
+};
+
+static void
+slab_dtor(void *p)
+{
+    struct slab_value *v = p;
+
+    if (v->ext == NULL || *v->ext != v->gen)
+        errx(1, "slab: destroying a corrupt value");
+    u64_dtor(v->ext);
+    v->ext = NULL;
+    /* The var recycles v itself */
+}
+
+static struct slab_value *
+slab_value(thread_safe_var vp, uint64_t gen)
+{
+    struct slab_value *v;
+
+    if ((v = thread_safe_var_value_alloc(vp)) == NULL)
+        err(1, "thread_safe_var_value_alloc() failed");
+    if (((uintptr_t)v & 0xf) != 0)
+        errx(1, "slab: value not aligned");
+    v->gen = gen;
+    v->ext = new_u64(gen);
+    memset(v->pad, (int)gen, sizeof(v->pad));
+    return v;
+}
+
+static void *
+slab_reader(void *data)
+{
+    thread_safe_var vp = data;
+    struct slab_value *v;
+    uint64_t version;
+    size_t i;
+
+    while (!atomic_read_32(&writer_done)) {
+        if ((errno = thread_safe_var_get(vp, (void **)&v, &version)) != 0)
+            err(1, "thread_safe_var_get() failed");
+        if (v == NULL)
+            continue;
+        if (v->ext == NULL || *v->ext != v->gen)
+            errx(1, "slab: reader saw a recycled value");
+        for (i = 0; i < sizeof(v->pad); i += 512) {
+            if (v->pad[i] != (char)v->gen)
+                errx(1, "slab: reader saw a recycled value");
+        }
+    }
+    thread_safe_var_release(vp);
+    return NULL;
+}
+
+static void *
+slab_test(void *data)
+{
+    pthread_t readers[NREADERS];
+    thread_safe_var_attr attr;
+    thread_safe_var vp;
+    struct slab_value *v;
+    void *seen[64];
+    size_t nseen = 0;
+    uint64_t gen;
+    size_t i, k;
+
+    thread_safe_var_attr_init(&attr);
+    attr.value_size = sizeof(struct slab_value);
+    attr.value_cache = SLAB_CACHE;
+    if ((errno = thread_safe_var_init_attr(&vp, slab_dtor, &attr)) != 0)
+        err(1, "thread_safe_var_init_attr() failed");
+
+    /* An unset value can be handed back */
+    v = slab_value(vp, 0);
+    u64_dtor(v->ext);
+    thread_safe_var_value_free(vp, v);
+
+    /* With no readers, a handful of buffers should go round and round */
+    for (gen = 1; gen < 100; gen++) {
+        v = slab_value(vp, gen);
+        for (k = 0; k < nseen && seen[k] != v; k++)
+            ;
+        if (k == nseen) {
+            if (nseen == sizeof(seen) / sizeof(seen[0]))
+                errx(1, "slab: values are not being recycled");
+            seen[nseen++] = v;
+        }
+        if ((errno = thread_safe_var_set(vp, v, NULL)) != 0)
+            err(1, "thread_safe_var_set() failed");
+    }
+    if (nseen > SLAB_CACHE + 2)
+        errx(1, "slab: used %zu buffers for 99 values", nseen);
+
+    atomic_write_32(&writer_done, 0);
+    for (i = 0; i < NREADERS; i++) {
+        if ((errno = pthread_create(&readers[i], NULL, slab_reader, vp)) != 0)
+            err(1, "pthread_create() failed");
+    }
+    for (i = 0; i < NWRITES; i++, gen++) {
+        if ((errno = thread_safe_var_set(vp, slab_value(vp, gen), NULL)) != 0)
+            err(1, "thread_safe_var_set() failed");
+    }
+    atomic_write_32(&writer_done, 1);
+    for (i = 0; i < NREADERS; i++) {
+        if ((errno = pthread_join(readers[i], NULL)) != 0)
+            err(1, "pthread_join() failed");
+    }
+    thread_safe_var_destroy(vp);
+    return data;
+}
+
+/* Values replicated per NUMA node */
+struct numa_value {
+    uint64_t    gen;
+    int         node;   /* -1 for the original */
+};
+
+static struct numa_value *
+numa_value(uint64_t gen, int node)
+{
+    struct numa_value *v;
+
+    if ((v = thread_safe_var_numa_alloc(sizeof(*v), node)) == NULL)
+        err(1, "thread_safe_var_numa_alloc() failed");
+    if (((uintptr_t)v & 0x3f) != 0)
+        errx(1, "numa: memory not aligned");
+    v->gen = gen;
+    v->node = node;
+    atomic_inc_32_nv(&live_vals);
+    return v;
+}
+
+static void
+numa_dtor(void *p)
+{
+    atomic_dec_32_nv(&live_vals);
+    thread_safe_var_numa_free(p);
+}
+
+static void *
+numa_replicate(void *p, int node)
+{
+    return numa_value(((struct numa_value *)p)->gen, node);
+}
+
+static void *
+numa_reader(void *data)
+{
+    thread_safe_var vp = data;
+    struct numa_value *v;
+    uint64_t last = 0;
+
+    while (!atomic_read_32(&writer_done)) {
+        if ((errno = thread_safe_var_get(vp, (void **)&v, NULL)) != 0)
+            err(1, "thread_safe_var_get() failed");
+        if (v == NULL)
+            continue;
+        if (v->node < 0 || v->node >= thread_safe_var_numa_nodes())
+            errx(1, "numa: reader got no replica");
+        if (v->gen < last)
+            errx(1, "numa: reader went back in time");
+        last = v->gen;
+    }
+    thread_safe_var_release(vp);
+    return NULL;
+}
+
+static void *
+numa_test(void *data)
+{
+    pthread_t readers[NREADERS];
+    thread_safe_var_attr attr;
+    thread_safe_var vp;
+    size_t i;
+
+    thread_safe_var_attr_init(&attr);
+    attr.replicate = numa_replicate;
+    if ((errno = thread_safe_var_init_attr(&vp, numa_dtor, &attr)) != 0)
+        err(1, "thread_safe_var_init_attr() failed");
+    atomic_write_32(&writer_done, 0);
+    for (i = 0; i < NREADERS; i++) {
+        if ((errno = pthread_create(&readers[i], NULL, numa_reader, vp)) != 0)
+            err(1, "pthread_create() failed");
+    }
+    for (i = 1; i <= NWRITES; i++) {
+        if ((errno = thread_safe_var_set(vp, numa_value(i, -1), NULL)) != 0)
+            err(1, "thread_safe_var_set() failed");
+    }
+    atomic_write_32(&writer_done, 1);
+    for (i = 0; i < NREADERS; i++) {
+        if ((errno = pthread_join(readers[i], NULL)) != 0)
+            err(1, "pthread_join() failed");
+    }
+    thread_safe_var_destroy(vp);
+    return data;
+}
+
+/* Setting a value equal to the current one publishes nothing */
+static int
+u64_eq(const void *a, const void *b)
+{
+    return *(const uint64_t *)a == *(const uint64_t *)b;
+}
+
+static uint64_t
+u64_hash(const void *p)
+{
+    return *(const uint64_t *)p * 0x9E3779B97F4A7C15ULL;
+}
+
+static void *
+dedup_test(void *data)
+{
+    thread_safe_var_attr attr;
+    thread_safe_var vp;
+    uint64_t v1, v2, v3;
+    uint32_t live;
+    void *p1, *p2;
+    int hashed;
+
+    for (hashed = 0; hashed < 2; hashed++) {
+        thread_safe_var_attr_init(&attr);
+        attr.eq = u64_eq;
+        attr.hash = hashed ? u64_hash : NULL;
+        if ((errno = thread_safe_var_init_attr(&vp, u64_dtor, &attr)) != 0)
+            err(1, "thread_safe_var_init_attr() failed");
+
+        if ((errno = thread_safe_var_set(vp, new_u64(1), &v1)) != 0 ||
+            (errno = thread_safe_var_get(vp, &p1, NULL)) != 0)
+            err(1, "thread_safe_var_set/get() failed");
+        live = atomic_read_32(&live_vals);
+        if ((errno = thread_safe_var_set(vp, new_u64(1), &v2)) != 0 ||
+            (errno = thread_safe_var_get(vp, &p2, NULL)) != 0)
+            err(1, "thread_safe_var_set/get() failed");
+        if (v2 != v1 || p2 != p1 || thread_safe_var_version(vp) != v1)
+            errx(1, "dedup: equal value was published");
+        if ((errno = thread_safe_var_set_if(vp, new_u64(1), v1, &v2)) != 0)
+            err(1, "thread_safe_var_set_if() failed");
+        if (v2 != v1 || atomic_read_32(&live_vals) != live)
+            errx(1, "dedup: equal value was published by set_if");
+
+        if ((errno = thread_safe_var_set(vp, new_u64(2), &v3)) != 0 ||
+            (errno = thread_safe_var_get(vp, &p2, NULL)) != 0)
+            err(1, "thread_safe_var_set/get() failed");
+        if (v3 <= v1 || *(uint64_t *)p2 != 2)
+            errx(1, "dedup: different value was not published");
+        thread_safe_var_destroy(vp);
+    }
+    return data;
+}
+
+/* Versions can be read back while they're in a var's history */
+#define HISTORY 3
+
+static void *
+history_test(void *data)
+{
+    thread_safe_var_attr attr;
+    thread_safe_var vp;
+    uint64_t versions[HISTORY + 3];
+    uint64_t *p;
+    size_t i, k;
+
+    thread_safe_var_attr_init(&attr);
+    attr.history = HISTORY;
+    if ((errno = thread_safe_var_init_attr(&vp, u64_dtor, &attr)) != 0)
+        err(1, "thread_safe_var_init_attr() failed");
+    if (thread_safe_var_get_version(vp, 1, (void **)&p) != ENOENT)
+        errx(1, "history: got a version of an unset var");
+
+    for (i = 0; i < sizeof(versions) / sizeof(versions[0]); i++) {
+        if ((errno = thread_safe_var_set(vp, new_u64(i), &versions[i])) != 0)
+            err(1, "thread_safe_var_set() failed");
+
+        /* The current version and HISTORY before it are available */
+        for (k = 0; k <= i; k++) {
+            errno = thread_safe_var_get_version(vp, versions[k], (void **)&p);
+            if (i - k <= HISTORY && (errno != 0 || *p != k))
+                errx(1, "history: version %zu of %zu not available", k, i);
+            if (i - k > HISTORY && errno != ENOENT)
+                errx(1, "history: version %zu of %zu still available", k, i);
+        }
+    }
+
+    /* A version read stays valid after it leaves the history */
+    if ((errno = thread_safe_var_get_version(vp, versions[i - 1 - HISTORY],
+                                             (void **)&p)) != 0)
+        err(1, "thread_safe_var_get_version() failed");
+    for (k = 0; k <= HISTORY; k++) {
+        if ((errno = thread_safe_var_set(vp, new_u64(i + k), NULL)) != 0)
+            err(1, "thread_safe_var_set() failed");
+    }
+    if (*p != i - 1 - HISTORY)
+        errx(1, "history: value read by version was destroyed");
+
+    /* Once released (and collected, in slot-list) it's gone */
+    thread_safe_var_release(vp);
+    if ((errno = thread_safe_var_set(vp, new_u64(0), NULL)) != 0)
+        err(1, "thread_safe_var_set() failed");
+    if (thread_safe_var_get_version(vp, versions[i - 1 - HISTORY],
+                                    (void **)&p) != ENOENT)
+        errx(1, "history: version still available");
+    thread_safe_var_destroy(vp);
+    return data;
+}
+
+/*
+ * Reading by version doesn't wait for writers: it works while a writer
+ * holds the write lock (parked in eq, as in the combining test), and
+ * readers racing writers only ever get the value of the version asked
+ * for.  Values are their versions here.
+ */
+#define HISTORY_READERS 4
+#define HISTORY_WRITES  2000
+
+static volatile uint32_t history_done;
+
+static void *
+history_reader(void *data)
+{
+    thread_safe_var vp = data;
+    uint64_t version, k;
+    uint64_t *p;
+
+    while (!atomic_read_32(&history_done)) {
+        if ((errno = thread_safe_var_get(vp, (void **)&p, &version)) != 0)
+            err(1, "thread_safe_var_get() failed");
+        for (k = 0; k <= HISTORY && k < version; k++) {
+            errno = thread_safe_var_get_version(vp, version - k, (void **)&p);
+            if (errno == ENOENT)
+                continue;   /* it left the history meanwhile */
+            if (errno != 0)
+                err(1, "thread_safe_var_get_version() failed");
+            if (*p != version - k)
+                errx(1, "history_race: version %ju has value %ju",
+                     (uintmax_t)(version - k), (uintmax_t)*p);
+        }
+    }
+    thread_safe_var_release(vp);
+    return NULL;
+}
+
+static void *
+history_race_test(void *data)
+{
+    pthread_t readers[HISTORY_READERS];
+    struct combine_setter holder;
+    thread_safe_var_attr attr;
+    thread_safe_var vp;
+    pthread_t t;
+    uint64_t version;
+    uint64_t *p;
+    size_t i;
+
+    thread_safe_var_attr_init(&attr);
+    attr.history = HISTORY;
+    attr.eq = combine_eq;
+    attr.hash = combine_hash;
+    if ((errno = thread_safe_var_init_attr(&vp, u64_dtor, &attr)) != 0)
+        err(1, "thread_safe_var_init_attr() failed");
+    for (i = 1; i <= 2; i++) {
+        if ((errno = thread_safe_var_set(vp, new_u64(i), &version)) != 0)
+            err(1, "thread_safe_var_set() failed");
+    }
+
+    /* Park a writer with the lock held, and read around it */
+    combine_park = 1;
+    holder.vp = vp;
+    holder.value = 3;
+    if ((errno = pthread_create(&t, NULL, combine_setter, &holder)) != 0)
+        err(1, "pthread_create() failed");
+    (void) pthread_mutex_lock(&combine_lock);
+    while (!combine_parked)
+        (void) pthread_cond_wait(&combine_cv, &combine_lock);
+    (void) pthread_mutex_unlock(&combine_lock);
+    for (i = 1; i <= 2; i++) {
+        if ((errno = thread_safe_var_get_version(vp, i, (void **)&p)) != 0)
+            err(1, "thread_safe_var_get_version() failed");
+        if (*p != i)
+            errx(1, "history_race: wrong value");
+    }
+    (void) pthread_mutex_lock(&combine_lock);
+    combine_parked = 0;
+    (void) pthread_cond_broadcast(&combine_cv);
+    (void) pthread_mutex_unlock(&combine_lock);
+    if ((errno = pthread_join(t, NULL)) != 0)
+        err(1, "pthread_join() failed");
+    if (holder.version != 3)
+        errx(1, "history_race: the parked writer got the wrong version");
+    thread_safe_var_release(vp);
+
+    /* Race readers against a writer */
+    atomic_write_32(&history_done, 0);
+    for (i = 0; i < HISTORY_READERS; i++) {
+        if ((errno = pthread_create(&readers[i], NULL, history_reader,
+                                    vp)) != 0)
+            err(1, "pthread_create() failed");
+    }
+    for (i = 4; i < 4 + HISTORY_WRITES; i++) {
+        if ((errno = thread_safe_var_set(vp, new_u64(i), &version)) != 0)
+            err(1, "thread_safe_var_set() failed");
+        if (version != i)
+            errx(1, "history_race: set got version %ju, not %zu",
+                 (uintmax_t)version, i);
+    }
+    atomic_write_32(&history_done, 1);
+    for (i = 0; i < HISTORY_READERS; i++) {
+        if ((errno = pthread_join(readers[i], NULL)) != 0)
+            err(1, "pthread_join() failed");
+    }
+    thread_safe_var_destroy(vp);
+    return data;
+}
+
+/* Large values' pages get faulted in before they're published */
+#define PREFAULT_SIZE   (4 << 20)
+
+static void
+prefault_dtor(void *p)
+{
+    atomic_dec_32_nv(&live_vals);
+    (void) munmap(p, PREFAULT_SIZE);
+}
+
+static size_t
+resident_pages(void *p, size_t len)
+{
+    unsigned char vec[PREFAULT_SIZE / 4096];
+    size_t pgsz = sysconf(_SC_PAGESIZE);
+    size_t i, n = 0;
+
+    if (mincore(p, len, (void *)vec) != 0)
+        err(1, "mincore() failed");
+    for (i = 0; i < len / pgsz; i++)
+        n += vec[i] & 1;
+    return n;
+}
+
+static void *
+prefault_test(void *data)
+{
+    thread_safe_var vp;
+    struct iovec iov;
+    void *p;
+
+    if ((errno = thread_safe_var_init(&vp, prefault_dtor)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    p = mmap(NULL, PREFAULT_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        err(1, "mmap() failed");
+    atomic_inc_32_nv(&live_vals);
+    if (resident_pages(p, PREFAULT_SIZE) != 0)
+        errx(1, "prefault: fresh mapping is resident");
+    iov.iov_base = p;
+    iov.iov_len = PREFAULT_SIZE;
+    if ((errno = thread_safe_var_set_prefault(vp, p, &iov, 1,
+                                              THREAD_SAFE_VAR_PREFAULT_WRITE,
+                                              NULL)) != 0)
+        err(1, "thread_safe_var_set_prefault() failed");
+    if (resident_pages(p, PREFAULT_SIZE) !=
+        PREFAULT_SIZE / (size_t)sysconf(_SC_PAGESIZE))
+        errx(1, "prefault: value not faulted in");
+    thread_safe_var_destroy(vp);
+    return data;
+}
+
+static uint32_t nallocs;     /* calls to counting_alloc() */
+static uint32_t nfrees;      /* calls to counting_free() */
+
+static void *
+counting_alloc(size_t size)
+{
+    atomic_inc_32_nv(&nallocs);
+    return malloc(size);
+}
+
+static void
+counting_free(void *p)
+{
+    atomic_inc_32_nv(&nfrees);
+    free(p);
+}
+
+/* Steady-state gets and sets must not allocate */
+static void *
+pool_test(void *data)
+{
+    thread_safe_var vp;
+    uint32_t before = 0;
+    uint64_t version;
+    void *v;
+    int i;
+
+    if ((errno = thread_safe_var_init(&vp, u64_dtor)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    if (atomic_read_32(&nallocs) == 0)
+        errx(1, "allocator hook not used");
+    for (i = 0; i < 2 * NWRITES; i++) {
+        if (i == NWRITES)
+            before = atomic_read_32(&nallocs);
+        if ((errno = thread_safe_var_set(vp, new_u64(i), &version)) != 0)
+            err(1, "thread_safe_var_set() failed");
+        if ((errno = thread_safe_var_get(vp, &v, &version)) != 0)
+            err(1, "thread_safe_var_get() failed");
+        if (*(uint64_t *)v != (uint64_t)i)
+            errx(1, "wrong value");
+    }
+    if (atomic_read_32(&nallocs) != before)
+        errx(1, "%u allocations in steady state",
+             atomic_read_32(&nallocs) - before);
+    thread_safe_var_destroy(vp);
+    return data;
+}
+
+#define DEPOT_THREADS   32
+#define DEPOT_VALUES    256     /* kept as history, so all live at once */
+
+static uint32_t depot_ready;
+
+/* Set DEPOT_VALUES values, and free their nodes once all threads have */
+static void *
+depot_churn(void *data)
+{
+    thread_safe_var_attr attr;
+    thread_safe_var vp;
+    int i;
+
+    thread_safe_var_attr_init(&attr);
+    attr.history = DEPOT_VALUES;
+    if ((errno = thread_safe_var_init_attr(&vp, u64_dtor, &attr)) != 0)
+        err(1, "thread_safe_var_init_attr() failed");
+    for (i = 0; i < DEPOT_VALUES; i++) {
+        if ((errno = thread_safe_var_set(vp, new_u64(i), NULL)) != 0)
+            err(1, "thread_safe_var_set() failed");
+    }
+    (void) atomic_inc_32_nv(&depot_ready);
+    while (atomic_read_32(&depot_ready) < DEPOT_THREADS)
+        sched_yield();
+    thread_safe_var_destroy(vp);
+    return data;
+}
+
+/* Nodes freed in a burst go back to the allocator, not all to the depot */
+static void *
+depot_test(void *data)
+{
+    pthread_t threads[DEPOT_THREADS];
+    uint32_t before, kept;
+    size_t i;
+
+    before = atomic_read_32(&nallocs) - atomic_read_32(&nfrees);
+    for (i = 0; i < DEPOT_THREADS; i++) {
+        if ((errno = pthread_create(&threads[i], NULL, depot_churn,
+                                    NULL)) != 0)
+            err(1, "pthread_create() failed");
+    }
+    for (i = 0; i < DEPOT_THREADS; i++) {
+        if ((errno = pthread_join(threads[i], NULL)) != 0)
+            err(1, "pthread_join() failed");
+    }
+    kept = atomic_read_32(&nallocs) - atomic_read_32(&nfrees) - before;
+    if (kept >= DEPOT_THREADS * DEPOT_VALUES / 2)
+        errx(1, "depot: %u allocations kept", kept);
+    return data;
+}
+
+/* Static vars: no allocations after init, ENOMEM at the limits */
+static thread_safe_var_attr static_attr;
+static pthread_mutex_t hold_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hold_cv = PTHREAD_COND_INITIALIZER;
+static int hold_done;
+static uint32_t nholding;
+
+struct holder {
+    thread_safe_var vp;
+    pthread_t       t;
+    int             err;
+};
+
+/* Read the var and hold on to the value until hold_done */
+static void *
+holder(void *data)
+{
+    struct holder *h = data;
+    void *v;
+
+    h->err = thread_safe_var_get(h->vp, &v, NULL);
+    (void) atomic_inc_32_nv(&nholding);
+    (void) pthread_mutex_lock(&hold_lock);
+    while (!hold_done)
+        (void) pthread_cond_wait(&hold_cv, &hold_lock);
+    (void) pthread_mutex_unlock(&hold_lock);
+    thread_safe_var_release(h->vp);
+    return NULL;
+}
+
+static void
+hold(struct holder *h, thread_safe_var vp)
+{
+    uint32_t n = atomic_read_32(&nholding);
+
+    h->vp = vp;
+    if ((errno = pthread_create(&h->t, NULL, holder, h)) != 0)
+        err(1, "pthread_create() failed");
+    while (atomic_read_32(&nholding) == n)
+        sched_yield();
+}
+
+static void
+unhold(struct holder *h, size_t n)
+{
+    size_t i;
+
+    (void) pthread_mutex_lock(&hold_lock);
+    hold_done = 1;
+    (void) pthread_cond_broadcast(&hold_cv);
+    (void) pthread_mutex_unlock(&hold_lock);
+    for (i = 0; i < n; i++) {
+        if ((errno = pthread_join(h[i].t, NULL)) != 0)
+            err(1, "pthread_join() failed");
+    }
+    hold_done = 0;
+    atomic_write_32(&nholding, 0);
+}
+
+static void *
+static_test(void *data)
+{
+    struct holder holders[STATIC_THREADS];
+    thread_safe_var vp;
+    uint64_t *extra;
+    uint32_t before;
+    uint64_t version;
+    void *v;
+    size_t i;
+
+    before = atomic_read_32(&nallocs);
+    if ((errno = thread_safe_var_init_attr(&vp, u64_dtor,
+                                           &static_attr)) != 0)
+        err(1, "thread_safe_var_init_attr() failed");
+
+    /* Have readers hold every version until we run out of values */
+    for (i = 0; i <= STATIC_VERSIONS; i++) {
+        extra = new_u64(i);
+        if ((errno = thread_safe_var_set(vp, extra, &version)) == ENOMEM)
+            break;
+        if (errno != 0)
+            err(1, "thread_safe_var_set() failed");
+        hold(&holders[i], vp);
+    }
+    if (i < 2 || i > STATIC_VERSIONS)
+        errx(1, "static: max_versions not enforced (%zu sets)", i);
+    unhold(holders, i);
+    while (i-- > 0) {
+        if (holders[i].err != 0)
+            errx(1, "static: reader failed");
+    }
+
+    /* Now there's room again */
+    if ((errno = thread_safe_var_set(vp, extra, &version)) != 0)
+        err(1, "thread_safe_var_set() failed");
+    for (i = 0; i < NWRITES; i++) {
+        if ((errno = thread_safe_var_set(vp, new_u64(i), &version)) != 0)
+            err(1, "thread_safe_var_set() failed");
+        if ((errno = thread_safe_var_get(vp, &v, &version)) != 0)
+            err(1, "thread_safe_var_get() failed");
+        if (*(uint64_t *)v != i)
+            errx(1, "static: wrong value");
+    }
+
+    /*
+     * We and STATIC_THREADS - 1 holders are all the readers there's
+     * room for in the slot-list implementation, which needs a slot per
+     * reader thread.
+     */
+    for (i = 0; i < STATIC_THREADS - 1; i++)
+        hold(&holders[i], vp);
+    hold(&holders[i], vp);
+#ifdef USE_TSV_SUBSCRIPTION_SLOTS_DESIGN
+    if (holders[i].err != ENOMEM)
+        errx(1, "static: more than max_threads readers");
+#else
+    if (holders[i].err != 0)
+        errx(1, "static: reader failed");
+#endif
+    unhold(holders, STATIC_THREADS);
+
+    if (atomic_read_32(&nallocs) != before)
+        errx(1, "static: %u allocations", atomic_read_32(&nallocs) - before);
+    thread_safe_var_destroy(vp);
+    return data;
+}
+
+/* Readers holding on to old versions get reported, once per stall */
+#define STALL_MS        20
+
+static pthread_mutex_t stall_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_safe_var_stall last_stall;
+static uint32_t nstalls;
+
+static void
+stall_cb(const struct thread_safe_var_stall *stall, void *arg)
+{
+    (void) pthread_mutex_lock(&stall_lock);
+    last_stall = *stall;
+    nstalls++;
+    (void) pthread_mutex_unlock(&stall_lock);
+    (void) arg;
+}
+
+static uint32_t
+stalls_seen(void)
+{
+    uint32_t n;
+
+    (void) pthread_mutex_lock(&stall_lock);
+    n = nstalls;
+    (void) pthread_mutex_unlock(&stall_lock);
+    return n;
+}
+
+static void *
+stall_test(void *data)
+{
+    thread_safe_var_attr attr;
+    struct holder h;
+    thread_safe_var vp;
+    uint64_t held, version;
+    size_t i;
+
+    thread_safe_var_attr_init(&attr);
+    attr.stall_ms = STALL_MS;
+    attr.stall_cb = stall_cb;
+    if ((errno = thread_safe_var_init_attr(&vp, u64_dtor, &attr)) != 0)
+        err(1, "thread_safe_var_init_attr() failed");
+    if ((errno = thread_safe_var_set(vp, new_u64(0), &held)) != 0)
+        err(1, "thread_safe_var_set() failed");
+
+    /* Up-to-date readers are not stalled */
+    hold(&h, vp);
+    (void) usleep(4 * STALL_MS * 1000);
+    if (stalls_seen() != 0)
+        errx(1, "stall: current reader reported");
+
+    /* Readers of old versions are, but only once */
+    for (i = 1; i < 3; i++) {
+        if ((errno = thread_safe_var_set(vp, new_u64(i), &version)) != 0)
+            err(1, "thread_safe_var_set() failed");
+    }
+    for (i = 0; i < 100 && stalls_seen() == 0; i++)
+        (void) usleep(STALL_MS * 1000);
+    (void) usleep(4 * STALL_MS * 1000);
+    (void) pthread_mutex_lock(&stall_lock);
+    if (nstalls != 1)
+        errx(1, "stall: %u reports", nstalls);
+    if (last_stall.vp != vp || !pthread_equal(last_stall.thread, h.t) ||
+        last_stall.version != held || last_stall.current != version ||
+        last_stall.ms < STALL_MS)
+        errx(1, "stall: wrong report");
+    (void) pthread_mutex_unlock(&stall_lock);
+
+    unhold(&h, 1);
+    if (h.err != 0)
+        errx(1, "stall: reader failed");
+    thread_safe_var_destroy(vp);
+    return data;
+}
+
+/*
+ * Stall callbacks may read and destroy vars: those take the lock the
+ * watchdog used to hold while calling them.
+ */
+static thread_safe_var reentrant_read;      /* read by the callback */
+static thread_safe_var reentrant_doomed;    /* destroyed by it */
+static uint64_t reentrant_value = 42;       /* not counted in live_vals */
+static volatile uint32_t reentrant_done;
+
+static void
+reentrant_cb(const struct thread_safe_var_stall *stall, void *arg)
+{
+    void *v;
+
+    (void) stall;
+    (void) arg;
+    if (atomic_read_32(&reentrant_done))
+        return;
+    if ((errno = thread_safe_var_get(reentrant_read, &v, NULL)) != 0)
+        err(1, "thread_safe_var_get() failed");
+    if (*(uint64_t *)v != reentrant_value)
+        errx(1, "stall_reentrant: wrong value");
+    thread_safe_var_release(reentrant_read);
+    thread_safe_var_destroy(reentrant_doomed);
+    atomic_write_32(&reentrant_done, 1);
+}
+
+static void *
+stall_reentrant_test(void *data)
+{
+    thread_safe_var_attr attr;
+    struct holder h;
+    thread_safe_var vp;
+    size_t i;
+
+    thread_safe_var_attr_init(&attr);
+    attr.stall_ms = STALL_MS;
+    if ((errno = thread_safe_var_init_attr(&reentrant_read, NULL,
+                                           &attr)) != 0 ||
+        (errno = thread_safe_var_init_attr(&reentrant_doomed, NULL,
+                                           &attr)) != 0)
+        err(1, "thread_safe_var_init_attr() failed");
+    if ((errno = thread_safe_var_set(reentrant_read, &reentrant_value,
+                                     NULL)) != 0)
+        err(1, "thread_safe_var_set() failed");
+    attr.stall_cb = reentrant_cb;
+    if ((errno = thread_safe_var_init_attr(&vp, u64_dtor, &attr)) != 0)
+        err(1, "thread_safe_var_init_attr() failed");
+    if ((errno = thread_safe_var_set(vp, new_u64(0), NULL)) != 0)
+        err(1, "thread_safe_var_set() failed");
+
+    hold(&h, vp);
+    if ((errno = thread_safe_var_set(vp, new_u64(1), NULL)) != 0)
+        err(1, "thread_safe_var_set() failed");
+    for (i = 0; i < 100 && !atomic_read_32(&reentrant_done); i++)
+        (void) usleep(STALL_MS * 1000);
+    if (!atomic_read_32(&reentrant_done))
+        errx(1, "stall_reentrant: callback didn't complete");
+
+    unhold(&h, 1);
+    if (h.err != 0)
+        errx(1, "stall_reentrant: reader failed");
+    thread_safe_var_destroy(vp);
+    thread_safe_var_destroy(reentrant_read);
+    return data;
+}
+
+/* Vars sharing a reclamation domain */
+#define DOMAIN_VARS     4
+
+static thread_safe_var domain_vars[DOMAIN_VARS];
+
+static void *
+domain_reader(void *data)
+{
+    uint64_t *v;
+    size_t k;
+
+    while (!atomic_read_32(&writer_done)) {
+        for (k = 0; k < DOMAIN_VARS; k++) {
+            if ((errno = thread_safe_var_get(domain_vars[k], (void **)&v,
+                                             NULL)) != 0)
+                err(1, "thread_safe_var_get() failed");
+            if (v != NULL && *v % DOMAIN_VARS != k)
+                errx(1, "domain: reader got another var's value");
+        }
+    }
+    return data;    /* thread exit releases all of them */
+}
+
+static void *
+domain_test(void *data)
+{
+    pthread_t readers[NREADERS];
+    thread_safe_var_domain dom;
+    thread_safe_var_attr attr;
+    thread_safe_var vp;
+    struct holder h;
+    uint32_t live;
+    size_t i, k;
+
+    if ((errno = thread_safe_var_domain_create(&dom, DOMAIN_VARS)) != 0)
+        err(1, "thread_safe_var_domain_create() failed");
+    thread_safe_var_attr_init(&attr);
+    attr.domain = dom;
+    for (k = 0; k < DOMAIN_VARS; k++) {
+        if ((errno = thread_safe_var_init_attr(&domain_vars[k], u64_dtor,
+                                               &attr)) != 0)
+            err(1, "thread_safe_var_init_attr() failed");
+    }
+#ifdef USE_TSV_SUBSCRIPTION_SLOTS_DESIGN
+    if (thread_safe_var_init_attr(&vp, u64_dtor, &attr) != ENOMEM)
+        errx(1, "domain: more than max_vars vars");
+    if (thread_safe_var_domain_destroy(dom) != EBUSY)
+        errx(1, "domain: destroyed a domain with vars");
+#endif
+
+    atomic_write_32(&writer_done, 0);
+    for (i = 0; i < NREADERS; i++) {
+        if ((errno = pthread_create(&readers[i], NULL, domain_reader,
+                                    NULL)) != 0)
+            err(1, "pthread_create() failed");
+    }
+    for (i = 0; i < NWRITES; i++) {
+        k = i % DOMAIN_VARS;
+        if ((errno = thread_safe_var_set(domain_vars[k], new_u64(i),
+                                         NULL)) != 0)
+            err(1, "thread_safe_var_set() failed");
+    }
+    atomic_write_32(&writer_done, 1);
+    for (i = 0; i < NREADERS; i++) {
+        if ((errno = pthread_join(readers[i], NULL)) != 0)
+            err(1, "pthread_join() failed");
+    }
+
+    /*
+     * Values readers let go of are freed by a reclaim, not just by sets,
+     * for all the domain's vars at once.
+     */
+    if ((errno = thread_safe_var_domain_reclaim(dom)) != 0)
+        err(1, "thread_safe_var_domain_reclaim() failed");
+#ifdef USE_TSV_SUBSCRIPTION_SLOTS_DESIGN
+    if (atomic_read_32(&live_vals) != DOMAIN_VARS)
+        errx(1, "domain: released values not reclaimed");
+#endif
+    vp = domain_vars[0];
+    hold(&h, vp);
+    if ((errno = thread_safe_var_set(vp, new_u64(NWRITES * DOMAIN_VARS),
+                                     NULL)) != 0)
+        err(1, "thread_safe_var_set() failed");
+    live = atomic_read_32(&live_vals);
+    unhold(&h, 1);
+    if ((errno = thread_safe_var_domain_reclaim(dom)) != 0)
+        err(1, "thread_safe_var_domain_reclaim() failed");
+#ifdef USE_TSV_SUBSCRIPTION_SLOTS_DESIGN
+    if (atomic_read_32(&live_vals) != live - 1)
+        errx(1, "domain: released value not reclaimed");
+#else
+    (void) live;
+#endif
+
+    /* Destroyed vars' indices are reused */
+    thread_safe_var_destroy(domain_vars[0]);
+    if ((errno = thread_safe_var_init_attr(&domain_vars[0], u64_dtor,
+                                           &attr)) != 0)
+        err(1, "thread_safe_var_init_attr() failed");
+    for (k = 0; k < DOMAIN_VARS; k++)
+        thread_safe_var_destroy(domain_vars[k]);
+    if ((errno = thread_safe_var_domain_destroy(dom)) != 0)
+        err(1, "thread_safe_var_domain_destroy() failed");
+    return data;
+}
+
+/* Single-writer vars: no lock, no combining, so versions are 1, 2, ... */
+static void *
+single_reader(void *data)
+{
+    thread_safe_var vp = data;
+    uint64_t version, last = 0;
+    uint64_t *v;
+
+    while (!atomic_read_32(&writer_done)) {
+        if ((errno = thread_safe_var_get(vp, (void **)&v, &version)) != 0)
+            err(1, "thread_safe_var_get() failed");
+        if (v == NULL)
+            continue;
+        if (*v + 1 != version || version < last)
+            errx(1, "single_writer: reader got the wrong version");
+        last = version;
+    }
+    thread_safe_var_release(vp);
+    return NULL;
+}
+
+static void *
+single_writer_test(void *data)
+{
+    struct {
+        struct thread_safe_var_waiter w;
+        uint64_t version;
+    } waiter;
+    pthread_t readers[NREADERS];
+    thread_safe_var_attr attr;
+    thread_safe_var vp;
+    uint64_t version;
+    uint64_t *v;
+    size_t i;
+
+    thread_safe_var_attr_init(&attr);
+    attr.single_writer = 1;
+    attr.history = 1;
+    if (thread_safe_var_init_attr(&vp, u64_dtor, &attr) != EINVAL)
+        errx(1, "single_writer: history should need a write lock");
+    attr.history = 0;
+    if ((errno = thread_safe_var_init_attr(&vp, u64_dtor, &attr)) != 0)
+        err(1, "thread_safe_var_init_attr() failed");
+
+    memset(&waiter, 0, sizeof(waiter));
+    waiter.w.after = NWRITES / 2;
+    waiter.w.notify = notified;
+    if ((errno = thread_safe_var_notify(vp, &waiter.w)) != 0)
+        err(1, "thread_safe_var_notify() failed");
+
+    atomic_write_32(&writer_done, 0);
+    for (i = 0; i < NREADERS; i++) {
+        if ((errno = pthread_create(&readers[i], NULL, single_reader,
+                                    vp)) != 0)
+            err(1, "pthread_create() failed");
+    }
+    for (i = 0; i < NWRITES; i++) {
+        if ((errno = thread_safe_var_set(vp, new_u64(i), &version)) != 0)
+            err(1, "thread_safe_var_set() failed");
+        if (version != i + 1)
+            errx(1, "single_writer: wrong version");
+    }
+    atomic_write_32(&writer_done, 1);
+    for (i = 0; i < NREADERS; i++) {
+        if ((errno = pthread_join(readers[i], NULL)) != 0)
+            err(1, "pthread_join() failed");
+    }
+    if (waiter.version != NWRITES / 2 + 1)
+        errx(1, "single_writer: waiter not notified");
+
+    v = new_u64(NWRITES);
+    if (thread_safe_var_set_if(vp, v, NWRITES - 1, &version) != EAGAIN)
+        errx(1, "single_writer: stale version should fail");
+    if ((errno = thread_safe_var_set_if(vp, v, NWRITES, &version)) != 0)
+        err(1, "thread_safe_var_set_if() failed");
+
+    /* Only the current version can be had by number */
+    if ((errno = thread_safe_var_get_version(vp, version,
+                                             (void **)&v)) != 0 ||
+        *v != NWRITES)
+        errx(1, "single_writer: current version not available");
+    if (thread_safe_var_get_version(vp, version - 1, (void **)&v) != ENOENT)
+        errx(1, "single_writer: old version available");
+    thread_safe_var_release(vp);
+    thread_safe_var_destroy(vp);
+    return data;
+}
+
+/* Writers contending for the write lock, with set_if(), which never combines */
+static void *
+counter_writer(void *data)
+{
+    thread_safe_var vp = data;
+    uint64_t version;
+    uint64_t *v;
+    size_t i;
+    int ret;
+
+    for (i = 0; i < NWRITES / NREADERS; i++) {
+        do {
+            if ((errno = thread_safe_var_get(vp, (void **)&v,
+                                             &version)) != 0)
+                err(1, "thread_safe_var_get() failed");
+            v = new_u64(*v + 1);
+            if ((ret = thread_safe_var_set_if(vp, v, version,
+                                              NULL)) == EAGAIN)
+                u64_dtor(v);
+            else if ((errno = ret) != 0)
+                err(1, "thread_safe_var_set_if() failed");
+        } while (ret == EAGAIN);
+    }
+    thread_safe_var_release(vp);
+    return NULL;
+}
+
+static void *
+wlock_test(void *data)
+{
+    pthread_t writers[NREADERS];
+    thread_safe_var vp;
+    uint64_t version;
+    uint64_t *v;
+    size_t i;
+
+    if ((errno = thread_safe_var_init(&vp, u64_dtor)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    if ((errno = thread_safe_var_set(vp, new_u64(0), NULL)) != 0)
+        err(1, "thread_safe_var_set() failed");
+    for (i = 0; i < NREADERS; i++) {
+        if ((errno = pthread_create(&writers[i], NULL, counter_writer,
+                                    vp)) != 0)
+            err(1, "pthread_create() failed");
+    }
+    for (i = 0; i < NREADERS; i++) {
+        if ((errno = pthread_join(writers[i], NULL)) != 0)
+            err(1, "pthread_join() failed");
+    }
+    if ((errno = thread_safe_var_get(vp, (void **)&v, &version)) != 0)
+        err(1, "thread_safe_var_get() failed");
+    if (*v != (NWRITES / NREADERS) * NREADERS || version != *v + 1)
+        errx(1, "wlock: lost updates");
+    thread_safe_var_release(vp);
+    thread_safe_var_destroy(vp);
+    return data;
+}
+
+/* Readers counting their reads with a striped counter */
+#define STATS_GETS  1000
+
+struct stats_reader {
+    thread_safe_var     vp;
+    ctp_counter         reads;
+};
+
+static void *
+stats_reader(void *data)
+{
+    struct stats_reader *r = data;
+    uint64_t *v;
+    size_t i;
+
+    for (i = 0; i < STATS_GETS; i++) {
+        if ((errno = thread_safe_var_get(r->vp, (void **)&v, NULL)) != 0)
+            err(1, "thread_safe_var_get() failed");
+        ctp_counter_add(r->reads, 1);
+    }
+    thread_safe_var_release(r->vp);
+    return NULL;
+}
+
+static void *
+stats_test(void *data)
+{
+    struct thread_safe_var_stats before, after;
+    struct stats_reader r;
+    thread_safe_var_attr attr;
+    thread_safe_var uncounted;
+    pthread_t readers[NREADERS];
+    uint64_t version;
+    uint64_t *v;
+    size_t i;
+
+    thread_safe_var_attr_init(&attr);
+    attr.stats = 1;
+    if ((errno = thread_safe_var_init_attr(&r.vp, u64_dtor, &attr)) != 0)
+        err(1, "thread_safe_var_init_attr() failed");
+    if ((errno = thread_safe_var_init(&uncounted, u64_dtor)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    if ((errno = ctp_counter_init(&r.reads)) != 0)
+        err(1, "ctp_counter_init() failed");
+    if ((errno = thread_safe_var_get_stats(&before)) != 0)
+        err(1, "thread_safe_var_get_stats() failed");
+
+    if ((errno = thread_safe_var_set(r.vp, new_u64(0), &version)) != 0)
+        err(1, "thread_safe_var_set() failed");
+    for (i = 0; i < NREADERS; i++) {
+        if ((errno = pthread_create(&readers[i], NULL, stats_reader,
+                                    &r)) != 0)
+            err(1, "pthread_create() failed");
+    }
+    for (i = 0; i < NREADERS; i++) {
+        if ((errno = pthread_join(readers[i], NULL)) != 0)
+            err(1, "pthread_join() failed");
+    }
+    v = new_u64(1);
+    if (thread_safe_var_set_if(r.vp, v, version - 1, NULL) != EAGAIN)
+        errx(1, "stats: stale version should fail");
+    u64_dtor(v);
+    /* Vars without attr.stats aren't counted */
+    if ((errno = thread_safe_var_set(uncounted, new_u64(2), NULL)) != 0)
+        err(1, "thread_safe_var_set() failed");
+    if ((errno = thread_safe_var_get(uncounted, (void **)&v, NULL)) != 0)
+        err(1, "thread_safe_var_get() failed");
+    thread_safe_var_release(uncounted);
+
+    if ((errno = thread_safe_var_get_stats(&after)) != 0)
+        err(1, "thread_safe_var_get_stats() failed");
+    if (ctp_counter_read(r.reads) != NREADERS * STATS_GETS)
+        errx(1, "stats: striped counter lost adds");
+    if (after.gets - before.gets != NREADERS * STATS_GETS ||
+        after.gets_new - before.gets_new != NREADERS ||
+        after.sets - before.sets != 2 ||
+        after.published - before.published != 1 ||
+        after.conflicts - before.conflicts != 1)
+        errx(1, "stats: wrong counts");
+
+    ctp_counter_destroy(r.reads);
+    thread_safe_var_destroy(r.vp);
+    thread_safe_var_destroy(uncounted);
+    return data;
+}
+
+/*
+ * Run a test in its own thread: in the slot-list implementation a var
+ * is destroyed only once every thread that read it has exited.
+ */
+static void
+run_test(const char *name, void *(*test)(void *), void *arg)
+{
+    pthread_t t;
+
+    if ((errno = pthread_create(&t, NULL, test, arg)) != 0)
+        err(1, "pthread_create() failed");
+    if ((errno = pthread_join(t, NULL)) != 0)
+        err(1, "pthread_join() failed");
+    if (atomic_read_32(&live_vals) != 0)
+        errx(1, "%s: leaked %u values", name, atomic_read_32(&live_vals));
+    printf("%s: OK\n", name);
+}
+
+int
+main(void)
+{
+    /* Must precede any allocation by the library */
+    if ((errno = thread_safe_var_set_allocator(counting_alloc,
+                                               counting_free)) != 0)
+        err(1, "thread_safe_var_set_allocator() failed");
+    if (thread_safe_var_set_allocator(counting_alloc, counting_free) != EBUSY)
+        errx(1, "thread_safe_var_set_allocator() allowed twice");
+
+    run_test("set_if", set_if_test, NULL);
+    run_test("notify", notify_test, NULL);
+    run_test("combine", combine_test, NULL);
+    run_test("dedup", dedup_test, NULL);
+    run_test("history", history_test, NULL);
+    run_test("history_race", history_race_test, NULL);
+    run_test("slab", slab_test, NULL);
+    run_test("pool", pool_test, NULL);
+    run_test("depot", depot_test, NULL);
+    run_test("numa", numa_test, NULL);
+    run_test("prefault", prefault_test, NULL);
+    run_test("stall", stall_test, NULL);
+    run_test("stall_reentrant", stall_reentrant_test, NULL);
+    run_test("domain", domain_test, NULL);
+    run_test("single_writer", single_writer_test, NULL);
+    run_test("wlock", wlock_test, NULL);
+    run_test("stats", stats_test, NULL);
+
+    /* The var's memory must outlive the thread that read it */
+    thread_safe_var_attr_init(&static_attr);
+    static_attr.max_threads = STATIC_THREADS;
+    static_attr.max_versions = STATIC_VERSIONS;
+    static_attr.mem_size = thread_safe_var_mem_size(&static_attr);
+    if (static_attr.mem_size == 0)
+        errx(1, "thread_safe_var_mem_size() failed");
+    if ((errno = posix_memalign(&static_attr.mem, 64,
+                                static_attr.mem_size)) != 0)
+        err(1, "posix_memalign() failed");
+    run_test("static", static_test, NULL);
+    free(static_attr.mem);
+    return 0;
+}
@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Tests checkpointing a thread_safe_var and warm-starting another from
+ * the checkpoint: the last version published is written in the
+ * background, loaded as version 1, and a damaged checkpoint is
+ * rejected.
+ *
+ * Usage: t_ckpt
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <sys/types.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "thread_safe_global.h"
+#include "tsv_ckpt.h"
+#include "atomics.h"
+
+#define NROWS       (256 * 1024)
+#define NVERSIONS   20
+
+/* A large table, as parsed from some configuration */
+struct table {
+    uint64_t    gen;
+    uint64_t    rows[NROWS];
+};
+
+static double
+now_ms(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        err(1, "clock_gettime(CLOCK_MONOTONIC) failed");
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int
+table_encode(const void *value, void **bufp, size_t *lenp, void *arg)
+{
+    (void) arg;
+    if ((*bufp = malloc(sizeof(struct table))) == NULL)
+        return ENOMEM;
+    memcpy(*bufp, value, sizeof(struct table));
+    *lenp = sizeof(struct table);
+    return 0;
+}
+
+static int
+table_decode(const void *buf, size_t len, void **valuep, void *arg)
+{
+    (void) arg;
+    if (len != sizeof(struct table))
+        return EINVAL;
+    if ((*valuep = malloc(len)) == NULL)
+        return ENOMEM;
+    memcpy(*valuep, buf, len);
+    return 0;
+}
+
+static uint32_t encode_calls;
+
+static int
+fail_encode(const void *value, void **bufp, size_t *lenp, void *arg)
+{
+    (void) value;
+    (void) bufp;
+    (void) lenp;
+    (void) arg;
+    atomic_inc_32_nv(&encode_calls);
+    return EIO;
+}
+
+static void
+table_destroy(void *value, void *arg)
+{
+    (void) arg;
+    free(value);
+}
+
+static struct table *
+table_new(uint64_t gen)
+{
+    struct table *t;
+    size_t i;
+
+    if ((t = malloc(sizeof(*t))) == NULL)
+        err(1, "malloc() failed");
+    t->gen = gen;
+    for (i = 0; i < NROWS; i++)
+        t->rows[i] = gen * NROWS + i;
+    return t;
+}
+
+static void
+table_check(const struct table *t, uint64_t gen)
+{
+    size_t i;
+
+    if (t == NULL || t->gen != gen)
+        errx(1, "wrong table loaded");
+    for (i = 0; i < NROWS; i++) {
+        if (t->rows[i] != gen * NROWS + i)
+            errx(1, "table loaded with wrong rows");
+    }
+}
+
+int
+main(void)
+{
+    struct tsv_ckpt_codec codec;
+    struct table *t;
+    thread_safe_var vp;
+    tsv_ckpt ckpt;
+    char path[64];
+    uint64_t version;
+    uint64_t gen;
+    double start;
+    int tries;
+    int fd;
+
+    memset(&codec, 0, sizeof(codec));
+    codec.encode = table_encode;
+    codec.decode = table_decode;
+    codec.destroy = table_destroy;
+    (void) snprintf(path, sizeof(path), "/tmp/t_ckpt.%ld", (long)getpid());
+
+    /* Cold start: no checkpoint yet */
+    if ((errno = thread_safe_var_init(&vp, free)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    if (tsv_ckpt_load(vp, path, &codec, NULL) != ENOENT)
+        errx(1, "loading a missing checkpoint should fail with ENOENT");
+    if ((errno = tsv_ckpt_create(&ckpt, vp, path, &codec)) != 0)
+        err(1, "tsv_ckpt_create() failed");
+    for (gen = 1; gen <= NVERSIONS; gen++) {
+        if ((errno = thread_safe_var_set(vp, table_new(gen), NULL)) != 0)
+            err(1, "thread_safe_var_set() failed");
+    }
+    for (tries = 0; tsv_ckpt_version(ckpt) != NVERSIONS; tries++) {
+        if (tries == 10000)
+            errx(1, "checkpoint not written in the background");
+        (void) usleep(1000);
+    }
+    if ((errno = tsv_ckpt_destroy(ckpt)) != 0)
+        err(1, "tsv_ckpt_destroy() failed");
+    thread_safe_var_destroy(vp);
+
+    /* Warm start */
+    if ((errno = thread_safe_var_init(&vp, free)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    start = now_ms();
+    if ((errno = tsv_ckpt_load(vp, path, &codec, &version)) != 0)
+        err(1, "tsv_ckpt_load() failed");
+    printf("Loaded a %zu byte checkpoint in %fms\n", sizeof(*t),
+           now_ms() - start);
+    if (version != 1)
+        errx(1, "checkpoint loaded as version %ju", (uintmax_t)version);
+    if ((errno = thread_safe_var_get(vp, (void **)&t, NULL)) != 0)
+        err(1, "thread_safe_var_get() failed");
+    table_check(t, NVERSIONS);
+    thread_safe_var_release(vp);
+    thread_safe_var_destroy(vp);
+
+    /* A damaged checkpoint */
+    if ((fd = open(path, O_WRONLY)) == -1)
+        err(1, "open(%s) failed", path);
+    if (pwrite(fd, "x", 1, 4096) != 1)
+        err(1, "pwrite() failed");
+    (void) close(fd);
+    if ((errno = thread_safe_var_init(&vp, free)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    if (tsv_ckpt_load(vp, path, &codec, NULL) != EINVAL ||
+        thread_safe_var_version(vp) != 0)
+        errx(1, "a damaged checkpoint should be rejected");
+    thread_safe_var_destroy(vp);
+
+    /* A version that can't be written is tried once, not in a loop */
+    codec.encode = fail_encode;
+    if ((errno = thread_safe_var_init(&vp, free)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    if ((errno = tsv_ckpt_create(&ckpt, vp, path, &codec)) != 0)
+        err(1, "tsv_ckpt_create() failed");
+    if ((errno = thread_safe_var_set(vp, table_new(1), NULL)) != 0)
+        err(1, "thread_safe_var_set() failed");
+    for (tries = 0; atomic_read_32(&encode_calls) == 0; tries++) {
+        if (tries == 10000)
+            errx(1, "checkpoint not attempted in the background");
+        (void) usleep(1000);
+    }
+    (void) usleep(100000);
+    if (atomic_read_32(&encode_calls) != 1)
+        errx(1, "a failed checkpoint was retried %u times",
+             atomic_read_32(&encode_calls) - 1);
+    if ((errno = thread_safe_var_set(vp, table_new(2), NULL)) != 0)
+        err(1, "thread_safe_var_set() failed");
+    for (tries = 0; atomic_read_32(&encode_calls) == 1; tries++) {
+        if (tries == 10000)
+            errx(1, "a newer version was not attempted");
+        (void) usleep(1000);
+    }
+    if (tsv_ckpt_destroy(ckpt) != EIO)
+        errx(1, "tsv_ckpt_destroy() should report the failed write");
+    thread_safe_var_destroy(vp);
+
+    (void) unlink(path);
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,797 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Tests for the copy-on-write containers built on thread_safe_var.
+ *
+ * Each container is checked against a trivial reference model, then
+ * hammered by reader threads racing with a writer.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _BSD_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <sys/types.h>
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tsv_map.h"
+#include "tsv_btree.h"
+#include "tsv_vec.h"
+#include "tsv_arena.h"
+#include "atomics.h"
+
+#define NKEYS       5000
+#define NREADERS    4
+#define NWRITES     2000
+
+static uint32_t live_keys;      /* keys not yet destroyed */
+static uint32_t live_vals;      /* values not yet destroyed */
+static uint32_t writer_done;
+
+/* Keys are malloc()ed uint64_ts; values are key * 3 */
+static uint64_t *
+new_u64(uint64_t v, uint32_t *live)
+{
+    uint64_t *p;
+
+    if ((p = malloc(sizeof(*p))) == NULL)
+        err(1, "malloc() failed");
+    *p = v;
+    atomic_inc_32_nv(live);
+    return p;
+}
+
+static void
+key_dtor(void *p)
+{
+    atomic_dec_32_nv(&live_keys);
+    free(p);
+}
+
+static void
+val_dtor(void *p)
+{
+    atomic_dec_32_nv(&live_vals);
+    free(p);
+}
+
+static uint64_t
+key_hash(const void *k)
+{
+    uint64_t h = *(const uint64_t *)k;
+
+    /* splitmix64 finalizer */
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+/* A terrible hash, to exercise collision nodes */
+static uint64_t
+bad_hash(const void *k)
+{
+    return *(const uint64_t *)k % 7;
+}
+
+static int
+key_eq(const void *a, const void *b)
+{
+    return *(const uint64_t *)a == *(const uint64_t *)b;
+}
+
+static void
+map_check(tsv_map m, const char *present, size_t n)
+{
+    tsv_map_snapshot snap;
+    uint64_t k;
+    size_t count = 0;
+    void *v;
+    int ret;
+
+    if ((errno = tsv_map_read(m, &snap, NULL)) != 0)
+        err(1, "tsv_map_read() failed");
+    for (k = 0; k < n; k++) {
+        ret = tsv_map_lookup(snap, &k, &v);
+        if (present[k]) {
+            count++;
+            if (ret != 0 || *(uint64_t *)v != k * 3)
+                errx(1, "tsv_map: key %ju missing or wrong", (uintmax_t)k);
+        } else if (ret != ENOENT) {
+            errx(1, "tsv_map: key %ju should be absent", (uintmax_t)k);
+        }
+    }
+    if (tsv_map_count(snap) != count)
+        errx(1, "tsv_map: count is %zu, expected %zu",
+             tsv_map_count(snap), count);
+}
+
+static void *
+map_model_test(void *data)
+{
+    tsv_map_hash_f hash = *(tsv_map_hash_f *)data;
+    size_t n = hash == bad_hash ? 200 : NKEYS;
+    tsv_map_snapshot old;
+    tsv_map m;
+    uint64_t k;
+    uint64_t version, v1;
+    char *present;
+    void *v;
+    size_t i;
+
+    if ((present = calloc(n, 1)) == NULL)
+        err(1, "calloc() failed");
+    if ((errno = tsv_map_init(&m, hash, key_eq, key_dtor, val_dtor)) != 0)
+        err(1, "tsv_map_init() failed");
+
+    for (k = 0; k < n; k++) {
+        if ((errno = tsv_map_put(m, new_u64(k, &live_keys),
+                                 new_u64(k * 3, &live_vals), NULL)) != 0)
+            err(1, "tsv_map_put() failed");
+        present[k] = 1;
+    }
+    map_check(m, present, n);
+
+    /* Hold on to this version while we change the map */
+    if ((errno = tsv_map_read(m, &old, &v1)) != 0)
+        err(1, "tsv_map_read() failed");
+
+    /* Delete every third key, replace every fifth */
+    for (k = 0; k < n; k++) {
+        if (k % 3 == 0) {
+            if ((errno = tsv_map_del(m, &k, &version)) != 0)
+                err(1, "tsv_map_del() failed");
+            present[k] = 0;
+        } else if (k % 5 == 0) {
+            if ((errno = tsv_map_put(m, new_u64(k, &live_keys),
+                                     new_u64(k * 3, &live_vals),
+                                     &version)) != 0)
+                err(1, "tsv_map_put() failed");
+        }
+    }
+    k = 0;
+    if (tsv_map_del(m, &k, NULL) != ENOENT)
+        errx(1, "tsv_map_del() of an absent key should fail");
+
+    /* The old version must be intact */
+    if (tsv_map_count(old) != n)
+        errx(1, "tsv_map: old version changed");
+    for (k = 0; k < n; k++) {
+        if (tsv_map_lookup(old, &k, &v) != 0 || *(uint64_t *)v != k * 3)
+            errx(1, "tsv_map: old version lost key %ju", (uintmax_t)k);
+    }
+
+    map_check(m, present, n);
+
+    /* Delete everything */
+    for (i = 0; i < n; i++) {
+        k = (i * 7919) % n;
+        if (!present[k])
+            continue;
+        if ((errno = tsv_map_del(m, &k, NULL)) != 0)
+            err(1, "tsv_map_del() failed");
+        present[k] = 0;
+    }
+    map_check(m, present, n);
+
+    tsv_map_release(m);
+    tsv_map_destroy(m);
+    free(present);
+    return NULL;
+}
+
+static void *
+map_reader(void *data)
+{
+    tsv_map m = data;
+    tsv_map_snapshot snap;
+    uint64_t last_version = 0;
+    uint64_t version;
+    uint64_t k;
+    void *v;
+    int ret;
+
+    while (!atomic_read_32(&writer_done)) {
+        if ((errno = tsv_map_read(m, &snap, &version)) != 0)
+            err(1, "tsv_map_read() failed");
+        if (version < last_version)
+            errx(1, "tsv_map: version went backwards");
+        last_version = version;
+        for (k = 0; k < NKEYS; k += 97) {
+            ret = tsv_map_lookup(snap, &k, &v);
+            if (ret == 0 && *(uint64_t *)v != k * 3)
+                errx(1, "tsv_map: reader saw a bad value");
+            if (ret != 0 && ret != ENOENT)
+                errx(1, "tsv_map_lookup() failed");
+        }
+    }
+    tsv_map_release(m);
+    return NULL;
+}
+
+static void *
+map_threaded_test(void *data)
+{
+    pthread_t readers[NREADERS];
+    tsv_map m;
+    uint64_t k;
+    size_t i;
+
+    if ((errno = tsv_map_init(&m, key_hash, key_eq, key_dtor, val_dtor)) != 0)
+        err(1, "tsv_map_init() failed");
+    atomic_write_32(&writer_done, 0);
+    for (i = 0; i < NREADERS; i++) {
+        if ((errno = pthread_create(&readers[i], NULL, map_reader, m)) != 0)
+            err(1, "pthread_create() failed");
+    }
+    for (i = 0; i < NWRITES; i++) {
+        k = (i * 31) % NKEYS;
+        if (i % 4 == 3)
+            (void) tsv_map_del(m, &k, NULL);
+        else if ((errno = tsv_map_put(m, new_u64(k, &live_keys),
+                                      new_u64(k * 3, &live_vals),
+                                      NULL)) != 0)
+            err(1, "tsv_map_put() failed");
+    }
+    atomic_write_32(&writer_done, 1);
+    for (i = 0; i < NREADERS; i++) {
+        if ((errno = pthread_join(readers[i], NULL)) != 0)
+            err(1, "pthread_join() failed");
+    }
+    tsv_map_destroy(m);
+    return data;
+}
+
+static void
+btree_check(tsv_btree t, const char *present, size_t n)
+{
+    tsv_btree_snapshot snap;
+    tsv_btree_iter it;
+    uint64_t k, next, prev, found;
+    size_t count = 0;
+    void *v;
+    int ret;
+
+    if ((errno = tsv_btree_read(t, &snap, NULL)) != 0)
+        err(1, "tsv_btree_read() failed");
+    for (k = 0; k < n; k++) {
+        ret = tsv_btree_lookup(snap, k, &v);
+        if (present[k]) {
+            count++;
+            if (ret != 0 || *(uint64_t *)v != k * 3)
+                errx(1, "tsv_btree: key %ju missing or wrong", (uintmax_t)k);
+        } else if (ret != ENOENT) {
+            errx(1, "tsv_btree: key %ju should be absent", (uintmax_t)k);
+        }
+    }
+    if (tsv_btree_count(snap) != count)
+        errx(1, "tsv_btree: count is %zu, expected %zu",
+             tsv_btree_count(snap), count);
+
+    /* A full scan must visit exactly the present keys, in order */
+    tsv_btree_iter_init(&it, snap, 0);
+    for (prev = 0; tsv_btree_iter_next(&it, &k, &v) == 0; prev = k + 1) {
+        while (prev < k) {
+            if (present[prev++])
+                errx(1, "tsv_btree: scan skipped a key");
+        }
+        if (k >= n || !present[k] || *(uint64_t *)v != k * 3)
+            errx(1, "tsv_btree: scan returned a bad key or value");
+        count--;
+    }
+    if (count != 0)
+        errx(1, "tsv_btree: scan missed keys");
+
+    /* Floor lookups and scans starting mid-way */
+    for (k = 0, found = UINT64_MAX; k < n; k++) {
+        if (present[k])
+            found = k;
+        ret = tsv_btree_floor(snap, k, &prev, &v);
+        if (found == UINT64_MAX ? ret != ENOENT : (ret != 0 || prev != found))
+            errx(1, "tsv_btree: wrong floor for %ju", (uintmax_t)k);
+        if (k % 101 != 0)
+            continue;
+        tsv_btree_iter_init(&it, snap, k);
+        ret = tsv_btree_iter_next(&it, &prev, &v);
+        for (next = k; next < n && !present[next]; next++)
+            ;
+        if (next < n ? ret != 0 || prev != next : ret != ENOENT)
+            errx(1, "tsv_btree: scan started at the wrong key");
+    }
+}
+
+static void *
+btree_model_test(void *data)
+{
+    tsv_btree_snapshot old;
+    tsv_btree_iter it;
+    tsv_btree t;
+    uint64_t k;
+    char *present;
+    void *v;
+    size_t i, n = NKEYS;
+
+    (void) data;
+    if ((present = calloc(n, 1)) == NULL)
+        err(1, "calloc() failed");
+    if ((errno = tsv_btree_init(&t, val_dtor)) != 0)
+        err(1, "tsv_btree_init() failed");
+    btree_check(t, present, n);
+
+    /* Insert in a scrambled order, so all split positions are hit */
+    for (i = 0; i < n; i++) {
+        k = (i * 7919) % n;
+        if ((errno = tsv_btree_put(t, k, new_u64(k * 3, &live_vals),
+                                   NULL)) != 0)
+            err(1, "tsv_btree_put() failed");
+        present[k] = 1;
+    }
+    btree_check(t, present, n);
+
+    /* Hold on to this version while we change the tree */
+    if ((errno = tsv_btree_read(t, &old, NULL)) != 0)
+        err(1, "tsv_btree_read() failed");
+
+    /* Delete every third key, replace every fifth */
+    for (k = 0; k < n; k++) {
+        if (k % 3 == 0) {
+            if ((errno = tsv_btree_del(t, k, NULL)) != 0)
+                err(1, "tsv_btree_del() failed");
+            present[k] = 0;
+        } else if (k % 5 == 0) {
+            if ((errno = tsv_btree_put(t, k, new_u64(k * 3, &live_vals),
+                                       NULL)) != 0)
+                err(1, "tsv_btree_put() failed");
+        }
+    }
+    if (tsv_btree_del(t, 0, NULL) != ENOENT)
+        errx(1, "tsv_btree_del() of an absent key should fail");
+
+    /* The old version must be intact */
+    if (tsv_btree_count(old) != n)
+        errx(1, "tsv_btree: old version changed");
+    tsv_btree_iter_init(&it, old, 0);
+    for (i = 0; i < n; i++) {
+        if (tsv_btree_iter_next(&it, &k, &v) != 0 || k != i ||
+            *(uint64_t *)v != k * 3)
+            errx(1, "tsv_btree: old version lost key %zu", i);
+    }
+
+    btree_check(t, present, n);
+
+    /* Delete everything, in yet another order */
+    for (i = 0; i < n; i++) {
+        k = (i * 4099) % n;
+        if (!present[k])
+            continue;
+        if ((errno = tsv_btree_del(t, k, NULL)) != 0)
+            err(1, "tsv_btree_del() failed");
+        present[k] = 0;
+        if (i % 997 == 0)
+            btree_check(t, present, n);
+    }
+    btree_check(t, present, n);
+
+    tsv_btree_release(t);
+    tsv_btree_destroy(t);
+    free(present);
+    return NULL;
+}
+
+static void *
+btree_reader(void *data)
+{
+    tsv_btree t = data;
+    tsv_btree_snapshot snap;
+    tsv_btree_iter it;
+    uint64_t k, prev;
+    void *v;
+    size_t count;
+
+    while (!atomic_read_32(&writer_done)) {
+        if ((errno = tsv_btree_read(t, &snap, NULL)) != 0)
+            err(1, "tsv_btree_read() failed");
+        tsv_btree_iter_init(&it, snap, 0);
+        for (count = 0, prev = 0; tsv_btree_iter_next(&it, &k, &v) == 0;
+             count++, prev = k) {
+            if ((count > 0 && k <= prev) || *(uint64_t *)v != k * 3)
+                errx(1, "tsv_btree: reader saw a bad scan");
+        }
+        if (count != tsv_btree_count(snap))
+            errx(1, "tsv_btree: reader saw a bad count");
+    }
+    tsv_btree_release(t);
+    return NULL;
+}
+
+static void *
+btree_threaded_test(void *data)
+{
+    pthread_t readers[NREADERS];
+    tsv_btree t;
+    uint64_t k;
+    size_t i;
+
+    if ((errno = tsv_btree_init(&t, val_dtor)) != 0)
+        err(1, "tsv_btree_init() failed");
+    atomic_write_32(&writer_done, 0);
+    for (i = 0; i < NREADERS; i++) {
+        if ((errno = pthread_create(&readers[i], NULL, btree_reader, t)) != 0)
+            err(1, "pthread_create() failed");
+    }
+    for (i = 0; i < NWRITES; i++) {
+        k = (i * 31) % NKEYS;
+        if (i % 4 == 3)
+            (void) tsv_btree_del(t, k, NULL);
+        else if ((errno = tsv_btree_put(t, k, new_u64(k * 3, &live_vals),
+                                        NULL)) != 0)
+            err(1, "tsv_btree_put() failed");
+    }
+    atomic_write_32(&writer_done, 1);
+    for (i = 0; i < NREADERS; i++) {
+        if ((errno = pthread_join(readers[i], NULL)) != 0)
+            err(1, "pthread_join() failed");
+    }
+    tsv_btree_destroy(t);
+    return data;
+}
+
+/* Check that a snapshot has n elements, element i being i * 3 + delta */
+static void
+vec_check(tsv_vec_snapshot snap, size_t n, uint64_t delta)
+{
+    size_t i;
+    void *v;
+
+    if (tsv_vec_size(snap) != n)
+        errx(1, "tsv_vec: size is %zu, expected %zu", tsv_vec_size(snap), n);
+    for (i = 0; i < n; i++) {
+        if (tsv_vec_at(snap, i, &v) != 0 || *(uint64_t *)v != i * 3 + delta)
+            errx(1, "tsv_vec: element %zu is wrong", i);
+    }
+    if (tsv_vec_at(snap, n, &v) != ERANGE)
+        errx(1, "tsv_vec_at() past the end should fail");
+}
+
+static void *
+vec_model_test(void *data)
+{
+    tsv_vec_snapshot old, snap;
+    tsv_vec_batch b;
+    tsv_vec v;
+    uint64_t version, v1;
+    size_t i, n = NKEYS;
+
+    (void) data;
+    if ((errno = tsv_vec_init(&v, val_dtor)) != 0)
+        err(1, "tsv_vec_init() failed");
+    if (tsv_vec_pop(v, NULL) != ERANGE)
+        errx(1, "tsv_vec_pop() of an empty array should fail");
+
+    /* Grow one element at a time */
+    for (i = 0; i < n; i++) {
+        if ((errno = tsv_vec_push(v, new_u64(i * 3, &live_vals), NULL)) != 0)
+            err(1, "tsv_vec_push() failed");
+    }
+    if ((errno = tsv_vec_read(v, &old, &v1)) != 0)
+        err(1, "tsv_vec_read() failed");
+    vec_check(old, n, 0);
+
+    /* Change every element in one batch: one new version */
+    if ((errno = tsv_vec_batch_begin(v, &b)) != 0)
+        err(1, "tsv_vec_batch_begin() failed");
+    for (i = 0; i < n; i++) {
+        if ((errno = tsv_vec_batch_set(b, (i * 7919) % n,
+                                       new_u64(((i * 7919) % n) * 3 + 1,
+                                               &live_vals))) != 0)
+            err(1, "tsv_vec_batch_set() failed");
+    }
+    if (tsv_vec_batch_set(b, n, NULL) != ERANGE)
+        errx(1, "tsv_vec_batch_set() past the end should fail");
+    if ((errno = tsv_vec_batch_commit(b, &version)) != 0)
+        err(1, "tsv_vec_batch_commit() failed");
+    if (version != v1 + 1)
+        errx(1, "tsv_vec: a batch should publish one version");
+
+    /* The old version must be intact */
+    vec_check(old, n, 0);
+    if ((errno = tsv_vec_read(v, &snap, NULL)) != 0)
+        err(1, "tsv_vec_read() failed");
+    vec_check(snap, n, 1);
+
+    /* An aborted batch must change nothing */
+    if ((errno = tsv_vec_batch_begin(v, &b)) != 0)
+        err(1, "tsv_vec_batch_begin() failed");
+    for (i = 0; i < TSV_VEC_CHUNK + 3; i++) {
+        if ((errno = tsv_vec_batch_pop(b)) != 0)
+            err(1, "tsv_vec_batch_pop() failed");
+    }
+    if ((errno = tsv_vec_batch_push(b, new_u64(0, &live_vals))) != 0)
+        err(1, "tsv_vec_batch_push() failed");
+    if (tsv_vec_batch_size(b) != n - TSV_VEC_CHUNK - 2)
+        errx(1, "tsv_vec: wrong batch size");
+    tsv_vec_batch_abort(b);
+    if ((errno = tsv_vec_read(v, &snap, NULL)) != 0)
+        err(1, "tsv_vec_read() failed");
+    vec_check(snap, n, 1);
+
+    /* Shrink across chunk boundaries, then to nothing */
+    for (i = 0; i < TSV_VEC_CHUNK + 3; i++) {
+        if ((errno = tsv_vec_pop(v, NULL)) != 0)
+            err(1, "tsv_vec_pop() failed");
+    }
+    if ((errno = tsv_vec_read(v, &snap, NULL)) != 0)
+        err(1, "tsv_vec_read() failed");
+    vec_check(snap, n - TSV_VEC_CHUNK - 3, 1);
+    if ((errno = tsv_vec_batch_begin(v, &b)) != 0)
+        err(1, "tsv_vec_batch_begin() failed");
+    while (tsv_vec_batch_size(b) > 0) {
+        if ((errno = tsv_vec_batch_pop(b)) != 0)
+            err(1, "tsv_vec_batch_pop() failed");
+    }
+    if ((errno = tsv_vec_batch_commit(b, NULL)) != 0)
+        err(1, "tsv_vec_batch_commit() failed");
+    if ((errno = tsv_vec_read(v, &snap, NULL)) != 0)
+        err(1, "tsv_vec_read() failed");
+    vec_check(snap, 0, 0);
+
+    tsv_vec_release(v);
+    tsv_vec_destroy(v);
+    return NULL;
+}
+
+static void *
+vec_reader(void *data)
+{
+    tsv_vec v = data;
+    tsv_vec_snapshot snap;
+    size_t i, n;
+    void *p;
+
+    while (!atomic_read_32(&writer_done)) {
+        if ((errno = tsv_vec_read(v, &snap, NULL)) != 0)
+            err(1, "tsv_vec_read() failed");
+        n = tsv_vec_size(snap);
+        for (i = 0; i < n; i += 7) {
+            if (tsv_vec_at(snap, i, &p) != 0 || *(uint64_t *)p != i * 3)
+                errx(1, "tsv_vec: reader saw a bad value");
+        }
+    }
+    tsv_vec_release(v);
+    return NULL;
+}
+
+static void *
+vec_threaded_test(void *data)
+{
+    pthread_t readers[NREADERS];
+    tsv_vec_batch b;
+    tsv_vec v;
+    size_t i, k, n;
+
+    if ((errno = tsv_vec_init(&v, val_dtor)) != 0)
+        err(1, "tsv_vec_init() failed");
+    atomic_write_32(&writer_done, 0);
+    for (i = 0; i < NREADERS; i++) {
+        if ((errno = pthread_create(&readers[i], NULL, vec_reader, v)) != 0)
+            err(1, "pthread_create() failed");
+    }
+    for (i = 0; i < NWRITES; i++) {
+        if ((errno = tsv_vec_batch_begin(v, &b)) != 0)
+            err(1, "tsv_vec_batch_begin() failed");
+        n = tsv_vec_batch_size(b);
+        if (i % 8 == 7 && n > 0) {
+            if ((errno = tsv_vec_batch_pop(b)) != 0)
+                err(1, "tsv_vec_batch_pop() failed");
+        } else if ((errno = tsv_vec_batch_push(b, new_u64(n * 3,
+                                                          &live_vals))) != 0) {
+            err(1, "tsv_vec_batch_push() failed");
+        }
+        n = tsv_vec_batch_size(b);
+        for (k = (i * 31) % (n + 1); k < n; k += 97) {
+            if ((errno = tsv_vec_batch_set(b, k,
+                                           new_u64(k * 3, &live_vals))) != 0)
+                err(1, "tsv_vec_batch_set() failed");
+        }
+        if ((errno = tsv_vec_batch_commit(b, NULL)) != 0)
+            err(1, "tsv_vec_batch_commit() failed");
+    }
+    atomic_write_32(&writer_done, 1);
+    for (i = 0; i < NREADERS; i++) {
+        if ((errno = pthread_join(readers[i], NULL)) != 0)
+            err(1, "pthread_join() failed");
+    }
+    tsv_vec_destroy(v);
+    return data;
+}
+
+/* An object graph built in an arena */
+struct arena_cfg {
+    uint64_t    gen;
+    size_t      n;
+    char        **names;
+    uint64_t    *big;   /* larger than an arena block */
+};
+
+#define ARENA_NAMES     3000
+#define ARENA_BIG       20000
+
+static int
+arena_publish(thread_safe_var vp, uint64_t gen)
+{
+    struct arena_cfg *cfg;
+    tsv_arena a;
+    char buf[64];
+    size_t i;
+    int ret;
+
+    if ((ret = tsv_arena_begin(vp, &a)) != 0)
+        return ret;
+    if ((cfg = tsv_arena_alloc(a, sizeof(*cfg))) == NULL ||
+        (cfg->names = tsv_arena_calloc(a, ARENA_NAMES,
+                                       sizeof(cfg->names[0]))) == NULL ||
+        (cfg->big = tsv_arena_calloc(a, ARENA_BIG,
+                                     sizeof(cfg->big[0]))) == NULL) {
+        tsv_arena_abort(a);
+        return ENOMEM;
+    }
+    cfg->gen = gen;
+    cfg->n = ARENA_NAMES;
+    for (i = 0; i < cfg->n; i++) {
+        (void) snprintf(buf, sizeof(buf), "name-%zu-%ju", i, (uintmax_t)gen);
+        if ((cfg->names[i] = tsv_arena_strdup(a, buf)) == NULL) {
+            tsv_arena_abort(a);
+            return ENOMEM;
+        }
+    }
+    cfg->big[ARENA_BIG - 1] = gen;
+    if ((ret = tsv_arena_publish(a, cfg, NULL)) != 0)
+        tsv_arena_abort(a);
+    return ret;
+}
+
+static void
+arena_cfg_check(const struct arena_cfg *cfg)
+{
+    char buf[64];
+    size_t i;
+
+    if (cfg->n != ARENA_NAMES || cfg->big[ARENA_BIG - 1] != cfg->gen ||
+        cfg->big[0] != 0)
+        errx(1, "tsv_arena: bad value");
+    for (i = 0; i < cfg->n; i += 13) {
+        (void) snprintf(buf, sizeof(buf), "name-%zu-%ju", i,
+                        (uintmax_t)cfg->gen);
+        if (strcmp(cfg->names[i], buf) != 0)
+            errx(1, "tsv_arena: bad string");
+    }
+}
+
+static void *
+arena_reader(void *data)
+{
+    thread_safe_var vp = data;
+    uint64_t last_gen = 0;
+    void *p;
+
+    while (!atomic_read_32(&writer_done)) {
+        if ((errno = thread_safe_var_get(vp, &p, NULL)) != 0)
+            err(1, "thread_safe_var_get() failed");
+        arena_cfg_check(p);
+        if (((struct arena_cfg *)p)->gen < last_gen)
+            errx(1, "tsv_arena: generation went backwards");
+        last_gen = ((struct arena_cfg *)p)->gen;
+    }
+    thread_safe_var_release(vp);
+    return NULL;
+}
+
+static void *
+arena_test(void *data)
+{
+    pthread_t readers[NREADERS];
+    thread_safe_var vp;
+    tsv_arena a;
+    uint64_t gen;
+    size_t i;
+    int x;
+
+    if ((errno = tsv_arena_var_init(&vp)) != 0)
+        err(1, "tsv_arena_var_init() failed");
+
+    /* Only values from the arena may be published */
+    if ((errno = tsv_arena_begin(vp, &a)) != 0)
+        err(1, "tsv_arena_begin() failed");
+    if (tsv_arena_publish(a, &x, NULL) != EINVAL)
+        errx(1, "tsv_arena_publish() of a foreign value should fail");
+    tsv_arena_abort(a);
+
+    if ((errno = arena_publish(vp, 1)) != 0)
+        err(1, "tsv_arena_publish() failed");
+    atomic_write_32(&writer_done, 0);
+    for (i = 0; i < NREADERS; i++) {
+        if ((errno = pthread_create(&readers[i], NULL, arena_reader, vp)) != 0)
+            err(1, "pthread_create() failed");
+    }
+    for (gen = 2; gen < NWRITES / 10; gen++) {
+        if ((errno = arena_publish(vp, gen)) != 0)
+            err(1, "tsv_arena_publish() failed");
+    }
+    atomic_write_32(&writer_done, 1);
+    for (i = 0; i < NREADERS; i++) {
+        if ((errno = pthread_join(readers[i], NULL)) != 0)
+            err(1, "pthread_join() failed");
+    }
+    thread_safe_var_destroy(vp);
+    return data;
+}
+
+/*
+ * Run a test in its own thread: in the slot-list implementation a var
+ * is destroyed only once every thread that read it has exited.
+ */
+static void
+run_test(const char *name, void *(*test)(void *), void *arg)
+{
+    pthread_t t;
+
+    if ((errno = pthread_create(&t, NULL, test, arg)) != 0)
+        err(1, "pthread_create() failed");
+    if ((errno = pthread_join(t, NULL)) != 0)
+        err(1, "pthread_join() failed");
+    if (atomic_read_32(&live_keys) != 0 || atomic_read_32(&live_vals) != 0)
+        errx(1, "%s: leaked %u keys and %u values", name,
+             atomic_read_32(&live_keys), atomic_read_32(&live_vals));
+    printf("%s: OK\n", name);
+}
+
+int
+main(void)
+{
+    tsv_map_hash_f good = key_hash;
+    tsv_map_hash_f bad = bad_hash;
+
+    run_test("tsv_map", map_model_test, &good);
+    run_test("tsv_map collisions", map_model_test, &bad);
+    run_test("tsv_map threaded", map_threaded_test, NULL);
+    run_test("tsv_btree", btree_model_test, NULL);
+    run_test("tsv_btree threaded", btree_threaded_test, NULL);
+    run_test("tsv_vec", vec_model_test, NULL);
+    run_test("tsv_vec threaded", vec_threaded_test, NULL);
+    run_test("tsv_arena", arena_test, NULL);
+    return 0;
+}
@@ -0,0 +1,333 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Tests for the C++ bindings in thread_safe_global.hpp.
+ */
+
+#include <err.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include "thread_safe_global.hpp"
+
+namespace {
+
+#define NOBJS   16
+
+std::atomic<int> live;                  // objs not yet destroyed
+std::atomic<int> destroyed[NOBJS];      // times each obj was destroyed
+
+struct obj {
+    explicit obj(int x) : x(x) { live++; }
+    ~obj()
+    {
+        if (x >= 0 && x < NOBJS)
+            destroyed[x]++;
+        live--;
+    }
+    int x;
+};
+
+void *
+snapshot_test()
+{
+    tsv::var<obj> v;
+
+    if (v.get() || v.version() != 0)
+        errx(1, "snapshot: a new var should be empty");
+    v.emplace(1);
+    auto s = v.get();
+    if (!s || s->x != 1 || s.version() != 1)
+        errx(1, "snapshot: wrong value");
+
+    /* Replacing a snapshot with a newer one releases nothing */
+    v.emplace(2);
+    s = v.get();
+    v.emplace(3);
+    v.emplace(4);
+    if (destroyed[2] != 0 || s->x != 2)
+        errx(1, "snapshot: value destroyed while held");
+    if (destroyed[1] != 1)
+        errx(1, "snapshot: replaced value not destroyed");
+
+    /* Moving one transfers the reference */
+    tsv::snapshot<obj> t(std::move(s));
+    if (s || !t || t->x != 2)
+        errx(1, "snapshot: move didn't transfer the value");
+    t.reset();
+    if (t)
+        errx(1, "snapshot: reset didn't empty the snapshot");
+    v.emplace(5);
+    v.emplace(6);
+    if (destroyed[2] != 1)
+        errx(1, "snapshot: released value not destroyed");
+
+    try {
+        (void) v.set(nullptr);
+        errx(1, "snapshot: setting nullptr should throw");
+    } catch (const std::system_error &e) {
+        if (e.code().value() != EINVAL)
+            errx(1, "snapshot: setting nullptr should fail with EINVAL");
+    }
+    return nullptr;
+}
+
+void *
+set_if_test()
+{
+    tsv::var<obj> v;
+    std::uint64_t version = 0;
+    auto o = std::make_unique<obj>(1);
+
+    if (!v.set_if(o, 0, &version) || o || version != 1)
+        errx(1, "set_if: setting the first value failed");
+    o = std::make_unique<obj>(2);
+    if (v.set_if(o, 0, &version) || !o || v.get()->x != 1)
+        errx(1, "set_if: a stale version should fail");
+    if (!v.set_if(o, 1, &version) || o || version != 2 || v.get()->x != 2)
+        errx(1, "set_if: setting the current version failed");
+    return nullptr;
+}
+
+#define ASP_READERS 4
+#define ASP_STORES  2000
+
+void *
+atomic_shared_ptr_test()
+{
+    tsv::atomic_shared_ptr<obj> a;
+    std::shared_ptr<obj> p, q;
+    std::atomic<bool> done(false);
+    std::vector<std::thread> readers;
+
+    if (a.load() || a.read())
+        errx(1, "atomic_shared_ptr: should start out null");
+    a.store(std::make_shared<obj>(1));
+    p = a.load();
+    if (!p || p->x != 1 || p.use_count() != 2)
+        errx(1, "atomic_shared_ptr: load() returned the wrong pointer");
+
+    /* read() aliases the pointee and leaves the reference count alone */
+    {
+        tsv::snapshot<obj> r = a.read();
+
+        if (!r || r.get() != p.get() || p.use_count() != 2)
+            errx(1, "atomic_shared_ptr: read() copied the shared_ptr");
+    }
+
+    q = a.exchange(std::make_shared<obj>(2));
+    if (q != p || a.load()->x != 2)
+        errx(1, "atomic_shared_ptr: exchange() failed");
+    if (a.compare_exchange_strong(q, std::make_shared<obj>(3)) ||
+        q->x != 2)
+        errx(1, "atomic_shared_ptr: compare_exchange with a stale pointer");
+    if (!a.compare_exchange_strong(q, std::make_shared<obj>(3)) ||
+        a.load()->x != 3)
+        errx(1, "atomic_shared_ptr: compare_exchange failed");
+
+    /*
+     * load() keeps nothing alive but its copy.  (The slot-pair design
+     * keeps the previous value until the next write, so write twice.)
+     */
+    std::weak_ptr<obj> w = a.load();
+    a.store(std::make_shared<obj>(4));
+    a.store(std::make_shared<obj>(5));
+    if (!w.expired())
+        errx(1, "atomic_shared_ptr: load() pinned a replaced pointer");
+    p.reset();
+    q.reset();
+
+    /* Readers racing a writer only ever see whole, live values */
+    for (int i = 0; i < ASP_READERS; i++) {
+        readers.emplace_back([&a, &done]() {
+            while (!done) {
+                {
+                    tsv::snapshot<obj> r = a.read();
+
+                    if (!r || r->x < 3 || r->x >= NOBJS)
+                        errx(1, "atomic_shared_ptr: read() saw garbage");
+                }
+                std::shared_ptr<obj> l = a.load();
+
+                if (!l || l->x < 3 || l->x >= NOBJS)
+                    errx(1, "atomic_shared_ptr: load() saw garbage");
+            }
+        });
+    }
+    for (int i = 0; i < ASP_STORES; i++)
+        a.store(std::make_shared<obj>(3 + i % (NOBJS - 3)));
+    done = true;
+    for (auto &t : readers)
+        t.join();
+    return nullptr;
+}
+
+#ifdef TSV_HAVE_COROUTINES
+/* A coroutine that runs eagerly and that nobody awaits */
+struct task {
+    struct promise_type {
+        task get_return_object() { return task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+/* Runs resumptions when told to, on whichever thread drains it */
+struct queue_executor {
+    std::mutex *lock;
+    std::vector<std::function<void()>> *q;
+
+    template <typename F>
+    void
+    operator()(F &&f) const
+    {
+        std::lock_guard<std::mutex> g(*lock);
+        q->emplace_back(std::forward<F>(f));
+    }
+};
+
+template <typename Executor>
+task
+await_next(const tsv::var<obj> &v, std::uint64_t after, Executor executor,
+           std::atomic<std::uint64_t> *woke)
+{
+    *woke = co_await v.next_version(after, executor);
+}
+
+void *
+coroutine_test()
+{
+    std::atomic<std::uint64_t> woke(0);
+    std::mutex lock;
+    std::vector<std::function<void()>> q;
+    tsv::var<obj> v;
+
+    /* Already newer: doesn't suspend */
+    v.emplace(1);
+    await_next(v, 0, tsv::inline_executor(), &woke);
+    if (woke != 1)
+        errx(1, "coroutine: should not have waited for version 1");
+
+    /* Resumed by the publishing thread, before its set returns */
+    woke = 0;
+    await_next(v, 1, tsv::inline_executor(), &woke);
+    if (woke != 0)
+        errx(1, "coroutine: resumed before a newer version");
+    v.emplace(2);
+    if (woke != 2)
+        errx(1, "coroutine: not resumed by the publisher");
+
+    /* Resumed through an executor, published from another thread */
+    woke = 0;
+    await_next(v, 2, queue_executor{&lock, &q}, &woke);
+    std::thread([&v]() { v.emplace(3); }).join();
+    if (woke != 0 || q.size() != 1)
+        errx(1, "coroutine: not resumed through the executor");
+    q[0]();
+    if (woke != 3)
+        errx(1, "coroutine: resumed with the wrong version");
+    return nullptr;
+}
+
+#define RACE_ROUNDS 2000
+
+/*
+ * Await while another thread publishes as fast as it can, so that the
+ * coroutine is often resumed, and its frame (the waiter) destroyed, by
+ * the publisher while thread_safe_var_notify() is still running here.
+ */
+void *
+coroutine_race_test()
+{
+    std::atomic<std::uint64_t> woke(0);
+    std::atomic<bool> done(false);
+    tsv::var<obj> v;
+
+    v.emplace(-1);
+    std::thread publisher([&v, &done]() {
+        while (!done)
+            v.emplace(-1);
+    });
+    for (int i = 0; i < RACE_ROUNDS; i++) {
+        std::uint64_t after = v.version();
+
+        woke = 0;
+        await_next(v, after, tsv::inline_executor(), &woke);
+        while (woke == 0)
+            std::this_thread::yield();
+        if (woke <= after)
+            errx(1, "coroutine race: resumed with a stale version");
+    }
+    done = true;
+    publisher.join();
+    return nullptr;
+}
+#endif
+
+/*
+ * Run a test in its own thread: in the slot-list implementation a var
+ * is destroyed only once every thread that read it has exited.
+ */
+void
+run_test(const char *name, void *(*test)())
+{
+    std::thread t(test);
+
+    t.join();
+    if (live != 0)
+        errx(1, "%s: leaked %d values", name, live.load());
+    std::printf("%s: OK\n", name);
+}
+
+} // namespace
+
+int
+main()
+{
+    run_test("snapshot", snapshot_test);
+    run_test("set_if", set_if_test);
+    run_test("atomic_shared_ptr", atomic_shared_ptr_test);
+#ifdef TSV_HAVE_COROUTINES
+    run_test("coroutine", coroutine_test);
+    run_test("coroutine race", coroutine_race_test);
+#endif
+    return 0;
+}
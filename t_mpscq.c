@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Tests ctp_mpscq and compares it with a mutex-protected queue: each
+ * producer pushes NPUSHES items while one consumer pops them in
+ * batches, checking that it gets every item, and each producer's in
+ * order.
+ *
+ * Usage: t_mpscq [NPRODUCERS]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <sys/types.h>
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ctp_mpscq.h"
+#include "atomics.h"
+
+#define NPUSHES     200000  /* per producer */
+#define BATCH       64
+
+struct item {
+    struct ctp_mpscq_node   node;   /* first, so nodes are items */
+    size_t                  producer;
+    uint64_t                seq;
+};
+
+enum kind {
+    KIND_CTP_MPSCQ,
+    KIND_MUTEX,
+};
+
+static const char *kind_names[] = {
+    "ctp_mpscq",
+    "mutex queue",
+};
+
+struct bench {
+    enum kind               kind;
+    ctp_mpscq               q;
+    pthread_mutex_t         lock;   /* the mutex queue */
+    struct ctp_mpscq_node   *first;
+    struct ctp_mpscq_node   *last;
+};
+
+struct producer {
+    struct bench            *b;
+    pthread_t               t;
+    struct item             *items;
+    double                  us;     /* time taken for NPUSHES pushes */
+};
+
+static double
+now_us(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        err(1, "clock_gettime(CLOCK_MONOTONIC) failed");
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+static void
+push(struct bench *b, struct ctp_mpscq_node *n)
+{
+    if (b->kind == KIND_CTP_MPSCQ) {
+        ctp_mpscq_push(b->q, n);
+        return;
+    }
+    n->next = NULL;
+    if ((errno = pthread_mutex_lock(&b->lock)) != 0)
+        err(1, "pthread_mutex_lock() failed");
+    if (b->last == NULL)
+        b->first = n;
+    else
+        b->last->next = n;
+    b->last = n;
+    if ((errno = pthread_mutex_unlock(&b->lock)) != 0)
+        err(1, "pthread_mutex_unlock() failed");
+}
+
+static size_t
+pop_batch(struct bench *b, struct ctp_mpscq_node **nodes)
+{
+    size_t n;
+
+    if (b->kind == KIND_CTP_MPSCQ)
+        return ctp_mpscq_pop_batch(b->q, nodes, BATCH);
+    if ((errno = pthread_mutex_lock(&b->lock)) != 0)
+        err(1, "pthread_mutex_lock() failed");
+    for (n = 0; n < BATCH && b->first != NULL; n++) {
+        nodes[n] = b->first;
+        if ((b->first = b->first->next) == NULL)
+            b->last = NULL;
+    }
+    if ((errno = pthread_mutex_unlock(&b->lock)) != 0)
+        err(1, "pthread_mutex_unlock() failed");
+    return n;
+}
+
+static void *
+producer(void *data)
+{
+    struct producer *p = data;
+    double start;
+    size_t i;
+
+    start = now_us();
+    for (i = 0; i < NPUSHES; i++)
+        push(p->b, &p->items[i].node);
+    p->us = now_us() - start;
+    return NULL;
+}
+
+static void
+run(enum kind kind, size_t nproducers)
+{
+    struct ctp_mpscq_node *nodes[BATCH];
+    struct producer *producers;
+    struct item *item;
+    struct bench b;
+    uint64_t *next_seq;
+    uint64_t total = (uint64_t)nproducers * NPUSHES;
+    uint64_t popped = 0;
+    double start, us = 0;
+    size_t i, j, n;
+
+    memset(&b, 0, sizeof(b));
+    b.kind = kind;
+    if ((errno = ctp_mpscq_init(&b.q)) != 0)
+        err(1, "ctp_mpscq_init() failed");
+    if ((errno = pthread_mutex_init(&b.lock, NULL)) != 0)
+        err(1, "pthread_mutex_init() failed");
+    if ((producers = calloc(nproducers, sizeof(producers[0]))) == NULL ||
+        (next_seq = calloc(nproducers, sizeof(next_seq[0]))) == NULL)
+        err(1, "calloc() failed");
+    for (i = 0; i < nproducers; i++) {
+        producers[i].b = &b;
+        if ((producers[i].items = calloc(NPUSHES, sizeof(struct item))) == NULL)
+            err(1, "calloc() failed");
+        for (j = 0; j < NPUSHES; j++) {
+            producers[i].items[j].producer = i;
+            producers[i].items[j].seq = j;
+        }
+    }
+
+    start = now_us();
+    for (i = 0; i < nproducers; i++) {
+        if ((errno = pthread_create(&producers[i].t, NULL, producer,
+                                    &producers[i])) != 0)
+            err(1, "pthread_create() failed");
+    }
+    while (popped < total) {
+        if ((n = pop_batch(&b, nodes)) == 0) {
+            sched_yield();
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            item = (struct item *)nodes[i];
+            if (item->seq != next_seq[item->producer]++)
+                errx(1, "%s: items out of order", kind_names[kind]);
+        }
+        popped += n;
+    }
+    for (i = 0; i < nproducers; i++) {
+        if ((errno = pthread_join(producers[i].t, NULL)) != 0)
+            err(1, "pthread_join() failed");
+        us += producers[i].us;
+    }
+    if (pop_batch(&b, nodes) != 0)
+        errx(1, "%s: more items than were pushed", kind_names[kind]);
+
+    printf("%s, %zu producers: %fus/push, %f items/s consumed\n",
+           kind_names[kind], nproducers, us / (double)total,
+           total * 1000000.0 / (now_us() - start));
+
+    for (i = 0; i < nproducers; i++)
+        free(producers[i].items);
+    free(producers);
+    free(next_seq);
+    (void) pthread_mutex_destroy(&b.lock);
+    ctp_mpscq_destroy(b.q);
+}
+
+int
+main(int argc, char **argv)
+{
+    long nproducers = 4;
+    int kind;
+
+    if (argc > 2 || (argc == 2 && (nproducers = atol(argv[1])) < 1)) {
+        fprintf(stderr, "Usage: %s [NPRODUCERS]\n", argv[0]);
+        return 1;
+    }
+    for (kind = KIND_CTP_MPSCQ; kind <= KIND_MUTEX; kind++)
+        run(kind, nproducers);
+    return 0;
+}
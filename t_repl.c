@@ -0,0 +1,378 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Tests replication of a thread_safe_var to another process over a
+ * Unix domain socket, with and without deltas: a child process
+ * subscribes, the parent publishes NVERSIONS versions, some in quick
+ * succession, and the child checks that it ends up with the last one.
+ * Both report their replication statistics.
+ *
+ * Usage: t_repl
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "thread_safe_global.h"
+#include "tsv_repl.h"
+#include "atomics.h"
+
+#define NVERSIONS   2000
+#define NSECTIONS   32
+#define BURST       50      /* versions published back to back */
+
+/* A value; each version changes one section */
+struct section {
+    uint64_t    words[8];
+};
+
+struct cfg {
+    uint64_t        gen;
+    struct section  sections[NSECTIONS];
+};
+
+/* A delta is a sequence of these, each followed by its section */
+struct section_hdr {
+    uint32_t    idx;
+};
+
+static int
+cfg_encode(const void *value, void **bufp, size_t *lenp, void *arg)
+{
+    (void) arg;
+    if ((*bufp = malloc(sizeof(struct cfg))) == NULL)
+        return ENOMEM;
+    memcpy(*bufp, value, sizeof(struct cfg));
+    *lenp = sizeof(struct cfg);
+    return 0;
+}
+
+static int
+cfg_decode(const void *buf, size_t len, void **valuep, void *arg)
+{
+    (void) arg;
+    if (len != sizeof(struct cfg))
+        return EINVAL;
+    if ((*valuep = malloc(len)) == NULL)
+        return ENOMEM;
+    memcpy(*valuep, buf, len);
+    return 0;
+}
+
+static void
+cfg_destroy(void *value, void *arg)
+{
+    (void) arg;
+    free(value);
+}
+
+/* The gen and the changed sections */
+static int
+cfg_diff(const void *old, size_t oldlen, const void *buf, size_t len,
+         void **deltap, size_t *deltalenp, void *arg)
+{
+    const struct cfg *a = old;
+    const struct cfg *b = buf;
+    struct section_hdr sh;
+    char *p;
+    uint32_t i;
+
+    (void) arg;
+    if (oldlen != sizeof(struct cfg) || len != sizeof(struct cfg))
+        return EINVAL;
+    if ((p = *deltap = malloc(sizeof(b->gen) +
+                              NSECTIONS * (sizeof(sh) + sizeof(struct section)))) == NULL)
+        return ENOMEM;
+    memcpy(p, &b->gen, sizeof(b->gen));
+    p += sizeof(b->gen);
+    for (i = 0; i < NSECTIONS; i++) {
+        if (memcmp(&a->sections[i], &b->sections[i],
+                   sizeof(struct section)) == 0)
+            continue;
+        sh.idx = i;
+        memcpy(p, &sh, sizeof(sh));
+        memcpy(p + sizeof(sh), &b->sections[i], sizeof(struct section));
+        p += sizeof(sh) + sizeof(struct section);
+    }
+    *deltalenp = p - (char *)*deltap;
+    return 0;
+}
+
+static int
+cfg_patch(const void *old, size_t oldlen, const void *delta, size_t deltalen,
+          void **bufp, size_t *lenp, void *arg)
+{
+    const char *p = delta;
+    const char *end = p + deltalen;
+    struct section_hdr sh;
+    struct cfg *c;
+
+    (void) arg;
+    if (oldlen != sizeof(struct cfg) || deltalen < sizeof(c->gen))
+        return EINVAL;
+    if ((c = malloc(sizeof(*c))) == NULL)
+        return ENOMEM;
+    memcpy(c, old, sizeof(*c));
+    memcpy(&c->gen, p, sizeof(c->gen));
+    for (p += sizeof(c->gen); p < end;
+         p += sizeof(sh) + sizeof(struct section)) {
+        memcpy(&sh, p, sizeof(sh));
+        if (end - p < (ptrdiff_t)(sizeof(sh) + sizeof(struct section)) ||
+            sh.idx >= NSECTIONS) {
+            free(c);
+            return EINVAL;
+        }
+        memcpy(&c->sections[sh.idx], p + sizeof(sh), sizeof(struct section));
+    }
+    *bufp = c;
+    *lenp = sizeof(*c);
+    return 0;
+}
+
+/* Version gen of the value, made from version gen - 1 */
+static void
+cfg_next(struct cfg *c, uint64_t gen)
+{
+    size_t i;
+
+    c->gen = gen;
+    for (i = 0; i < 8; i++)
+        c->sections[gen % NSECTIONS].words[i] = gen * 8 + i;
+}
+
+static void
+print_stats(const char *who, const struct tsv_repl_stats *st)
+{
+    printf("  %s: version %ju, %ju versions in %ju frames (%ju deltas), "
+           "%ju bytes, lag %.1fus (max %.1fus)\n", who,
+           (uintmax_t)st->version, (uintmax_t)st->versions,
+           (uintmax_t)st->frames, (uintmax_t)st->deltas,
+           (uintmax_t)st->bytes, st->lag_ns / 1000.0,
+           st->max_lag_ns / 1000.0);
+}
+
+/* The child: replicate until the last version arrives, then check it */
+static int
+subscriber(const char *path, const struct tsv_repl_codec *codec, int ready)
+{
+    struct tsv_repl_stats st;
+    struct cfg expected;
+    struct cfg *c;
+    thread_safe_var vp;
+    tsv_repl_sub sub;
+    uint64_t gen;
+    int tries;
+
+    if ((errno = thread_safe_var_init(&vp, free)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    for (tries = 0; (errno = tsv_repl_sub_create(&sub, vp, path,
+                                                 codec)) != 0; tries++) {
+        if (tries == 1000)
+            err(1, "tsv_repl_sub_create() failed");
+        (void) usleep(1000);
+    }
+    if (write(ready, "", 1) != 1)
+        err(1, "write() failed");
+
+    for (;;) {
+        if ((errno = thread_safe_var_get(vp, (void **)&c, NULL)) != 0)
+            err(1, "thread_safe_var_get() failed");
+        if (c != NULL && c->gen == NVERSIONS)
+            break;
+        tsv_repl_sub_stats(sub, &st);
+        if (st.err != 0) {
+            errno = st.err;
+            err(1, "replication failed");
+        }
+        (void) usleep(100);
+    }
+
+    memset(&expected, 0, sizeof(expected));
+    for (gen = 1; gen <= NVERSIONS; gen++)
+        cfg_next(&expected, gen);
+    if (memcmp(c, &expected, sizeof(expected)) != 0)
+        errx(1, "subscriber: wrong value replicated");
+
+    tsv_repl_sub_stats(sub, &st);
+    print_stats("subscriber", &st);
+    if (st.version != NVERSIONS || st.versions != NVERSIONS ||
+        st.frames > st.versions || (codec->diff != NULL && st.deltas == 0))
+        errx(1, "subscriber: wrong statistics");
+    thread_safe_var_release(vp);
+    tsv_repl_sub_destroy(sub);
+    thread_safe_var_destroy(vp);
+    return 0;
+}
+
+static void
+run(const char *name, const struct tsv_repl_codec *codec)
+{
+    struct tsv_repl_stats st;
+    struct cfg cur;
+    struct cfg *c;
+    thread_safe_var vp;
+    tsv_repl_pub pub;
+    char path[64];
+    uint64_t gen;
+    pid_t pid;
+    int ready[2];
+    int status;
+    char junk;
+
+    printf("%s:\n", name);
+    fflush(stdout);
+    (void) snprintf(path, sizeof(path), "/tmp/t_repl.%ld.sock",
+                    (long)getpid());
+    if (pipe(ready) == -1)
+        err(1, "pipe() failed");
+    if ((pid = fork()) == -1)
+        err(1, "fork() failed");
+    if (pid == 0) {
+        (void) close(ready[0]);
+        exit(subscriber(path, codec, ready[1]));
+    }
+    (void) close(ready[1]);
+
+    if ((errno = thread_safe_var_init(&vp, free)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    if ((errno = tsv_repl_pub_create(&pub, vp, path, codec)) != 0)
+        err(1, "tsv_repl_pub_create() failed");
+    if (read(ready[0], &junk, 1) != 1)
+        errx(1, "subscriber failed to start");
+    (void) close(ready[0]);
+
+    memset(&cur, 0, sizeof(cur));
+    for (gen = 1; gen <= NVERSIONS; gen++) {
+        cfg_next(&cur, gen);
+        if ((c = malloc(sizeof(*c))) == NULL)
+            err(1, "malloc() failed");
+        memcpy(c, &cur, sizeof(*c));
+        if ((errno = thread_safe_var_set(vp, c, NULL)) != 0)
+            err(1, "thread_safe_var_set() failed");
+        if (gen % BURST == 0)
+            (void) usleep(1000);
+    }
+
+    if (waitpid(pid, &status, 0) != pid)
+        err(1, "waitpid() failed");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        errx(1, "%s: subscriber failed", name);
+    tsv_repl_pub_stats(pub, &st);
+    print_stats("publisher", &st);
+    tsv_repl_pub_destroy(pub);
+    thread_safe_var_destroy(vp);
+}
+
+static uint32_t encode_calls;
+
+static int
+fail_encode(const void *value, void **bufp, size_t *lenp, void *arg)
+{
+    (void) value;
+    (void) bufp;
+    (void) lenp;
+    (void) arg;
+    atomic_inc_32_nv(&encode_calls);
+    return EIO;
+}
+
+/* A version that fails to encode is tried once, not in a loop */
+static void
+run_failing(void)
+{
+    struct tsv_repl_codec codec;
+    thread_safe_var vp;
+    tsv_repl_pub pub;
+    char path[64];
+    int tries;
+
+    memset(&codec, 0, sizeof(codec));
+    codec.encode = fail_encode;
+    (void) snprintf(path, sizeof(path), "/tmp/t_repl.%ld.sock",
+                    (long)getpid());
+    if ((errno = thread_safe_var_init(&vp, free)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    if ((errno = tsv_repl_pub_create(&pub, vp, path, &codec)) != 0)
+        err(1, "tsv_repl_pub_create() failed");
+    if ((errno = thread_safe_var_set(vp, calloc(1, sizeof(struct cfg)),
+                                     NULL)) != 0)
+        err(1, "thread_safe_var_set() failed");
+    for (tries = 0; atomic_read_32(&encode_calls) == 0; tries++) {
+        if (tries == 10000)
+            errx(1, "publisher didn't try to encode");
+        (void) usleep(1000);
+    }
+    (void) usleep(100000);
+    if (atomic_read_32(&encode_calls) != 1)
+        errx(1, "a failed encoding was retried %u times",
+             atomic_read_32(&encode_calls) - 1);
+    if ((errno = thread_safe_var_set(vp, calloc(1, sizeof(struct cfg)),
+                                     NULL)) != 0)
+        err(1, "thread_safe_var_set() failed");
+    for (tries = 0; atomic_read_32(&encode_calls) == 1; tries++) {
+        if (tries == 10000)
+            errx(1, "a newer version was not encoded");
+        (void) usleep(1000);
+    }
+    tsv_repl_pub_destroy(pub);
+    thread_safe_var_destroy(vp);
+    printf("failing encoder: OK\n");
+}
+
+int
+main(void)
+{
+    struct tsv_repl_codec codec;
+
+    memset(&codec, 0, sizeof(codec));
+    codec.encode = cfg_encode;
+    codec.decode = cfg_decode;
+    codec.destroy = cfg_destroy;
+    run("full values", &codec);
+
+    codec.diff = cfg_diff;
+    codec.patch = cfg_patch;
+    run("deltas", &codec);
+
+    run_failing();
+    return 0;
+}
@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Tests ctp_rwlock and compares its read-side performance with that of
+ * pthread_rwlock_t and of thread_safe_var reads, with and without a
+ * concurrent writer.
+ *
+ * Usage: t_rwlock [NTHREADS]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <sys/types.h>
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ctp_rwlock.h"
+#include "thread_safe_global.h"
+#include "atomics.h"
+
+#ifdef USE_TSV_SUBSCRIPTION_SLOTS_DESIGN
+#define TSV_TYPE "slotlist"
+#else
+#define TSV_TYPE "slotpair"
+#endif
+
+#define NREADS          200000  /* per reader thread */
+#define WRITE_SLEEP_US  100     /* between writes, when there's a writer */
+
+/* The data; a writer mutating it in place must not be seen half-way */
+struct data {
+    volatile uint64_t   a;
+    volatile uint64_t   b;
+};
+
+enum kind {
+    KIND_CTP_RWLOCK,
+    KIND_PTHREAD_RWLOCK,
+    KIND_TSV,
+};
+
+static const char *kind_names[] = {
+    "ctp_rwlock",
+    "pthread_rwlock_t",
+    "thread_safe_var (" TSV_TYPE ")",
+};
+
+struct bench {
+    enum kind           kind;
+    ctp_rwlock          ctp;
+    pthread_rwlock_t    prw;
+    thread_safe_var     tsv;
+    struct data         data;       /* for the locks */
+    uint32_t            stop;       /* atomic; tells the writer to stop */
+    uint64_t            nwrites;
+};
+
+struct reader {
+    struct bench        *b;
+    pthread_t           t;
+    double              us;         /* time taken for NREADS reads */
+};
+
+static double
+now_us(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        err(1, "clock_gettime(CLOCK_MONOTONIC) failed");
+    return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+static void
+read_one(struct bench *b)
+{
+    struct data *d;
+    uint64_t x, y;
+    void *cookie;
+
+    switch (b->kind) {
+    case KIND_CTP_RWLOCK:
+        if ((errno = ctp_rwlock_rdlock(b->ctp, &cookie)) != 0)
+            err(1, "ctp_rwlock_rdlock() failed");
+        x = b->data.a;
+        y = b->data.b;
+        if ((errno = ctp_rwlock_rdunlock(b->ctp, cookie)) != 0)
+            err(1, "ctp_rwlock_rdunlock() failed");
+        break;
+    case KIND_PTHREAD_RWLOCK:
+        if ((errno = pthread_rwlock_rdlock(&b->prw)) != 0)
+            err(1, "pthread_rwlock_rdlock() failed");
+        x = b->data.a;
+        y = b->data.b;
+        if ((errno = pthread_rwlock_unlock(&b->prw)) != 0)
+            err(1, "pthread_rwlock_unlock() failed");
+        break;
+    default:
+        if ((errno = thread_safe_var_get(b->tsv, (void **)&d, NULL)) != 0)
+            err(1, "thread_safe_var_get() failed");
+        x = d->a;
+        y = d->b;
+        break;
+    }
+    if (x != y)
+        errx(1, "%s: reader saw a partial write", kind_names[b->kind]);
+}
+
+static void
+write_one(struct bench *b, uint64_t i)
+{
+    struct data *d;
+
+    switch (b->kind) {
+    case KIND_CTP_RWLOCK:
+        if ((errno = ctp_rwlock_wrlock(b->ctp)) != 0)
+            err(1, "ctp_rwlock_wrlock() failed");
+        b->data.a = i;
+        b->data.b = i;
+        if ((errno = ctp_rwlock_wrunlock(b->ctp)) != 0)
+            err(1, "ctp_rwlock_wrunlock() failed");
+        break;
+    case KIND_PTHREAD_RWLOCK:
+        if ((errno = pthread_rwlock_wrlock(&b->prw)) != 0)
+            err(1, "pthread_rwlock_wrlock() failed");
+        b->data.a = i;
+        b->data.b = i;
+        if ((errno = pthread_rwlock_unlock(&b->prw)) != 0)
+            err(1, "pthread_rwlock_unlock() failed");
+        break;
+    default:
+        if ((d = malloc(sizeof(*d))) == NULL)
+            err(1, "malloc() failed");
+        d->a = d->b = i;
+        if ((errno = thread_safe_var_set(b->tsv, d, NULL)) != 0)
+            err(1, "thread_safe_var_set() failed");
+        break;
+    }
+}
+
+static void *
+reader(void *data)
+{
+    struct reader *r = data;
+    double start;
+    size_t i;
+
+    start = now_us();
+    for (i = 0; i < NREADS; i++)
+        read_one(r->b);
+    r->us = now_us() - start;
+    if (r->b->kind == KIND_TSV)
+        thread_safe_var_release(r->b->tsv);
+    return NULL;
+}
+
+static void *
+writer(void *data)
+{
+    struct bench *b = data;
+
+    while (!atomic_read_32(&b->stop)) {
+        write_one(b, ++b->nwrites);
+        (void) usleep(WRITE_SLEEP_US);
+    }
+    return NULL;
+}
+
+static void
+run(enum kind kind, size_t nreaders, int with_writer)
+{
+    struct reader *readers;
+    struct bench b;
+    pthread_t w;
+    double us = 0;
+    size_t i;
+
+    memset(&b, 0, sizeof(b));
+    b.kind = kind;
+    if ((errno = ctp_rwlock_init(&b.ctp)) != 0)
+        err(1, "ctp_rwlock_init() failed");
+    if ((errno = pthread_rwlock_init(&b.prw, NULL)) != 0)
+        err(1, "pthread_rwlock_init() failed");
+    if ((errno = thread_safe_var_init(&b.tsv, free)) != 0)
+        err(1, "thread_safe_var_init() failed");
+    write_one(&b, 0);
+
+    if ((readers = calloc(nreaders, sizeof(readers[0]))) == NULL)
+        err(1, "calloc() failed");
+    if (with_writer &&
+        (errno = pthread_create(&w, NULL, writer, &b)) != 0)
+        err(1, "pthread_create() failed");
+    for (i = 0; i < nreaders; i++) {
+        readers[i].b = &b;
+        if ((errno = pthread_create(&readers[i].t, NULL, reader,
+                                    &readers[i])) != 0)
+            err(1, "pthread_create() failed");
+    }
+    for (i = 0; i < nreaders; i++) {
+        if ((errno = pthread_join(readers[i].t, NULL)) != 0)
+            err(1, "pthread_join() failed");
+        us += readers[i].us;
+    }
+    atomic_write_32(&b.stop, 1);
+    if (with_writer && (errno = pthread_join(w, NULL)) != 0)
+        err(1, "pthread_join() failed");
+
+    us /= (double)nreaders * NREADS;
+    printf("%s, %zu readers, %s: %fus/read, %f reads/s/thread "
+           "(%ju writes)\n", kind_names[kind], nreaders,
+           with_writer ? "one writer" : "no writers", us, 1000000.0 / us,
+           (uintmax_t)b.nwrites);
+
+    free(readers);
+    thread_safe_var_destroy(b.tsv);
+    (void) pthread_rwlock_destroy(&b.prw);
+    ctp_rwlock_destroy(b.ctp);
+}
+
+int
+main(int argc, char **argv)
+{
+    long nreaders = 4;
+    int with_writer;
+    int kind;
+
+    if (argc > 2 || (argc == 2 && (nreaders = atol(argv[1])) < 1)) {
+        fprintf(stderr, "Usage: %s [NTHREADS]\n", argv[0]);
+        return 1;
+    }
+    for (with_writer = 0; with_writer < 2; with_writer++) {
+        for (kind = KIND_CTP_RWLOCK; kind <= KIND_TSV; kind++)
+            run(kind, nreaders, with_writer);
+    }
+    return 0;
+}
@@ -42,15 +42,30 @@
  *  - readers do not starve writers; writers do not block readers
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE     /* sched_getcpu() */
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <stdio.h>
+#include <unistd.h>
+#endif
+
 #include <sys/types.h>
 #include <assert.h>
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "thread_safe_global.h"
+#include "ctp_counter.h"
 #include "atomics.h"
 
 #if defined(USE_TSV_SLOT_PAIR_DESIGN) && defined(USE_TSV_SUBSCRIPTION_SLOTS_DESIGN)
@@ -63,6 +78,120 @@
 
 typedef thread_safe_var_dtor_f var_dtor_t;
 
+struct set_req; /* See thread_safe_var_set() */
+
+/*
+ * Fixed-size value slabs; see thread_safe_var_value_alloc().
+ *
+ * Each element of a slab holds a value and, in front of it, the
+ * wrapper/list element that thread_safe_var_set() would otherwise
+ * allocate for it.  When a value is destroyed its element goes on a
+ * LIFO free list, up to a watermark, to be handed out again while still
+ * warm in cache.  A slab outlives its var for as long as any of its
+ * elements are in use, as slot-pair readers may release values after
+ * the var is destroyed.
+ *
+ * Readers destroy values too, so they mustn't wait on writers
+ * allocating: freed elements are pushed onto a lock-free stack
+ * (returned), and writers, under a lock of their own, move the whole
+ * stack (swapped with NULL, so there's no ABA) to their free list when
+ * that runs out.
+ *
+ * Vars with static memory (see thread_safe_var_attr's mem) have a
+ * "fixed" slab carved from the caller's memory, with exactly
+ * max_versions elements, and if the var has no value_size then its
+ * elements are just wrappers/list elements.
+ */
+struct value_slab {
+    pthread_mutex_t     lock;       /* protects free_elems */
+    void                *free_elems;/* LIFO of free elements */
+    void                *returned;  /* atomic; LIFO of freed elements */
+    volatile uint32_t   nfree;      /* atomic; elements in both LIFOs */
+    uint32_t            max_free;   /* watermark */
+    volatile uint32_t   dead;       /* atomic; the var was destroyed */
+    int                 fixed;      /* never allocates nor frees */
+    volatile uint32_t   nref;       /* the var's, plus one per element */
+    size_t              hdr_size;   /* wrapper/list element size */
+    size_t              value_size; /* zero if the values are elsewhere */
+    size_t              elem_size;  /* hdr_size + value_size, aligned */
+};
+
+#define SLAB_ALIGN  16  /* enough for any scalar type */
+
+/* Caller-provided memory of a static var; see thread_safe_var_attr */
+struct mem_region {
+    char                *base;
+    size_t              size;
+    size_t              used;
+};
+
+static void *region_alloc(struct mem_region *, size_t);
+static int  region_init(struct mem_region *, const thread_safe_var_attr *,
+                        size_t);
+static size_t slab_mem_size(size_t, const thread_safe_var_attr *);
+static int  slab_create(size_t, const thread_safe_var_attr *,
+                        struct mem_region *, struct value_slab **);
+static void *slab_get(struct value_slab *);
+static void slab_put(struct value_slab *, void *);
+static void slab_release(struct value_slab *);
+static void var_reclaim(thread_safe_var);
+
+static int get_current_version(thread_safe_var, uint64_t, void **);
+
+/* Reader stall detection; see thread_safe_var_attr's stall_ms */
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static int  watch_var(thread_safe_var);
+static void unwatch_var(thread_safe_var);
+static size_t var_find_stalls(thread_safe_var, uint64_t,
+                              struct thread_safe_var_stall *, size_t);
+
+/* Per-NUMA-node replicas of values; see thread_safe_var_attr */
+static int  replicas_make(thread_safe_var_replicate_f, void *, void ***);
+static void replicas_destroy(void **, var_dtor_t);
+static void *replica_pick(void *, void **);
+
+/* All internal allocations; see thread_safe_var_set_allocator() */
+static void *mem_alloc(size_t);
+static void *mem_calloc(size_t, size_t);
+static void mem_free(void *);
+
+/* Statistics of vars with attr->stats; see thread_safe_var_get_stats() */
+enum var_stat {
+    STAT_GETS,
+    STAT_GETS_NEW,
+    STAT_SETS,
+    STAT_PUBLISHED,
+    STAT_COMBINED,
+    STAT_DUPS,
+    STAT_CONFLICTS,
+    STAT_MAX
+};
+static int stats_init(void);
+static void stat_add(thread_safe_var, enum var_stat, uint64_t);
+
+/* Pooled wrappers/list elements (NODE_SIZE bytes), shared by all vars */
+static void *node_get(void);
+static void node_put(void *);
+
+/*
+ * Vars' write locks are FIFO queue locks; see wlock_lock().  Each thread
+ * holding or waiting for one has a wlock_node, normally on its stack,
+ * which must remain valid until it unlocks.
+ */
+struct wlock_node {
+    struct wlock_node   *next;      /* atomic; next in line */
+    volatile uint32_t   state;      /* atomic; see wlock_lock() */
+};
+
+struct wlock {
+    struct wlock_node   *tail;      /* atomic; last in line, or NULL */
+};
+
+static void wlock_init(struct wlock *);
+static void wlock_lock(struct wlock *, struct wlock_node *);
+static void wlock_unlock(struct wlock *, struct wlock_node *);
+static void cpu_pause(void);
+
 #ifdef USE_TSV_SLOT_PAIR_DESIGN
 /*
  * There are two designs, but one of them is ommited here.
@@ -162,9 +291,37 @@ struct vwrapper {
     var_dtor_t          dtor;       /* value destructor */
     void                *ptr;       /* the actual value */
     uint64_t            version;    /* version of this data */
+    struct value_slab   *slab;      /* NULL if not from a slab */
+    void                **replicas; /* per-NUMA-node copies of ptr */
+    uint64_t            hash;       /* see var_is_dup() */
     volatile uint32_t   nref;       /* release when drops to 0 */
 };
 
+#define NODE_SIZE sizeof(struct vwrapper)
+
+/*
+ * What a reader thread holds, for the stall watchdog.  Readers of vars
+ * with a stall_ms attribute have one of these per var, which they
+ * update when they read a new version or release.  The rest is the
+ * watchdog's, and each var's list of these is protected by the
+ * watch_lock.
+ *
+ * A thread's records are on a list of their own, under reader_key (one
+ * key for all vars, so destroying vars leaks no keys).  A record whose
+ * var is destroyed is reused for the next var the thread reads, and
+ * they're all freed when the thread exits.
+ */
+struct reader_rec {
+    struct reader_rec   *next;          /* the var's next reader */
+    struct reader_rec   *tnext;         /* the thread's next record */
+    thread_safe_var     vp;             /* atomic; NULL once destroyed */
+    pthread_t           thread;
+    volatile uint64_t   version;        /* atomic; held version, or 0 */
+    uint64_t            stale_version;  /* see var_find_stalls() */
+    uint64_t            stale_since;
+    int                 reported;
+};
+
 /* This is a slot.  There are two of these. */
 struct var {
     struct vwrapper     *wrapper;   /* wraps real ptr, has nref */
@@ -175,7 +332,7 @@ struct var {
 
 struct thread_safe_var_s {
     pthread_key_t       tkey;           /* to detect thread exits */
-    pthread_mutex_t     write_lock;     /* one writer at a time */
+    struct wlock        write_lock;     /* one writer at a time */
     pthread_mutex_t     waiter_lock;    /* to signal waiters */
     pthread_cond_t      waiter_cv;      /* to signal waiters */
     pthread_mutex_t     cv_lock;        /* to signal waiting writer */
@@ -183,8 +340,42 @@ struct thread_safe_var_s {
     struct var          vars[2];        /* the two slots */
     var_dtor_t          dtor;           /* both read this */
     uint64_t            next_version;   /* both read; writer writes */
+    struct set_req      *set_reqs;      /* atomic; posted writes */
+    struct thread_safe_var_waiter *waiters; /* atomic; see notify */
+    struct value_slab   *slab;          /* see thread_safe_var_value_alloc() */
+    int                 static_mem;     /* vp is in the caller's memory */
+    thread_safe_var_replicate_f replicate; /* see replicas_make() */
+    thread_safe_var_eq_f eq;            /* see var_is_dup() */
+    thread_safe_var_hash_f hash;        /* see var_is_dup() */
+    struct vwrapper     **history;      /* atomic; see history_add() */
+    struct vwrapper     *history_limbo; /* writer-only; see history_add() */
+    uint32_t            history_size;   /* attr->history + 1, or 0 */
+    uint32_t            history_next;   /* next history[] entry to use */
+    uint32_t            stall_ms;       /* see var_find_stalls() */
+    thread_safe_var_stall_f stall_cb;
+    void                *stall_arg;
+    thread_safe_var     watch_next;     /* see watch_var() */
+    struct reader_rec   *readers;       /* protected by watch_lock */
+    int                 single_writer;  /* see set_single() */
+    int                 stats;          /* see stat_add() */
+    volatile uint32_t   writer_known;
+    pthread_t           writer;
 };
 
+static void
+var_free(thread_safe_var vp)
+{
+    if (!vp->static_mem)
+        mem_free(vp);
+}
+
+/* Wrappers are freed by their last release; nothing to do here */
+static void
+var_reclaim(thread_safe_var vp)
+{
+    (void) vp;
+}
+
 
 static void
 wrapper_free(struct vwrapper *wrapper)
@@ -195,7 +386,11 @@ wrapper_free(struct vwrapper *wrapper)
         return;
     if (wrapper->dtor != NULL)
         wrapper->dtor(wrapper->ptr);
-    free(wrapper);
+    replicas_destroy(wrapper->replicas, wrapper->dtor);
+    if (wrapper->slab != NULL)
+        slab_put(wrapper->slab, wrapper); /* the value is in there too */
+    else
+        node_put(wrapper);
 }
 
 /* For the thread-specific key */
@@ -205,32 +400,121 @@ var_dtor_wrapper(void *wrapper)
     wrapper_free(wrapper);
 }
 
+static pthread_key_t reader_key;    /* this thread's reader_recs */
+static int reader_key_made;         /* protected by watch_lock */
+
+/* Thread exit: drop this thread's reader_recs */
+static void
+reader_rec_dtor(void *data)
+{
+    struct reader_rec *recs = data;
+    struct reader_rec *rec;
+    struct reader_rec **recp;
+
+    (void) pthread_mutex_lock(&watch_lock);
+    for (rec = recs; rec != NULL; rec = rec->tnext) {
+        if (rec->vp == NULL)
+            continue;
+        for (recp = &rec->vp->readers; *recp != rec; recp = &(*recp)->next)
+            ;
+        *recp = rec->next;
+    }
+    (void) pthread_mutex_unlock(&watch_lock);
+    for (rec = recs; rec != NULL; rec = recs) {
+        recs = rec->tnext;
+        mem_free(rec);
+    }
+}
+
+/* Create reader_key for the first var with a stall_ms attribute */
+static int
+reader_key_init(void)
+{
+    int err = 0;
+
+    (void) pthread_mutex_lock(&watch_lock);
+    if (!reader_key_made &&
+        (err = pthread_key_create(&reader_key, reader_rec_dtor)) == 0)
+        reader_key_made = 1;
+    (void) pthread_mutex_unlock(&watch_lock);
+    return err;
+}
+
+/* Note the version this thread now holds (0 -> none) for the watchdog */
+static void
+reader_note(thread_safe_var vp, uint64_t version)
+{
+    struct reader_rec *recs = pthread_getspecific(reader_key);
+    struct reader_rec *spare = NULL;
+    struct reader_rec *rec;
+    thread_safe_var rvp;
+
+    /* Only we make our records' vp non-NULL, so a spare stays spare */
+    for (rec = recs; rec != NULL; rec = rec->tnext) {
+        if ((rvp = atomic_read_ptr((volatile void **)&rec->vp)) == vp)
+            break;
+        if (rvp == NULL)
+            spare = rec;
+    }
+    if (rec == NULL) {
+        if (version == 0)
+            return;
+        if ((rec = spare) == NULL) {
+            if ((rec = mem_calloc(1, sizeof(*rec))) == NULL)
+                return; /* we can't watch this reader; oh well */
+            rec->thread = pthread_self();
+            rec->tnext = recs;
+            if (pthread_setspecific(reader_key, rec) != 0) {
+                mem_free(rec);
+                return;
+            }
+        }
+        (void) pthread_mutex_lock(&watch_lock);
+        atomic_write_64(&rec->version, 0);
+        rec->stale_version = 0;
+        atomic_write_ptr((volatile void **)&rec->vp, vp);
+        rec->next = vp->readers;
+        vp->readers = rec;
+        (void) pthread_mutex_unlock(&watch_lock);
+    }
+    atomic_write_64(&rec->version, version);
+}
+
 /**
- * Initialize a thread-safe global variable
+ * Initialize a thread-safe global variable with optional attributes
  *
- * A thread-safe global variable stores a current value, a pointer to
- * void, which may be set and read.  A value read from a thread-safe
- * global variable will be valid in the thread that read it, and will
- * remain valid until released or until the thread-safe global variable
- * is read again in the same thread.  New values may be set.  Values
- * will be destroyed with the destructor provided when no references
- * remain.
+ * See thread_safe_var_init().
  *
  * @param var Pointer to thread-safe global variable
  * @param dtor Pointer to thread-safe global value destructor function
+ * @param attr Attributes (may be NULL)
  *
  * @return Returns zero on success, else a system error number
  */
 int
-thread_safe_var_init(thread_safe_var *vpp,
-                     thread_safe_var_dtor_f dtor)
+thread_safe_var_init_attr(thread_safe_var *vpp,
+                          thread_safe_var_dtor_f dtor,
+                          const thread_safe_var_attr *attr)
 {
+    struct wlock_node wn;
+    struct mem_region region;
     thread_safe_var vp;
     int err;
 
     *vpp = NULL;
-    if ((vp = calloc(1, sizeof(*vp))) == NULL)
-        return errno;
+    if (attr != NULL && attr->single_writer && attr->history > 0)
+        return EINVAL;
+    if (attr != NULL && attr->stats && (err = stats_init()) != 0)
+        return err;
+    if (attr != NULL && attr->mem != NULL) {
+        if ((err = region_init(&region, attr,
+                               thread_safe_var_mem_size(attr))) != 0)
+            return err;
+        vp = region_alloc(&region, sizeof(*vp));
+        vp->static_mem = 1;
+    } else if ((vp = mem_calloc(1, sizeof(*vp))) == NULL) {
+        return ENOMEM;
+    }
 
     /*
      * The thread-local key is used to hold a reference for destruction
@@ -244,37 +528,30 @@ thread_safe_var_init(thread_safe_var *vpp,
      * realloc()'ed as needed).
      */
     if ((err = pthread_key_create(&vp->tkey, var_dtor_wrapper)) != 0) {
-        free(vp);
-        return err;
-    }
-    if ((err = pthread_mutex_init(&vp->write_lock, NULL)) != 0) {
-        free(vp);
+        var_free(vp);
         return err;
     }
+    wlock_init(&vp->write_lock);
     if ((err = pthread_mutex_init(&vp->waiter_lock, NULL)) != 0) {
-        pthread_mutex_destroy(&vp->write_lock);
-        free(vp);
+        var_free(vp);
         return err;
     }
     if ((err = pthread_mutex_init(&vp->cv_lock, NULL)) != 0) {
-        pthread_mutex_destroy(&vp->write_lock);
         pthread_mutex_destroy(&vp->cv_lock);
-        free(vp);
+        var_free(vp);
         return err;
     }
     if ((err = pthread_cond_init(&vp->cv, NULL)) != 0) {
-        pthread_mutex_destroy(&vp->write_lock);
         pthread_mutex_destroy(&vp->waiter_lock);
         pthread_mutex_destroy(&vp->cv_lock);
-        free(vp);
+        var_free(vp);
         return err;
     }
     if ((err = pthread_cond_init(&vp->waiter_cv, NULL)) != 0) {
-        pthread_mutex_destroy(&vp->write_lock);
         pthread_mutex_destroy(&vp->waiter_lock);
         pthread_mutex_destroy(&vp->cv_lock);
         pthread_cond_destroy(&vp->cv);
-        free(vp);
+        var_free(vp);
         return err;
     }
 
@@ -292,14 +569,145 @@ thread_safe_var_init(thread_safe_var *vpp,
     vp->vars[1].wrapper = NULL;
     vp->vars[1].other = &vp->vars[0]; /* other pointer never changes */
     vp->dtor = dtor;
+    vp->replicate = attr != NULL ? attr->replicate : NULL;
+    vp->eq = attr != NULL ? attr->eq : NULL;
+    vp->hash = attr != NULL && attr->eq != NULL ? attr->hash : NULL;
+    vp->single_writer = attr != NULL && attr->single_writer;
+    vp->stats = attr != NULL && attr->stats;
+
+    /* Readers' records are allocated as they come, so not if static */
+    if (attr != NULL && attr->stall_ms > 0) {
+        if (vp->static_mem) {
+            thread_safe_var_destroy(vp);
+            return EINVAL;
+        }
+        if ((err = reader_key_init()) != 0) {
+            thread_safe_var_destroy(vp);
+            return err;
+        }
+        vp->stall_ms = attr->stall_ms;
+        vp->stall_cb = attr->stall_cb;
+        vp->stall_arg = attr->stall_arg;
+    }
+
+    if (attr != NULL && attr->history > 0) {
+        if (vp->static_mem)
+            vp->history = region_alloc(&region, (attr->history + 1) *
+                                       sizeof(vp->history[0]));
+        else if ((vp->history = mem_calloc(attr->history + 1,
+                                           sizeof(vp->history[0]))) == NULL) {
+            thread_safe_var_destroy(vp);
+            return ENOMEM;
+        }
+        vp->history_size = attr->history + 1;
+    }
+
+    if (attr != NULL && (attr->value_size > 0 || vp->static_mem) &&
+        (err = slab_create(sizeof(struct vwrapper), attr,
+                           vp->static_mem ? &region : NULL,
+                           &vp->slab)) != 0) {
+        thread_safe_var_destroy(vp);
+        return err;
+    }
+
+    if (vp->stall_ms > 0 && (err = watch_var(vp)) != 0) {
+        thread_safe_var_destroy(vp);
+        return err;
+    }
 
     /*
      * Acquiring and dropping the lock functions as a trivial memory
      * barrier.
      */
-    pthread_mutex_lock(&vp->write_lock);
+    wlock_lock(&vp->write_lock, &wn);
     *vpp = vp;
-    pthread_mutex_unlock(&vp->write_lock);
+    wlock_unlock(&vp->write_lock, &wn);
+    return 0;
+}
+
+/**
+ * Compute the memory needed by a var with static memory
+ *
+ * See thread_safe_var_attr's mem.  In this implementation readers need
+ * no per-thread memory, so max_threads is not used.
+ *
+ * @param [in] attr Attributes
+ *
+ * @return The size of the memory needed, or zero if the attributes are
+ *         invalid
+ */
+size_t
+thread_safe_var_mem_size(const thread_safe_var_attr *attr)
+{
+    size_t slab_size = slab_mem_size(sizeof(struct vwrapper), attr);
+    size_t vp_size = (sizeof(struct thread_safe_var_s) + SLAB_ALIGN - 1) &
+                     ~(size_t)(SLAB_ALIGN - 1);
+    size_t history_size = 0;
+
+    if (attr->history > 0)
+        history_size = ((attr->history + (size_t)1) * sizeof(void *) +
+                        SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    if (slab_size == 0 || slab_size > SIZE_MAX - vp_size - history_size)
+        return 0;
+    return vp_size + history_size + slab_size;
+}
+
+/*
+ * Readers of slot-pair vars keep no per-var subscription state to share,
+ * so reclamation domains are empty: vars ignore them, and there's never
+ * anything to reclaim that the last release didn't already free.
+ */
+struct thread_safe_var_domain_s {
+    uint32_t            max_vars;
+};
+
+/**
+ * Create a reclamation domain for up to max_vars vars
+ *
+ * See thread_safe_var_attr's domain.
+ *
+ * @param [out] domp The new domain
+ * @param [in] max_vars How many vars can be in the domain at once
+ *
+ * @return Zero on success, else a system error number
+ */
+int
+thread_safe_var_domain_create(thread_safe_var_domain *domp, uint32_t max_vars)
+{
+    *domp = NULL;
+    if (max_vars == 0)
+        return EINVAL;
+    if ((*domp = mem_calloc(1, sizeof(**domp))) == NULL)
+        return ENOMEM;
+    (*domp)->max_vars = max_vars;
+    return 0;
+}
+
+/**
+ * Destroy a reclamation domain
+ *
+ * @param [in] dom A domain none of whose vars remain
+ *
+ * @return Zero on success, else a system error number
+ */
+int
+thread_safe_var_domain_destroy(thread_safe_var_domain dom)
+{
+    mem_free(dom);
+    return 0;
+}
+
+/**
+ * Free values of a domain's vars that no reader references any longer
+ *
+ * @param [in] dom A domain
+ *
+ * @return Zero on success, else a system error number
+ */
+int
+thread_safe_var_domain_reclaim(thread_safe_var_domain dom)
+{
+    (void) dom;
     return 0;
 }
 
@@ -314,23 +722,42 @@ thread_safe_var_init(thread_safe_var *vpp,
 void
 thread_safe_var_destroy(thread_safe_var vp)
 {
+    struct wlock_node wn;
     if (vp == 0)
         return;
 
     thread_safe_var_release(vp);
-    pthread_mutex_lock(&vp->write_lock); /* There'd better not be readers */
+    if (vp->stall_ms > 0) {
+        struct reader_rec *rec;
+
+        /* Readers keep their reader_recs for reuse; see reader_note() */
+        unwatch_var(vp);
+        (void) pthread_mutex_lock(&watch_lock);
+        for (rec = vp->readers; rec != NULL; rec = rec->next)
+            atomic_write_ptr((volatile void **)&rec->vp, NULL);
+        vp->readers = NULL;
+        (void) pthread_mutex_unlock(&watch_lock);
+    }
+    wlock_lock(&vp->write_lock, &wn); /* There'd better not be readers */
     pthread_cond_destroy(&vp->cv);
     pthread_mutex_destroy(&vp->cv_lock);
     wrapper_free(vp->vars[0].wrapper);
     wrapper_free(vp->vars[1].wrapper);
+    while (vp->history_size > 0)
+        wrapper_free(vp->history[--vp->history_size]);
+    wrapper_free(vp->history_limbo);
+    vp->history_limbo = NULL;
+    if (!vp->static_mem)
+        mem_free(vp->history);
+    vp->history = NULL;
     vp->vars[0].other = &vp->vars[1];
     vp->vars[1].other = &vp->vars[0];
     vp->vars[0].wrapper = NULL;
     vp->vars[1].wrapper = NULL;
     vp->dtor = NULL;
-    pthread_mutex_unlock(&vp->write_lock);
-    pthread_mutex_destroy(&vp->write_lock);
-    free(vp);
+    wlock_unlock(&vp->write_lock, &wn);
+    slab_release(vp->slab);
+    var_free(vp);
     /* Remaining references will be released by the thread key destructor */
     /* XXX We leak var->tkey!  See note in initiator above. */
 }
@@ -372,14 +799,16 @@ thread_safe_var_get(thread_safe_var vp, void **res, uint64_t *version)
 
     *res = NULL;
 
+    stat_add(vp, STAT_GETS, 1);
     if ((wrapper = pthread_getspecific(vp->tkey)) != NULL &&
         wrapper->version == atomic_read_64(&vp->next_version) - 1) {
 
         /* Fast path */
         *version = wrapper->version;
-        *res = wrapper->ptr;
+        *res = replica_pick(wrapper->ptr, wrapper->replicas);
         return 0;
     }
+    stat_add(vp, STAT_GETS_NEW, 1);
 
     /* Busy loop to get current slot.  Races with writers. */
     for (;;) {
@@ -409,14 +838,14 @@ thread_safe_var_get(thread_safe_var vp, void **res, uint64_t *version)
     }
 
     assert(v->wrapper != NULL);
-    assert(*version + 1 == atomic_read_64(&vp->next_version) ||
-           *version + 2 == atomic_read_64(&vp->next_version));
+    /* At most one writer can have gone by, possibly skipping versions */
+    assert(*version < atomic_read_64(&vp->next_version));
 
     /* Take the wrapped value for the slot we chose */
     nref = atomic_inc_32_nv(&v->wrapper->nref);
     assert(nref > 1);
     *version = v->wrapper->version;
-    *res = v->wrapper->ptr;
+    *res = replica_pick(v->wrapper->ptr, v->wrapper->replicas);
 
 
     /*
@@ -450,9 +879,85 @@ thread_safe_var_get(thread_safe_var vp, void **res, uint64_t *version)
 
     /* Recall this value we just read */
     err = pthread_setspecific(vp->tkey, wrapper);
+    if (vp->stall_ms > 0)
+        reader_note(vp, *version);
     return (err2 == 0) ? err : err2;
 }
 
+/**
+ * Get a given version of a thread-safe global variable
+ *
+ * The current version and, if the var has a history attribute, that
+ * many versions before it can be read this way.  As with
+ * thread_safe_var_get(), the value remains valid until the thread
+ * reads the var again or releases it.  Like it, this is lock-less, and
+ * doesn't wait for writers.
+ *
+ * @param [in] vp A thread-safe global variable
+ * @param [in] version The version to read
+ * @param [out] res The value of that version
+ *
+ * @return Zero on success, ENOENT if that version is not (or no longer)
+ *         available, or a system error
+ */
+int
+thread_safe_var_get_version(thread_safe_var vp, uint64_t version,
+                            void **res)
+{
+    struct vwrapper *wrapper = NULL;
+    struct vwrapper *w;
+    uint64_t current;
+    struct var *v;
+    uint32_t i;
+    int err;
+
+    *res = NULL;
+    if (vp->single_writer || vp->history_size == 0)
+        return get_current_version(vp, version, res);
+
+    /*
+     * Enter the current slot as thread_safe_var_get() does.  While
+     * we're in it no writer can get through history_add() twice, so the
+     * wrappers we find in history[] can't be freed under us.
+     */
+    for (;;) {
+        if ((current = atomic_read_64(&vp->next_version)) == 0)
+            return ENOENT;
+        current--;
+        v = &vp->vars[current & 0x1];
+        (void) atomic_inc_32_nv(&v->nreaders);
+        if (atomic_read_64(&vp->next_version) == current + 1)
+            break;
+        if (atomic_dec_32_nv(&v->nreaders) == 0)
+            (void) signal_writer(vp);
+    }
+    if (v->wrapper->version == version)
+        wrapper = v->wrapper;
+    for (i = 0; wrapper == NULL && i < vp->history_size; i++) {
+        w = atomic_read_ptr((volatile void **)&vp->history[i]);
+        if (w != NULL && w->version == version)
+            wrapper = w;
+    }
+    if (wrapper != NULL)
+        (void) atomic_inc_32_nv(&wrapper->nref);
+    if (atomic_dec_32_nv(&v->nreaders) == 0 &&
+        atomic_read_64(&vp->next_version) != current + 1)
+        (void) signal_writer(vp);
+    if (wrapper == NULL)
+        return ENOENT;
+
+    /* Replace this thread's reference as thread_safe_var_get() would */
+    thread_safe_var_release(vp);
+    if ((err = pthread_setspecific(vp->tkey, wrapper)) != 0) {
+        wrapper_free(wrapper);
+        return err;
+    }
+    if (vp->stall_ms > 0)
+        reader_note(vp, version);
+    *res = replica_pick(wrapper->ptr, wrapper->replicas);
+    return 0;
+}
+
 /**
  * Release this thread's reference (if it holds one) to the current
  * value of the given thread-safe global variable.
@@ -469,72 +974,153 @@ thread_safe_var_release(thread_safe_var vp)
     if (pthread_setspecific(vp->tkey, NULL) != 0)
         abort();
     assert(pthread_getspecific(vp->tkey) == NULL);
+    if (vp->stall_ms > 0)
+        reader_note(vp, 0);
+    wrapper_free(wrapper);
+}
+
+/* Allocate a wrapper for a value to be set; see thread_safe_var_set() */
+static void node_free(thread_safe_var, void *);
+
+static int
+node_alloc(thread_safe_var vp, void *cfdata, void **nodep)
+{
+    struct vwrapper *wrapper;
+    int err;
+
+    if (vp->slab != NULL && vp->slab->value_size > 0) {
+        /* The wrapper is in front of the value */
+        wrapper = (void *)((char *)cfdata - vp->slab->hdr_size);
+        memset(wrapper, 0, sizeof(*wrapper));
+        wrapper->slab = vp->slab;
+        *nodep = wrapper;
+    } else if (vp->slab != NULL) {
+        if ((*nodep = wrapper = slab_get(vp->slab)) == NULL)
+            return ENOMEM;
+        memset(wrapper, 0, sizeof(*wrapper));
+        wrapper->slab = vp->slab;
+    } else if ((*nodep = wrapper = node_get()) == NULL) {
+        return ENOMEM;
+    }
+
+    /*
+     * The var itself holds a reference to the current value, thus its
+     * nref starts at 1, but that is made so in var_publish().
+     */
+    wrapper->dtor = vp->dtor;
+    wrapper->nref = 0;
+    wrapper->ptr = cfdata;
+    if (vp->hash != NULL)
+        wrapper->hash = vp->hash(cfdata);
+    if (vp->replicate != NULL &&
+        (err = replicas_make(vp->replicate, cfdata, &wrapper->replicas)) != 0) {
+        node_free(vp, wrapper);
+        return err;
+    }
+    return 0;
+}
+
+/* Free a wrapper that never got published; the caller keeps the value */
+static void
+node_free(thread_safe_var vp, void *node)
+{
+    struct vwrapper *wrapper = node;
+
+    replicas_destroy(wrapper->replicas, vp->dtor);
+    wrapper->replicas = NULL;
+    if (vp->slab == NULL)
+        node_put(node);
+    else if (vp->slab->value_size == 0)
+        slab_put(vp->slab, node);
+}
+
+/* Destroy a value that never got published, and its wrapper */
+static void
+node_destroy(thread_safe_var vp, void *node)
+{
+    struct vwrapper *wrapper = node;
+
+    (void) vp;
+    assert(wrapper->nref == 0);
+    wrapper->nref = 1;
     wrapper_free(wrapper);
 }
 
+/*
+ * Keep a reference to a newly published value so that it can be read
+ * by version with thread_safe_var_get_version() until attr->history
+ * newer versions have been published.  The caller must hold the
+ * write_lock, and must have waited for the slot it's about to publish
+ * to be quiescent.
+ *
+ * Readers look through history[] without the write_lock, from within a
+ * slot's nreaders (see thread_safe_var_get_version()), so we can't
+ * release the value we replace yet: a reader in the current slot may be
+ * looking at it.  We keep it in history_limbo until the next publish,
+ * which will have waited for that slot's readers to drain.  (Readers
+ * entering the slot we publish only after we're done will not see it.)
+ */
+static void
+history_add(thread_safe_var vp, struct vwrapper *wrapper)
+{
+    struct vwrapper *old;
+
+    if (vp->history_size == 0)
+        return;
+    (void) atomic_inc_32_nv(&wrapper->nref);
+    old = vp->history[vp->history_next];
+    atomic_write_ptr((volatile void **)&vp->history[vp->history_next],
+                     wrapper);
+    vp->history_next = (vp->history_next + 1) % vp->history_size;
+    wrapper_free(vp->history_limbo);
+    vp->history_limbo = old;
+}
+
 /**
- * Set new data on a thread-safe global variable
+ * Publish a new value on a thread-safe global variable
  *
- * @param [in] var Pointer to thread-safe global variable
- * @param [in] cfdata New value for the thread-safe global variable
+ * The caller must hold the write_lock (or be a single writer; see
+ * set_single()).
+ *
+ * @param [in] vp Thread-safe global variable
+ * @param [in] node Wrapper for the new value (see node_alloc())
+ * @param [in] nskip Number of versions to skip (see thread_safe_var_set())
  * @param [out] new_version New version number
+ * @param [out] garbagep Values to release after dropping the write_lock
  *
- * @return 0 on success, or a system error such as ENOMEM.
+ * @return 0 on success, or a system error.
  */
-int
-thread_safe_var_set(thread_safe_var vp, void *cfdata,
-                    uint64_t *new_version)
+static int
+var_publish(thread_safe_var vp, void *node, uint64_t nskip,
+            uint64_t *new_version, void **garbagep)
 {
     int err;
     size_t i;
     struct var *v;
     struct vwrapper *old_wrapper = NULL;
-    struct vwrapper *wrapper;
+    struct vwrapper *wrapper = node;
     struct vwrapper *tmp;
-    uint64_t vers;
+    uint64_t next_version;
     uint64_t tmp_version;
     uint64_t nref;
 
-    if (cfdata == NULL)
-        return EINVAL;
-
-    if (new_version == NULL)
-        new_version = &vers;
-
-    *new_version = 0;
-
-    /* Build a wrapper for the new value */
-    if ((wrapper = calloc(1, sizeof(*wrapper))) == NULL)
-        return errno;
-
-    /*
-     * The var itself holds a reference to the current value, thus its
-     * nref starts at 1, but that is made so further below.
-     */
-    wrapper->dtor = vp->dtor;
-    wrapper->nref = 0;
-    wrapper->ptr = cfdata;
-
-    /* This functions as a memory barrier for the above writes */
-    if ((err = pthread_mutex_lock(&vp->write_lock)) != 0) {
-        free(wrapper);
-        return err;
-    }
+    *garbagep = NULL; /* We release the old value here */
 
     /* vp->next_version is stable because we hold the write_lock */
-    *new_version = wrapper->version = atomic_read_64(&vp->next_version);
+    next_version = atomic_read_64(&vp->next_version);
 
     /* Grab the next slot */
-    v = vp->vars[(*new_version + 1) & 0x1].other;
+    v = vp->vars[(next_version + 1) & 0x1].other;
     old_wrapper = atomic_read_ptr((volatile void **)&v->wrapper);
 
-    if (*new_version == 0) {
+    if (next_version == 0) {
         /* This is the first write; set wrapper on both slots */
+        *new_version = wrapper->version = 1 + nskip;
 
         for (i = 0; i < sizeof(vp->vars)/sizeof(vp->vars[0]); i++) {
             v = &vp->vars[i];
             nref = atomic_inc_32_nv(&wrapper->nref);
-            v->version = 0;
+            v->version = *new_version;
             /* This functions as a memory barrier for the above writes */
             tmp = atomic_cas_ptr((volatile void **)&v->wrapper,
                                  old_wrapper, wrapper);
@@ -543,27 +1129,36 @@ thread_safe_var_set(thread_safe_var vp, void *cfdata,
 
         assert(nref > 1);
 
-        tmp_version = atomic_inc_64_nv(&vp->next_version);
-        assert(tmp_version == 1);
+        tmp_version = atomic_cas_64(&vp->next_version, 0, *new_version + 1);
+        assert(tmp_version == 0);
+
+        history_add(vp, wrapper);
 
         /* Signal waiters */
         (void) pthread_mutex_lock(&vp->waiter_lock);
         (void) pthread_cond_signal(&vp->waiter_cv); /* no thundering herd */
         (void) pthread_mutex_unlock(&vp->waiter_lock);
-        return pthread_mutex_unlock(&vp->write_lock);
+        return 0;
     }
 
+    /*
+     * Readers find the current slot by the parity of the current
+     * version, so the version we publish must have the same parity as
+     * next_version.  If we must skip an odd number of versions, skip one
+     * more.
+     */
+    if (nskip & 0x1)
+        nskip++;
+    *new_version = wrapper->version = next_version + nskip;
+
     nref = atomic_inc_32_nv(&wrapper->nref);
     assert(nref == 1);
 
     assert(old_wrapper != NULL && atomic_read_32(&old_wrapper->nref) > 0);
 
     /* Wait until that slot is quiescent before mutating it */
-    if ((err = pthread_mutex_lock(&vp->cv_lock)) != 0) {
-        (void) pthread_mutex_unlock(&vp->write_lock);
-        free(wrapper);
+    if ((err = pthread_mutex_lock(&vp->cv_lock)) != 0)
         return err;
-    }
     while (atomic_read_32(&v->nreaders) > 0) {
         /*
          * We have a separate lock for writing vs. waiting so that no
@@ -574,40 +1169,112 @@ thread_safe_var_set(thread_safe_var vp, void *cfdata,
          */
         if ((err = pthread_cond_wait(&vp->cv, &vp->cv_lock)) != 0) {
             (void) pthread_mutex_unlock(&vp->cv_lock);
-            (void) pthread_mutex_unlock(&vp->write_lock);
-            free(wrapper);
             return err;
         }
     }
-    if ((err = pthread_mutex_unlock(&vp->cv_lock)) != 0) {
-        (void) pthread_mutex_unlock(&vp->write_lock);
-        free(wrapper);
+    if ((err = pthread_mutex_unlock(&vp->cv_lock)) != 0)
         return err;
-    }
+
+    /* Before readers can enter the slot; see history_add() */
+    history_add(vp, wrapper);
 
     /* Update that now quiescent slot; these are the release operations */
     tmp = atomic_cas_ptr((volatile void **)&v->wrapper, old_wrapper, wrapper);
     assert(tmp == old_wrapper);
     v->version = *new_version;
-    tmp_version = atomic_inc_64_nv(&vp->next_version); /* Memory barrier */
-    assert(tmp_version == *new_version + 1);
+    tmp_version = atomic_cas_64(&vp->next_version, next_version,
+                                *new_version + 1); /* Memory barrier */
+    assert(tmp_version == next_version);
     assert(v->version > v->other->version);
 
     /* Release the old cf */
     assert(old_wrapper != NULL && atomic_read_32(&old_wrapper->nref) > 0);
     wrapper_free(old_wrapper);
+    return 0;
+}
+
+/* Current version, or 0 if no value has been set */
+static uint64_t
+var_version(thread_safe_var vp)
+{
+    uint64_t next_version = atomic_read_64(&vp->next_version);
 
-    /* Done */
-    return pthread_mutex_unlock(&vp->write_lock);
+    return next_version ? next_version - 1 : 0;
 }
 
-#else /* USE_TSV_SLOT_PAIR_DESIGN */
+/*
+ * Whether a value to be set is equal to the current value, per the
+ * var's eq and hash callbacks.  The caller must hold the write_lock.
+ */
+static int
+var_is_dup(thread_safe_var vp, void *node)
+{
+    struct vwrapper *wrapper = node;
+    struct vwrapper *cur;
+    uint64_t next_version = atomic_read_64(&vp->next_version);
 
-#include <sched.h>
+    if (vp->eq == NULL || next_version == 0)
+        return 0;
+    cur = vp->vars[(next_version - 1) & 0x1].wrapper;
+    if (vp->hash != NULL && cur->hash != wrapper->hash)
+        return 0;
+    return vp->eq(cur->ptr, wrapper->ptr);
+}
 
 /*
- * Subscription Slot Design
- *
+ * Find readers that have held a non-current version for stall_ms or
+ * longer (as far as the watchdog has seen), reporting each stall once.
+ * The caller must hold the watch_lock.
+ */
+static size_t
+var_find_stalls(thread_safe_var vp, uint64_t now,
+                struct thread_safe_var_stall *stalls, size_t max)
+{
+    struct reader_rec *rec;
+    uint64_t current = var_version(vp);
+    uint64_t version;
+    size_t n = 0;
+
+    for (rec = vp->readers; rec != NULL && n < max; rec = rec->next) {
+        version = atomic_read_64(&rec->version);
+        if (version == 0 || version >= current) {
+            rec->stale_version = 0;
+            continue;
+        }
+        if (rec->stale_version != version) {
+            rec->stale_version = version;
+            rec->stale_since = now;
+            rec->reported = 0;
+            continue;
+        }
+        if (rec->reported || now - rec->stale_since < vp->stall_ms)
+            continue;
+        rec->reported = 1;
+        stalls[n].vp = vp;
+        stalls[n].thread = rec->thread;
+        stalls[n].version = version;
+        stalls[n].current = current;
+        stalls[n].ms = now - rec->stale_since;
+        n++;
+    }
+    return n;
+}
+
+/* Release values retired by var_publish(); nothing to do in this design */
+static void
+var_collect(thread_safe_var vp, void *garbage)
+{
+    (void) vp;
+    assert(garbage == NULL);
+}
+
+#else /* USE_TSV_SLOT_PAIR_DESIGN */
+
+#include <sched.h>
+
+/*
+ * Subscription Slot Design
+ *
  * Here we have a linked list of extant values where the head has the
  * current value and where the head and the next pointers are the only
  * things written to by the writer; all readers "subscribe" and thence
@@ -673,10 +1340,17 @@ thread_safe_var_set(thread_safe_var vp, void *cfdata,
 struct value {
     volatile struct value   *next;      /* previous (still ref'd) value */
     void                    *value;     /* actual value */
+    void                    **replicas; /* per-NUMA-node copies of value */
+    uint64_t                hash;       /* see var_is_dup() */
     volatile uint64_t       version;    /* version number */
     volatile uint32_t       referenced; /* for mark and sweep */
 };
 
+#define NODE_SIZE sizeof(struct value)
+
+/* Rounds of exponential backoff for writers waiting on retrying readers */
+#define READER_WAIT_ROUNDS 10
+
 /*
  * Each thread that has read this thread-safe global variable gets one
  * of these.
@@ -685,7 +1359,11 @@ struct slot {
     volatile struct value       *value; /* reference to last value read */
     volatile uint32_t           in_use; /* atomic */
     thread_safe_var             vp;     /* for cleanup from thread key dtor */
-    /* We could add a pthread_t here */
+    pthread_t                   owner;  /* written before value */
+    volatile uint64_t           version;/* atomic; of value, if stall_ms */
+    uint64_t                    stale_version;  /* see var_find_stalls() */
+    uint64_t                    stale_since;
+    int                         reported;
 };
 
 /*
@@ -699,9 +1377,45 @@ struct slots {
     uint32_t                slot_base;  /* logical index of slot_array[0] */
 };
 
+/*
+ * The last history + 1 published values, for readers looking for a
+ * version; see thread_safe_var_get_version().  The writer clears
+ * version before changing value, then sets version.
+ */
+struct hist_ent {
+    volatile struct value       *value;     /* atomic */
+    volatile uint64_t           version;    /* atomic */
+};
+
+/*
+ * Reclamation domains.
+ *
+ * Vars in a domain don't have slots.  Instead each thread that reads
+ * any of them has one of these records, with its references to each
+ * var's values side by side, indexed by the vars' domain_idx.  Records
+ * are only ever added to a domain's list (and reused after their
+ * threads exit), so writers can scan the list without locking.
+ */
+struct domain_rec {
+    struct domain_rec           *next;      /* atomic */
+    volatile uint32_t           in_use;     /* atomic */
+    uint32_t                    nrefs;
+    pthread_t                   owner;
+    volatile struct value       **refs;     /* refs[domain_idx]; atomic */
+};
+
+struct thread_safe_var_domain_s {
+    pthread_key_t               tkey;       /* this thread's domain_rec */
+    pthread_mutex_t             lock;       /* protects vars[] */
+    struct domain_rec           *recs;      /* atomic; see domain_ref() */
+    thread_safe_var             *vars;      /* indexed by domain_idx */
+    uint32_t                    max_vars;
+    uint32_t                    nvars;
+};
+
 struct thread_safe_var_s {
     pthread_key_t           tkey;           /* to detect thread exits */
-    pthread_mutex_t         write_lock;     /* one writer at a time */
+    struct wlock            write_lock;     /* one writer at a time */
     pthread_mutex_t         waiter_lock;    /* to signal waiters */
     pthread_cond_t          waiter_cv;      /* to signal waiters */
     var_dtor_t              dtor;           /* value destructor */
@@ -710,8 +1424,48 @@ struct thread_safe_var_s {
     volatile uint32_t       next_slot_idx;  /* atomic index of next new slot */
     volatile uint32_t       slots_in_use;   /* atomic count of live readers */
     uint32_t                nvalues;        /* writer-only; for housekeeping */
+    volatile struct value   **mark_scratch; /* writer-only; see mark_values() */
+    uint32_t                mark_scratch_size;
+    volatile uint64_t       version;        /* atomic current version */
+    struct set_req          *set_reqs;      /* atomic; posted writes */
+    struct thread_safe_var_waiter *waiters; /* atomic; see notify */
+    struct value_slab       *slab;          /* see thread_safe_var_value_alloc() */
+    int                     static_mem;     /* vp is in the caller's memory */
+    thread_safe_var_replicate_f replicate;  /* see replicas_make() */
+    thread_safe_var_eq_f    eq;             /* see var_is_dup() */
+    thread_safe_var_hash_f  hash;           /* see var_is_dup() */
+    uint32_t                history;        /* see mark_values() */
+    struct hist_ent         *hist;          /* history + 1 of these */
+    uint32_t                hist_next;      /* writer-only */
+    uint32_t                stall_ms;       /* see var_find_stalls() */
+    thread_safe_var_stall_f stall_cb;
+    void                    *stall_arg;
+    thread_safe_var         watch_next;     /* see watch_var() */
+    thread_safe_var_domain  domain;         /* see domain_ref() */
+    uint32_t                domain_idx;
+    int                     marking;        /* see domain reclaim */
+    struct wlock_node       marking_wn;     /* domain reclaim's lock node */
+    int                     single_writer;  /* see set_single() */
+    int                     stats;          /* see stat_add() */
+    volatile uint32_t       writer_known;
+    pthread_t               writer;
+    volatile uint32_t       retrying;       /* readers that lost a race */
+    volatile uint32_t       retried;        /* ...and then got through */
 };
 
+/* Destroy a value and free its list element */
+static void
+value_free(thread_safe_var vp, volatile struct value *value)
+{
+    if (vp->dtor != NULL)
+        vp->dtor(value->value);
+    replicas_destroy(value->replicas, vp->dtor);
+    if (vp->slab != NULL)
+        slab_put(vp->slab, (void *)value); /* the value is in there too */
+    else
+        node_put((void *)value);
+}
+
 /*
  * Lock-less utility that scans through logical slot array looking for a
  * free slot to reuse.
@@ -778,8 +1532,11 @@ grow_slots(thread_safe_var vp, uint32_t slot_idx, int tries)
     if (tries < 1)
         return EAGAIN; /* shouldn't happen; XXX assert? */
 
-    if ((new_slots = calloc(1, sizeof(*new_slots))) == NULL)
-        return errno;
+    if (vp->static_mem)
+        return ENOMEM; /* more than max_threads readers */
+
+    if ((new_slots = mem_calloc(1, sizeof(*new_slots))) == NULL)
+        return ENOMEM;
 
     additions = (nslots == 0) ? 4 : nslots + nslots / 2;
     while (slot_idx >= nslots + additions) {
@@ -797,10 +1554,11 @@ grow_slots(thread_safe_var vp, uint32_t slot_idx, int tries)
     }
     assert(slot_idx - nslots < additions);
 
-    new_slots->slot_array = calloc(additions, sizeof(*new_slots->slot_array));
+    new_slots->slot_array = mem_calloc(additions,
+                                       sizeof(*new_slots->slot_array));
     if (new_slots->slot_array == NULL) {
-        free(new_slots);
-        return errno;
+        mem_free(new_slots);
+        return ENOMEM;
     }
     new_slots->slot_count = additions;
     new_slots->slot_base = nslots;
@@ -822,8 +1580,8 @@ grow_slots(thread_safe_var vp, uint32_t slot_idx, int tries)
          *
          * See commentary above where tries is incremented.
          */
-        free(new_slots->slot_array);
-        free(new_slots);
+        mem_free(new_slots->slot_array);
+        mem_free(new_slots);
     }
 
     /*
@@ -839,33 +1597,43 @@ grow_slots(thread_safe_var vp, uint32_t slot_idx, int tries)
 static void
 destroy_var(thread_safe_var vp)
 {
+    struct wlock_node wn;
     struct slots *slots;
     struct value *val;
 
     if (vp == 0)
         return;
 
-    pthread_mutex_lock(&vp->write_lock);
+    if (vp->stall_ms > 0)
+        unwatch_var(vp);
+
+    wlock_lock(&vp->write_lock, &wn);
 
     while (vp->values != NULL) {
         val = atomic_read_ptr((volatile void **)&vp->values);
         vp->values = val->next;
-        if (vp->dtor != NULL)
-            vp->dtor(val->value);
-        free(val);
+        value_free(vp, val);
     }
     while (vp->slots != NULL) {
         slots = atomic_read_ptr((volatile void **)&vp->slots);
         vp->slots = slots->next;
-        free(slots->slot_array);
-        free(slots);
+        if (!vp->static_mem) {
+            mem_free(slots->slot_array);
+            mem_free(slots);
+        }
     }
+    if (!vp->static_mem) {
+        mem_free(vp->mark_scratch);
+        mem_free(vp->hist);
+    }
+    vp->mark_scratch = NULL;
+    vp->hist = NULL;
     vp->dtor = NULL;
 
-    pthread_mutex_unlock(&vp->write_lock);
-    pthread_mutex_destroy(&vp->write_lock);
+    wlock_unlock(&vp->write_lock, &wn);
     pthread_mutex_destroy(&vp->waiter_lock);
     pthread_cond_destroy(&vp->waiter_cv);
+    slab_release(vp->slab);
     /* XXX We leak var->tkey! */
 }
 
@@ -880,6 +1648,7 @@ release_slot(void *data)
 
     /* Release value */
     atomic_write_ptr((volatile void **)&slot->value, NULL);
+    atomic_write_64(&slot->version, 0);
 
     /* Release slot */
     atomic_write_32(&slot->in_use, 0);
@@ -892,77 +1661,411 @@ release_slot(void *data)
         destroy_var(slot->vp);
 }
 
+/* Thread specific key destructor for domain records */
+static void
+domain_rec_release(void *data)
+{
+    struct domain_rec *rec = data;
+    uint32_t i;
+
+    if (rec == NULL)
+        return;
+    for (i = 0; i < rec->nrefs; i++)
+        atomic_write_ptr((volatile void **)&rec->refs[i], NULL);
+    atomic_write_32(&rec->in_use, 0);
+}
+
+/* Get this thread's reference to a domain var's values; see reader_ref() */
+static int
+domain_ref(thread_safe_var vp, volatile struct value ***refp)
+{
+    thread_safe_var_domain dom = vp->domain;
+    struct domain_rec *rec, *next;
+    int err;
+
+    if ((rec = pthread_getspecific(dom->tkey)) == NULL) {
+        /* First read of any of this domain's vars by this thread */
+        for (rec = atomic_read_ptr((volatile void **)&dom->recs);
+             rec != NULL;
+             rec = atomic_read_ptr((volatile void **)&rec->next)) {
+            if (atomic_cas_32(&rec->in_use, 0, 1) == 0)
+                break;
+        }
+        if (rec == NULL) {
+            rec = mem_calloc(1, sizeof(*rec) +
+                             dom->max_vars * sizeof(rec->refs[0]));
+            if (rec == NULL)
+                return ENOMEM;
+            rec->refs = (void *)(rec + 1);
+            rec->nrefs = dom->max_vars;
+            rec->in_use = 1;
+            do {
+                next = atomic_read_ptr((volatile void **)&dom->recs);
+                rec->next = next;
+            } while (atomic_cas_ptr((volatile void **)&dom->recs,
+                                    next, rec) != next);
+        }
+        rec->owner = pthread_self();
+        if ((err = pthread_setspecific(dom->tkey, rec)) != 0) {
+            atomic_write_32(&rec->in_use, 0);
+            return err;
+        }
+    }
+    *refp = &rec->refs[vp->domain_idx];
+    return 0;
+}
+
+/* Add a new var to a domain */
+static int
+domain_add(thread_safe_var vp, thread_safe_var_domain dom)
+{
+    uint32_t i;
+    int err;
+
+    if ((err = pthread_mutex_lock(&dom->lock)) != 0)
+        return err;
+    for (i = 0; i < dom->max_vars && dom->vars[i] != NULL; i++)
+        ;
+    if (i < dom->max_vars) {
+        dom->vars[i] = vp;
+        dom->nvars++;
+        vp->domain_idx = i;
+        vp->domain = dom;
+    }
+    (void) pthread_mutex_unlock(&dom->lock);
+    return i < dom->max_vars ? 0 : ENOMEM;
+}
+
+/* Remove a var being destroyed from its domain, and readers' refs to it */
+static void
+domain_remove(thread_safe_var vp)
+{
+    thread_safe_var_domain dom = vp->domain;
+    struct domain_rec *rec;
+
+    if (pthread_mutex_lock(&dom->lock) != 0)
+        abort();
+    for (rec = atomic_read_ptr((volatile void **)&dom->recs);
+         rec != NULL;
+         rec = atomic_read_ptr((volatile void **)&rec->next))
+        atomic_write_ptr((volatile void **)&rec->refs[vp->domain_idx], NULL);
+    dom->vars[vp->domain_idx] = NULL;
+    dom->nvars--;
+    (void) pthread_mutex_unlock(&dom->lock);
+}
+
 /**
- * Initialize a thread-safe global variable
+ * Create a reclamation domain for up to max_vars vars
  *
- * A thread-safe global variable stores a current value, a pointer to
- * void, which may be set and read.  A value read from a thread-safe
- * global variable will be valid in the thread that read it, and will
- * remain valid until released or until the thread-safe global variable
- * is read again in the same thread.  New values may be set.  Values
- * will be destroyed with the destructor provided when no references
- * remain.
+ * See thread_safe_var_attr's domain.
+ *
+ * @param [out] domp The new domain
+ * @param [in] max_vars How many vars can be in the domain at once
+ *
+ * @return Zero on success, else a system error number
+ */
+int
+thread_safe_var_domain_create(thread_safe_var_domain *domp, uint32_t max_vars)
+{
+    thread_safe_var_domain dom;
+    int err;
+
+    *domp = NULL;
+    if (max_vars == 0)
+        return EINVAL;
+    if ((dom = mem_calloc(1, sizeof(*dom))) == NULL)
+        return ENOMEM;
+    if ((dom->vars = mem_calloc(max_vars, sizeof(dom->vars[0]))) == NULL) {
+        mem_free(dom);
+        return ENOMEM;
+    }
+    dom->max_vars = max_vars;
+    if ((err = pthread_key_create(&dom->tkey, domain_rec_release)) != 0) {
+        mem_free(dom->vars);
+        mem_free(dom);
+        return err;
+    }
+    if ((err = pthread_mutex_init(&dom->lock, NULL)) != 0) {
+        (void) pthread_key_delete(dom->tkey);
+        mem_free(dom->vars);
+        mem_free(dom);
+        return err;
+    }
+    *domp = dom;
+    return 0;
+}
+
+/**
+ * Destroy a reclamation domain
+ *
+ * @param [in] dom A domain none of whose vars remain
+ *
+ * @return Zero on success, EBUSY if the domain still has vars, else a
+ *         system error number
+ */
+int
+thread_safe_var_domain_destroy(thread_safe_var_domain dom)
+{
+    struct domain_rec *rec;
+    int err;
+
+    if (dom == NULL)
+        return 0;
+    if ((err = pthread_mutex_lock(&dom->lock)) != 0)
+        return err;
+    err = dom->nvars > 0 ? EBUSY : 0;
+    (void) pthread_mutex_unlock(&dom->lock);
+    if (err != 0)
+        return err;
+
+    /* No more thread exit callbacks, so we can free the records */
+    (void) pthread_key_delete(dom->tkey);
+    while ((rec = dom->recs) != NULL) {
+        dom->recs = rec->next;
+        mem_free(rec);
+    }
+    (void) pthread_mutex_destroy(&dom->lock);
+    mem_free(dom->vars);
+    mem_free(dom);
+    return 0;
+}
+
+static int  mark_start(thread_safe_var);
+static void mark_ref(thread_safe_var, volatile struct value *);
+static volatile struct value *mark_sweep(thread_safe_var);
+static void var_collect(thread_safe_var, void *);
+
+/**
+ * Free values of a domain's vars that no reader references any longer
+ *
+ * Values are otherwise collected only when a var is set.  This scans
+ * the domain's readers once for all of its vars.
+ *
+ * @param [in] dom A domain
+ *
+ * @return Zero on success, else a system error number
+ */
+int
+thread_safe_var_domain_reclaim(thread_safe_var_domain dom)
+{
+    struct domain_rec *rec;
+    thread_safe_var vp;
+    void *garbage;
+    uint32_t i;
+    int err;
+
+    if ((err = pthread_mutex_lock(&dom->lock)) != 0)
+        return err;
+
+    /* Writers are kept out until we're done; locks are taken in order */
+    for (i = 0; i < dom->max_vars; i++) {
+        if ((vp = dom->vars[i]) == NULL)
+            continue;
+        wlock_lock(&vp->write_lock, &vp->marking_wn);
+        vp->marking = vp->values != NULL && mark_start(vp) == 0;
+    }
+
+    /* One pass over the readers' records for all the vars */
+    for (rec = atomic_read_ptr((volatile void **)&dom->recs);
+         rec != NULL;
+         rec = atomic_read_ptr((volatile void **)&rec->next)) {
+        for (i = 0; i < dom->max_vars; i++) {
+            if ((vp = dom->vars[i]) != NULL && vp->marking)
+                mark_ref(vp, atomic_read_ptr((volatile void **)&rec->refs[i]));
+        }
+    }
+
+    for (i = 0; i < dom->max_vars; i++) {
+        if ((vp = dom->vars[i]) == NULL)
+            continue;
+        garbage = vp->marking ? (void *)(uintptr_t)mark_sweep(vp) : NULL;
+        vp->marking = 0;
+        wlock_unlock(&vp->write_lock, &vp->marking_wn);
+        var_collect(vp, garbage);
+    }
+    (void) pthread_mutex_unlock(&dom->lock);
+    return 0;
+}
+
+/**
+ * Initialize a thread-safe global variable with optional attributes
+ *
+ * See thread_safe_var_init().
  *
  * @param var Pointer to thread-safe global variable
  * @param dtor Pointer to thread-safe global value destructor function
+ * @param attr Attributes (may be NULL)
  *
  * @return Returns zero on success, else a system error number
  */
 int
-thread_safe_var_init(thread_safe_var *vpp,
-                     thread_safe_var_dtor_f dtor)
+thread_safe_var_init_attr(thread_safe_var *vpp,
+                          thread_safe_var_dtor_f dtor,
+                          const thread_safe_var_attr *attr)
 {
+    struct wlock_node wn;
+    thread_safe_var_domain dom = attr != NULL ? attr->domain : NULL;
+    struct mem_region region;
+    struct slots *slots;
     thread_safe_var vp;
+    uint32_t i;
     int err;
 
     *vpp = NULL;
-    if ((vp = calloc(1, sizeof(*vp))) == NULL)
-        return errno;
+    if (dom != NULL && (attr->mem != NULL || attr->stall_ms > 0))
+        return EINVAL;
+    if (attr != NULL && attr->single_writer &&
+        (attr->history > 0 || attr->stall_ms > 0 || dom != NULL))
+        return EINVAL;
+    if (attr != NULL && attr->stats && (err = stats_init()) != 0)
+        return err;
+    if (attr != NULL && attr->mem != NULL) {
+        if (attr->max_threads == 0)
+            return EINVAL;
+        if ((err = region_init(&region, attr,
+                               thread_safe_var_mem_size(attr))) != 0)
+            return err;
+        vp = region_alloc(&region, sizeof(*vp));
+        vp->static_mem = 1;
+    } else if ((vp = mem_calloc(1, sizeof(*vp))) == NULL) {
+        return ENOMEM;
+    }
 
     vp->values = NULL;
     vp->slots = NULL;
     vp->dtor = dtor;
+    vp->replicate = attr != NULL ? attr->replicate : NULL;
+    vp->history = attr != NULL ? attr->history : 0;
+    if (attr != NULL) {
+        vp->stall_ms = attr->stall_ms;
+        vp->stall_cb = attr->stall_cb;
+        vp->stall_arg = attr->stall_arg;
+    }
+    vp->eq = attr != NULL ? attr->eq : NULL;
+    vp->hash = attr != NULL && attr->eq != NULL ? attr->hash : NULL;
+    vp->single_writer = attr != NULL && attr->single_writer;
+    vp->stats = attr != NULL && attr->stats;
     vp->slots_in_use = 1; /* decremented upon destruction */
     vp->nvalues = 0;
 
-    if ((err = pthread_key_create(&vp->tkey, release_slot)) != 0) {
-        memset(vp, 0, sizeof(*vp));
-        return err;
-    }
-    if ((err = pthread_mutex_init(&vp->write_lock, NULL)) != 0) {
+    if (dom == NULL &&
+        (err = pthread_key_create(&vp->tkey, release_slot)) != 0) {
         memset(vp, 0, sizeof(*vp));
         return err;
     }
+    wlock_init(&vp->write_lock);
     if ((err = pthread_mutex_init(&vp->waiter_lock, NULL)) != 0) {
-        pthread_mutex_destroy(&vp->write_lock);
         memset(vp, 0, sizeof(*vp));
         return err;
     }
     if ((err = pthread_cond_init(&vp->waiter_cv, NULL)) != 0) {
-        pthread_mutex_destroy(&vp->write_lock);
         pthread_mutex_destroy(&vp->waiter_lock);
         memset(vp, 0, sizeof(*vp));
         return err;
     }
 
-    if ((err = grow_slots(vp, 3, 1)) != 0) {
+    if (vp->static_mem) {
+        /* All the slots and GC scratch space we'll ever have */
+        slots = region_alloc(&region, sizeof(*slots));
+        slots->slot_array = region_alloc(&region, attr->max_threads *
+                                         sizeof(slots->slot_array[0]));
+        slots->slot_count = attr->max_threads;
+        for (i = 0; i < attr->max_threads; i++)
+            slots->slot_array[i].vp = vp;
+        vp->slots = slots;
+        vp->mark_scratch = region_alloc(&region, attr->max_versions *
+                                        sizeof(vp->mark_scratch[0]));
+        vp->mark_scratch_size = attr->max_versions;
+    } else if (dom == NULL && (err = grow_slots(vp, 3, 1)) != 0) {
+        thread_safe_var_destroy(vp);
+        return err;
+    }
+
+    if (vp->history > 0) {
+        if (vp->static_mem)
+            vp->hist = region_alloc(&region, (vp->history + 1) *
+                                    sizeof(vp->hist[0]));
+        else if ((vp->hist = mem_calloc(vp->history + 1,
+                                        sizeof(vp->hist[0]))) == NULL) {
+            thread_safe_var_destroy(vp);
+            return ENOMEM;
+        }
+    }
+
+    if (attr != NULL && (attr->value_size > 0 || vp->static_mem) &&
+        (err = slab_create(sizeof(struct value), attr,
+                           vp->static_mem ? &region : NULL,
+                           &vp->slab)) != 0) {
+        thread_safe_var_destroy(vp);
+        return err;
+    }
+
+    assert(dom != NULL || get_slot(vp, 0) != NULL);
+
+    if (dom != NULL && (err = domain_add(vp, dom)) != 0) {
         thread_safe_var_destroy(vp);
         return err;
     }
 
-    assert(get_slot(vp, 0) != NULL);
+    if (vp->stall_ms > 0 && (err = watch_var(vp)) != 0) {
+        thread_safe_var_destroy(vp);
+        return err;
+    }
 
     /*
      * Acquiring and dropping the lock functions as a trivial memory
      * barrier.
      */
-    pthread_mutex_lock(&vp->write_lock);
+    wlock_lock(&vp->write_lock, &wn);
     *vpp = vp;
-    pthread_mutex_unlock(&vp->write_lock);
+    wlock_unlock(&vp->write_lock, &wn);
     *vpp = vp;
     return 0;
 }
 
+/**
+ * Compute the memory needed by a var with static memory
+ *
+ * See thread_safe_var_attr's mem.
+ *
+ * @param [in] attr Attributes
+ *
+ * @return The size of the memory needed, or zero if the attributes are
+ *         invalid
+ */
+size_t
+thread_safe_var_mem_size(const thread_safe_var_attr *attr)
+{
+    size_t sizes[5];
+    size_t size, total;
+    size_t i;
+
+    if (attr->max_threads == 0)
+        return 0;
+    sizes[0] = sizeof(struct thread_safe_var_s);
+    sizes[1] = sizeof(struct slots);
+    sizes[2] = (uint64_t)attr->max_threads * sizeof(struct slot);
+    sizes[3] = (uint64_t)attr->max_versions * sizeof(struct value *);
+    sizes[4] = attr->history > 0 ?
+        ((uint64_t)attr->history + 1) * sizeof(struct hist_ent) : 0;
+    if (sizes[2] / sizeof(struct slot) != attr->max_threads ||
+        sizes[3] / sizeof(struct value *) != attr->max_versions ||
+        (attr->history > 0 &&
+         sizes[4] / sizeof(struct hist_ent) != attr->history + (size_t)1))
+        return 0;   /* overflow (32-bit) */
+    if ((total = slab_mem_size(sizeof(struct value), attr)) == 0)
+        return 0;
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        if (sizes[i] > SIZE_MAX - SLAB_ALIGN)
+            return 0;
+        size = (sizes[i] + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+        if (size > SIZE_MAX - total)
+            return 0;
+        total += size;
+    }
+    return total;
+}
+
 /**
  * Destroy a thread-safe global variable
  *
@@ -976,34 +2079,44 @@ thread_safe_var_destroy(thread_safe_var vp)
 {
     if (vp == 0)
         return;
+    if (vp->domain != NULL) {
+        /* Readers' refs are in the domain's records, not ours */
+        domain_remove(vp);
+        destroy_var(vp);
+        return;
+    }
     if (atomic_dec_32_nv(&vp->slots_in_use) > 0)
         return;     /* defer to last reader slot release via thread key dtor */
     destroy_var(vp);/* we're the last, destroy now */
 }
 
-/**
- * Get the most up to date value of the given cf var.
- *
- * @param [in] var Pointer to a cf var
- * @param [out] res Pointer to location where the variable's value will be output
- * @param [out] version Pointer (may be NULL) to 64-bit integer where the current version will be output
- *
- * @return Zero on success, a system error code otherwise
+/*
+ * Note the version a reader now holds (0 -> none) for the watchdog.
+ * Vars with stall_ms aren't in domains, so ref is in a slot.
  */
-int
-thread_safe_var_get(thread_safe_var vp, void **res, uint64_t *version)
+static void
+slot_note(volatile struct value **ref, uint64_t version)
 {
-    int err = 0;
+    struct slot *slot = (struct slot *)
+        ((char *)ref - offsetof(struct slot, value));
+
+    atomic_write_64(&slot->version, version);
+}
+
+/*
+ * Get this thread's reference to vp's values (its slot's, or its domain
+ * record's), subscribing the thread the first time.
+ */
+static int
+reader_ref(thread_safe_var vp, volatile struct value ***refp)
+{
+    int err;
     uint32_t slot_idx;
     uint32_t slots_in_use;
-    uint64_t vers;
     struct slot *slot;
-    struct value *newest;
 
-    if (version == NULL)
-        version = &vers;
-    *version = 0;
-    *res = NULL;
+    if (vp->domain != NULL)
+        return domain_ref(vp, refp);
 
     if ((slot = pthread_getspecific(vp->tkey)) == NULL) {
         /* First time for this thread -> O(N) slow path (subscribe thread) */
@@ -1011,17 +2124,49 @@ thread_safe_var_get(thread_safe_var vp, void **res, uint64_t *version)
         if ((slot = get_free_slot(vp)) == NULL) {
             /* Slower path still: grow slots array list */
             err = grow_slots(vp, slot_idx, 2);  /* O(log N) */
-            assert(err == 0);
+            if (err != 0)
+                return err;
             slot = get_slot(vp, slot_idx);      /* O(N) */
             assert(slot != NULL);
             atomic_write_32(&slot->in_use, 1);
         }
         assert(slot->vp == vp);
+        slot->owner = pthread_self();
         slots_in_use = atomic_inc_32_nv(&vp->slots_in_use);
         assert(slots_in_use > 1);
         if ((err = pthread_setspecific(vp->tkey, slot)) != 0)
             return err;
     }
+    *refp = &slot->value;
+    return 0;
+}
+
+/**
+ * Get the most up to date value of the given cf var.
+ *
+ * @param [in] var Pointer to a cf var
+ * @param [out] res Pointer to location where the variable's value will be output
+ * @param [out] version Pointer (may be NULL) to 64-bit integer where the current version will be output
+ *
+ * @return Zero on success, a system error code otherwise
+ */
+int
+thread_safe_var_get(thread_safe_var vp, void **res, uint64_t *version)
+{
+    volatile struct value **ref;
+    struct value *newest;
+    uint64_t vers;
+    uint32_t tries;
+    int err;
+
+    if (version == NULL)
+        version = &vers;
+    *version = 0;
+    *res = NULL;
+
+    stat_add(vp, STAT_GETS, 1);
+    if ((err = reader_ref(vp, &ref)) != 0)
+        return err;
 
     /*
      * Else/then fast path: one acquire read, one release write, no
@@ -1037,96 +2182,243 @@ thread_safe_var_get(thread_safe_var vp, void **res, uint64_t *version)
      * run as many times as writers can run between the conditional and
      * the body.  This loop can only be an infinite loop if there's an
      * infinite number of writers who run with higher priority than this
-     * thread.  This is why writers sched_yield() before dropping their
-     * write lock.
+     * thread.  This is why a reader that loses a race says so (in
+     * vp->retrying), and writers then wait for it to get through (see
+     * readers_wait()) before letting the next writer in.
      *
      * Note that in the body of this loop we can write a soon-to-become-
      * invalid value to our slot because many writers can write between
      * the loop condition and the body.  The writer has to jump through
      * some hoops to deal with this.
      */
-    while (atomic_read_ptr((volatile void **)&slot->value) !=
-           (newest = atomic_read_ptr((volatile void **)&vp->values)))
-        atomic_write_ptr((volatile void **)&slot->value, newest);
+    for (tries = 0;
+         atomic_read_ptr((volatile void **)ref) !=
+         (newest = atomic_read_ptr((volatile void **)&vp->values));
+         tries++) {
+        if (tries == 1)
+            (void) atomic_inc_32_nv(&vp->retrying);
+        atomic_write_ptr((volatile void **)ref, newest);
+    }
+    if (tries > 1) {
+        (void) atomic_inc_32_nv(&vp->retried);
+        (void) atomic_dec_32_nv(&vp->retrying);
+    }
+    if (tries > 0)
+        stat_add(vp, STAT_GETS_NEW, 1);
 
     if (newest != NULL) {
-        *res = newest->value;
+        *res = replica_pick(newest->value, newest->replicas);
         *version = newest->version;
     }
+    if (vp->stall_ms > 0)
+        slot_note(ref, *version);
 
     return 0;
 }
 
 /**
- * Release this thread's reference (if it holds one) to the current
- * value of the given thread-safe global variable.
+ * Get a given version of a thread-safe global variable
  *
- * @param vp [in] A thread-safe global variable
+ * The current version and, if the var has a history attribute, that
+ * many versions before it can be read this way.  As with
+ * thread_safe_var_get(), the value remains valid until the thread
+ * reads the var again or releases it.  Like it, this is lock-less, and
+ * doesn't wait for writers.
+ *
+ * @param [in] vp A thread-safe global variable
+ * @param [in] version The version to read
+ * @param [out] res The value of that version
+ *
+ * @return Zero on success, ENOENT if that version is not (or no longer)
+ *         available, or a system error
  */
-void
-thread_safe_var_release(thread_safe_var vp)
+int
+thread_safe_var_get_version(thread_safe_var vp, uint64_t version,
+                            void **res)
 {
-    struct slot *slot;
+    volatile struct value **ref;
+    volatile struct value *v;
+    struct hist_ent *h;
+    uint32_t i;
+    int err;
 
-    /* Always fast; never free()s.  O(1) */
+    *res = NULL;
+    if (vp->single_writer || vp->hist == NULL)
+        return get_current_version(vp, version, res);
+    if (version == 0)
+        return ENOENT; /* unused hist entries have version 0 */
+    if ((err = reader_ref(vp, &ref)) != 0)
+        return err;
+
+    for (i = 0, h = NULL; i <= vp->history && h == NULL; i++) {
+        if (atomic_read_64(&vp->hist[i].version) == version)
+            h = &vp->hist[i];
+    }
+    if (h == NULL)
+        return ENOENT;
+
+    /*
+     * As in thread_safe_var_get(): once our slot references v, a writer
+     * collecting will see it, so if v is still in the history after
+     * that, it's ours.  If not, then v (and the version, as entries are
+     * only ever replaced with newer ones) just left the history.
+     */
+    v = atomic_read_ptr((volatile void **)&h->value);
+    atomic_write_ptr((volatile void **)ref, (void *)v);
+    if (atomic_read_ptr((volatile void **)&h->value) != v ||
+        atomic_read_64(&h->version) != version) {
+        atomic_write_ptr((volatile void **)ref, NULL);
+        if (vp->stall_ms > 0)
+            slot_note(ref, 0);
+        return ENOENT;
+    }
+    if (vp->stall_ms > 0)
+        slot_note(ref, version);
+    *res = replica_pick(v->value, v->replicas);
+    return 0;
+}
+
+/**
+ * Release this thread's reference (if it holds one) to the current
+ * value of the given thread-safe global variable.
+ *
+ * @param vp [in] A thread-safe global variable
+ */
+void
+thread_safe_var_release(thread_safe_var vp)
+{
+    struct domain_rec *rec;
+    struct slot *slot;
+
+    /* Always fast; never free()s.  O(1) */
+    if (vp->domain != NULL) {
+        if ((rec = pthread_getspecific(vp->domain->tkey)) != NULL)
+            atomic_write_ptr((volatile void **)&rec->refs[vp->domain_idx],
+                             NULL);
+        return;
+    }
     if ((slot = pthread_getspecific(vp->tkey)) == NULL)
         return;
+    /*
+     * Only drop the value.  The slot stays ours for as long as our tkey
+     * points at it; release_slot() frees it when this thread exits.
+     */
     atomic_write_ptr((volatile void **)&slot->value, NULL);
-    atomic_write_32(&slot->in_use, 0);
+    if (vp->stall_ms > 0)
+        slot_note(&slot->value, 0);
 }
 
 static volatile struct value *mark_values(thread_safe_var);
+static void readers_wait(thread_safe_var);
 
-/**
- * Set new data on a thread-safe global variable
- *
- * @param [in] var Pointer to thread-safe global variable
- * @param [in] cfdata New value for the thread-safe global variable
- * @param [out] new_version New version number
- *
- * @return 0 on success, or a system error such as ENOMEM.
- */
-int
-thread_safe_var_set(thread_safe_var vp, void *data,
-                    uint64_t *new_version)
+/* Allocate a list element for a value to be set; see thread_safe_var_set() */
+static void node_free(thread_safe_var, void *);
+
+static int
+node_alloc(thread_safe_var vp, void *data, void **nodep)
 {
     struct value *new_value;
-    volatile struct value *old_values = NULL;
-    volatile struct value *value;
-    uint64_t vers;
     int err;
 
-    if (new_version == NULL)
-        new_version = &vers;
-    *new_version = 0;
-
-    if ((new_value = calloc(1, sizeof(*new_value))) == NULL)
-        return errno;
-
-    if ((err = pthread_mutex_lock(&vp->write_lock)) != 0) {
-        free(new_value);
+    if (vp->slab != NULL && vp->slab->value_size > 0) {
+        /* The list element is in front of the value */
+        new_value = (void *)((char *)data - vp->slab->hdr_size);
+        memset(new_value, 0, sizeof(*new_value));
+        *nodep = new_value;
+    } else if (vp->slab != NULL) {
+        if ((new_value = slab_get(vp->slab)) == NULL) {
+            var_reclaim(vp);
+            if ((new_value = slab_get(vp->slab)) == NULL)
+                return ENOMEM;
+        }
+        memset(new_value, 0, sizeof(*new_value));
+        *nodep = new_value;
+    } else if ((*nodep = new_value = node_get()) == NULL) {
+        return ENOMEM;
+    }
+    new_value->value = data;
+    if (vp->hash != NULL)
+        new_value->hash = vp->hash(data);
+    if (vp->replicate != NULL &&
+        (err = replicas_make(vp->replicate, data, &new_value->replicas)) != 0) {
+        node_free(vp, new_value);
         return err;
     }
+    return 0;
+}
+
+/* Free a list element that never got published; the caller keeps the value */
+static void
+node_free(thread_safe_var vp, void *node)
+{
+    struct value *value = node;
+
+    replicas_destroy(value->replicas, vp->dtor);
+    value->replicas = NULL;
+    if (vp->slab == NULL)
+        node_put(node);
+    else if (vp->slab->value_size == 0)
+        slab_put(vp->slab, node);
+}
+
+/* Destroy a value that never got published, and its list element */
+static void
+node_destroy(thread_safe_var vp, void *node)
+{
+    value_free(vp, node);
+}
+
+/**
+ * Publish a new value on a thread-safe global variable
+ *
+ * The caller must hold the write_lock (or be a single writer; see
+ * set_single()).
+ *
+ * @param [in] vp Thread-safe global variable
+ * @param [in] node List element for the new value (see node_alloc())
+ * @param [in] nskip Number of versions to skip (see thread_safe_var_set())
+ * @param [out] new_version New version number
+ * @param [out] garbagep Values to release after dropping the write_lock
+ *
+ * @return 0 on success, or a system error.
+ */
+static int
+var_publish(thread_safe_var vp, void *node, uint64_t nskip,
+            uint64_t *new_version, void **garbagep)
+{
+    struct value *new_value = node;
 
     /*
      * No allocations/free()s done with write lock held -> higher write
      * throughput.
      */
 
-    new_value->value = data;
     new_value->next = atomic_read_ptr((volatile void **)&vp->values);
     if (new_value->next == NULL)
-        new_value->version = 1;
+        new_value->version = 1 + nskip;
     else
-        new_value->version = new_value->next->version + 1;
+        new_value->version = new_value->next->version + 1 + nskip;
 
     *new_version = new_value->version;
 
     /* Publish the new value */
     atomic_write_ptr((volatile void **)&vp->values, new_value);
+    /* A full barrier, as we check for waiters after; see notify_waiters() */
+    (void) atomic_cas_64(&vp->version, atomic_read_64(&vp->version),
+                         new_value->version);
     vp->nvalues++;
 
-    if (*new_version < 2) {
+    /* Before collecting, which is what frees the value this replaces */
+    if (vp->hist != NULL) {
+        struct hist_ent *h = &vp->hist[vp->hist_next];
+
+        atomic_write_64(&h->version, 0);
+        atomic_write_ptr((volatile void **)&h->value, new_value);
+        atomic_write_64(&h->version, new_value->version);
+        vp->hist_next = (vp->hist_next + 1) % (vp->history + 1);
+    }
+
+    if (new_value->next == NULL) {
         /* Signal waiters */
         (void) pthread_mutex_lock(&vp->waiter_lock);
         (void) pthread_cond_signal(&vp->waiter_cv); /* no thundering herd */
@@ -1134,26 +2426,153 @@ thread_safe_var_set(thread_safe_var vp, void *data,
     }
 
     /* Now comes the slow part: garbage collect vp->values */
-    old_values = mark_values(vp);
+    *garbagep = (void *)(uintptr_t)mark_values(vp);
 
     /*
      * Because readers must loop, and could be kept from reading by a
      * long sequence of back-to-back higher-priority writers (presumably
      * all threads of a process will run with the same priority, but we
-     * don't know that here), we yield the CPU before releasing the
-     * write lock.  Hopefully we yield to a reader.
+     * don't know that here), we let any reader that is looping get
+     * through before releasing the write lock (or, for a single writer,
+     * before returning).
      */
+    readers_wait(vp);
+    return 0;
+}
+
+/*
+ * Wait for readers that lost a race with a writer to get through.
+ *
+ * Readers that lose a race announce it, so when none is looping (nearly
+ * always) this is one atomic read.  Else we back off exponentially
+ * until one of them gets through or none is left looping.  If that
+ * takes too long then they're not running (e.g., they share our CPU),
+ * and we yield the CPU to them.
+ */
+static void
+readers_wait(thread_safe_var vp)
+{
+    uint32_t retried;
+    uint32_t spins;
+    uint32_t i;
+
+    if (atomic_read_32(&vp->retrying) == 0)
+        return;
+    retried = atomic_read_32(&vp->retried);
+    for (spins = 1; spins < (1U << READER_WAIT_ROUNDS); spins <<= 1) {
+        for (i = 0; i < spins; i++)
+            cpu_pause();
+        if (atomic_read_32(&vp->retrying) == 0 ||
+            atomic_read_32(&vp->retried) != retried)
+            return;
+    }
     sched_yield();
-    err = pthread_mutex_unlock(&vp->write_lock);
+}
+
+/* Current version, or 0 if no value has been set */
+static uint64_t
+var_version(thread_safe_var vp)
+{
+    return atomic_read_64(&vp->version);
+}
+
+/*
+ * Whether a value to be set is equal to the current value, per the
+ * var's eq and hash callbacks.  The caller must hold the write_lock.
+ */
+static int
+var_is_dup(thread_safe_var vp, void *node)
+{
+    struct value *new_value = node;
+    volatile struct value *cur = vp->values;
+
+    if (vp->eq == NULL || cur == NULL)
+        return 0;
+    if (vp->hash != NULL && cur->hash != new_value->hash)
+        return 0;
+    return vp->eq(cur->value, new_value->value);
+}
+
+/*
+ * Find readers that have held a non-current version for stall_ms or
+ * longer (as far as the watchdog has seen), reporting each stall once.
+ * The caller must hold the watch_lock.
+ */
+static size_t
+var_find_stalls(thread_safe_var vp, uint64_t now,
+                struct thread_safe_var_stall *stalls, size_t max)
+{
+    uint64_t current = var_version(vp);
+    uint64_t version;
+    struct slots *slots;
+    struct slot *slot;
+    size_t i, n = 0;
+
+    /*
+     * Readers note the versions they hold in their slots, so we needn't
+     * look at values (nor take the write_lock to keep them around).
+     * Slots are only freed by destroy_var(), after unwatch_var().
+     */
+    for (slots = atomic_read_ptr((volatile void **)&vp->slots);
+         slots != NULL && n < max;
+         slots = atomic_read_ptr((volatile void **)&slots->next)) {
+        for (i = 0; i < slots->slot_count && n < max; i++) {
+            slot = &slots->slot_array[i];
+            version = atomic_read_64(&slot->version);
+            if (version == 0 || version >= current) {
+                slot->stale_version = 0;
+                continue;
+            }
+            if (slot->stale_version != version) {
+                slot->stale_version = version;
+                slot->stale_since = now;
+                slot->reported = 0;
+                continue;
+            }
+            if (slot->reported || now - slot->stale_since < vp->stall_ms)
+                continue;
+            slot->reported = 1;
+            stalls[n].vp = vp;
+            stalls[n].thread = slot->owner;
+            stalls[n].version = version;
+            stalls[n].current = current;
+            stalls[n].ms = now - slot->stale_since;
+            n++;
+        }
+    }
+    return n;
+}
+
+/* Free old values retired by var_publish(), holding no locks */
+static void
+var_collect(thread_safe_var vp, void *garbage)
+{
+    volatile struct value *old_values = garbage;
+    volatile struct value *value;
 
-    /* Free old values now, holding no locks */
     for (value = old_values; value != NULL; value = old_values) {
-        if (vp->dtor)
-            vp->dtor(value->value);
         old_values = value->next;
-        free((void *)value);
+        value_free(vp, value);
     }
-    return err;
+}
+
+/*
+ * Free values that readers have let go of since the last set.
+ *
+ * Values are normally collected only when a new one is published, but a
+ * static var may need the memory of unreferenced values to set one.
+ */
+static void
+var_reclaim(thread_safe_var vp)
+{
+    struct wlock_node wn;
+    void *garbage = NULL;
+
+    wlock_lock(&vp->write_lock, &wn);
+    if (vp->values != NULL)
+        garbage = (void *)(uintptr_t)mark_values(vp);
+    wlock_unlock(&vp->write_lock, &wn);
+    var_collect(vp, garbage);
 }
 
 int
@@ -1186,19 +2605,34 @@ value_binary_search(volatile struct value **seen, size_t n, volatile struct valu
     return NULL;
 }
 
-/* Mark half of mark-and-sweep GC */
-static volatile struct value *
-mark_values(thread_safe_var vp)
+/*
+ * Start a mark-and-sweep GC of vp's values: list them in sorted order in
+ * the scratch array (see mark_ref()) and mark the ones kept regardless
+ * of readers.  The caller must hold the write_lock.
+ */
+static int
+mark_start(thread_safe_var vp)
 {
     volatile struct value **old_values_array;
-    volatile struct value * volatile *p;
-    volatile struct value *old_values = NULL;
-    volatile struct value *v, *v2;
-    volatile struct slots *slots;
-    struct slot *slot;
+    volatile struct value *v;
     size_t i;
 
-    old_values_array = calloc(vp->nvalues, sizeof(old_values_array[0]));
+    /*
+     * The scratch array is kept across calls so that steady-state writes
+     * don't allocate.  If we can't grow it we just don't collect this
+     * time.
+     */
+    if (vp->nvalues > vp->mark_scratch_size) {
+        uint32_t n = vp->nvalues < 8 ? 8 : vp->nvalues * 2;
+
+        old_values_array = mem_alloc(n * sizeof(old_values_array[0]));
+        if (old_values_array == NULL)
+            return ENOMEM;
+        mem_free(vp->mark_scratch);
+        vp->mark_scratch = old_values_array;
+        vp->mark_scratch_size = n;
+    }
+    old_values_array = vp->mark_scratch;
 
     /*
      * XXX There should be no need to atomically read vp->values here,
@@ -1215,65 +2649,64 @@ mark_values(thread_safe_var vp)
     for (i = 1; i < vp->nvalues; i++)
         assert(old_values_array[i-1] < old_values_array[i]);
 
-    /*
-     * Mark. This is O(N log(M)) where N is the number of subscribed
-     * threads and M is the number of values, but with the optimizations
-     * below, and with a bit of luck, this is more like O(N) than like
-     * O(N log(M)).
-     */
     vp->values->referenced = 1; /* curr value is always in use */
 
-    for (i = 0, slots = atomic_read_ptr((volatile void **)&vp->slots);
-         slots != NULL;
-         i++) {
-        assert(slots != NULL);
-        assert(i >= slots->slot_base);
-        assert(i <= slots->slot_base + slots->slot_count);
-        if (i == slots->slot_base + slots->slot_count) {
-            slots = slots->next;
-            if (slots == NULL)
-                break;
-        }
-        assert(slots->slot_count > 0);
-        assert(i >= slots->slot_base);
-        assert(i < slots->slot_base + slots->slot_count);
-        slot = &slots->slot_array[i - slots->slot_base];
-        v = atomic_read_ptr((volatile void **)&slot->value);
+    /* So are the history values (the list is in newest-first order) */
+    for (i = 0, v = vp->values->next;
+         i < vp->history && v != NULL;
+         i++, v = v->next)
+        v->referenced = 1;
+    return 0;
+}
 
-        /*
-         * Optimization: ignore slots with a NULL value.  The owner of
-         * that slot may be about to write a value that we're about to
-         * free, but they will notice that multiple writers went by and
-         * re-read vp->value.
-         *
-         * Also ignore slots with the current value.
-         */
-        if (v == NULL || v == vp->values)
-            continue;
+/* Mark a value that a reader references; see mark_start() */
+static void
+mark_ref(thread_safe_var vp, volatile struct value *v)
+{
+#ifndef NDEBUG
+    volatile struct value *v2;
+#endif
 
-        /*
-         * We can't just dereference v->referenced because there's a
-         * window in the get-side where we can set the slot's value to
-         * an immediately-after free()'ed value, and we could be seeing
-         * such a value, which means we can't dereference it.
-         *
-         * Instead we search for v in the old_values_array[].  If it's
-         * found then it's safe to write to v->referenced because it is
-         * stable through the execution of this function and won't be
-         * free()'ed until after.
-         */
-        if ((value_binary_search(old_values_array,
-                                 vp->nvalues, v)) != NULL) {
-            v->referenced = 1;  /* so v is valid, safe to deref */
-            continue;
-        }
+    /*
+     * Optimization: ignore slots with a NULL value.  The owner of
+     * that slot may be about to write a value that we're about to
+     * free, but they will notice that multiple writers went by and
+     * re-read vp->value.
+     *
+     * Also ignore slots with the current value.
+     */
+    if (v == NULL || v == vp->values)
+        return;
+
+    /*
+     * We can't just dereference v->referenced because there's a
+     * window in the get-side where we can set the slot's value to
+     * an immediately-after free()'ed value, and we could be seeing
+     * such a value, which means we can't dereference it.
+     *
+     * Instead we search for v in the old_values_array[].  If it's
+     * found then it's safe to write to v->referenced because it is
+     * stable through the execution of this function and won't be
+     * free()'ed until after.
+     */
+    if ((value_binary_search(vp->mark_scratch, vp->nvalues, v)) != NULL) {
+        v->referenced = 1;  /* so v is valid, safe to deref */
+        return;
+    }
 
 #ifndef NDEBUG
-        for (v2 = vp->values; v2 != NULL; v2 = v2->next)
-            assert(v2 != v);
+    for (v2 = vp->values; v2 != NULL; v2 = v2->next)
+        assert(v2 != v);
 #endif
-    }
-    free(old_values_array);
+}
+
+/* Sweep half of mark-and-sweep GC; returns the unreferenced values */
+static volatile struct value *
+mark_sweep(thread_safe_var vp)
+{
+    volatile struct value * volatile *p;
+    volatile struct value *old_values = NULL;
+    volatile struct value *v;
 
     /* Sweep; O(N) where N is the number of referenced values */
     for (p = &vp->values; *p != NULL;) {
@@ -1303,10 +2736,1608 @@ mark_values(thread_safe_var vp)
     return old_values;
 }
 
+/* Mark-and-sweep GC of vp's values; returns the unreferenced values */
+static volatile struct value *
+mark_values(thread_safe_var vp)
+{
+    volatile struct slots *slots;
+    struct domain_rec *rec;
+    size_t i;
+
+    if (mark_start(vp) != 0)
+        return NULL;
+
+    /*
+     * Mark. This is O(N log(M)) where N is the number of subscribed
+     * threads and M is the number of values, but with the optimizations
+     * in mark_ref(), and with a bit of luck, this is more like O(N) than
+     * like O(N log(M)).
+     */
+    if (vp->domain != NULL) {
+        for (rec = atomic_read_ptr((volatile void **)&vp->domain->recs);
+             rec != NULL;
+             rec = atomic_read_ptr((volatile void **)&rec->next))
+            mark_ref(vp, atomic_read_ptr((volatile void **)
+                                         &rec->refs[vp->domain_idx]));
+        return mark_sweep(vp);
+    }
+
+    for (i = 0, slots = atomic_read_ptr((volatile void **)&vp->slots);
+         slots != NULL;
+         i++) {
+        assert(slots != NULL);
+        assert(i >= slots->slot_base);
+        assert(i <= slots->slot_base + slots->slot_count);
+        if (i == slots->slot_base + slots->slot_count) {
+            /* Pairs with the CAS in grow_slots() */
+            slots = atomic_read_ptr((volatile void **)&slots->next);
+            if (slots == NULL)
+                break;
+        }
+        assert(slots->slot_count > 0);
+        assert(i >= slots->slot_base);
+        assert(i < slots->slot_base + slots->slot_count);
+        mark_ref(vp, atomic_read_ptr((volatile void **)
+                     &slots->slot_array[i - slots->slot_base].value));
+    }
+    return mark_sweep(vp);
+}
+
 #endif /* USE_TSV_SLOT_PAIR_DESIGN */
 
 /* Code common to both implementations */
 
+/**
+ * Initialize a thread-safe global variable
+ *
+ * A thread-safe global variable stores a current value, a pointer to
+ * void, which may be set and read.  A value read from a thread-safe
+ * global variable will be valid in the thread that read it, and will
+ * remain valid until released or until the thread-safe global variable
+ * is read again in the same thread.  New values may be set.  Values
+ * will be destroyed with the destructor provided when no references
+ * remain.
+ *
+ * @param var Pointer to thread-safe global variable
+ * @param dtor Pointer to thread-safe global value destructor function
+ *
+ * @return Returns zero on success, else a system error number
+ */
+int
+thread_safe_var_init(thread_safe_var *vpp,
+                     thread_safe_var_dtor_f dtor)
+{
+    return thread_safe_var_init_attr(vpp, dtor, NULL);
+}
+
+/* Initialize thread-safe global variable attributes to the defaults */
+void
+thread_safe_var_attr_init(thread_safe_var_attr *attr)
+{
+    memset(attr, 0, sizeof(*attr));
+    attr->value_cache = 8;
+}
+
+/* Carve zeroed, SLAB_ALIGN-aligned memory from a region */
+static void *
+region_alloc(struct mem_region *region, size_t size)
+{
+    char *p;
+
+    size = (size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    if (size > region->size - region->used)
+        return NULL;
+    p = region->base + region->used;
+    region->used += size;
+    memset(p, 0, size);
+    return p;
+}
+
+static int
+region_init(struct mem_region *region, const thread_safe_var_attr *attr,
+            size_t needed)
+{
+    if (needed == 0 || ((uintptr_t)attr->mem & (SLAB_ALIGN - 1)) != 0 ||
+        attr->replicate != NULL)
+        return EINVAL;
+    if (attr->mem_size < needed)
+        return ENOMEM;
+    region->base = attr->mem;
+    region->size = attr->mem_size;
+    region->used = 0;
+    return 0;
+}
+
+/* Size of a slab's element, or zero on overflow */
+static size_t
+slab_elem_size(size_t node_size, size_t value_size)
+{
+    size_t hdr_size = (node_size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+
+    if (value_size > SIZE_MAX - hdr_size - SLAB_ALIGN)
+        return 0;
+    return (hdr_size + value_size + SLAB_ALIGN - 1) &
+           ~(size_t)(SLAB_ALIGN - 1);
+}
+
+/* Memory needed for a fixed slab in a static var, or zero if invalid */
+static size_t
+slab_mem_size(size_t node_size, const thread_safe_var_attr *attr)
+{
+    size_t elem_size = slab_elem_size(node_size, attr->value_size);
+    size_t hdr_size = (sizeof(struct value_slab) + SLAB_ALIGN - 1) &
+                      ~(size_t)(SLAB_ALIGN - 1);
+
+    /*
+     * We need room for the current value, one being set, and (in the
+     * slot-pair implementation) the previous value.
+     */
+    if (elem_size == 0 || attr->max_versions < 3 ||
+        attr->max_versions > (SIZE_MAX - hdr_size) / elem_size)
+        return 0;
+    return hdr_size + attr->max_versions * elem_size;
+}
+
+/* Free a chain of slab elements */
+static void
+slab_free_elems(void *elem)
+{
+    void *next;
+
+    for (; elem != NULL; elem = next) {
+        next = *(void **)elem;
+        mem_free(elem);
+    }
+}
+
+static void
+slab_free(struct value_slab *slab)
+{
+    pthread_mutex_destroy(&slab->lock);
+    if (slab->fixed)
+        return;
+    /* Elements put back while or after the var was destroyed */
+    slab_free_elems(slab->returned);
+    mem_free(slab);
+}
+
+/*
+ * Create a slab.  If a region is given the slab is fixed, and it and
+ * all its elements are carved from the region.
+ */
+static int
+slab_create(size_t node_size, const thread_safe_var_attr *attr,
+            struct mem_region *region, struct value_slab **slabp)
+{
+    struct value_slab *slab;
+    uint32_t i;
+    void *elem;
+    int err;
+
+    *slabp = NULL;
+    if (region != NULL)
+        slab = region_alloc(region, sizeof(*slab));
+    else if ((slab = mem_calloc(1, sizeof(*slab))) == NULL)
+        return ENOMEM;
+    if (slab == NULL)
+        return ENOMEM; /* can't happen: see thread_safe_var_mem_size() */
+    slab->fixed = (region != NULL);
+    if ((err = pthread_mutex_init(&slab->lock, NULL)) != 0) {
+        if (!slab->fixed)
+            mem_free(slab);
+        return err;
+    }
+    slab->hdr_size = (node_size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    slab->value_size = attr->value_size;
+    if ((slab->elem_size = slab_elem_size(node_size, attr->value_size)) == 0) {
+        slab_free(slab);
+        return EINVAL;
+    }
+    slab->max_free = attr->value_cache;
+    slab->nref = 1;
+    if (slab->fixed) {
+        slab->max_free = attr->max_versions;
+        for (i = 0; i < attr->max_versions; i++) {
+            if ((elem = region_alloc(region, slab->elem_size)) == NULL) {
+                slab_free(slab);
+                return ENOMEM;
+            }
+            *(void **)elem = slab->free_elems;
+            slab->free_elems = elem;
+            slab->nfree++;
+        }
+    }
+    *slabp = slab;
+    return 0;
+}
+
+/*
+ * Get a slab element, allocating one if there are no free ones (unless
+ * the slab is fixed)
+ */
+static void *
+slab_get(struct value_slab *slab)
+{
+    void *elem;
+
+    if (pthread_mutex_lock(&slab->lock) != 0)
+        abort();
+    if (slab->free_elems == NULL)
+        slab->free_elems = atomic_swap_ptr((volatile void **)&slab->returned,
+                                           NULL);
+    if ((elem = slab->free_elems) != NULL) {
+        slab->free_elems = *(void **)elem;
+        (void) atomic_dec_32_nv(&slab->nfree);
+    }
+    (void) pthread_mutex_unlock(&slab->lock);
+    if (elem == NULL && (slab->fixed ||
+                         (elem = mem_alloc(slab->elem_size)) == NULL))
+        return NULL;
+    (void) atomic_inc_32_nv(&slab->nref);
+    return elem;
+}
+
+/*
+ * Return a slab element to its slab, or free it.  Lock-less; the
+ * watermark may be overshot by racing puts.
+ */
+static void
+slab_put(struct value_slab *slab, void *elem)
+{
+    void *old;
+
+    if (slab->fixed || (!atomic_read_32(&slab->dead) &&
+                        atomic_read_32(&slab->nfree) < slab->max_free)) {
+        (void) atomic_inc_32_nv(&slab->nfree);
+        do {
+            old = atomic_read_ptr((volatile void **)&slab->returned);
+            *(void **)elem = old;
+        } while (atomic_cas_ptr((volatile void **)&slab->returned,
+                                old, elem) != old);
+    } else {
+        mem_free(elem);
+    }
+    if (atomic_dec_32_nv(&slab->nref) == 0)
+        slab_free(slab);
+}
+
+/*
+ * Drop the var's reference to its slab, freeing the slab's free
+ * elements now and the slab once its other elements are all freed.
+ */
+static void
+slab_release(struct value_slab *slab)
+{
+    if (slab == NULL)
+        return;
+    if (pthread_mutex_lock(&slab->lock) != 0)
+        abort();
+    atomic_write_32(&slab->dead, 1);
+    if (!slab->fixed) {
+        slab_free_elems(slab->free_elems);
+        slab_free_elems(atomic_swap_ptr((volatile void **)&slab->returned,
+                                        NULL));
+        slab->free_elems = NULL;
+    }
+    (void) pthread_mutex_unlock(&slab->lock);
+    if (atomic_dec_32_nv(&slab->nref) == 0)
+        slab_free(slab);
+}
+
+/**
+ * Allocate memory for a value of a var with a fixed value size
+ *
+ * Such a var (see thread_safe_var_attr's value_size) must only be set
+ * to values allocated with this function.  When such a value is
+ * destroyed its destructor (if any) is called to release whatever the
+ * value refers to, but must not free the value itself: its memory is
+ * kept for reuse by this function instead.
+ *
+ * @param [in] vp A thread-safe global variable with a fixed value size
+ *
+ * @return Memory for value_size bytes, suitably aligned for any scalar
+ *         type, or NULL (with errno set) on failure
+ */
+void *
+thread_safe_var_value_alloc(thread_safe_var vp)
+{
+    struct value_slab *slab = vp->slab;
+    char *elem;
+
+    if (slab == NULL || slab->value_size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((elem = slab_get(slab)) == NULL && slab->fixed) {
+        var_reclaim(vp);
+        elem = slab_get(slab);
+    }
+    if (elem == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return elem + slab->hdr_size;
+}
+
+/**
+ * Free a value from thread_safe_var_value_alloc() that was not set
+ *
+ * @param [in] vp The thread-safe global variable it was allocated for
+ * @param [in] value The value (may be NULL)
+ */
+void
+thread_safe_var_value_free(thread_safe_var vp, void *value)
+{
+    if (value != NULL)
+        slab_put(vp->slab, (char *)value - vp->slab->hdr_size);
+}
+
+/*
+ * Internal allocations.
+ *
+ * Everything the library allocates for itself goes through mem_alloc()
+ * and mem_free(), which the application may point at its own allocator
+ * before the first allocation.  Wrappers/list elements, of which there
+ * is one per set, are further pooled: each thread keeps a small cache
+ * of free nodes, and caches spill to and refill from a global
+ * lock-less depot, so steady-state gets and sets do not call the
+ * allocator at all.
+ */
+static void *(*mem_alloc_f)(size_t) = malloc;
+static void (*mem_free_f)(void *) = free;
+static volatile uint32_t mem_used;
+
+static void *
+mem_alloc(size_t size)
+{
+    if (atomic_read_32(&mem_used) == 0)
+        atomic_write_32(&mem_used, 1);
+    return mem_alloc_f(size);
+}
+
+static void *
+mem_calloc(size_t n, size_t size)
+{
+    void *p;
+
+    if (size != 0 && n > SIZE_MAX / size)
+        return NULL;
+    if ((p = mem_alloc(n * size)) != NULL)
+        memset(p, 0, n * size);
+    return p;
+}
+
+static void
+mem_free(void *p)
+{
+    if (p != NULL)
+        mem_free_f(p);
+}
+
+/**
+ * Set the allocator used for all of this library's internal allocations
+ *
+ * This must be called before any thread-safe global variable is
+ * created, and can only be called once.  Values are allocated by the
+ * application and are not affected, except those of vars with a fixed
+ * value size (see thread_safe_var_value_alloc()).
+ *
+ * @param [in] alloc_fn A malloc()-like function
+ * @param [in] free_fn A free()-like function
+ *
+ * @return Returns zero on success, EINVAL if either function is NULL,
+ *         or EBUSY if the library has already allocated memory
+ */
+int
+thread_safe_var_set_allocator(void *(*alloc_fn)(size_t),
+                              void (*free_fn)(void *))
+{
+    if (alloc_fn == NULL || free_fn == NULL)
+        return EINVAL;
+    if (atomic_cas_32(&mem_used, 0, 1) != 0)
+        return EBUSY;
+    mem_alloc_f = alloc_fn;
+    mem_free_f = free_fn;
+    return 0;
+}
+
+#define NODE_CACHE_MAX  64  /* per-thread free nodes */
+#define NODE_DEPOT_MAX  (16 * NODE_CACHE_MAX) /* free nodes in the depot */
+
+struct free_node {
+    struct free_node        *next;
+};
+
+struct node_cache {
+    struct free_node        *nodes;
+    struct free_node        *last;  /* for splicing onto the depot */
+    uint32_t                count;
+};
+
+/*
+ * node_depot_count over-counts the depot's nodes: it's added to before
+ * nodes are pushed and subtracted from after they're taken, so it never
+ * goes below zero.  It only bounds the depot, so it needn't be exact.
+ */
+static struct free_node * volatile node_depot;
+static volatile uint64_t node_depot_count;
+static pthread_key_t node_cache_key;
+static pthread_once_t node_cache_once = PTHREAD_ONCE_INIT;
+static int node_cache_err;
+
+/*
+ * Push a chain of count free nodes onto the depot, or give them back to
+ * the allocator if the depot already has NODE_DEPOT_MAX
+ */
+static void
+depot_push(struct free_node *first, struct free_node *last, uint32_t count)
+{
+    struct free_node *old;
+
+    if (atomic_read_64(&node_depot_count) >= NODE_DEPOT_MAX) {
+        while (first != NULL) {
+            old = first;
+            first = first == last ? NULL : first->next;
+            mem_free(old);
+        }
+        return;
+    }
+    (void) atomic_add_64_nv(&node_depot_count, count);
+    do {
+        old = atomic_read_ptr((volatile void **)&node_depot);
+        last->next = old;
+    } while (atomic_cas_ptr((volatile void **)&node_depot, old, first) != old);
+}
+
+static void
+node_cache_flush(struct node_cache *cache)
+{
+    if (cache->nodes != NULL)
+        depot_push(cache->nodes, cache->last, cache->count);
+    cache->nodes = cache->last = NULL;
+    cache->count = 0;
+}
+
+/* Thread exit: give our nodes back for other threads to use */
+static void
+node_cache_dtor(void *data)
+{
+    struct node_cache *cache = data;
+
+    node_cache_flush(cache);
+    mem_free(cache);
+}
+
+static void
+node_cache_init(void)
+{
+    node_cache_err = pthread_key_create(&node_cache_key, node_cache_dtor);
+}
+
+static struct node_cache *
+node_cache(int create)
+{
+    struct node_cache *cache;
+
+    if (pthread_once(&node_cache_once, node_cache_init) != 0 ||
+        node_cache_err != 0)
+        return NULL;
+    if ((cache = pthread_getspecific(node_cache_key)) != NULL || !create)
+        return cache;
+    if ((cache = mem_calloc(1, sizeof(*cache))) == NULL)
+        return NULL;
+    if (pthread_setspecific(node_cache_key, cache) != 0) {
+        mem_free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+/* Refill an empty cache from the depot, up to NODE_CACHE_MAX nodes */
+static void
+node_cache_refill(struct node_cache *cache)
+{
+    struct free_node *n, *seen, *rest, *last = NULL;
+    uint32_t excess = 0;
+
+    n = atomic_read_ptr((volatile void **)&node_depot);
+    while (n != NULL) {
+        seen = atomic_cas_ptr((volatile void **)&node_depot, n, NULL);
+        if (seen == n)
+            break;
+        n = seen;
+    }
+    if (n == NULL)
+        return;
+    cache->nodes = n;
+    cache->count = 1;
+    while (n->next != NULL && cache->count < NODE_CACHE_MAX) {
+        n = n->next;
+        cache->count++;
+    }
+    cache->last = n;
+    rest = n->next;
+    n->next = NULL;
+    for (n = rest; n != NULL; n = n->next) {
+        last = n;
+        excess++;
+    }
+    (void) atomic_add_64_nv(&node_depot_count,
+                            -(uint64_t)(cache->count + excess));
+    /* Splice the excess back (or free it, if others refilled the depot) */
+    if (rest != NULL)
+        depot_push(rest, last, excess);
+}
+
+/*
+ * Get a zeroed node.
+ *
+ * Refills take the whole depot at once (CAS to NULL), which, unlike
+ * popping single nodes, is not subject to ABA, and then splice back
+ * what doesn't fit in the cache.
+ */
+static void *
+node_get(void)
+{
+    struct node_cache *cache = node_cache(1);
+    struct free_node *n;
+
+    if (cache != NULL && cache->nodes == NULL)
+        node_cache_refill(cache);
+    if (cache != NULL && (n = cache->nodes) != NULL) {
+        cache->nodes = n->next;
+        if (--cache->count == 0)
+            cache->last = NULL;
+        memset(n, 0, NODE_SIZE);
+        return n;
+    }
+    return mem_calloc(1, NODE_SIZE);
+}
+
+/*
+ * Put a node back.  Readers release nodes too, so this does not create
+ * a cache for threads that don't have one.
+ */
+static void
+node_put(void *node)
+{
+    struct node_cache *cache = node_cache(0);
+    struct free_node *n = node;
+
+    if (n == NULL)
+        return;
+    if (cache == NULL) {
+        depot_push(n, n, 1);
+        return;
+    }
+    if (cache->count >= NODE_CACHE_MAX)
+        node_cache_flush(cache);
+    n->next = cache->nodes;
+    cache->nodes = n;
+    if (cache->count++ == 0)
+        cache->last = n;
+}
+
+/*
+ * NUMA replication.
+ *
+ * A var may be given a replicate callback, in which case the writer
+ * (before taking the write lock) makes a copy of each new value for
+ * each NUMA node, and readers get their node's copy.  The copies are
+ * destroyed along with the value, with the var's destructor.
+ *
+ * The CPU to node map is read from sysfs once.  On other systems, or if
+ * there's no sysfs, there's just one node.
+ */
+#define NUMA_MAX_NODES  64
+
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+static int numa_nnodes = 1;
+static int numa_ncpus;
+static unsigned char *numa_cpu_node;    /* CPU number -> node number */
+
+#ifdef __linux__
+/* Parse a sysfs CPU list ("0-3,8,10-11") into the CPU to node map */
+static void
+numa_parse_cpulist(FILE *f, int node)
+{
+    unsigned long lo, hi;
+    int c;
+
+    while (fscanf(f, "%lu", &lo) == 1) {
+        hi = lo;
+        if ((c = getc(f)) == '-') {
+            if (fscanf(f, "%lu", &hi) != 1)
+                return;
+            c = getc(f);
+        }
+        for (; lo <= hi && lo < (unsigned long)numa_ncpus; lo++)
+            numa_cpu_node[lo] = node;
+        if (c != ',')
+            return;
+    }
+}
+#endif
+
+static void
+numa_init(void)
+{
+#ifdef __linux__
+    char path[64];
+    FILE *f;
+    long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+    int node;
+
+    if (ncpus <= 0 || (numa_cpu_node = mem_calloc(ncpus, 1)) == NULL)
+        return;
+    numa_ncpus = ncpus;
+    for (node = 0; node < NUMA_MAX_NODES; node++) {
+        (void) snprintf(path, sizeof(path),
+                        "/sys/devices/system/node/node%d/cpulist", node);
+        if ((f = fopen(path, "r")) == NULL)
+            continue; /* node numbers can be sparse */
+        numa_parse_cpulist(f, node);
+        (void) fclose(f);
+        numa_nnodes = node + 1;
+    }
+#endif
+}
+
+/**
+ * Get the number of NUMA nodes (more precisely: one more than the
+ * highest NUMA node number)
+ *
+ * @return The number of NUMA nodes, which is 1 on non-NUMA systems
+ */
+int
+thread_safe_var_numa_nodes(void)
+{
+    (void) pthread_once(&numa_once, numa_init);
+    return numa_nnodes;
+}
+
+/* The calling thread's current NUMA node */
+static int
+numa_node(void)
+{
+#ifdef __linux__
+    int cpu = sched_getcpu();
+
+    if (cpu >= 0 && cpu < numa_ncpus)
+        return numa_cpu_node[cpu];
+#endif
+    return 0;
+}
+
+#define NUMA_HDR    64  /* keeps the memory we return cache-line aligned */
+
+/**
+ * Allocate memory on a given NUMA node
+ *
+ * This is a convenience for replicate callbacks (see
+ * thread_safe_var_attr).  The memory is page-granular, so it is best
+ * used for large values.
+ *
+ * @param [in] size Size
+ * @param [in] node NUMA node number, or -1 for no particular node
+ *
+ * @return Memory aligned to 64 bytes, or NULL (with errno set)
+ */
+void *
+thread_safe_var_numa_alloc(size_t size, int node)
+{
+    char *p;
+
+    if (size > SIZE_MAX - NUMA_HDR) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size += NUMA_HDR;
+#if defined(__linux__) && defined(SYS_mbind)
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+             -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    if (node >= 0 && node < NUMA_MAX_NODES) {
+        unsigned long mask = 1UL << node;
+
+        /* MPOL_PREFERRED (1): fall back on other nodes rather than fail */
+        (void) syscall(SYS_mbind, p, size, 1, &mask,
+                       (unsigned long)NUMA_MAX_NODES + 1, 0);
+    }
+#else
+    (void) node;
+    if ((errno = posix_memalign((void **)&p, NUMA_HDR, size)) != 0)
+        return NULL;
+#endif
+    *(size_t *)p = size;
+    return p + NUMA_HDR;
+}
+
+/**
+ * Free memory allocated with thread_safe_var_numa_alloc()
+ *
+ * @param [in] ptr Memory to free (may be NULL)
+ */
+void
+thread_safe_var_numa_free(void *ptr)
+{
+    char *p = ptr;
+
+    if (p == NULL)
+        return;
+    p -= NUMA_HDR;
+#if defined(__linux__) && defined(SYS_mbind)
+    (void) munmap(p, *(size_t *)p);
+#else
+    free(p);
+#endif
+}
+
+/*
+ * Make a value's replicas.  A node for which the callback fails simply
+ * has no replica, and its readers get the original.
+ */
+static int
+replicas_make(thread_safe_var_replicate_f replicate, void *value,
+              void ***replicasp)
+{
+    void **replicas;
+    int node;
+
+    *replicasp = NULL;
+    (void) pthread_once(&numa_once, numa_init);
+    if ((replicas = mem_calloc(numa_nnodes, sizeof(replicas[0]))) == NULL)
+        return ENOMEM;
+    for (node = 0; node < numa_nnodes; node++)
+        replicas[node] = replicate(value, node);
+    *replicasp = replicas;
+    return 0;
+}
+
+static void
+replicas_destroy(void **replicas, var_dtor_t dtor)
+{
+    int node;
+
+    if (replicas == NULL)
+        return;
+    for (node = 0; dtor != NULL && node < numa_nnodes; node++) {
+        if (replicas[node] != NULL)
+            dtor(replicas[node]);
+    }
+    mem_free(replicas);
+}
+
+/* Pick the calling thread's node's replica of a value, if it has one */
+static void *
+replica_pick(void *value, void **replicas)
+{
+    void *replica;
+
+    if (replicas == NULL || (replica = replicas[numa_node()]) == NULL)
+        return value;
+    return replica;
+}
+
+/*
+ * Statistics.
+ *
+ * Counting every get costs readers a counter add, so only vars created
+ * with attr->stats are counted; vp->stats doesn't change after the var
+ * is created, so readers test it with a plain load.  The counters are
+ * made by the first such var, and are then kept for good.
+ *
+ * Every get and set of those vars is counted, so the counters are
+ * striped (see ctp_counter.h): readers on different CPUs add to
+ * different cache lines, and counting doesn't make them contend where
+ * the vars themselves don't.
+ */
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t stats_made;     /* atomic; stats[] are initialized */
+static ctp_counter stats[STAT_MAX];
+
+/* Make the counters, if no var with attr->stats has yet */
+static int
+stats_init(void)
+{
+    int err;
+    int i;
+
+    if (atomic_read_32(&stats_made))
+        return 0;
+    if ((err = pthread_mutex_lock(&stats_lock)) != 0)
+        return err;
+    if (atomic_read_32(&stats_made))
+        goto out;
+    for (i = 0; i < STAT_MAX; i++) {
+        if ((err = ctp_counter_init(&stats[i])) != 0)
+            break;
+    }
+    if (err != 0) {
+        while (i-- > 0) {
+            ctp_counter_destroy(stats[i]);
+            stats[i] = NULL;
+        }
+        goto out;
+    }
+    atomic_write_32(&stats_made, 1);
+
+out:
+    (void) pthread_mutex_unlock(&stats_lock);
+    return err;
+}
+
+static void
+stat_add(thread_safe_var vp, enum var_stat stat, uint64_t n)
+{
+    if (vp->stats && n > 0)
+        ctp_counter_add(stats[stat], n);
+}
+
+/**
+ * Get the library's statistics, summed over all vars created with
+ * attr->stats set
+ *
+ * @param [out] st The statistics
+ *
+ * @return Zero on success, or ENOTSUP if no var was created with
+ *         attr->stats set
+ */
+int
+thread_safe_var_get_stats(struct thread_safe_var_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+    if (!atomic_read_32(&stats_made))
+        return ENOTSUP;
+    st->gets = ctp_counter_read(stats[STAT_GETS]);
+    st->gets_new = ctp_counter_read(stats[STAT_GETS_NEW]);
+    st->sets = ctp_counter_read(stats[STAT_SETS]);
+    st->published = ctp_counter_read(stats[STAT_PUBLISHED]);
+    st->combined = ctp_counter_read(stats[STAT_COMBINED]);
+    st->dups = ctp_counter_read(stats[STAT_DUPS]);
+    st->conflicts = ctp_counter_read(stats[STAT_CONFLICTS]);
+    return 0;
+}
+
+/* Spin-wait hint */
+static void
+cpu_pause(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __asm__ __volatile__("pause");
+#elif defined(__GNUC__) && defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#elif defined(__GNUC__)
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/*
+ * Writers' queue lock (MCS).
+ *
+ * Writers line up in arrival order, each spinning briefly on its own
+ * node rather than on a shared word, then parking (on a futex, where
+ * there is one) until the writer ahead of it hands it the lock
+ * directly.  Writers thus can't barge ahead of each other, and a burst
+ * of writers passes the lock along with one cache line transfer (and, if
+ * the next writer had to park, one wakeup) per writer.
+ */
+#define WLOCK_WAITING   0
+#define WLOCK_PARKED    1
+#define WLOCK_GRANTED   2
+#define WLOCK_SPINS     1000
+
+static void
+wlock_init(struct wlock *l)
+{
+    l->tail = NULL;
+}
+
+static void
+wlock_park(volatile uint32_t *state)
+{
+#if defined(__linux__) && defined(SYS_futex)
+    (void) syscall(SYS_futex, state, FUTEX_WAIT_PRIVATE, WLOCK_PARKED,
+                   NULL, NULL, 0);
+#else
+    (void) state;
+    sched_yield();
+#endif
+}
+
+/*
+ * The parked thread may see the grant and return before we get here, so
+ * state may no longer be its node; a stray wakeup is harmless though.
+ */
+static void
+wlock_unpark(volatile uint32_t *state)
+{
+#if defined(__linux__) && defined(SYS_futex)
+    (void) syscall(SYS_futex, state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    (void) state;
+#endif
+}
+
+static void
+wlock_lock(struct wlock *l, struct wlock_node *n)
+{
+    struct wlock_node *pred;
+    uint32_t i;
+
+    n->next = NULL;
+    n->state = WLOCK_WAITING;
+    do {
+        pred = atomic_read_ptr((volatile void **)&l->tail);
+    } while (atomic_cas_ptr((volatile void **)&l->tail, pred, n) != pred);
+    if (pred == NULL)
+        return;     /* uncontended */
+
+    atomic_write_ptr((volatile void **)&pred->next, n);
+    for (i = 0; i < WLOCK_SPINS; i++) {
+        if (atomic_read_32(&n->state) == WLOCK_GRANTED)
+            return;
+        cpu_pause();
+    }
+    if (atomic_cas_32(&n->state, WLOCK_WAITING, WLOCK_PARKED) ==
+        WLOCK_GRANTED)
+        return;
+    while (atomic_read_32(&n->state) == WLOCK_PARKED)
+        wlock_park(&n->state);
+}
+
+static void
+wlock_unlock(struct wlock *l, struct wlock_node *n)
+{
+    struct wlock_node *next;
+
+    if ((next = atomic_read_ptr((volatile void **)&n->next)) == NULL) {
+        if (atomic_cas_ptr((volatile void **)&l->tail, n, NULL) == n)
+            return; /* nobody in line */
+        /* Someone's joining the line; wait for them to link in */
+        while ((next = atomic_read_ptr((volatile void **)&n->next)) == NULL)
+            sched_yield();
+    }
+    if (atomic_cas_32(&next->state, WLOCK_WAITING, WLOCK_GRANTED) ==
+        WLOCK_WAITING)
+        return;     /* it was still spinning */
+    atomic_write_32(&next->state, WLOCK_GRANTED);
+    wlock_unpark(&next->state);
+}
+
+/*
+ * Reader stall watchdog.
+ *
+ * Vars with a stall_ms attribute are put on a list that a watchdog
+ * thread (started when the first such var is created) scans every
+ * stall_ms / 2 milliseconds (for the var with the smallest stall_ms),
+ * looking for readers that have held on to a version that is no longer
+ * current for stall_ms or longer, as those keep memory (and, in the
+ * slot-pair implementation, the slot writers need next) from being
+ * freed.  Each stall is reported once, with the var's stall callback,
+ * or else on stderr.
+ *
+ * Callbacks are called without the watch_lock, so they may read and
+ * destroy vars.  A var whose callbacks are running is watch_calling;
+ * other threads destroying it wait for the callbacks to finish, while
+ * the callbacks themselves may destroy it (the rest of its stalls are
+ * then not reported).
+ */
+#define STALLS_PER_SCAN 16
+
+static pthread_cond_t watch_cv = PTHREAD_COND_INITIALIZER;
+static thread_safe_var watched;     /* list of vars to watch */
+static thread_safe_var watch_calling; /* see above */
+static uint64_t watch_gen;          /* bumped when a var is unwatched */
+static pthread_t watchdog_thread;
+static int watchdog_running;
+
+static uint64_t
+now_ms(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+stall_log(const struct thread_safe_var_stall *stall, void *arg)
+{
+    (void) arg;
+    fprintf(stderr, "thread_safe_var %p: thread %lu has held version "
+            "%llu for %llu ms (current version is %llu)\n",
+            (void *)stall->vp, (unsigned long)stall->thread,
+            (unsigned long long)stall->version,
+            (unsigned long long)stall->ms,
+            (unsigned long long)stall->current);
+}
+
+static void *
+watchdog(void *arg)
+{
+    struct thread_safe_var_stall stalls[STALLS_PER_SCAN];
+    struct timespec ts;
+    thread_safe_var_stall_f cb;
+    thread_safe_var vp;
+    void *cb_arg;
+    uint64_t period;
+    uint64_t now;
+    uint64_t gen;
+    size_t i, n;
+
+    (void) arg;
+    (void) pthread_mutex_lock(&watch_lock);
+    for (;;) {
+rescan:
+        period = 0;
+        now = now_ms();
+        for (vp = watched; vp != NULL; vp = vp->watch_next) {
+            if (period == 0 || vp->stall_ms / 2 < period)
+                period = vp->stall_ms / 2 ? vp->stall_ms / 2 : 1;
+            if ((n = var_find_stalls(vp, now, stalls, STALLS_PER_SCAN)) == 0)
+                continue;
+            cb = vp->stall_cb != NULL ? vp->stall_cb : stall_log;
+            cb_arg = vp->stall_arg;
+            watch_calling = vp;
+            gen = watch_gen;
+            (void) pthread_mutex_unlock(&watch_lock);
+            for (i = 0; i < n && watch_calling == vp; i++)
+                cb(&stalls[i], cb_arg);
+            (void) pthread_mutex_lock(&watch_lock);
+            watch_calling = NULL;
+            (void) pthread_cond_broadcast(&watch_cv);
+            /*
+             * If a var was unwatched meanwhile vp may be gone; start
+             * over (stalls are reported once, so none will be again).
+             */
+            if (watch_gen != gen)
+                goto rescan;
+        }
+        if (period == 0) {
+            (void) pthread_cond_wait(&watch_cv, &watch_lock);
+            continue;
+        }
+        (void) clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += period / 1000;
+        ts.tv_nsec += (period % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        (void) pthread_cond_timedwait(&watch_cv, &watch_lock, &ts);
+    }
+    return NULL;
+}
+
+/* Add a var to the watchdog's list, starting the watchdog if need be */
+static int
+watch_var(thread_safe_var vp)
+{
+    pthread_attr_t attr;
+    pthread_t t;
+    int err = 0;
+
+    (void) pthread_mutex_lock(&watch_lock);
+    if (!watchdog_running) {
+        if ((err = pthread_attr_init(&attr)) == 0) {
+            (void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            err = pthread_create(&t, &attr, watchdog, NULL);
+            (void) pthread_attr_destroy(&attr);
+        }
+        if ((watchdog_running = (err == 0)))
+            watchdog_thread = t;
+    }
+    if (err == 0) {
+        vp->watch_next = watched;
+        watched = vp;
+        (void) pthread_cond_broadcast(&watch_cv);
+    }
+    (void) pthread_mutex_unlock(&watch_lock);
+    return err;
+}
+
+static void
+unwatch_var(thread_safe_var vp)
+{
+    thread_safe_var *vpp;
+
+    (void) pthread_mutex_lock(&watch_lock);
+    for (vpp = &watched; *vpp != NULL; vpp = &(*vpp)->watch_next) {
+        if (*vpp == vp) {
+            *vpp = vp->watch_next;
+            break;
+        }
+    }
+    watch_gen++;
+
+    /* Don't pull the var out from under its stall callbacks */
+    if (watch_calling == vp &&
+        pthread_equal(pthread_self(), watchdog_thread))
+        watch_calling = NULL; /* a callback is destroying it */
+    while (watch_calling == vp)
+        (void) pthread_cond_wait(&watch_cv, &watch_lock);
+    (void) pthread_mutex_unlock(&watch_lock);
+}
+
+/*
+ * Writes are flat-combined.
+ *
+ * Each writer posts a request on a lock-less stack of pending requests,
+ * then takes the write lock.  The first writer to get the lock becomes
+ * the combiner: it takes all pending requests, publishes only the most
+ * recently posted value, and assigns versions to all of the requests.
+ * The other writers then find their requests completed when they get
+ * the lock, and they merely drop it.  Thus N concurrent writers cost
+ * one publish (and, in the slot-list case, one garbage collection)
+ * rather than N.
+ *
+ * Values superseded this way are never seen by readers, but their
+ * versions are consumed all the same, so versions remain monotonic.
+ * The writers that set them destroy them.
+ *
+ * If the var has an eq callback and the newest value is equal to the
+ * current one then nothing is published: all the requests' values are
+ * destroyed and they all get the current version.
+ */
+enum set_req_state {
+    SET_REQ_PENDING = 0,    /* not yet taken by a combiner */
+    SET_REQ_PUBLISHED,      /* published */
+    SET_REQ_SUPERSEDED,     /* combined away; destroy the value */
+    SET_REQ_FAILED,         /* publish failed; see err */
+};
+
+struct set_req {
+    struct set_req      *next;      /* previously posted request */
+    void                *data;      /* the value to set */
+    void                *node;      /* wrapper/list element for data */
+    uint64_t            version;    /* version assigned by the combiner */
+    int                 err;        /* set if the publish failed */
+    volatile uint32_t   state;      /* see enum set_req_state */
+};
+
+/*
+ * Take all pending write requests and publish the newest one.  The
+ * caller must hold the write_lock.  Returns garbage for var_collect().
+ */
+static void *
+combine_set_reqs(thread_safe_var vp)
+{
+    struct set_req *reqs;
+    struct set_req *r;
+    struct set_req *next;
+    uint64_t version = 0;
+    uint64_t n;
+    void *garbage = NULL;
+    int err;
+
+    do {
+        reqs = atomic_read_ptr((volatile void **)&vp->set_reqs);
+    } while (atomic_cas_ptr((volatile void **)&vp->set_reqs,
+                            reqs, NULL) != reqs);
+
+    /* Our caller's request is pending, so there's at least one */
+    assert(reqs != NULL);
+    for (n = 0, r = reqs; r != NULL; r = r->next)
+        n++;
+
+    if (var_is_dup(vp, reqs->node)) {
+        stat_add(vp, STAT_DUPS, n);
+        version = var_version(vp);
+        for (r = reqs; r != NULL; r = next) {
+            next = r->next;
+            r->version = version;
+            atomic_write_32(&r->state, SET_REQ_SUPERSEDED);
+        }
+        return NULL;
+    }
+
+    /* The head of the stack is the most recently posted request */
+    err = var_publish(vp, reqs->node, n - 1, &version, &garbage);
+    if (err == 0) {
+        stat_add(vp, STAT_PUBLISHED, 1);
+        stat_add(vp, STAT_COMBINED, n - 1);
+    }
+
+    for (r = reqs; r != NULL; r = next) {
+        next = r->next;
+        r->err = err;
+        r->version = err ? 0 : version--;
+        atomic_write_32(&r->state,
+                        err ? SET_REQ_FAILED :
+                        r == reqs ? SET_REQ_PUBLISHED : SET_REQ_SUPERSEDED);
+    }
+    return garbage;
+}
+
+/*
+ * Push a waiter.  Once the CAS succeeds a notifier may take w and
+ * requeue it, rewriting w->next, so we compare against our own copy.
+ */
+static void
+waiter_push(thread_safe_var vp, struct thread_safe_var_waiter *w)
+{
+    struct thread_safe_var_waiter *old;
+
+    do {
+        old = atomic_read_ptr((volatile void **)&vp->waiters);
+        w->next = old;
+    } while (atomic_cas_ptr((volatile void **)&vp->waiters, old, w) != old);
+}
+
+/*
+ * Notify waiters registered with thread_safe_var_notify() of newer
+ * versions, and put back those still waiting.
+ *
+ * Any thread may do this.  If a newer version is published while we're
+ * at it, its writer may find the waiters list empty, so we go around
+ * again if the version changed.
+ */
+static void
+notify_waiters(thread_safe_var vp)
+{
+    struct thread_safe_var_waiter *waiters;
+    struct thread_safe_var_waiter *w;
+    struct thread_safe_var_waiter *next;
+    uint64_t version;
+    int requeued;
+
+    do {
+        do {
+            waiters = atomic_read_ptr((volatile void **)&vp->waiters);
+        } while (atomic_cas_ptr((volatile void **)&vp->waiters,
+                                waiters, NULL) != waiters);
+
+        version = var_version(vp);
+        requeued = 0;
+        for (w = waiters; w != NULL; w = next) {
+            next = w->next; /* w may go away once notified */
+            if (version > w->after) {
+                w->notify(w, version);
+                continue;
+            }
+            waiter_push(vp, w);
+            requeued = 1;
+        }
+    } while (requeued && var_version(vp) != version);
+}
+
+/*
+ * Set for single-writer vars: there are no other writers to exclude or
+ * to combine with, so there's no write_lock and no set_req.  If check
+ * then the current version must be the given one.
+ */
+static int
+set_single(thread_safe_var vp, void *node, int check, uint64_t version,
+           uint64_t *new_version)
+{
+    void *garbage = NULL;
+    int err;
+
+#ifndef NDEBUG
+    if (atomic_cas_32(&vp->writer_known, 0, 1) == 0)
+        vp->writer = pthread_self();
+    assert(pthread_equal(vp->writer, pthread_self()));
+#endif
+
+    if (check && var_version(vp) != version) {
+        stat_add(vp, STAT_CONFLICTS, 1);
+        node_free(vp, node);
+        return EAGAIN;
+    }
+    if (var_is_dup(vp, node)) {
+        stat_add(vp, STAT_DUPS, 1);
+        node_destroy(vp, node);
+        *new_version = var_version(vp);
+        return 0;
+    }
+    if ((err = var_publish(vp, node, 0, new_version, &garbage)) != 0) {
+        node_free(vp, node);
+        *new_version = 0;
+        return err;
+    }
+    stat_add(vp, STAT_PUBLISHED, 1);
+    var_collect(vp, garbage);
+    if (atomic_read_ptr((volatile void **)&vp->waiters) != NULL)
+        notify_waiters(vp);
+    return 0;
+}
+
+/*
+ * thread_safe_var_get_version() for vars that keep no history (which
+ * includes single-writer vars): only the current version is available.
+ */
+static int
+get_current_version(thread_safe_var vp, uint64_t version, void **res)
+{
+    uint64_t current;
+    int err;
+
+    if ((err = thread_safe_var_get(vp, res, &current)) != 0)
+        return err;
+    if (current == version)
+        return 0;
+    *res = NULL;
+    return ENOENT;
+}
+
+/**
+ * Set new data on a thread-safe global variable
+ *
+ * Concurrent writes may be combined, in which case only the last one
+ * is published, and the others' values are destroyed (by the threads
+ * that set them) without ever being seen by readers.
+ *
+ * If the var has an eq callback (see thread_safe_var_attr) and data is
+ * equal to the current value then data is destroyed and the current
+ * version is output: readers see no change.
+ *
+ * @param [in] var Pointer to thread-safe global variable
+ * @param [in] data New value for the thread-safe global variable
+ * @param [out] new_version New version number
+ *
+ * @return 0 on success, or a system error such as ENOMEM.
+ */
+int
+thread_safe_var_set(thread_safe_var vp, void *data, uint64_t *new_version)
+{
+    struct wlock_node wn;
+    struct set_req req;
+    void *garbage = NULL;
+    uint64_t vers;
+    int err;
+
+    if (new_version == NULL)
+        new_version = &vers;
+    *new_version = 0;
+
+    if (data == NULL)
+        return EINVAL;
+
+    stat_add(vp, STAT_SETS, 1);
+    memset(&req, 0, sizeof(req));
+    req.data = data;
+    if ((err = node_alloc(vp, data, &req.node)) != 0)
+        return err;
+    if (vp->single_writer)
+        return set_single(vp, req.node, 0, 0, new_version);
+
+    /* Post our request */
+    do {
+        req.next = atomic_read_ptr((volatile void **)&vp->set_reqs);
+    } while (atomic_cas_ptr((volatile void **)&vp->set_reqs,
+                            req.next, &req) != req.next);
+
+    /*
+     * Our request is visible to other writers now.  Writers queue for
+     * the lock in FIFO order, and whoever gets it first publishes every
+     * request posted by then.
+     */
+    wlock_lock(&vp->write_lock, &wn);
+    if (atomic_read_32(&req.state) == SET_REQ_PENDING)
+        garbage = combine_set_reqs(vp); /* We're the combiner */
+    wlock_unlock(&vp->write_lock, &wn);
+
+    var_collect(vp, garbage);
+
+    switch (atomic_read_32(&req.state)) {
+    case SET_REQ_PUBLISHED:
+        if (atomic_read_ptr((volatile void **)&vp->waiters) != NULL)
+            notify_waiters(vp);
+        break;
+    case SET_REQ_SUPERSEDED:
+        node_destroy(vp, req.node);
+        break;
+    case SET_REQ_FAILED:
+        node_free(vp, req.node);
+        return req.err;
+    default:
+        abort();
+    }
+    *new_version = req.version;
+    return err;
+}
+
+#ifdef __linux__
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ  22  /* Linux 5.14 */
+#define MADV_POPULATE_WRITE 23
+#endif
+#endif
+
+/*
+ * Fault in the pages of a memory range, by touching one byte per page
+ * if the kernel can't do it for us.
+ */
+static void
+prefault_range(char *base, size_t len, int flags)
+{
+    size_t pgsz = 4096;
+    uintptr_t start, end;
+    volatile char *p;
+
+#ifdef __linux__
+    pgsz = sysconf(_SC_PAGESIZE);
+#endif
+    start = (uintptr_t)base & ~(uintptr_t)(pgsz - 1);
+    end = (uintptr_t)base + len;
+#ifdef __linux__
+#ifdef MADV_HUGEPAGE
+    if (flags & THREAD_SAFE_VAR_PREFAULT_HUGE)
+        (void) madvise((void *)start, end - start, MADV_HUGEPAGE);
+#endif
+    if (madvise((void *)start, end - start,
+                (flags & THREAD_SAFE_VAR_PREFAULT_WRITE) ?
+                MADV_POPULATE_WRITE : MADV_POPULATE_READ) == 0)
+        return;
+#endif
+    /* Touch the first byte we were given, and then one per page */
+    for (p = base; (uintptr_t)p < end;
+         p = (volatile char *)((((uintptr_t)p) & ~(uintptr_t)(pgsz - 1)) + pgsz)) {
+        if (flags & THREAD_SAFE_VAR_PREFAULT_WRITE)
+            *p = *p;
+        else
+            (void) *p;
+    }
+}
+
+/**
+ * Set new data on a thread-safe global variable after faulting in its
+ * memory
+ *
+ * For large values, this moves the cost of the page faults that the
+ * first readers of a new value would take to the writer: all the pages
+ * of the given ranges are faulted in (with MADV_POPULATE_READ or, with
+ * THREAD_SAFE_VAR_PREFAULT_WRITE, MADV_POPULATE_WRITE where available,
+ * else by touching them) before the value is set, and with
+ * THREAD_SAFE_VAR_PREFAULT_HUGE transparent huge pages are requested
+ * for them first.
+ *
+ * @param [in] var Pointer to thread-safe global variable
+ * @param [in] data New value for the thread-safe global variable
+ * @param [in] iov Memory ranges making up the value
+ * @param [in] iovcnt Number of memory ranges
+ * @param [in] flags THREAD_SAFE_VAR_PREFAULT_* flags
+ * @param [out] new_version New version number
+ *
+ * @return See thread_safe_var_set()
+ */
+int
+thread_safe_var_set_prefault(thread_safe_var vp, void *data,
+                             const struct iovec *iov, int iovcnt, int flags,
+                             uint64_t *new_version)
+{
+    int i;
+
+    if (iovcnt < 0 || (iovcnt > 0 && iov == NULL))
+        return EINVAL;
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > 0)
+            prefault_range(iov[i].iov_base, iov[i].iov_len, flags);
+    }
+    return thread_safe_var_set(vp, data, new_version);
+}
+
+/**
+ * Set new data on a thread-safe global variable if its current version
+ * is the given one
+ *
+ * This is never combined with concurrent writes.  If the version does
+ * not match then the caller retains ownership of data.  As with
+ * thread_safe_var_set(), data equal to the current value is destroyed
+ * and the current version output.
+ *
+ * @param [in] var Pointer to thread-safe global variable
+ * @param [in] data New value for the thread-safe global variable
+ * @param [in] version Expected current version (0 -> no value yet)
+ * @param [out] new_version New version number
+ *
+ * @return 0 on success, EAGAIN if the current version is not the
+ *         expected one, or a system error such as ENOMEM.
+ */
+int
+thread_safe_var_set_if(thread_safe_var vp, void *data, uint64_t version,
+                       uint64_t *new_version)
+{
+    struct wlock_node wn;
+    void *garbage = NULL;
+    void *node;
+    uint64_t vers;
+    int err;
+
+    if (new_version == NULL)
+        new_version = &vers;
+    *new_version = 0;
+
+    if (data == NULL)
+        return EINVAL;
+
+    stat_add(vp, STAT_SETS, 1);
+    if ((err = node_alloc(vp, data, &node)) != 0)
+        return err;
+    if (vp->single_writer)
+        return set_single(vp, node, 1, version, new_version);
+
+    wlock_lock(&vp->write_lock, &wn);
+    if (var_version(vp) != version) {
+        stat_add(vp, STAT_CONFLICTS, 1);
+        err = EAGAIN;
+    } else if (var_is_dup(vp, node)) {
+        wlock_unlock(&vp->write_lock, &wn);
+        stat_add(vp, STAT_DUPS, 1);
+        node_destroy(vp, node);
+        *new_version = version;
+        return 0;
+    } else if ((err = var_publish(vp, node, 0, new_version,
+                                  &garbage)) == 0) {
+        stat_add(vp, STAT_PUBLISHED, 1);
+    }
+    wlock_unlock(&vp->write_lock, &wn);
+
+    var_collect(vp, garbage);
+
+    if (err != 0) {
+        node_free(vp, node);
+        *new_version = 0;
+        return err;
+    }
+    if (atomic_read_ptr((volatile void **)&vp->waiters) != NULL)
+        notify_waiters(vp);
+    return 0;
+}
+
+/**
+ * Get the current version of a thread-safe global variable without
+ * reading (or taking a reference to) its value.
+ *
+ * @param [in] vp A thread-safe global variable
+ *
+ * @return The current version, or 0 if no value has been set yet
+ */
+uint64_t
+thread_safe_var_version(thread_safe_var vp)
+{
+    return var_version(vp);
+}
+
+/**
+ * Ask to be notified when a version newer than w->after is published.
+ *
+ * Registration is lock-less.  w->notify() is called exactly once, with
+ * the then-current version, by the thread that publishes a newer
+ * version, or by this thread (possibly before this function returns) if
+ * a newer version has already been published.  The waiter must remain
+ * valid until then, and it must not be touched by the caller once
+ * notify() may have been called.
+ *
+ * @param [in] vp A thread-safe global variable
+ * @param [in] w A waiter; the caller sets after and notify
+ *
+ * @return Zero on success, else EINVAL
+ */
+int
+thread_safe_var_notify(thread_safe_var vp, struct thread_safe_var_waiter *w)
+{
+    uint64_t after;
+
+    if (w == NULL || w->notify == NULL)
+        return EINVAL;
+
+    /* Once pushed, w may be notified and freed at any time */
+    after = w->after;
+    waiter_push(vp, w);
+
+    /*
+     * A writer that published before we registered won't have seen us,
+     * so we check for ourselves.  Any writer that publishes after this
+     * check will see us.
+     */
+    if (var_version(vp) > after)
+        notify_waiters(vp);
+    return 0;
+}
+
 /**
  * Wait for a var to have its first value set.
  *
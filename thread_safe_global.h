@@ -32,6 +32,7 @@
 #define THREAD_SAFE_VAR_H
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <stdint.h>
 #include <pthread.h>
 
@@ -49,21 +50,194 @@ extern "C" {
  * thread_safe_var -- typically configuration information, the sort of
  * data that rarely changes.
  *
- * Writes are serialized.  Readers don't block and do not spin, and
+ * Writes are serialized, and concurrent writes may be combined such
+ * that only the last is published.  Readers don't block and do not spin, and
  * mostly perform only fast atomic operations; the only blocking
  * operations done by readers are for uncontended resources.
  */
 typedef struct thread_safe_var_s *thread_safe_var;
 
+/**
+ * A reclamation domain is shared by a set of vars (see
+ * thread_safe_var_attr's domain) so that each reader thread has one
+ * record for all of them, with its references to their values side by
+ * side, instead of a subscription slot per var, and so that
+ * thread_safe_var_domain_reclaim() can scan the readers once for all of
+ * them.
+ */
+typedef struct thread_safe_var_domain_s *thread_safe_var_domain;
+
 typedef void (*thread_safe_var_dtor_f)(void *);
+typedef void *(*thread_safe_var_replicate_f)(void *, int);
+typedef int (*thread_safe_var_eq_f)(const void *, const void *);
+typedef uint64_t (*thread_safe_var_hash_f)(const void *);
+
+/**
+ * A waiter for thread_safe_var_notify().  The caller sets after and
+ * notify; notify is called once with the first version newer than
+ * after.  next is private.
+ */
+struct thread_safe_var_waiter {
+    struct thread_safe_var_waiter   *next;
+    uint64_t                        after;
+    void                            (*notify)(struct thread_safe_var_waiter *,
+                                              uint64_t);
+};
+
+/**
+ * A reader stall, as reported by the watchdog (see
+ * thread_safe_var_attr's stall_ms): thread has held version of vp,
+ * which is no longer current, for (at least) ms milliseconds.
+ */
+struct thread_safe_var_stall {
+    thread_safe_var vp;
+    pthread_t       thread;
+    uint64_t        version;
+    uint64_t        current;
+    uint64_t        ms;
+};
+
+typedef void (*thread_safe_var_stall_f)(const struct thread_safe_var_stall *,
+                                        void *);
+
+/**
+ * Statistics summed over the vars created with thread_safe_var_attr's
+ * stats set, from thread_safe_var_get_stats():
+ *
+ * gets:      calls to thread_safe_var_get()
+ * gets_new:  gets that found a value other than the one the thread
+ *            last read (including first reads)
+ * sets:      calls to thread_safe_var_set() and thread_safe_var_set_if()
+ * published: values published
+ * combined:  values superseded by a concurrent set (see
+ *            thread_safe_var_set())
+ * dups:      values not published for being equal to the current one
+ * conflicts: calls to thread_safe_var_set_if() that failed with EAGAIN
+ */
+struct thread_safe_var_stats {
+    uint64_t    gets;
+    uint64_t    gets_new;
+    uint64_t    sets;
+    uint64_t    published;
+    uint64_t    combined;
+    uint64_t    dups;
+    uint64_t    conflicts;
+};
+
+/* Flags for thread_safe_var_set_prefault() */
+#define THREAD_SAFE_VAR_PREFAULT_WRITE  0x1 /* fault in writable pages */
+#define THREAD_SAFE_VAR_PREFAULT_HUGE   0x2 /* ask for transparent huge pages */
+
+/**
+ * Optional attributes for thread_safe_var_init_attr().  Initialize with
+ * thread_safe_var_attr_init(), then set the fields of interest.
+ *
+ * value_size: if non-zero, all values are value_size bytes and are
+ *             allocated with thread_safe_var_value_alloc(), which
+ *             recycles destroyed values' memory
+ * value_cache: how many destroyed values to keep for recycling
+ * mem, mem_size: if mem is not NULL the var is static: it, its
+ *             bookkeeping and (if value_size is set) its values all
+ *             live in this caller-provided memory, which must be
+ *             aligned to 16 bytes and at least
+ *             thread_safe_var_mem_size() bytes long, and the library
+ *             never allocates or frees memory for it.  Sets then fail
+ *             with ENOMEM when max_versions values are live, and first
+ *             reads by more than max_threads threads at once fail with
+ *             ENOMEM.  The memory must remain valid until every thread
+ *             that read the var has released it or exited.
+ * max_threads: for static vars, the maximum number of reader threads
+ * max_versions: for static vars, the maximum number of live values:
+ *             the current one, values held by readers, values being
+ *             set and, in the slot-pair implementation, the previous
+ *             one (at least 3)
+ * replicate: if not NULL, called by thread_safe_var_set() with each
+ *             new value and each NUMA node number to make a copy of the
+ *             value for readers on that node (e.g., allocated with
+ *             thread_safe_var_numa_alloc()), or NULL to have them read
+ *             the original; copies are destroyed with the var's
+ *             destructor along with the original (not for static vars)
+ * eq, hash:   if eq is not NULL, a value set that is equal to the
+ *             current value (eq returns non-zero) is destroyed instead
+ *             of published; eq is called with the write lock held, so
+ *             an optional hash function (called before the lock is
+ *             taken, once per value) can be given to rule out most
+ *             unequal values cheaply
+ * history:    how many versions before the current one to keep alive
+ *             for thread_safe_var_get_version() (static vars' max_versions
+ *             must allow for them)
+ * stall_ms:   if not zero, a watchdog thread reports readers that hold
+ *             on to a version that is no longer current for this long,
+ *             once per stall, by calling stall_cb (with stall_arg) or
+ *             else by logging to stderr; stall_cb is called on the
+ *             watchdog thread with no locks held, and may read or
+ *             destroy vars (destroying the var it reports on from
+ *             another thread waits for the callback to return)
+ *             (slot-pair static vars can't have this)
+ * domain:     if not NULL, the reclamation domain the var belongs to;
+ *             the var then gets no per-var thread-specific key or
+ *             slots, and is destroyed as soon as it is destroyed (not
+ *             when its last reader exits); not for static vars or vars
+ *             with stall_ms (only the slot-list implementation has
+ *             subscription slots; in the slot-pair implementation this
+ *             is ignored)
+ * single_writer: if non-zero, only one thread ever sets the var, so
+ *             sets take no lock and are not combined (debug builds
+ *             assert that it's always the same thread);
+ *             thread_safe_var_get_version() then only gets the current
+ *             version, and the var can't have history, a domain or, in
+ *             the slot-list implementation, stall_ms
+ * stats:      if non-zero, the var's gets and sets are counted in the
+ *             library's statistics (see thread_safe_var_get_stats());
+ *             this costs each get a counter add
+ */
+typedef struct thread_safe_var_attr {
+    size_t      value_size;
+    uint32_t    value_cache;
+    void        *mem;
+    size_t      mem_size;
+    uint32_t    max_threads;
+    uint32_t    max_versions;
+    thread_safe_var_replicate_f replicate;
+    thread_safe_var_eq_f        eq;
+    thread_safe_var_hash_f      hash;
+    uint32_t                    history;
+    uint32_t                    stall_ms;
+    thread_safe_var_stall_f     stall_cb;
+    void                        *stall_arg;
+    thread_safe_var_domain      domain;
+    int                         single_writer;
+    int                         stats;
+} thread_safe_var_attr;
+
+void thread_safe_var_attr_init(thread_safe_var_attr *);
+size_t thread_safe_var_mem_size(const thread_safe_var_attr *);
 
 int  thread_safe_var_init(thread_safe_var *, thread_safe_var_dtor_f);
+int  thread_safe_var_init_attr(thread_safe_var *, thread_safe_var_dtor_f,
+                               const thread_safe_var_attr *);
 void thread_safe_var_destroy(thread_safe_var);
 
 int  thread_safe_var_get(thread_safe_var, void **, uint64_t *);
+int  thread_safe_var_get_version(thread_safe_var, uint64_t, void **);
 int  thread_safe_var_wait(thread_safe_var);
 int  thread_safe_var_set(thread_safe_var, void *, uint64_t *);
+int  thread_safe_var_set_if(thread_safe_var, void *, uint64_t, uint64_t *);
+int  thread_safe_var_set_prefault(thread_safe_var, void *,
+                                  const struct iovec *, int, int, uint64_t *);
 void thread_safe_var_release(thread_safe_var);
+uint64_t thread_safe_var_version(thread_safe_var);
+int  thread_safe_var_notify(thread_safe_var, struct thread_safe_var_waiter *);
+void *thread_safe_var_value_alloc(thread_safe_var);
+void thread_safe_var_value_free(thread_safe_var, void *);
+int  thread_safe_var_domain_create(thread_safe_var_domain *, uint32_t);
+int  thread_safe_var_domain_destroy(thread_safe_var_domain);
+int  thread_safe_var_domain_reclaim(thread_safe_var_domain);
+int  thread_safe_var_set_allocator(void *(*)(size_t), void (*)(void *));
+int  thread_safe_var_numa_nodes(void);
+void *thread_safe_var_numa_alloc(size_t, int);
+void thread_safe_var_numa_free(void *);
+int  thread_safe_var_get_stats(struct thread_safe_var_stats *);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,500 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef THREAD_SAFE_VAR_HPP
+#define THREAD_SAFE_VAR_HPP
+
+/*
+ * Header-only C++17 bindings for thread_safe_var.
+ *
+ * tsv::var<T> owns a thread_safe_var whose values are T objects, and
+ * whose value destructor is T's.  Reads return a tsv::snapshot<T>, a
+ * move-only guard for the value read.
+ *
+ * The TSV implementation (slot-pair or slot-list) is chosen when the
+ * library is built, so there is nothing to choose here.
+ *
+ * With C++20 coroutines, co_await var.next_version(after, executor)
+ * suspends until a version newer than after is published.
+ *
+ * tsv::atomic_shared_ptr<T> is a TSV-backed stand-in for
+ * std::atomic<std::shared_ptr<T>>.
+ */
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <memory>
+#include <system_error>
+#include <utility>
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+#include <coroutine>
+#define TSV_HAVE_COROUTINES 1
+#endif
+
+#include "thread_safe_global.h"
+
+namespace tsv {
+
+namespace detail {
+
+inline void
+check(int err, const char *what)
+{
+    if (err != 0)
+        throw std::system_error(err, std::generic_category(), what);
+}
+
+#ifdef TSV_HAVE_COROUTINES
+/*
+ * Awaitable for var<T>::next_version().  Registration with
+ * thread_safe_var_notify() is lock-less; the coroutine is resumed by
+ * handing executor a callable when a newer version is published.
+ */
+template <typename Executor>
+class next_version_awaiter : private thread_safe_var_waiter {
+public:
+    next_version_awaiter(thread_safe_var vp, std::uint64_t after,
+                         Executor executor)
+        : thread_safe_var_waiter(), vp_(vp), executor_(std::move(executor))
+    {
+        this->after = after;
+        this->notify = &next_version_awaiter::fire;
+    }
+
+    bool
+    await_ready() const noexcept
+    {
+        return thread_safe_var_version(vp_) > this->after;
+    }
+
+    bool
+    await_suspend(std::coroutine_handle<> h)
+    {
+        int err;
+
+        handle_ = h;
+        /* Once registered we may be resumed, so don't touch *this */
+        if ((err = thread_safe_var_notify(vp_, this)) == 0)
+            return true;
+        err_ = err;
+        return false;
+    }
+
+    /* Returns the version that woke us */
+    std::uint64_t
+    await_resume() const
+    {
+        check(err_, "thread_safe_var_notify");
+        return version_ ? version_ : thread_safe_var_version(vp_);
+    }
+
+private:
+    static void
+    fire(thread_safe_var_waiter *w, std::uint64_t version)
+    {
+        auto *self = static_cast<next_version_awaiter *>(w);
+        std::coroutine_handle<> h = self->handle_;
+        Executor executor(std::move(self->executor_));
+
+        /* *self may be gone as soon as the coroutine is resumed */
+        self->version_ = version;
+        executor([h]() { h.resume(); });
+    }
+
+    thread_safe_var vp_;
+    Executor executor_;
+    std::coroutine_handle<> handle_;
+    std::uint64_t version_ = 0;
+    int err_ = 0;
+};
+#endif
+
+} // namespace detail
+
+/* Resumes coroutines on the thread that notifies them */
+struct inline_executor {
+    template <typename F>
+    void operator()(F &&f) const { std::forward<F>(f)(); }
+};
+
+/**
+ * A value read from a tsv::var<T>.
+ *
+ * The value remains valid until the snapshot is destroyed, at which
+ * point this thread's reference to it is released.  As with the C API,
+ * a thread holds at most one reference per var: taking a new snapshot
+ * of a var replaces (and may destroy) the value held by any older
+ * snapshot of the same var in the same thread, so don't hold two at
+ * once.  Replacing a snapshot with a newer one of the same var
+ * (s = v.get()) is fine, and releases nothing.
+ */
+template <typename T>
+class snapshot {
+public:
+    snapshot() noexcept = default;
+    snapshot(const snapshot &) = delete;
+    snapshot &operator=(const snapshot &) = delete;
+
+    snapshot(snapshot &&o) noexcept
+        : vp_(std::exchange(o.vp_, nullptr)),
+          ptr_(std::exchange(o.ptr_, nullptr)),
+          version_(std::exchange(o.version_, 0))
+    {
+    }
+
+    snapshot &
+    operator=(snapshot &&o) noexcept
+    {
+        if (this != &o) {
+            /*
+             * If o is of our var, taking it replaced this thread's
+             * reference to our value with one to o's, so releasing ours
+             * would release o's.
+             */
+            if (o.vp_ != vp_)
+                reset();
+            vp_ = std::exchange(o.vp_, nullptr);
+            ptr_ = std::exchange(o.ptr_, nullptr);
+            version_ = std::exchange(o.version_, 0);
+        }
+        return *this;
+    }
+
+    /*
+     * Aliasing: a snapshot of *ptr, which must live at least as long as
+     * o's value (say, be owned by it), holding o's reference.
+     */
+    template <typename U>
+    snapshot(snapshot<U> &&o, const T *ptr) noexcept
+        : vp_(std::exchange(o.vp_, nullptr)), ptr_(ptr),
+          version_(std::exchange(o.version_, 0))
+    {
+        o.ptr_ = nullptr;
+    }
+
+    ~snapshot() { reset(); }
+
+    /* Release this thread's reference to the value now */
+    void
+    reset() noexcept
+    {
+        if (vp_ != nullptr)
+            thread_safe_var_release(vp_);
+        vp_ = nullptr;
+        ptr_ = nullptr;
+        version_ = 0;
+    }
+
+    const T *get() const noexcept { return ptr_; }
+    const T &operator*() const noexcept { return *ptr_; }
+    const T *operator->() const noexcept { return ptr_; }
+    explicit operator bool() const noexcept { return ptr_ != nullptr; }
+
+    /* Version of the value; 0 if the var had no value */
+    std::uint64_t version() const noexcept { return version_; }
+
+private:
+    template <typename> friend class snapshot;
+    template <typename> friend class var;
+
+    snapshot(thread_safe_var vp, const T *ptr, std::uint64_t version) noexcept
+        : vp_(vp), ptr_(ptr), version_(version)
+    {
+    }
+
+    thread_safe_var vp_ = nullptr;
+    const T *ptr_ = nullptr;
+    std::uint64_t version_ = 0;
+};
+
+/**
+ * A thread-safe variable holding values of type T.
+ *
+ * Errors from the C API are thrown as std::system_error.
+ */
+template <typename T>
+class var {
+public:
+    var()
+    {
+        detail::check(thread_safe_var_init(&vp_, &var::destroy),
+                      "thread_safe_var_init");
+    }
+
+    ~var() { thread_safe_var_destroy(vp_); }
+
+    var(const var &) = delete;
+    var &operator=(const var &) = delete;
+
+    /* Read the current value; the snapshot is empty if there is none */
+    snapshot<T>
+    get() const
+    {
+        void *p;
+        std::uint64_t version;
+
+        detail::check(thread_safe_var_get(vp_, &p, &version),
+                      "thread_safe_var_get");
+        if (p == nullptr)
+            return snapshot<T>();
+        return snapshot<T>(vp_, static_cast<const T *>(p), version);
+    }
+
+    /* Wait for the first value to be set, then read it */
+    snapshot<T>
+    wait() const
+    {
+        detail::check(thread_safe_var_wait(vp_), "thread_safe_var_wait");
+        return get();
+    }
+
+    /* Publish a value, taking ownership of it; returns its version */
+    std::uint64_t
+    set(std::unique_ptr<T> value)
+    {
+        std::uint64_t version;
+
+        if (!value)
+            detail::check(EINVAL, "thread_safe_var_set");
+        detail::check(thread_safe_var_set(vp_, value.get(), &version),
+                      "thread_safe_var_set");
+        value.release();
+        return version;
+    }
+
+    /**
+     * Publish a value only if the current version is the given one (0
+     * meaning no value yet).  Takes ownership of the value and returns
+     * true on success, else leaves it with the caller and returns false.
+     */
+    bool
+    set_if(std::unique_ptr<T> &value, std::uint64_t version,
+           std::uint64_t *new_version = nullptr)
+    {
+        int err;
+
+        if (!value)
+            detail::check(EINVAL, "thread_safe_var_set_if");
+        err = thread_safe_var_set_if(vp_, value.get(), version, new_version);
+        if (err == EAGAIN)
+            return false;
+        detail::check(err, "thread_safe_var_set_if");
+        value.release();
+        return true;
+    }
+
+    /* Construct a T from args and publish it; returns its version */
+    template <typename... Args>
+    std::uint64_t
+    emplace(Args &&...args)
+    {
+        return set(std::make_unique<T>(std::forward<Args>(args)...));
+    }
+
+    /* Current version, or 0 if no value has been set */
+    std::uint64_t
+    version() const noexcept
+    {
+        return thread_safe_var_version(vp_);
+    }
+
+#ifdef TSV_HAVE_COROUTINES
+    /**
+     * co_await var.next_version(after, executor) suspends the calling
+     * coroutine until a version newer than after is published, then
+     * resumes it by calling executor with a callable, and evaluates to
+     * the new version.  The default executor resumes the coroutine on
+     * the publishing thread.
+     */
+    template <typename Executor = inline_executor>
+    detail::next_version_awaiter<Executor>
+    next_version(std::uint64_t after, Executor executor = Executor()) const
+    {
+        return detail::next_version_awaiter<Executor>(vp_, after,
+                                                      std::move(executor));
+    }
+#endif
+
+    thread_safe_var native_handle() const noexcept { return vp_; }
+
+private:
+    static void
+    destroy(void *p)
+    {
+        delete static_cast<T *>(p);
+    }
+
+    thread_safe_var vp_ = nullptr;
+};
+
+/**
+ * A std::atomic<std::shared_ptr<T>> work-alike backed by a TSV.
+ *
+ * load() copies the current shared_ptr from a lock-less TSV read,
+ * rather than taking a lock as libstdc++'s std::atomic<std::shared_ptr<T>>
+ * does, then releases the TSV reference, so like the std one it keeps
+ * nothing alive but the copy.  But the copy increments the reference
+ * count in the control block that every thread loading that pointer
+ * shares, so loads from many threads still contend on its cache line.
+ *
+ * Hot readers should use read() instead: it returns a snapshot of the
+ * pointee that aliases the TSV's reference to the shared_ptr, and
+ * touches no reference count.  The snapshot pins the value until it's
+ * destroyed.  This is where the work-alike differs from the std one:
+ * as with any snapshot, a thread holds at most one per var, so don't
+ * hold one across any other access to the same atomic_shared_ptr
+ * (load(), exchange() and compare_exchange_*() included, as those
+ * release it) in the same thread.  Code that only uses the std
+ * surface is unaffected.
+ *
+ * Writes allocate a small holder for the shared_ptr.  A replaced
+ * shared_ptr may outlive the write that replaced it: the slot-pair
+ * implementation keeps the previous value until the next write.
+ * Memory order arguments are accepted for compatibility; all
+ * operations are at least as strong as std::memory_order_seq_cst.
+ */
+template <typename T>
+class atomic_shared_ptr {
+public:
+    using value_type = std::shared_ptr<T>;
+
+    static constexpr bool is_always_lock_free = false;
+
+    atomic_shared_ptr() = default;
+    atomic_shared_ptr(value_type desired) { store(std::move(desired)); }
+    atomic_shared_ptr(const atomic_shared_ptr &) = delete;
+    atomic_shared_ptr &operator=(const atomic_shared_ptr &) = delete;
+
+    bool is_lock_free() const noexcept { return false; }
+
+    /* Snapshot of the current pointee; empty if it's null */
+    snapshot<T>
+    read() const
+    {
+        snapshot<value_type> s = var_.get();
+        const T *p = s ? s->get() : nullptr;
+
+        return snapshot<T>(std::move(s), p);
+    }
+
+    value_type
+    load(std::memory_order = std::memory_order_seq_cst) const
+    {
+        return current(nullptr);
+    }
+
+    operator value_type() const { return load(); }
+
+    void
+    store(value_type desired, std::memory_order = std::memory_order_seq_cst)
+    {
+        (void) var_.set(std::make_unique<value_type>(std::move(desired)));
+    }
+
+    atomic_shared_ptr &
+    operator=(value_type desired)
+    {
+        store(std::move(desired));
+        return *this;
+    }
+
+    value_type
+    exchange(value_type desired,
+             std::memory_order = std::memory_order_seq_cst)
+    {
+        auto holder = std::make_unique<value_type>(std::move(desired));
+
+        for (;;) {
+            std::uint64_t version;
+            value_type old = current(&version);
+
+            if (var_.set_if(holder, version))
+                return old;
+        }
+    }
+
+    /* Never fails spuriously, so this is the same as the strong version */
+    bool
+    compare_exchange_weak(value_type &expected, value_type desired,
+                          std::memory_order = std::memory_order_seq_cst,
+                          std::memory_order = std::memory_order_seq_cst)
+    {
+        return compare_exchange_strong(expected, std::move(desired));
+    }
+
+    bool
+    compare_exchange_strong(value_type &expected, value_type desired,
+                            std::memory_order = std::memory_order_seq_cst,
+                            std::memory_order = std::memory_order_seq_cst)
+    {
+        std::unique_ptr<value_type> holder;
+
+        for (;;) {
+            std::uint64_t version;
+            value_type cur = current(&version);
+
+            /* Equal means same pointer and shared ownership */
+            if (cur.get() != expected.get() ||
+                cur.owner_before(expected) || expected.owner_before(cur)) {
+                expected = std::move(cur);
+                return false;
+            }
+            if (!holder)
+                holder = std::make_unique<value_type>(std::move(desired));
+            if (var_.set_if(holder, version))
+                return true;
+            /* Lost a race with another writer; look again */
+        }
+    }
+
+private:
+    /* Copy the current shared_ptr; the copy is all that stays alive */
+    value_type
+    current(std::uint64_t *version) const
+    {
+        value_type cur;
+        void *p;
+
+        detail::check(thread_safe_var_get(var_.native_handle(), &p, version),
+                      "thread_safe_var_get");
+        if (p)
+            cur = *static_cast<const value_type *>(p);
+        thread_safe_var_release(var_.native_handle());
+        return cur;
+    }
+
+    var<value_type> var_;
+};
+
+} // namespace tsv
+
+#endif /* THREAD_SAFE_VAR_HPP */
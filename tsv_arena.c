@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Version-scoped arenas for values published through thread_safe_vars.
+ *
+ * An arena is a list of blocks, each TSV_ARENA_BLOCK bytes long and
+ * aligned to that size, starting with a header that points to the
+ * arena's state (which lives in the first block).  Allocations too
+ * large for a block get a block of their own, also aligned, so every
+ * pointer the arena hands out lies within the first TSV_ARENA_BLOCK
+ * bytes of its block.  That lets the TSV value destructor find the
+ * arena from the value (any object in the arena) by masking its
+ * address, so values need no extra header.
+ */
+
+#include <sys/types.h>
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tsv_arena.h"
+
+#define TSV_ARENA_BLOCK     ((size_t)64 * 1024)
+#define TSV_ARENA_ALIGN     16  /* enough for any scalar type */
+
+#define ROUNDUP(n, a)       (((n) + (a) - 1) & ~((size_t)(a) - 1))
+#define BLOCK_OF(p) \
+    ((struct arena_block *)((uintptr_t)(p) & ~(uintptr_t)(TSV_ARENA_BLOCK - 1)))
+
+struct arena_block {
+    struct tsv_arena_s  *arena;
+    struct arena_block  *next;
+};
+
+#define BLOCK_HDR           ROUNDUP(sizeof(struct arena_block), TSV_ARENA_ALIGN)
+
+struct tsv_arena_s {
+    thread_safe_var     vp;
+    struct arena_block  *blocks;        /* first block, which holds this */
+    char                *cur;           /* next free byte of blocks */
+    char                *end;
+};
+
+static struct arena_block *
+block_alloc(struct tsv_arena_s *arena, size_t size)
+{
+    struct arena_block *b;
+
+    if (posix_memalign((void **)&b, TSV_ARENA_BLOCK, size) != 0)
+        return NULL;
+    b->arena = arena;
+    b->next = NULL;
+    return b;
+}
+
+/**
+ * Start building a value to publish on a TSV
+ *
+ * @param [in] vp A TSV initialized with tsv_arena_var_init()
+ * @param [out] ap Pointer to the new arena
+ *
+ * @return Zero on success, else a system error code such as ENOMEM
+ */
+int
+tsv_arena_begin(thread_safe_var vp, tsv_arena *ap)
+{
+    struct arena_block *b;
+    tsv_arena a;
+
+    *ap = NULL;
+    if ((b = block_alloc(NULL, TSV_ARENA_BLOCK)) == NULL)
+        return ENOMEM;
+    a = (tsv_arena)((char *)b + BLOCK_HDR);
+    b->arena = a;
+    a->vp = vp;
+    a->blocks = b;
+    a->cur = (char *)a + ROUNDUP(sizeof(*a), TSV_ARENA_ALIGN);
+    a->end = (char *)b + TSV_ARENA_BLOCK;
+    *ap = a;
+    return 0;
+}
+
+/**
+ * Allocate memory from an arena
+ *
+ * The memory is suitably aligned for any scalar type and lives until
+ * the version published from this arena is destroyed.
+ *
+ * @param [in] a An arena
+ * @param [in] size The number of bytes to allocate
+ *
+ * @return A pointer to the memory, or NULL if out of memory
+ */
+void *
+tsv_arena_alloc(tsv_arena a, size_t size)
+{
+    struct arena_block *b;
+    void *p;
+
+    size = ROUNDUP(size ? size : 1, TSV_ARENA_ALIGN);
+    if (size <= (size_t)(a->end - a->cur)) {
+        p = a->cur;
+        a->cur += size;
+        return p;
+    }
+    if (size > TSV_ARENA_BLOCK - BLOCK_HDR) {
+        /* Give it a block of its own; keep bumping in the current one */
+        if (size > SIZE_MAX - BLOCK_HDR ||
+            (b = block_alloc(a, BLOCK_HDR + size)) == NULL)
+            return NULL;
+        b->next = a->blocks->next;
+        a->blocks->next = b;
+        return (char *)b + BLOCK_HDR;
+    }
+    if ((b = block_alloc(a, TSV_ARENA_BLOCK)) == NULL)
+        return NULL;
+    b->next = a->blocks->next;
+    a->blocks->next = b;
+    a->cur = (char *)b + BLOCK_HDR + size;
+    a->end = (char *)b + TSV_ARENA_BLOCK;
+    return (char *)b + BLOCK_HDR;
+}
+
+/* Allocate zeroed memory for n objects of a given size from an arena */
+void *
+tsv_arena_calloc(tsv_arena a, size_t n, size_t size)
+{
+    void *p;
+
+    if (size != 0 && n > SIZE_MAX / size)
+        return NULL;
+    if ((p = tsv_arena_alloc(a, n * size)) != NULL)
+        memset(p, 0, n * size);
+    return p;
+}
+
+/* Copy a string into an arena */
+char *
+tsv_arena_strdup(tsv_arena a, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *p;
+
+    if ((p = tsv_arena_alloc(a, len)) != NULL)
+        memcpy(p, s, len);
+    return p;
+}
+
+/* Free an arena and everything allocated from it */
+static void
+arena_free(tsv_arena a)
+{
+    struct arena_block *first = a->blocks;
+    struct arena_block *b, *next;
+
+    /* a itself is in the first block, so free that one last */
+    for (b = first->next; b != NULL; b = next) {
+        next = b->next;
+        free(b);
+    }
+    free(first);
+}
+
+/**
+ * Publish a value built in an arena
+ *
+ * On success the arena belongs to the TSV and must no longer be used by
+ * the caller; on failure it remains the caller's, to publish again or
+ * abort.
+ *
+ * @param [in] a An arena
+ * @param [in] root The value to publish, which must have been
+ *                  allocated from a
+ * @param [out] version Pointer (may be NULL) to the new version
+ *
+ * @return Zero on success, EINVAL if root is not from a, else a system
+ *         error code
+ */
+int
+tsv_arena_publish(tsv_arena a, void *root, uint64_t *version)
+{
+    struct arena_block *b;
+
+    /* Don't trust BLOCK_OF() on a pointer that might not be ours */
+    for (b = a->blocks; b != NULL && b != BLOCK_OF(root); b = b->next)
+        ;
+    if (b == NULL || root == NULL)
+        return EINVAL;
+    return thread_safe_var_set(a->vp, root, version);
+}
+
+/* Discard an arena without publishing it */
+void
+tsv_arena_abort(tsv_arena a)
+{
+    if (a != NULL)
+        arena_free(a);
+}
+
+/**
+ * TSV value destructor for values published from arenas
+ *
+ * @param [in] value A value published with tsv_arena_publish()
+ */
+void
+tsv_arena_dtor(void *value)
+{
+    arena_free(BLOCK_OF(value)->arena);
+}
+
+/**
+ * Initialize a TSV for values published from arenas
+ *
+ * @param [out] vp Pointer to the new TSV
+ *
+ * @return Zero on success, else a system error code
+ */
+int
+tsv_arena_var_init(thread_safe_var *vp)
+{
+    return thread_safe_var_init(vp, tsv_arena_dtor);
+}
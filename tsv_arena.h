@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef TSV_ARENA_H
+#define TSV_ARENA_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include "thread_safe_global.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A tsv_arena is a bump allocator for building a value to publish on a
+ * thread_safe_var.
+ *
+ * A writer calls tsv_arena_begin(), allocates the value's whole object
+ * graph (strings, arrays, nested structs) from the arena, then calls
+ * tsv_arena_publish() with the graph's root object.  When the TSV
+ * destroys that version, the whole arena is freed at once, without
+ * walking the graph and without a free() per object.
+ *
+ * The TSV must be initialized with tsv_arena_var_init(), or with
+ * tsv_arena_dtor() as its value destructor, and all values published
+ * on it must come from arenas.
+ */
+typedef struct tsv_arena_s *tsv_arena;
+
+int  tsv_arena_var_init(thread_safe_var *);
+void tsv_arena_dtor(void *);
+
+int  tsv_arena_begin(thread_safe_var, tsv_arena *);
+void *tsv_arena_alloc(tsv_arena, size_t);
+void *tsv_arena_calloc(tsv_arena, size_t, size_t);
+char *tsv_arena_strdup(tsv_arena, const char *);
+int  tsv_arena_publish(tsv_arena, void *, uint64_t *);
+void tsv_arena_abort(tsv_arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TSV_ARENA_H */
@@ -0,0 +1,743 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * A persistent (copy-on-write) B+tree published through a
+ * thread_safe_var.
+ *
+ * Nodes hold up to BT_MAX sorted uint64_t keys.  Leaves pair each key
+ * with a reference counted item holding the value; inner nodes pair
+ * each child with the smallest key in that child's subtree.  Every node
+ * but the root holds at least BT_MIN entries, so all leaves are at the
+ * same, logarithmic, depth.
+ *
+ * The key array comes first in each node and the nodes are cache line
+ * aligned, so that a node's keys occupy exactly two cache lines.  Unused
+ * keys are set to UINT64_MAX so that the in-node search can be a
+ * fixed-length, branch-free loop, which compilers vectorize when the
+ * target has 64-bit vector compares (e.g., -msse4.2 or -mavx2).
+ *
+ * Nodes and items are immutable once published and are reference
+ * counted, so that each version of the tree (a struct tsv_btree_root,
+ * the TSV's value) shares all but the O(log N) nodes that an update
+ * copies.  When the TSV destroys a version its root's reference is
+ * dropped, and with it any nodes and items no longer used by newer
+ * versions.
+ *
+ * Leaves are not linked to their siblings, as that would make every
+ * update copy the whole tree; iterators keep a stack instead.
+ *
+ * Writers are serialized by a mutex, which also keeps the TSV from
+ * combining (and so dropping) tree updates.
+ */
+
+#include <sys/types.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tsv_btree.h"
+#include "thread_safe_global.h"
+#include "atomics.h"
+
+#define BT_MAX          16
+#define BT_MIN          (BT_MAX / 2)
+#define BT_ALIGN        64
+
+struct bt_item {
+    volatile uint32_t   nref;
+    void                *val;
+};
+
+struct bt_node {
+    uint64_t            key[BT_MAX];    /* first, for alignment */
+    void                *ptr[BT_MAX];   /* struct bt_item/bt_node */
+    volatile uint32_t   nref;
+    uint16_t            count;
+    uint16_t            leaf;
+};
+
+/* One version of a tree; this is the TSV's value */
+struct tsv_btree_root {
+    struct bt_node      *node;          /* NULL when empty */
+    size_t              count;          /* number of keys */
+    tsv_btree_dtor_f    val_dtor;       /* copied so it outlives the tree */
+};
+
+struct tsv_btree_s {
+    thread_safe_var     var;
+    pthread_mutex_t     write_lock;     /* one writer at a time */
+    struct tsv_btree_root *root;        /* writer-only; current version */
+    tsv_btree_dtor_f    val_dtor;
+};
+
+/*
+ * Entries being assembled into one or two new nodes.  References to
+ * entries marked own pass to the new nodes; the others gain one.
+ */
+struct bt_scratch {
+    unsigned            n;
+    uint64_t            key[2 * BT_MAX];
+    void                *ptr[2 * BT_MAX];
+    unsigned char       own[2 * BT_MAX];
+};
+
+/* Number of keys in node less than k */
+static unsigned
+key_rank(const struct bt_node *node, uint64_t k)
+{
+    unsigned i, n = 0;
+
+    /* Unused keys are UINT64_MAX, so this needn't stop at node->count */
+    for (i = 0; i < BT_MAX; i++)
+        n += node->key[i] < k;
+    return n;
+}
+
+/* Index of the child of an inner node whose subtree would hold k */
+static unsigned
+child_index(const struct bt_node *node, uint64_t k)
+{
+    unsigned i = key_rank(node, k);
+
+    if (i < node->count && node->key[i] == k)
+        return i;
+    return i ? i - 1 : 0;
+}
+
+static void
+entry_ref(int leaf, void *p)
+{
+    if (leaf)
+        (void) atomic_inc_32_nv(&((struct bt_item *)p)->nref);
+    else
+        (void) atomic_inc_32_nv(&((struct bt_node *)p)->nref);
+}
+
+static void
+item_release(tsv_btree_dtor_f val_dtor, struct bt_item *item)
+{
+    if (atomic_dec_32_nv(&item->nref) > 0)
+        return;
+    if (val_dtor != NULL)
+        val_dtor(item->val);
+    free(item);
+}
+
+static void
+node_release(tsv_btree_dtor_f val_dtor, struct bt_node *node)
+{
+    unsigned i;
+
+    if (node == NULL || atomic_dec_32_nv(&node->nref) > 0)
+        return;
+    for (i = 0; i < node->count; i++) {
+        if (node->leaf)
+            item_release(val_dtor, node->ptr[i]);
+        else
+            node_release(val_dtor, node->ptr[i]);
+    }
+    free(node);
+}
+
+static struct bt_node *
+node_alloc(int leaf)
+{
+    struct bt_node *node;
+    unsigned i;
+
+    if (posix_memalign((void **)&node, BT_ALIGN, sizeof(*node)) != 0)
+        return NULL;
+    for (i = 0; i < BT_MAX; i++) {
+        node->key[i] = UINT64_MAX;
+        node->ptr[i] = NULL;
+    }
+    node->nref = 1;
+    node->count = 0;
+    node->leaf = leaf;
+    return node;
+}
+
+static void
+scratch_add(struct bt_scratch *s, uint64_t key, void *ptr, int own)
+{
+    assert(s->n < 2 * BT_MAX);
+    s->key[s->n] = key;
+    s->ptr[s->n] = ptr;
+    s->own[s->n] = own;
+    s->n++;
+}
+
+/* Add node's entries [from, to) to s */
+static void
+scratch_add_node(struct bt_scratch *s, const struct bt_node *node,
+                 unsigned from, unsigned to)
+{
+    for (; from < to; from++)
+        scratch_add(s, node->key[from], node->ptr[from], 0);
+}
+
+/*
+ * Build one node from s, or two (out[1] non-NULL) if s has more than
+ * BT_MAX entries.  On failure no references are taken or passed.
+ */
+static int
+scratch_build(const struct bt_scratch *s, int leaf, struct bt_node **out)
+{
+    unsigned split = s->n <= BT_MAX ? s->n : (s->n + 1) / 2;
+    unsigned i;
+
+    assert(s->n > 0 && s->n <= 2 * BT_MAX);
+    out[1] = NULL;
+    if ((out[0] = node_alloc(leaf)) == NULL)
+        return ENOMEM;
+    if (split < s->n && (out[1] = node_alloc(leaf)) == NULL) {
+        free(out[0]);
+        out[0] = NULL;
+        return ENOMEM;
+    }
+    for (i = 0; i < s->n; i++) {
+        struct bt_node *node = i < split ? out[0] : out[1];
+
+        if (!s->own[i])
+            entry_ref(leaf, s->ptr[i]);
+        node->key[node->count] = s->key[i];
+        node->ptr[node->count] = s->ptr[i];
+        node->count++;
+    }
+    return 0;
+}
+
+/* Release the references to inner nodes that s would have passed on */
+static void
+scratch_release(tsv_btree_dtor_f val_dtor, const struct bt_scratch *s)
+{
+    unsigned i;
+
+    for (i = 0; i < s->n; i++) {
+        if (s->own[i])
+            node_release(val_dtor, s->ptr[i]);
+    }
+}
+
+/*
+ * Insert key/item into the subtree at node, outputting its replacement
+ * in out[0] and, if it split, its new right sibling in out[1].  On
+ * success the caller's reference to item passes to the new nodes; on
+ * failure it stays with the caller.
+ */
+static int
+bt_insert(tsv_btree_dtor_f val_dtor, const struct bt_node *node,
+          uint64_t key, struct bt_item *item, struct bt_node **out,
+          int *replaced)
+{
+    struct bt_scratch s;
+    struct bt_node *sub[2];
+    unsigned i;
+    int err;
+
+    s.n = 0;
+    if (node->leaf) {
+        i = key_rank(node, key);
+        *replaced = i < node->count && node->key[i] == key;
+        scratch_add_node(&s, node, 0, i);
+        scratch_add(&s, key, item, 1);
+        scratch_add_node(&s, node, i + *replaced, node->count);
+        return scratch_build(&s, 1, out);
+    }
+
+    i = child_index(node, key);
+    if ((err = bt_insert(val_dtor, node->ptr[i], key, item, sub,
+                         replaced)) != 0)
+        return err;
+    scratch_add_node(&s, node, 0, i);
+    scratch_add(&s, sub[0]->key[0], sub[0], 1);
+    if (sub[1] != NULL)
+        scratch_add(&s, sub[1]->key[0], sub[1], 1);
+    scratch_add_node(&s, node, i + 1, node->count);
+    if ((err = scratch_build(&s, 0, out)) != 0) {
+        /* Keep item; release the rest of the new subtrees */
+        entry_ref(1, item);
+        scratch_release(val_dtor, &s);
+    }
+    return err;
+}
+
+/*
+ * Remove key from the subtree at node, outputting its replacement in
+ * *out.  The replacement may have fewer than BT_MIN entries, and is
+ * NULL if it would have none.
+ */
+static int
+bt_remove(tsv_btree_dtor_f val_dtor, const struct bt_node *node,
+          uint64_t key, struct bt_node **out)
+{
+    const struct bt_node *left, *right;
+    struct bt_node *new_nodes[2];
+    struct bt_node *sub;
+    struct bt_scratch s;
+    unsigned i, l;
+    int err;
+
+    *out = NULL;
+    s.n = 0;
+    if (node->leaf) {
+        i = key_rank(node, key);
+        if (i == node->count || node->key[i] != key)
+            return ENOENT;
+        if (node->count == 1)
+            return 0;
+        scratch_add_node(&s, node, 0, i);
+        scratch_add_node(&s, node, i + 1, node->count);
+        if ((err = scratch_build(&s, 1, new_nodes)) != 0)
+            return err;
+        *out = new_nodes[0];
+        return 0;
+    }
+
+    i = child_index(node, key);
+    if ((err = bt_remove(val_dtor, node->ptr[i], key, &sub)) != 0)
+        return err;
+    assert(sub != NULL && sub->count > 0);
+
+    if (sub->count >= BT_MIN) {
+        scratch_add_node(&s, node, 0, i);
+        scratch_add(&s, sub->key[0], sub, 1);
+        scratch_add_node(&s, node, i + 1, node->count);
+    } else {
+        /*
+         * Merge with a sibling, or split the two evenly if together
+         * they'd be too big for one node.
+         */
+        l = i > 0 ? i - 1 : i;
+        left = l == i ? sub : node->ptr[l];
+        right = l == i ? node->ptr[l + 1] : sub;
+        scratch_add_node(&s, left, 0, left->count);
+        scratch_add_node(&s, right, 0, right->count);
+        err = scratch_build(&s, sub->leaf, new_nodes);
+        node_release(val_dtor, sub);
+        if (err != 0)
+            return err;
+
+        s.n = 0;
+        scratch_add_node(&s, node, 0, l);
+        scratch_add(&s, new_nodes[0]->key[0], new_nodes[0], 1);
+        if (new_nodes[1] != NULL)
+            scratch_add(&s, new_nodes[1]->key[0], new_nodes[1], 1);
+        scratch_add_node(&s, node, l + 2, node->count);
+    }
+    if ((err = scratch_build(&s, 0, new_nodes)) != 0) {
+        scratch_release(val_dtor, &s);
+        return err;
+    }
+    assert(new_nodes[1] == NULL);
+    *out = new_nodes[0];
+    return 0;
+}
+
+/* TSV value destructor */
+static void
+root_destroy(void *data)
+{
+    struct tsv_btree_root *root = data;
+
+    node_release(root->val_dtor, root->node);
+    free(root);
+}
+
+/* Publish a new version; the caller holds the write_lock */
+static int
+root_publish(tsv_btree t, struct bt_node *node, size_t count,
+             uint64_t *version)
+{
+    struct tsv_btree_root *root;
+    int err;
+
+    if ((root = malloc(sizeof(*root))) == NULL)
+        return ENOMEM;
+    root->node = node;
+    root->count = count;
+    root->val_dtor = t->val_dtor;
+    if ((err = thread_safe_var_set(t->var, root, version)) != 0) {
+        free(root);
+        return err;
+    }
+    t->root = root;
+    return 0;
+}
+
+/**
+ * Initialize a tsv_btree
+ *
+ * @param [out] tp Pointer to the new tree
+ * @param [in] val_dtor Value destructor (may be NULL)
+ *
+ * @return Returns zero on success, else a system error number
+ */
+int
+tsv_btree_init(tsv_btree *tp, tsv_btree_dtor_f val_dtor)
+{
+    tsv_btree t;
+    int err;
+
+    *tp = NULL;
+    if ((t = calloc(1, sizeof(*t))) == NULL)
+        return errno;
+    t->val_dtor = val_dtor;
+
+    if ((err = pthread_mutex_init(&t->write_lock, NULL)) != 0) {
+        free(t);
+        return err;
+    }
+    if ((err = thread_safe_var_init(&t->var, root_destroy)) != 0) {
+        pthread_mutex_destroy(&t->write_lock);
+        free(t);
+        return err;
+    }
+    /* Start with an empty version so readers needn't special-case it */
+    if ((err = root_publish(t, NULL, 0, NULL)) != 0) {
+        tsv_btree_destroy(t);
+        return err;
+    }
+    *tp = t;
+    return 0;
+}
+
+/**
+ * Destroy a tsv_btree
+ *
+ * It is the caller's responsibility to ensure that no thread is using
+ * this tree and that none will use it again.
+ *
+ * @param [in] t The tree to destroy
+ */
+void
+tsv_btree_destroy(tsv_btree t)
+{
+    if (t == NULL)
+        return;
+    thread_safe_var_destroy(t->var);
+    pthread_mutex_destroy(&t->write_lock);
+    free(t);
+}
+
+/**
+ * Read the current version of a tree
+ *
+ * The snapshot remains valid until this thread reads the tree again or
+ * calls tsv_btree_release().
+ *
+ * @param [in] t A tree
+ * @param [out] snap The current version of the tree
+ * @param [out] version Pointer (may be NULL) to the snapshot's version
+ *
+ * @return Zero on success, a system error code otherwise
+ */
+int
+tsv_btree_read(tsv_btree t, tsv_btree_snapshot *snap, uint64_t *version)
+{
+    void *p;
+    int err;
+
+    *snap = NULL;
+    if ((err = thread_safe_var_get(t->var, &p, version)) != 0)
+        return err;
+    *snap = p;
+    return 0;
+}
+
+/* Release this thread's reference to the version of the tree it read */
+void
+tsv_btree_release(tsv_btree t)
+{
+    thread_safe_var_release(t->var);
+}
+
+/**
+ * Look up a key in a snapshot of a tree
+ *
+ * @param [in] snap A snapshot from tsv_btree_read()
+ * @param [in] key The key to look up
+ * @param [out] val The key's value, valid as long as the snapshot is
+ *
+ * @return Zero on success, ENOENT if the key is not present
+ */
+int
+tsv_btree_lookup(tsv_btree_snapshot snap, uint64_t key, void **val)
+{
+    const struct bt_node *node;
+    unsigned i;
+
+    *val = NULL;
+    if (snap == NULL || (node = snap->node) == NULL)
+        return ENOENT;
+    while (!node->leaf)
+        node = node->ptr[child_index(node, key)];
+    i = key_rank(node, key);
+    if (i == node->count || node->key[i] != key)
+        return ENOENT;
+    *val = ((struct bt_item *)node->ptr[i])->val;
+    return 0;
+}
+
+/**
+ * Find the greatest key less than or equal to a given key in a
+ * snapshot of a tree
+ *
+ * This is the lookup for tables of ranges keyed by their start.
+ *
+ * @param [in] snap A snapshot from tsv_btree_read()
+ * @param [in] key The key to look up
+ * @param [out] found Pointer (may be NULL) to the key found
+ * @param [out] val The found key's value, valid as long as the
+ *                  snapshot is
+ *
+ * @return Zero on success, ENOENT if all keys are greater than key
+ */
+int
+tsv_btree_floor(tsv_btree_snapshot snap, uint64_t key, uint64_t *found,
+                void **val)
+{
+    const struct bt_node *node;
+    unsigned i;
+
+    *val = NULL;
+    if (snap == NULL || (node = snap->node) == NULL)
+        return ENOENT;
+    /* Each child's keys are >= its key, so the floor is in this path */
+    while (!node->leaf)
+        node = node->ptr[child_index(node, key)];
+    i = key_rank(node, key);
+    if (i == node->count || node->key[i] != key) {
+        if (i == 0)
+            return ENOENT;
+        i--;
+    }
+    if (found != NULL)
+        *found = node->key[i];
+    *val = ((struct bt_item *)node->ptr[i])->val;
+    return 0;
+}
+
+/* Number of keys in a snapshot of a tree */
+size_t
+tsv_btree_count(tsv_btree_snapshot snap)
+{
+    return snap ? snap->count : 0;
+}
+
+/**
+ * Start an in-order scan of a snapshot of a tree
+ *
+ * The iterator is valid as long as the snapshot is.
+ *
+ * @param [out] it The iterator
+ * @param [in] snap A snapshot from tsv_btree_read()
+ * @param [in] from The smallest key to return
+ */
+void
+tsv_btree_iter_init(tsv_btree_iter *it, tsv_btree_snapshot snap,
+                    uint64_t from)
+{
+    const struct bt_node *node;
+
+    it->depth = 0;
+    if (snap == NULL || (node = snap->node) == NULL)
+        return;
+    for (;;) {
+        assert(it->depth < TSV_BTREE_MAX_DEPTH);
+        it->node[it->depth] = node;
+        if (node->leaf) {
+            it->idx[it->depth++] = key_rank(node, from);
+            return;
+        }
+        it->idx[it->depth] = child_index(node, from);
+        node = node->ptr[it->idx[it->depth++]];
+    }
+}
+
+/**
+ * Get the next key and value of an in-order scan
+ *
+ * @param [in] it An iterator from tsv_btree_iter_init()
+ * @param [out] key Pointer (may be NULL) to the next key
+ * @param [out] val The next key's value
+ *
+ * @return Zero on success, ENOENT at the end of the scan
+ */
+int
+tsv_btree_iter_next(tsv_btree_iter *it, uint64_t *key, void **val)
+{
+    const struct bt_node *node;
+    unsigned idx;
+
+    *val = NULL;
+    while (it->depth > 0) {
+        node = it->node[it->depth - 1];
+        idx = it->idx[it->depth - 1];
+        if (idx >= node->count) {
+            /* Done with this node; move on to its next sibling */
+            if (--it->depth > 0)
+                it->idx[it->depth - 1]++;
+            continue;
+        }
+        if (node->leaf) {
+            if (key != NULL)
+                *key = node->key[idx];
+            *val = ((struct bt_item *)node->ptr[idx])->val;
+            it->idx[it->depth - 1]++;
+            return 0;
+        }
+        assert(it->depth < TSV_BTREE_MAX_DEPTH);
+        it->node[it->depth] = node->ptr[idx];
+        it->idx[it->depth++] = 0;
+    }
+    return ENOENT;
+}
+
+/**
+ * Add or replace a key in a tree and publish the new version
+ *
+ * The tree takes ownership of val, unless this fails.  A replaced value
+ * is destroyed once no version uses it.
+ *
+ * @param [in] t A tree
+ * @param [in] key The key
+ * @param [in] val The value
+ * @param [out] version Pointer (may be NULL) to the new version
+ *
+ * @return Zero on success, else a system error code such as ENOMEM
+ */
+int
+tsv_btree_put(tsv_btree t, uint64_t key, void *val, uint64_t *version)
+{
+    struct bt_node *out[2];
+    struct bt_node *node;
+    struct bt_item *item;
+    int replaced = 0;
+    int err;
+
+    if ((item = malloc(sizeof(*item))) == NULL)
+        return errno;
+    item->nref = 1;
+    item->val = val;
+
+    if ((err = pthread_mutex_lock(&t->write_lock)) != 0) {
+        free(item);
+        return err;
+    }
+
+    if (t->root->node == NULL) {
+        if ((node = node_alloc(1)) == NULL) {
+            err = ENOMEM;
+        } else {
+            node->key[0] = key;
+            node->ptr[0] = item;
+            node->count = 1;
+        }
+    } else if ((err = bt_insert(t->val_dtor, t->root->node, key, item, out,
+                                &replaced)) == 0) {
+        node = out[0];
+        if (out[1] != NULL) {
+            /* The root split; grow the tree */
+            if ((node = node_alloc(0)) == NULL) {
+                err = ENOMEM;
+                entry_ref(1, item);
+                node_release(t->val_dtor, out[0]);
+                node_release(t->val_dtor, out[1]);
+            } else {
+                node->key[0] = out[0]->key[0];
+                node->ptr[0] = out[0];
+                node->key[1] = out[1]->key[0];
+                node->ptr[1] = out[1];
+                node->count = 2;
+            }
+        }
+    }
+    if (err == 0) {
+        err = root_publish(t, node, t->root->count + !replaced, version);
+        if (err != 0) {
+            /* Give val back to the caller */
+            entry_ref(1, item);
+            node_release(t->val_dtor, node);
+        }
+    }
+
+    (void) pthread_mutex_unlock(&t->write_lock);
+    if (err != 0)
+        free(item);
+    return err;
+}
+
+/**
+ * Remove a key from a tree and publish the new version
+ *
+ * The removed value is destroyed once no version uses it.
+ *
+ * @param [in] t A tree
+ * @param [in] key The key
+ * @param [out] version Pointer (may be NULL) to the new version
+ *
+ * @return Zero on success, ENOENT if the key is not present, else a
+ *         system error code such as ENOMEM
+ */
+int
+tsv_btree_del(tsv_btree t, uint64_t key, uint64_t *version)
+{
+    struct bt_node *node = NULL;
+    struct bt_node *child;
+    int err;
+
+    if ((err = pthread_mutex_lock(&t->write_lock)) != 0)
+        return err;
+
+    if (t->root->node == NULL)
+        err = ENOENT;
+    else
+        err = bt_remove(t->val_dtor, t->root->node, key, &node);
+    if (err == 0 && node != NULL && !node->leaf && node->count == 1) {
+        /* The root has just one child; shrink the tree */
+        child = node->ptr[0];
+        entry_ref(0, child);
+        node_release(t->val_dtor, node);
+        node = child;
+    }
+    if (err == 0 &&
+        (err = root_publish(t, node, t->root->count - 1, version)) != 0)
+        node_release(t->val_dtor, node);
+
+    (void) pthread_mutex_unlock(&t->write_lock);
+    return err;
+}
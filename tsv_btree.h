@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef TSV_BTREE_H
+#define TSV_BTREE_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A tsv_btree is a read-mostly ordered map from uint64_t keys to
+ * values, built on a thread_safe_var.
+ *
+ * Each version of the map is an immutable B+tree with wide,
+ * cache-line-aligned nodes.  Updates copy only the O(log N) nodes on
+ * the path to the changed key, sharing the rest with the previous
+ * version, then publish the new version.  Readers do lock-less lookups,
+ * floor lookups (e.g., for range tables keyed by range start), and
+ * in-order scans against the version they read, which remains valid
+ * until they read the tree again (or call tsv_btree_release()).
+ *
+ * Writes are serialized.
+ */
+typedef struct tsv_btree_s *tsv_btree;
+
+/* A version of a tree, as read by tsv_btree_read() */
+typedef const struct tsv_btree_root *tsv_btree_snapshot;
+
+typedef void (*tsv_btree_dtor_f)(void *);
+
+/* Deeper than any tree of 2^64 keys can be */
+#define TSV_BTREE_MAX_DEPTH 24
+
+/* An in-order cursor over a snapshot; see tsv_btree_iter_init() */
+typedef struct tsv_btree_iter {
+    unsigned    depth;
+    const void  *node[TSV_BTREE_MAX_DEPTH];
+    unsigned    idx[TSV_BTREE_MAX_DEPTH];
+} tsv_btree_iter;
+
+int  tsv_btree_init(tsv_btree *, tsv_btree_dtor_f);
+void tsv_btree_destroy(tsv_btree);
+
+int  tsv_btree_read(tsv_btree, tsv_btree_snapshot *, uint64_t *);
+int  tsv_btree_lookup(tsv_btree_snapshot, uint64_t, void **);
+int  tsv_btree_floor(tsv_btree_snapshot, uint64_t, uint64_t *, void **);
+size_t tsv_btree_count(tsv_btree_snapshot);
+
+void tsv_btree_iter_init(tsv_btree_iter *, tsv_btree_snapshot, uint64_t);
+int  tsv_btree_iter_next(tsv_btree_iter *, uint64_t *, void **);
+
+void tsv_btree_release(tsv_btree);
+
+int  tsv_btree_put(tsv_btree, uint64_t, void *, uint64_t *);
+int  tsv_btree_del(tsv_btree, uint64_t, uint64_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TSV_BTREE_H */
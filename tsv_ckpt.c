@@ -0,0 +1,455 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Checkpoints of a thread_safe_var's value; see tsv_ckpt.h.
+ *
+ * A checkpoint file is a header followed by the encoded value.  The
+ * header has the value's length and a checksum of it, so that a
+ * truncated or otherwise damaged file is rejected rather than decoded.
+ * Files are written to path.tmp, synced, and renamed over path, so
+ * path always has a whole checkpoint, the old one or the new one; then
+ * the directory is synced, so that the rename survives a crash.
+ *
+ * A version that can't be written (say, the disk is full) isn't retried
+ * until a newer one is published, else the checkpointer would spin
+ * re-encoding it.
+ *
+ * The checkpointer's thread waits on a condition variable that a
+ * thread_safe_var_notify() waiter signals.  A waiter can't be
+ * withdrawn, so the waiter and what it touches are allocated together,
+ * apart from the checkpointer, and one still armed when the
+ * checkpointer is destroyed is orphaned, to be freed when (if ever)
+ * it's called.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tsv_ckpt.h"
+#include "atomics.h"
+
+#define CKPT_MAGIC      0x54535643  /* "TSVC" */
+#define CKPT_FORMAT     1
+
+/* 64 bytes, so the value that follows is cache line-aligned */
+struct ckpt_hdr {
+    uint32_t    magic;
+    uint32_t    format;
+    uint64_t    len;        /* of the encoded value that follows */
+    uint64_t    version;    /* the var's version when written */
+    uint64_t    sum;        /* see ckpt_sum() */
+    uint64_t    spare[4];
+};
+
+/* What the waiter touches; see above */
+struct ckpt_wait {
+    struct thread_safe_var_waiter w;    /* first, so waiters are these */
+    pthread_mutex_t     lock;
+    pthread_cond_t      cv;
+    int                 armed;      /* registered */
+    int                 orphaned;   /* armed when the checkpointer went */
+    int                 pending;    /* called, not yet handled */
+    int                 stop;
+};
+
+struct tsv_ckpt_s {
+    thread_safe_var     vp;
+    struct tsv_ckpt_codec codec;
+    char                *path;
+    char                *tmp_path;
+    char                *dir_path;
+    struct ckpt_wait    *wait;
+    pthread_t           thread;
+    volatile uint64_t   version;    /* atomic; version last written */
+    uint64_t            failed;     /* version last failed to write */
+    int                 err;        /* of the last write */
+};
+
+/*
+ * A checksum that takes a word at a time, so that checking a large
+ * checkpoint doesn't cost much of what loading it saves.
+ */
+static uint64_t
+ckpt_sum(const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    uint64_t h = 0xcbf29ce484222325ULL ^ len;
+    uint64_t w;
+
+    for (; len >= sizeof(w); p += sizeof(w), len -= sizeof(w)) {
+        memcpy(&w, p, sizeof(w));
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    while (len-- > 0)
+        h = (h ^ *p++) * 0x100000001b3ULL;
+    return h;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, p, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int
+sync_dir(const char *path)
+{
+    int err = 0;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return errno;
+    /* Some file systems can't sync directories, nor need to */
+    if (fsync(fd) == -1 && errno != EINVAL)
+        err = errno;
+    (void) close(fd);
+    return err;
+}
+
+/* Write a checkpoint of the current version, if it's new */
+static int
+ckpt_write(tsv_ckpt c)
+{
+    struct ckpt_hdr hdr;
+    uint64_t version;
+    void *value;
+    void *buf = NULL;
+    size_t len;
+    int err;
+    int fd;
+
+    if (thread_safe_var_version(c->vp) <= atomic_read_64(&c->version))
+        return 0;
+    if ((err = thread_safe_var_get(c->vp, &value, &version)) != 0) {
+        c->failed = thread_safe_var_version(c->vp);
+        return err;
+    }
+    err = c->codec.encode(value, &buf, &len, c->codec.arg);
+    thread_safe_var_release(c->vp);
+    if (err != 0) {
+        c->failed = version;
+        return err;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = CKPT_MAGIC;
+    hdr.format = CKPT_FORMAT;
+    hdr.len = len;
+    hdr.version = version;
+    hdr.sum = ckpt_sum(buf, len);
+    if ((fd = open(c->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1) {
+        err = errno;
+        free(buf);
+        c->failed = version;
+        return err;
+    }
+    if ((err = write_all(fd, &hdr, sizeof(hdr))) == 0 &&
+        (err = write_all(fd, buf, len)) == 0 && fsync(fd) == -1)
+        err = errno;
+    free(buf);
+    if (close(fd) == -1 && err == 0)
+        err = errno;
+    if (err == 0 && rename(c->tmp_path, c->path) == -1)
+        err = errno;
+    if (err != 0) {
+        (void) unlink(c->tmp_path);
+        c->failed = version;
+        return err;
+    }
+    if ((err = sync_dir(c->dir_path)) != 0) {
+        c->failed = version;
+        return err;
+    }
+    atomic_write_64(&c->version, version);
+    return 0;
+}
+
+static void
+ckpt_notify(struct thread_safe_var_waiter *w, uint64_t version)
+{
+    struct ckpt_wait *cw = (struct ckpt_wait *)w;
+
+    (void) version;
+    (void) pthread_mutex_lock(&cw->lock);
+    cw->armed = 0;
+    if (cw->orphaned) {
+        (void) pthread_mutex_unlock(&cw->lock);
+        (void) pthread_cond_destroy(&cw->cv);
+        (void) pthread_mutex_destroy(&cw->lock);
+        free(cw);
+        return;
+    }
+    cw->pending = 1;
+    (void) pthread_cond_signal(&cw->cv);
+    (void) pthread_mutex_unlock(&cw->lock);
+}
+
+static void *
+ckpt_thread(void *data)
+{
+    tsv_ckpt c = data;
+    struct ckpt_wait *cw = c->wait;
+
+    (void) pthread_mutex_lock(&cw->lock);
+    while (!cw->stop) {
+        if (!cw->pending) {
+            if (!cw->armed) {
+                /* The waiter may be called before notify returns */
+                cw->armed = 1;
+                cw->w.after = atomic_read_64(&c->version);
+                if (cw->w.after < c->failed)
+                    cw->w.after = c->failed;
+                (void) pthread_mutex_unlock(&cw->lock);
+                (void) thread_safe_var_notify(c->vp, &cw->w);
+                (void) pthread_mutex_lock(&cw->lock);
+            } else {
+                (void) pthread_cond_wait(&cw->cv, &cw->lock);
+            }
+            continue;
+        }
+        cw->pending = 0;
+        (void) pthread_mutex_unlock(&cw->lock);
+        c->err = ckpt_write(c);
+        (void) pthread_mutex_lock(&cw->lock);
+    }
+    (void) pthread_mutex_unlock(&cw->lock);
+    return NULL;
+}
+
+static void
+ckpt_free(tsv_ckpt c)
+{
+    free(c->path);
+    free(c->tmp_path);
+    free(c->dir_path);
+    free(c);
+}
+
+/**
+ * Start checkpointing a var
+ *
+ * Versions newer than the current one are written to path.  A version
+ * that can't be written is not retried, but the next one is; the error
+ * is reported by tsv_ckpt_destroy() if no later write succeeds.
+ *
+ * @param [out] cp The new checkpointer
+ * @param [in] vp The var
+ * @param [in] path The checkpoint file (path.tmp is used too)
+ * @param [in] codec The codec (copied) to encode values with
+ *
+ * @return Zero on success, else a system error number
+ */
+int
+tsv_ckpt_create(tsv_ckpt *cp, thread_safe_var vp, const char *path,
+                const struct tsv_ckpt_codec *codec)
+{
+    struct ckpt_wait *cw;
+    tsv_ckpt c;
+    const char *slash = strrchr(path, '/');
+    size_t len = strlen(path);
+    int err;
+
+    *cp = NULL;
+    if (codec == NULL || codec->encode == NULL)
+        return EINVAL;
+    if ((c = calloc(1, sizeof(*c))) == NULL)
+        return ENOMEM;
+    c->vp = vp;
+    c->codec = *codec;
+    c->version = thread_safe_var_version(vp);
+    if ((c->path = strdup(path)) == NULL ||
+        (c->tmp_path = malloc(len + sizeof(".tmp"))) == NULL ||
+        (c->dir_path = slash == NULL ? strdup(".") :
+                       slash == path ? strdup("/") :
+                       strndup(path, slash - path)) == NULL ||
+        (cw = c->wait = calloc(1, sizeof(*cw))) == NULL) {
+        ckpt_free(c);
+        return ENOMEM;
+    }
+    memcpy(c->tmp_path, path, len);
+    memcpy(c->tmp_path + len, ".tmp", sizeof(".tmp"));
+    cw->w.notify = ckpt_notify;
+
+    if ((err = pthread_mutex_init(&cw->lock, NULL)) != 0)
+        goto fail;
+    if ((err = pthread_cond_init(&cw->cv, NULL)) != 0) {
+        (void) pthread_mutex_destroy(&cw->lock);
+        goto fail;
+    }
+    if ((err = pthread_create(&c->thread, NULL, ckpt_thread, c)) != 0) {
+        (void) pthread_cond_destroy(&cw->cv);
+        (void) pthread_mutex_destroy(&cw->lock);
+        goto fail;
+    }
+    *cp = c;
+    return 0;
+
+fail:
+    free(cw);
+    ckpt_free(c);
+    return err;
+}
+
+/**
+ * Stop checkpointing a var, first writing the current version if it
+ * hasn't been written yet
+ *
+ * @param [in] c A checkpointer
+ *
+ * @return Zero if the last checkpoint written (or attempted) was
+ *         written, else a system error number
+ */
+int
+tsv_ckpt_destroy(tsv_ckpt c)
+{
+    struct ckpt_wait *cw;
+    int err;
+
+    if (c == NULL)
+        return 0;
+    cw = c->wait;
+    (void) pthread_mutex_lock(&cw->lock);
+    cw->stop = 1;
+    (void) pthread_cond_signal(&cw->cv);
+    (void) pthread_mutex_unlock(&cw->lock);
+    (void) pthread_join(c->thread, NULL);
+
+    if (thread_safe_var_version(c->vp) > atomic_read_64(&c->version))
+        c->err = ckpt_write(c);
+    err = c->err;
+
+    (void) pthread_mutex_lock(&cw->lock);
+    if (cw->armed) {
+        cw->orphaned = 1;   /* ckpt_notify() will free it */
+        (void) pthread_mutex_unlock(&cw->lock);
+    } else {
+        (void) pthread_mutex_unlock(&cw->lock);
+        (void) pthread_cond_destroy(&cw->cv);
+        (void) pthread_mutex_destroy(&cw->lock);
+        free(cw);
+    }
+    ckpt_free(c);
+    return err;
+}
+
+/**
+ * Get the version of a var last checkpointed
+ *
+ * @param [in] c A checkpointer
+ *
+ * @return The var's version last written to the checkpoint file, or
+ *         the var's version when checkpointing started if none has
+ *         been written since
+ */
+uint64_t
+tsv_ckpt_version(tsv_ckpt c)
+{
+    return atomic_read_64(&c->version);
+}
+
+/**
+ * Set a var's value from a checkpoint
+ *
+ * @param [in] vp A var; normally one with no value yet
+ * @param [in] path The checkpoint file
+ * @param [in] codec The codec to decode the value with; it must have
+ *                   decode and destroy
+ * @param [out] version The var's new version (may be NULL)
+ *
+ * @return Zero on success, ENOENT if there's no checkpoint, EINVAL if
+ *         it's damaged, else a system error number
+ */
+int
+tsv_ckpt_load(thread_safe_var vp, const char *path,
+              const struct tsv_ckpt_codec *codec, uint64_t *version)
+{
+    const struct ckpt_hdr *hdr;
+    struct stat st;
+    void *value = NULL;
+    void *p;
+    int err = 0;
+    int fd;
+
+    if (codec == NULL || codec->decode == NULL || codec->destroy == NULL)
+        return EINVAL;
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return errno;
+    if (fstat(fd, &st) == -1) {
+        err = errno;
+        (void) close(fd);
+        return err;
+    }
+    if ((size_t)st.st_size < sizeof(*hdr)) {
+        (void) close(fd);
+        return EINVAL;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    err = (p == MAP_FAILED) ? errno : 0;
+    (void) close(fd);
+    if (err != 0)
+        return err;
+
+    hdr = p;
+    if (hdr->magic != CKPT_MAGIC || hdr->format != CKPT_FORMAT ||
+        hdr->len != (uint64_t)st.st_size - sizeof(*hdr) ||
+        hdr->sum != ckpt_sum(hdr + 1, hdr->len))
+        err = EINVAL;
+    else
+        err = codec->decode(hdr + 1, hdr->len, &value, codec->arg);
+    (void) munmap(p, st.st_size);
+    if (err != 0)
+        return err;
+    if ((err = thread_safe_var_set(vp, value, version)) != 0)
+        codec->destroy(value, codec->arg);
+    return err;
+}
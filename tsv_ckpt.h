@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TSV_CKPT_H
+#define TSV_CKPT_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include "thread_safe_global.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Checkpoints of a thread_safe_var's value, for fast warm starts.
+ *
+ * A checkpointer (tsv_ckpt_create()) has a thread that, whenever a
+ * newer version of the var is published, serializes it with the codec
+ * and replaces the checkpoint file with it (atomically, by renaming a
+ * new file over it).  Versions published while it's writing are
+ * batched: only the newest is written next.
+ *
+ * At startup, tsv_ckpt_load() maps the last checkpoint, decodes it and
+ * sets it on the (new) var, as version 1, so that readers can be served
+ * the last known good value right away; the value then parsed from the
+ * authoritative source is set as usual.  Start the checkpointer after
+ * loading, so that it doesn't write back what was just loaded.
+ */
+typedef struct tsv_ckpt_s *tsv_ckpt;
+
+/**
+ * A codec.  encode outputs a buffer allocated with malloc(), which the
+ * library frees; decode makes a value for the var from a buffer that
+ * is only valid during the call; destroy destroys a value made by
+ * decode that couldn't be set on the var.  All get arg.
+ */
+struct tsv_ckpt_codec {
+    int     (*encode)(const void *, void **, size_t *, void *);
+    int     (*decode)(const void *, size_t, void **, void *);
+    void    (*destroy)(void *, void *);
+    void    *arg;
+};
+
+int  tsv_ckpt_load(thread_safe_var, const char *, const struct tsv_ckpt_codec *,
+                   uint64_t *);
+
+int  tsv_ckpt_create(tsv_ckpt *, thread_safe_var, const char *,
+                     const struct tsv_ckpt_codec *);
+int  tsv_ckpt_destroy(tsv_ckpt);
+uint64_t tsv_ckpt_version(tsv_ckpt);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TSV_CKPT_H */
@@ -0,0 +1,699 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A persistent (copy-on-write) hash array mapped trie published through
+ * a thread_safe_var.
+ *
+ * Each trie node has a 32-bit bitmap of which of its 32 possible
+ * children are present, indexed by 5 bits of the key's 64-bit hash per
+ * level, and a compact array of just the present children.  Children
+ * are either leaves (key/value pairs) or other nodes.  Keys whose full
+ * hashes are equal go in "collision nodes", which have a zero bitmap
+ * and are searched linearly; they can appear at any depth.
+ *
+ * Nodes and leaves are immutable once published and are reference
+ * counted, so that each version of the map (a struct tsv_map_root, the
+ * TSV's value) shares all but the O(log N) nodes that an update copies.
+ * When the TSV destroys a version its root's reference is dropped, and
+ * with it any nodes and leaves no longer used by newer versions.
+ * Reference counts are atomic because versions may be destroyed by
+ * reader threads while a writer copies nodes that share children.
+ *
+ * Writers are serialized by a mutex, which also keeps the TSV from
+ * combining (and so dropping) map updates.
+ */
+
+#include <sys/types.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "tsv_map.h"
+#include "thread_safe_global.h"
+#include "atomics.h"
+
+#define MAP_BITS        5
+#define MAP_FRAG(h, s)  ((uint32_t)((h) >> (s)) & ((1U << MAP_BITS) - 1))
+
+/* Children are tagged pointers: the low bit is set for leaves */
+#define IS_LEAF(e)      (((uintptr_t)(e)) & 0x1)
+#define TO_LEAF(e)      ((struct map_leaf *)((uintptr_t)(e) & ~(uintptr_t)0x1))
+#define FROM_LEAF(l)    ((void *)((uintptr_t)(l) | 0x1))
+#define TO_NODE(e)      ((struct map_node *)(e))
+
+struct map_ops {
+    tsv_map_hash_f      hash;
+    tsv_map_eq_f        eq;
+    tsv_map_dtor_f      key_dtor;
+    tsv_map_dtor_f      val_dtor;
+};
+
+struct map_leaf {
+    volatile uint32_t   nref;
+    uint64_t            hash;
+    void                *key;
+    void                *val;
+};
+
+struct map_node {
+    volatile uint32_t   nref;
+    uint32_t            bitmap;     /* children present; 0 -> collision */
+    uint32_t            count;      /* number of children */
+    void                *child[1];  /* count tagged children */
+};
+
+/* One version of a map; this is the TSV's value */
+struct tsv_map_root {
+    struct map_node     *node;      /* NULL when empty */
+    size_t              count;      /* number of keys */
+    struct map_ops      ops;        /* copied so it outlives the map */
+};
+
+struct tsv_map_s {
+    thread_safe_var     var;
+    pthread_mutex_t     write_lock; /* one writer at a time */
+    struct tsv_map_root *root;      /* writer-only; current version */
+    struct map_ops      ops;
+};
+
+enum node_copy_how { COPY_REPLACE, COPY_INSERT, COPY_REMOVE };
+
+static uint32_t
+popcount32(uint32_t x)
+{
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    x = (x + (x >> 4)) & 0x0F0F0F0F;
+    return (x * 0x01010101) >> 24;
+}
+
+static struct map_node *
+node_alloc(uint32_t bitmap, uint32_t count)
+{
+    struct map_node *node;
+
+    node = malloc(offsetof(struct map_node, child) +
+                  (count ? count : 1) * sizeof(node->child[0]));
+    if (node == NULL)
+        return NULL;
+    node->nref = 1;
+    node->bitmap = bitmap;
+    node->count = count;
+    return node;
+}
+
+static void
+entry_ref(void *e)
+{
+    if (IS_LEAF(e))
+        (void) atomic_inc_32_nv(&TO_LEAF(e)->nref);
+    else
+        (void) atomic_inc_32_nv(&TO_NODE(e)->nref);
+}
+
+static void
+entry_release(const struct map_ops *ops, void *e)
+{
+    struct map_leaf *leaf;
+    struct map_node *node;
+    uint32_t i;
+
+    if (e == NULL)
+        return;
+    if (IS_LEAF(e)) {
+        leaf = TO_LEAF(e);
+        if (atomic_dec_32_nv(&leaf->nref) > 0)
+            return;
+        if (ops->key_dtor != NULL)
+            ops->key_dtor(leaf->key);
+        if (ops->val_dtor != NULL)
+            ops->val_dtor(leaf->val);
+        free(leaf);
+        return;
+    }
+    node = TO_NODE(e);
+    if (atomic_dec_32_nv(&node->nref) > 0)
+        return;
+    for (i = 0; i < node->count; i++)
+        entry_release(ops, node->child[i]);
+    free(node);
+}
+
+/*
+ * Copy a node, replacing, inserting, or removing the child at idx.  The
+ * caller's reference to e passes to the copy; other children gain one.
+ */
+static struct map_node *
+node_copy(const struct map_node *old, uint32_t bitmap, uint32_t idx,
+          void *e, enum node_copy_how how)
+{
+    struct map_node *node;
+    uint32_t count = old->count;
+    uint32_t i, j;
+
+    if (how == COPY_INSERT)
+        count++;
+    else if (how == COPY_REMOVE)
+        count--;
+    if ((node = node_alloc(bitmap, count)) == NULL)
+        return NULL;
+
+    for (i = j = 0; i < old->count; i++) {
+        if (i == idx) {
+            if (how == COPY_REMOVE)
+                continue;
+            node->child[j++] = e;
+            if (how == COPY_REPLACE)
+                continue;
+        }
+        entry_ref(old->child[i]);
+        node->child[j++] = old->child[i];
+    }
+    if (how == COPY_INSERT && idx == old->count)
+        node->child[j++] = e;
+    assert(j == count);
+    return node;
+}
+
+/* Hash of the keys in a leaf or collision node */
+static uint64_t
+entry_hash(void *e)
+{
+    if (IS_LEAF(e))
+        return TO_LEAF(e)->hash;
+    assert(TO_NODE(e)->bitmap == 0);
+    return TO_LEAF(TO_NODE(e)->child[0])->hash;
+}
+
+/*
+ * Make a subtree holding e (a leaf or collision node) and leaf, whose
+ * hashes differ.  References to both pass to the subtree.
+ */
+static int
+merge(void *e, struct map_leaf *leaf, unsigned shift, struct map_node **out)
+{
+    struct map_node *sub;
+    uint32_t fe = MAP_FRAG(entry_hash(e), shift);
+    uint32_t fl = MAP_FRAG(leaf->hash, shift);
+    int err;
+
+    assert(entry_hash(e) != leaf->hash && shift < 64);
+    if (fe == fl) {
+        if ((err = merge(e, leaf, shift + MAP_BITS, &sub)) != 0)
+            return err;
+        if ((*out = node_alloc(1U << fe, 1)) == NULL) {
+            /* Free sub, but not e and leaf, which are still the caller's */
+            entry_ref(e);
+            entry_ref(FROM_LEAF(leaf));
+            entry_release(NULL, sub);
+            return ENOMEM;
+        }
+        (*out)->child[0] = sub;
+        return 0;
+    }
+    if ((*out = node_alloc((1U << fe) | (1U << fl), 2)) == NULL)
+        return ENOMEM;
+    (*out)->child[fe < fl ? 0 : 1] = e;
+    (*out)->child[fe < fl ? 1 : 0] = FROM_LEAF(leaf);
+    return 0;
+}
+
+/*
+ * Return in *out a copy of node with leaf inserted.  On success the
+ * caller's reference to leaf passes to *out; on failure it stays with
+ * the caller.
+ */
+static int
+node_insert(const struct map_ops *ops, struct map_node *node, unsigned shift,
+            struct map_leaf *leaf, struct map_node **out, int *replaced)
+{
+    struct map_leaf *old;
+    struct map_node *sub = NULL;
+    uint32_t bit, idx, i;
+    void *e;
+    int err;
+
+    *out = NULL;
+    if (node->bitmap == 0) {
+        /* Collision node; all keys here have leaf's hash */
+        for (i = 0; i < node->count; i++) {
+            if (ops->eq(TO_LEAF(node->child[i])->key, leaf->key))
+                break;
+        }
+        *replaced = i < node->count;
+        *out = node_copy(node, 0, i, FROM_LEAF(leaf),
+                         *replaced ? COPY_REPLACE : COPY_INSERT);
+        return *out ? 0 : ENOMEM;
+    }
+
+    bit = 1U << MAP_FRAG(leaf->hash, shift);
+    idx = popcount32(node->bitmap & (bit - 1));
+    if (!(node->bitmap & bit)) {
+        *out = node_copy(node, node->bitmap | bit, idx, FROM_LEAF(leaf),
+                         COPY_INSERT);
+        return *out ? 0 : ENOMEM;
+    }
+
+    e = node->child[idx];
+    if (IS_LEAF(e) && TO_LEAF(e)->hash == leaf->hash) {
+        old = TO_LEAF(e);
+        if (ops->eq(old->key, leaf->key)) {
+            *replaced = 1;
+            *out = node_copy(node, node->bitmap, idx, FROM_LEAF(leaf),
+                             COPY_REPLACE);
+            return *out ? 0 : ENOMEM;
+        }
+        /* Full hash collision */
+        if ((sub = node_alloc(0, 2)) == NULL)
+            return ENOMEM;
+        entry_ref(e);
+        sub->child[0] = e;
+        sub->child[1] = FROM_LEAF(leaf);
+    } else if (IS_LEAF(e) ||
+               (TO_NODE(e)->bitmap == 0 && entry_hash(e) != leaf->hash)) {
+        /* Split a leaf or collision node with a different hash */
+        entry_ref(e);
+        if ((err = merge(e, leaf, shift + MAP_BITS, &sub)) != 0) {
+            entry_release(ops, e);
+            return err;
+        }
+    } else if ((err = node_insert(ops, TO_NODE(e), shift + MAP_BITS,
+                                  leaf, &sub, replaced)) != 0) {
+        return err;
+    }
+
+    if ((*out = node_copy(node, node->bitmap, idx, sub, COPY_REPLACE)) == NULL) {
+        /* Keep leaf; release the rest of sub */
+        entry_ref(FROM_LEAF(leaf));
+        entry_release(ops, sub);
+        return ENOMEM;
+    }
+    return 0;
+}
+
+/*
+ * Return in *out what replaces node once key is removed: a new node, a
+ * leaf or collision node to hoist into the parent, or NULL if nothing
+ * is left.  The root is never hoisted.
+ */
+static int
+node_remove(const struct map_ops *ops, struct map_node *node, unsigned shift,
+            uint64_t hash, const void *key, int is_root, void **out)
+{
+    struct map_leaf *leaf;
+    void *sub = NULL;
+    void *e;
+    uint32_t bit, idx, i;
+    int err;
+
+    *out = NULL;
+    if (node->bitmap == 0) {
+        for (i = 0; i < node->count; i++) {
+            leaf = TO_LEAF(node->child[i]);
+            if (leaf->hash == hash && ops->eq(leaf->key, key))
+                break;
+        }
+        if (i == node->count)
+            return ENOENT;
+        if (node->count == 2) {
+            *out = node->child[1 - i];
+            entry_ref(*out);
+            return 0;
+        }
+        *out = node_copy(node, 0, i, NULL, COPY_REMOVE);
+        return *out ? 0 : ENOMEM;
+    }
+
+    bit = 1U << MAP_FRAG(hash, shift);
+    idx = popcount32(node->bitmap & (bit - 1));
+    if (!(node->bitmap & bit))
+        return ENOENT;
+
+    e = node->child[idx];
+    if (IS_LEAF(e)) {
+        leaf = TO_LEAF(e);
+        if (leaf->hash != hash || !ops->eq(leaf->key, key))
+            return ENOENT;
+    } else if ((err = node_remove(ops, TO_NODE(e), shift + MAP_BITS,
+                                  hash, key, 0, &sub)) != 0) {
+        return err;
+    }
+
+    if (sub == NULL) {
+        if (node->count == 1)
+            return 0; /* Nothing left */
+        if (!is_root && node->count == 2) {
+            e = node->child[1 - idx];
+            if (IS_LEAF(e) || TO_NODE(e)->bitmap == 0) {
+                entry_ref(e);
+                *out = e;
+                return 0;
+            }
+        }
+        *out = node_copy(node, node->bitmap & ~bit, idx, NULL, COPY_REMOVE);
+        return *out ? 0 : ENOMEM;
+    }
+    if (!is_root && node->count == 1 &&
+        (IS_LEAF(sub) || TO_NODE(sub)->bitmap == 0)) {
+        *out = sub;
+        return 0;
+    }
+    if ((*out = node_copy(node, node->bitmap, idx, sub, COPY_REPLACE)) == NULL) {
+        entry_release(ops, sub);
+        return ENOMEM;
+    }
+    return 0;
+}
+
+/* TSV value destructor */
+static void
+root_destroy(void *data)
+{
+    struct tsv_map_root *root = data;
+
+    entry_release(&root->ops, root->node);
+    free(root);
+}
+
+/* Publish a new version; the caller holds the write_lock */
+static int
+root_publish(tsv_map m, struct map_node *node, size_t count,
+             uint64_t *version)
+{
+    struct tsv_map_root *root;
+    int err;
+
+    if ((root = malloc(sizeof(*root))) == NULL)
+        return ENOMEM;
+    root->node = node;
+    root->count = count;
+    root->ops = m->ops;
+    if ((err = thread_safe_var_set(m->var, root, version)) != 0) {
+        free(root);
+        return err;
+    }
+    m->root = root;
+    return 0;
+}
+
+/**
+ * Initialize a tsv_map
+ *
+ * @param [out] mp Pointer to the new map
+ * @param [in] hash Key hash function
+ * @param [in] eq Key equality function (returns non-zero if equal)
+ * @param [in] key_dtor Key destructor (may be NULL)
+ * @param [in] val_dtor Value destructor (may be NULL)
+ *
+ * @return Returns zero on success, else a system error number
+ */
+int
+tsv_map_init(tsv_map *mp, tsv_map_hash_f hash, tsv_map_eq_f eq,
+             tsv_map_dtor_f key_dtor, tsv_map_dtor_f val_dtor)
+{
+    tsv_map m;
+    int err;
+
+    *mp = NULL;
+    if (hash == NULL || eq == NULL)
+        return EINVAL;
+    if ((m = calloc(1, sizeof(*m))) == NULL)
+        return errno;
+    m->ops.hash = hash;
+    m->ops.eq = eq;
+    m->ops.key_dtor = key_dtor;
+    m->ops.val_dtor = val_dtor;
+
+    if ((err = pthread_mutex_init(&m->write_lock, NULL)) != 0) {
+        free(m);
+        return err;
+    }
+    if ((err = thread_safe_var_init(&m->var, root_destroy)) != 0) {
+        pthread_mutex_destroy(&m->write_lock);
+        free(m);
+        return err;
+    }
+    /* Start with an empty version so readers needn't special-case it */
+    if ((err = root_publish(m, NULL, 0, NULL)) != 0) {
+        tsv_map_destroy(m);
+        return err;
+    }
+    *mp = m;
+    return 0;
+}
+
+/**
+ * Destroy a tsv_map
+ *
+ * It is the caller's responsibility to ensure that no thread is using
+ * this map and that none will use it again.
+ *
+ * @param [in] m The map to destroy
+ */
+void
+tsv_map_destroy(tsv_map m)
+{
+    if (m == NULL)
+        return;
+    thread_safe_var_destroy(m->var);
+    pthread_mutex_destroy(&m->write_lock);
+    free(m);
+}
+
+/**
+ * Read the current version of a map
+ *
+ * The snapshot remains valid until this thread reads the map again or
+ * calls tsv_map_release().
+ *
+ * @param [in] m A map
+ * @param [out] snap The current version of the map
+ * @param [out] version Pointer (may be NULL) to the snapshot's version
+ *
+ * @return Zero on success, a system error code otherwise
+ */
+int
+tsv_map_read(tsv_map m, tsv_map_snapshot *snap, uint64_t *version)
+{
+    void *p;
+    int err;
+
+    *snap = NULL;
+    if ((err = thread_safe_var_get(m->var, &p, version)) != 0)
+        return err;
+    *snap = p;
+    return 0;
+}
+
+/**
+ * Look up a key in a snapshot of a map
+ *
+ * @param [in] snap A snapshot from tsv_map_read()
+ * @param [in] key The key to look up
+ * @param [out] val The key's value, valid as long as the snapshot is
+ *
+ * @return Zero on success, ENOENT if the key is not present
+ */
+int
+tsv_map_lookup(tsv_map_snapshot snap, const void *key, void **val)
+{
+    const struct map_node *node;
+    struct map_leaf *leaf;
+    uint64_t hash;
+    uint32_t bit, i;
+    unsigned shift;
+    void *e;
+
+    *val = NULL;
+    if (snap == NULL || snap->node == NULL)
+        return ENOENT;
+
+    hash = snap->ops.hash(key);
+    for (shift = 0, e = snap->node; ; shift += MAP_BITS) {
+        if (IS_LEAF(e)) {
+            leaf = TO_LEAF(e);
+            if (leaf->hash != hash || !snap->ops.eq(leaf->key, key))
+                return ENOENT;
+            *val = leaf->val;
+            return 0;
+        }
+        node = TO_NODE(e);
+        if (node->bitmap == 0) {
+            for (i = 0; i < node->count; i++) {
+                leaf = TO_LEAF(node->child[i]);
+                if (leaf->hash == hash && snap->ops.eq(leaf->key, key)) {
+                    *val = leaf->val;
+                    return 0;
+                }
+            }
+            return ENOENT;
+        }
+        bit = 1U << MAP_FRAG(hash, shift);
+        if (!(node->bitmap & bit))
+            return ENOENT;
+        e = node->child[popcount32(node->bitmap & (bit - 1))];
+    }
+}
+
+/* Number of keys in a snapshot of a map */
+size_t
+tsv_map_count(tsv_map_snapshot snap)
+{
+    return snap ? snap->count : 0;
+}
+
+/**
+ * Look up a key in the current version of a map
+ *
+ * The value remains valid until this thread reads the map again or
+ * calls tsv_map_release().
+ *
+ * @param [in] m A map
+ * @param [in] key The key to look up
+ * @param [out] val The key's value
+ * @param [out] version Pointer (may be NULL) to the version read
+ *
+ * @return Zero on success, ENOENT if the key is not present, else a
+ *         system error code
+ */
+int
+tsv_map_get(tsv_map m, const void *key, void **val, uint64_t *version)
+{
+    tsv_map_snapshot snap;
+    int err;
+
+    *val = NULL;
+    if ((err = tsv_map_read(m, &snap, version)) != 0)
+        return err;
+    return tsv_map_lookup(snap, key, val);
+}
+
+/* Release this thread's reference to the version of the map it read */
+void
+tsv_map_release(tsv_map m)
+{
+    thread_safe_var_release(m->var);
+}
+
+/**
+ * Add or replace a key in a map and publish the new version
+ *
+ * The map takes ownership of key and val, unless this fails.  A
+ * replaced key/value pair is destroyed once no version uses it.
+ *
+ * @param [in] m A map
+ * @param [in] key The key
+ * @param [in] val The value
+ * @param [out] version Pointer (may be NULL) to the new version
+ *
+ * @return Zero on success, else a system error code such as ENOMEM
+ */
+int
+tsv_map_put(tsv_map m, void *key, void *val, uint64_t *version)
+{
+    struct map_leaf *leaf;
+    struct map_node *node;
+    int replaced = 0;
+    int err;
+
+    if ((leaf = malloc(sizeof(*leaf))) == NULL)
+        return errno;
+    leaf->nref = 1;
+    leaf->hash = m->ops.hash(key);
+    leaf->key = key;
+    leaf->val = val;
+
+    if ((err = pthread_mutex_lock(&m->write_lock)) != 0) {
+        free(leaf);
+        return err;
+    }
+
+    if (m->root->node == NULL) {
+        if ((node = node_alloc(1U << MAP_FRAG(leaf->hash, 0), 1)) == NULL)
+            err = ENOMEM;
+        else
+            node->child[0] = FROM_LEAF(leaf);
+    } else {
+        err = node_insert(&m->ops, m->root->node, 0, leaf, &node, &replaced);
+    }
+    if (err == 0) {
+        err = root_publish(m, node, m->root->count + !replaced, version);
+        if (err != 0) {
+            /* Give key and val back to the caller */
+            entry_ref(FROM_LEAF(leaf));
+            entry_release(&m->ops, node);
+        }
+    }
+
+    (void) pthread_mutex_unlock(&m->write_lock);
+    if (err != 0)
+        free(leaf);
+    return err;
+}
+
+/**
+ * Remove a key from a map and publish the new version
+ *
+ * The removed key/value pair is destroyed once no version uses it.
+ *
+ * @param [in] m A map
+ * @param [in] key The key
+ * @param [out] version Pointer (may be NULL) to the new version
+ *
+ * @return Zero on success, ENOENT if the key is not present, else a
+ *         system error code such as ENOMEM
+ */
+int
+tsv_map_del(tsv_map m, const void *key, uint64_t *version)
+{
+    uint64_t hash = m->ops.hash(key);
+    void *node = NULL;
+    int err;
+
+    if ((err = pthread_mutex_lock(&m->write_lock)) != 0)
+        return err;
+
+    if (m->root->node == NULL)
+        err = ENOENT;
+    else
+        err = node_remove(&m->ops, m->root->node, 0, hash, key, 1, &node);
+    if (err == 0) {
+        assert(node == NULL || !IS_LEAF(node));
+        if ((err = root_publish(m, node, m->root->count - 1, version)) != 0)
+            entry_release(&m->ops, node);
+    }
+
+    (void) pthread_mutex_unlock(&m->write_lock);
+    return err;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TSV_MAP_H
+#define TSV_MAP_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A tsv_map is a read-mostly hash map built on a thread_safe_var.
+ *
+ * Each version of the map is an immutable hash array mapped trie
+ * (HAMT).  Updates copy only the O(log N) nodes on the path to the
+ * changed key, sharing the rest with the previous version, then publish
+ * the new version.  Readers do lock-less lookups against the version
+ * they read, which remains valid until they read the map again (or
+ * call tsv_map_release()).  Nodes are reference counted and are
+ * released as the versions that use them are released.
+ *
+ * Writes are serialized.
+ */
+typedef struct tsv_map_s *tsv_map;
+
+/* A version of a map, as read by tsv_map_read() */
+typedef const struct tsv_map_root *tsv_map_snapshot;
+
+typedef uint64_t (*tsv_map_hash_f)(const void *);
+typedef int      (*tsv_map_eq_f)(const void *, const void *);
+typedef void     (*tsv_map_dtor_f)(void *);
+
+int  tsv_map_init(tsv_map *, tsv_map_hash_f, tsv_map_eq_f,
+                  tsv_map_dtor_f, tsv_map_dtor_f);
+void tsv_map_destroy(tsv_map);
+
+int  tsv_map_read(tsv_map, tsv_map_snapshot *, uint64_t *);
+int  tsv_map_lookup(tsv_map_snapshot, const void *, void **);
+size_t tsv_map_count(tsv_map_snapshot);
+
+int  tsv_map_get(tsv_map, const void *, void **, uint64_t *);
+void tsv_map_release(tsv_map);
+
+int  tsv_map_put(tsv_map, void *, void *, uint64_t *);
+int  tsv_map_del(tsv_map, const void *, uint64_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TSV_MAP_H */
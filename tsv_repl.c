@@ -0,0 +1,715 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Replication of a thread_safe_var's values over a Unix domain socket;
+ * see tsv_repl.h.
+ *
+ * The publisher has a thread that polls the listening socket and a
+ * pipe, which a thread_safe_var_notify() waiter writes to when a newer
+ * version is published.  Since the thread then reads whatever version
+ * is current, versions published while it was busy are batched into
+ * one frame.  The thread keeps the encoding it last sent, to diff the
+ * next one against and to bring new subscribers up to date.
+ *
+ * Each frame is a header followed by the encoding, or by a delta from
+ * the encoding of version base.  Both ends are on the same host, so
+ * headers are in host byte order, and CLOCK_MONOTONIC timestamps can be
+ * compared across processes.
+ *
+ * A waiter can't be withdrawn, so one armed when the publisher is
+ * destroyed is orphaned instead, and frees itself if it's ever called.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tsv_repl.h"
+#include "atomics.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL    0
+#endif
+
+#define REPL_MAGIC      0x54535652  /* "TSVR" */
+#define FRAME_FULL      1
+#define FRAME_DELTA     2
+#define REPL_BACKLOG    16
+
+struct frame_hdr {
+    uint32_t    magic;
+    uint32_t    type;       /* FRAME_FULL or FRAME_DELTA */
+    uint64_t    version;    /* the publisher's version */
+    uint64_t    base;       /* for FRAME_DELTA, the version it applies to */
+    uint64_t    nversions;  /* versions published since the last frame */
+    uint64_t    stamp_ns;   /* when the publisher noticed version */
+    uint64_t    len;        /* length of what follows */
+};
+
+enum waker_state {
+    WAKER_IDLE = 0,         /* the publisher thread may arm it */
+    WAKER_ARMED,            /* registered with thread_safe_var_notify() */
+    WAKER_FIRING,           /* being called */
+    WAKER_ORPHANED,         /* armed when the publisher went away */
+};
+
+struct waker {
+    struct thread_safe_var_waiter w;    /* first, so waiters are wakers */
+    int                 fd;             /* the wake pipe's write end */
+    volatile uint64_t   noticed_ns;     /* atomic; when last called */
+    volatile uint32_t   state;          /* atomic; see enum waker_state */
+};
+
+struct peer {
+    int                 fd;
+    uint64_t            have;           /* version the subscriber has */
+};
+
+struct tsv_repl_pub_s {
+    thread_safe_var     vp;
+    struct tsv_repl_codec codec;
+    struct sockaddr_un  addr;
+    int                 listen_fd;
+    int                 wake_fds[2];    /* pipe */
+    struct waker        *waker;
+    pthread_t           thread;
+    volatile uint32_t   stop;           /* atomic */
+    struct peer         *peers;
+    size_t              npeers;
+    size_t              peers_alloc;
+    void                *buf;           /* encoding of version */
+    size_t              len;
+    uint64_t            version;
+    uint64_t            failed;         /* version that failed to encode */
+    pthread_mutex_t     stats_lock;
+    struct tsv_repl_stats stats;
+};
+
+struct tsv_repl_sub_s {
+    thread_safe_var     vp;
+    struct tsv_repl_codec codec;
+    int                 fd;
+    pthread_t           thread;
+    void                *buf;           /* encoding of version */
+    size_t              len;
+    uint64_t            version;
+    pthread_mutex_t     stats_lock;
+    struct tsv_repl_stats stats;
+};
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+send_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = send(fd, p, len, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Returns EPIPE at end of file */
+static int
+recv_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = recv(fd, p, len, 0)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        if (n == 0)
+            return EPIPE;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void
+lag_note(struct tsv_repl_stats *st, uint64_t stamp_ns)
+{
+    uint64_t now = now_ns();
+
+    st->lag_ns = now > stamp_ns ? now - stamp_ns : 0;
+    if (st->lag_ns > st->max_lag_ns)
+        st->max_lag_ns = st->lag_ns;
+}
+
+/* Our thread_safe_var_notify() callback; see enum waker_state */
+static void
+waker_notify(struct thread_safe_var_waiter *w, uint64_t version)
+{
+    struct waker *k = (struct waker *)w;
+    ssize_t junk;
+
+    (void) version;
+    if (atomic_cas_32(&k->state, WAKER_ARMED, WAKER_FIRING) != WAKER_ARMED) {
+        free(k);    /* orphaned */
+        return;
+    }
+    atomic_write_64(&k->noticed_ns, now_ns());
+    junk = write(k->fd, "", 1);   /* the pipe's non-blocking; one will do */
+    (void) junk;
+    atomic_write_32(&k->state, WAKER_IDLE);
+}
+
+static int
+waker_arm(tsv_repl_pub pub)
+{
+    struct waker *k = pub->waker;
+    uint32_t state;
+
+    /* Still armed, or just called and about to be idle */
+    while ((state = atomic_read_32(&k->state)) == WAKER_FIRING)
+        sched_yield();
+    if (state == WAKER_ARMED)
+        return 0;
+    /* Don't retry a version that failed to encode; wait for a newer one */
+    k->w.after = pub->version > pub->failed ? pub->version : pub->failed;
+    k->w.notify = waker_notify;
+    atomic_write_32(&k->state, WAKER_ARMED);
+    return thread_safe_var_notify(pub->vp, &k->w);
+}
+
+static void
+waker_release(struct waker *k)
+{
+    if (atomic_cas_32(&k->state, WAKER_ARMED, WAKER_ORPHANED) == WAKER_ARMED)
+        return;     /* it'll free itself */
+    while (atomic_read_32(&k->state) == WAKER_FIRING)
+        sched_yield();
+    free(k);
+}
+
+static void
+peer_drop(tsv_repl_pub pub, size_t i)
+{
+    (void) close(pub->peers[i].fd);
+    pub->peers[i] = pub->peers[--pub->npeers];
+}
+
+static void
+peers_accept(tsv_repl_pub pub)
+{
+    struct peer *peers;
+    int flags;
+    int fd;
+
+    while ((fd = accept(pub->listen_fd, NULL, NULL)) >= 0) {
+        /* Some systems have accepted sockets inherit O_NONBLOCK */
+        if ((flags = fcntl(fd, F_GETFL)) == -1 ||
+            fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+            (void) close(fd);
+            continue;
+        }
+        if (pub->npeers == pub->peers_alloc) {
+            peers = realloc(pub->peers, (pub->peers_alloc * 2 + 4) *
+                                        sizeof(pub->peers[0]));
+            if (peers == NULL) {
+                (void) close(fd);
+                continue;
+            }
+            pub->peers = peers;
+            pub->peers_alloc = pub->peers_alloc * 2 + 4;
+        }
+        pub->peers[pub->npeers].fd = fd;
+        pub->peers[pub->npeers].have = 0;
+        pub->npeers++;
+    }
+}
+
+static int
+frame_send(int fd, struct frame_hdr *hdr, const void *buf)
+{
+    int err;
+
+    if ((err = send_all(fd, hdr, sizeof(*hdr))) != 0)
+        return err;
+    return send_all(fd, buf, hdr->len);
+}
+
+/*
+ * Encode the current version, if it's new, and bring every subscriber
+ * up to date, with a delta where possible.
+ */
+static void
+pub_send(tsv_repl_pub pub)
+{
+    struct frame_hdr full, delta;
+    void *delta_buf = NULL;
+    void *old_buf = NULL;
+    void *value;
+    uint64_t version;
+    uint64_t stamp;
+    size_t old_len = 0;
+    size_t delta_len = 0;
+    size_t i, ndeltas = 0, nfull = 0, nbytes = 0;
+    uint64_t nversions = 0;
+
+    memset(&full, 0, sizeof(full));
+    memset(&delta, 0, sizeof(delta));
+    if (thread_safe_var_version(pub->vp) > pub->version) {
+        if (thread_safe_var_get(pub->vp, &value, &version) != 0 ||
+            value == NULL) {
+            pub->failed = thread_safe_var_version(pub->vp);
+            return;
+        }
+        old_buf = pub->buf;
+        old_len = pub->len;
+        pub->buf = NULL;
+        if (pub->codec.encode(value, &pub->buf, &pub->len,
+                              pub->codec.arg) != 0) {
+            thread_safe_var_release(pub->vp);
+            pub->buf = old_buf;
+            pub->len = old_len;
+            pub->failed = version;
+            return;
+        }
+        thread_safe_var_release(pub->vp);
+        if (old_buf != NULL && pub->codec.diff != NULL &&
+            pub->codec.diff(old_buf, old_len, pub->buf, pub->len,
+                            &delta_buf, &delta_len, pub->codec.arg) != 0)
+            delta_buf = NULL;
+        nversions = version - pub->version;
+        delta.base = pub->version;
+        pub->version = version;
+    }
+    if (pub->buf == NULL)
+        return;
+
+    stamp = atomic_read_64(&pub->waker->noticed_ns);
+    full.magic = delta.magic = REPL_MAGIC;
+    full.type = FRAME_FULL;
+    delta.type = FRAME_DELTA;
+    full.version = delta.version = pub->version;
+    full.nversions = delta.nversions = nversions;
+    full.stamp_ns = delta.stamp_ns = stamp;
+    full.len = pub->len;
+    delta.len = delta_len;
+
+    for (i = 0; i < pub->npeers; ) {
+        struct peer *p = &pub->peers[i];
+        int err;
+
+        if (p->have == pub->version) {
+            i++;
+            continue;
+        }
+        if (delta_buf != NULL && p->have == delta.base && p->have != 0) {
+            err = frame_send(p->fd, &delta, delta_buf);
+            ndeltas++;
+            nbytes += delta_len;
+        } else {
+            err = frame_send(p->fd, &full, pub->buf);
+            nfull++;
+            nbytes += pub->len;
+        }
+        if (err != 0) {
+            peer_drop(pub, i);
+            continue;
+        }
+        p->have = pub->version;
+        i++;
+    }
+    free(delta_buf);
+    free(old_buf);
+
+    if (ndeltas + nfull == 0 && nversions == 0)
+        return;
+    (void) pthread_mutex_lock(&pub->stats_lock);
+    pub->stats.version = pub->version;
+    pub->stats.versions += nversions;
+    pub->stats.frames += ndeltas + nfull;
+    pub->stats.deltas += ndeltas;
+    pub->stats.bytes += nbytes;
+    if (nversions > 0)
+        lag_note(&pub->stats, stamp);
+    (void) pthread_mutex_unlock(&pub->stats_lock);
+}
+
+static void *
+pub_thread(void *data)
+{
+    tsv_repl_pub pub = data;
+    struct pollfd fds[2];
+    char junk[64];
+
+    fds[0].fd = pub->listen_fd;
+    fds[1].fd = pub->wake_fds[0];
+    fds[0].events = fds[1].events = POLLIN;
+    while (!atomic_read_32(&pub->stop)) {
+        if (waker_arm(pub) != 0)
+            break;
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            while (read(pub->wake_fds[0], junk, sizeof(junk)) > 0)
+                ;
+        }
+        if (atomic_read_32(&pub->stop))
+            break;
+        if (fds[0].revents & POLLIN)
+            peers_accept(pub);
+        pub_send(pub);
+    }
+    return NULL;
+}
+
+static int
+set_nonblock(int fd)
+{
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL)) == -1 ||
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        return errno;
+    return 0;
+}
+
+static int
+addr_init(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+        return ENAMETOOLONG;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/**
+ * Start publishing a var's values on a Unix domain socket
+ *
+ * Any socket already at path is replaced.
+ *
+ * @param [out] pubp The new publisher
+ * @param [in] vp The var to publish
+ * @param [in] path The path to listen on
+ * @param [in] codec The codec (copied) to encode values with
+ *
+ * @return Zero on success, else a system error number
+ */
+int
+tsv_repl_pub_create(tsv_repl_pub *pubp, thread_safe_var vp,
+                    const char *path, const struct tsv_repl_codec *codec)
+{
+    tsv_repl_pub pub;
+    int err;
+
+    *pubp = NULL;
+    if (codec == NULL || codec->encode == NULL)
+        return EINVAL;
+    if ((pub = calloc(1, sizeof(*pub))) == NULL)
+        return ENOMEM;
+    pub->vp = vp;
+    pub->codec = *codec;
+    pub->listen_fd = pub->wake_fds[0] = pub->wake_fds[1] = -1;
+    if ((err = addr_init(&pub->addr, path)) != 0)
+        goto fail;
+    if ((pub->waker = calloc(1, sizeof(*pub->waker))) == NULL) {
+        err = ENOMEM;
+        goto fail;
+    }
+    if (pipe(pub->wake_fds) == -1 ||
+        (pub->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        err = errno;
+        goto fail;
+    }
+    pub->waker->fd = pub->wake_fds[1];
+    if ((err = set_nonblock(pub->wake_fds[0])) != 0 ||
+        (err = set_nonblock(pub->wake_fds[1])) != 0 ||
+        (err = set_nonblock(pub->listen_fd)) != 0)
+        goto fail;
+    (void) unlink(path);
+    if (bind(pub->listen_fd, (struct sockaddr *)&pub->addr,
+             sizeof(pub->addr)) == -1 ||
+        listen(pub->listen_fd, REPL_BACKLOG) == -1) {
+        err = errno;
+        goto fail;
+    }
+    if ((err = pthread_mutex_init(&pub->stats_lock, NULL)) != 0)
+        goto fail;
+    if ((err = pthread_create(&pub->thread, NULL, pub_thread, pub)) != 0) {
+        (void) pthread_mutex_destroy(&pub->stats_lock);
+        goto fail;
+    }
+    *pubp = pub;
+    return 0;
+
+fail:
+    if (pub->listen_fd != -1) {
+        (void) close(pub->listen_fd);
+        (void) unlink(path);
+    }
+    if (pub->wake_fds[0] != -1) {
+        (void) close(pub->wake_fds[0]);
+        (void) close(pub->wake_fds[1]);
+    }
+    free(pub->waker);
+    free(pub);
+    return err;
+}
+
+/**
+ * Stop publishing, disconnect subscribers and remove the socket
+ *
+ * @param [in] pub A publisher
+ */
+void
+tsv_repl_pub_destroy(tsv_repl_pub pub)
+{
+    ssize_t junk;
+
+    if (pub == NULL)
+        return;
+    atomic_write_32(&pub->stop, 1);
+    junk = write(pub->wake_fds[1], "", 1);
+    (void) junk;
+    (void) pthread_join(pub->thread, NULL);
+    waker_release(pub->waker);
+
+    while (pub->npeers > 0)
+        peer_drop(pub, pub->npeers - 1);
+    (void) close(pub->listen_fd);
+    (void) unlink(pub->addr.sun_path);
+    (void) close(pub->wake_fds[0]);
+    (void) close(pub->wake_fds[1]);
+    (void) pthread_mutex_destroy(&pub->stats_lock);
+    free(pub->peers);
+    free(pub->buf);
+    free(pub);
+}
+
+/**
+ * Get a publisher's statistics
+ *
+ * @param [in] pub A publisher
+ * @param [out] st Its statistics
+ */
+void
+tsv_repl_pub_stats(tsv_repl_pub pub, struct tsv_repl_stats *st)
+{
+    (void) pthread_mutex_lock(&pub->stats_lock);
+    *st = pub->stats;
+    (void) pthread_mutex_unlock(&pub->stats_lock);
+}
+
+/* Receive and apply one frame */
+static int
+sub_apply(tsv_repl_sub sub)
+{
+    struct frame_hdr hdr;
+    void *payload;
+    void *buf = NULL;
+    void *value = NULL;
+    size_t len;
+    int err;
+
+    if ((err = recv_all(sub->fd, &hdr, sizeof(hdr))) != 0)
+        return err;
+    if (hdr.magic != REPL_MAGIC ||
+        (hdr.type != FRAME_FULL && hdr.type != FRAME_DELTA) ||
+        (hdr.type == FRAME_DELTA &&
+         (sub->codec.patch == NULL || hdr.base != sub->version)))
+        return EPROTO;
+    if ((payload = malloc(hdr.len ? hdr.len : 1)) == NULL)
+        return ENOMEM;
+    if ((err = recv_all(sub->fd, payload, hdr.len)) != 0) {
+        free(payload);
+        return err;
+    }
+
+    if (hdr.type == FRAME_FULL) {
+        buf = payload;
+        len = hdr.len;
+    } else {
+        err = sub->codec.patch(sub->buf, sub->len, payload, hdr.len,
+                               &buf, &len, sub->codec.arg);
+        free(payload);
+        if (err != 0)
+            return err;
+    }
+    if ((err = sub->codec.decode(buf, len, &value, sub->codec.arg)) != 0) {
+        free(buf);
+        return err;
+    }
+    if ((err = thread_safe_var_set(sub->vp, value, NULL)) != 0) {
+        sub->codec.destroy(value, sub->codec.arg);
+        free(buf);
+        return err;
+    }
+    free(sub->buf);
+    sub->buf = buf;
+    sub->len = len;
+    sub->version = hdr.version;
+
+    (void) pthread_mutex_lock(&sub->stats_lock);
+    sub->stats.version = hdr.version;
+    sub->stats.versions += hdr.nversions;
+    sub->stats.frames++;
+    if (hdr.type == FRAME_DELTA)
+        sub->stats.deltas++;
+    sub->stats.bytes += hdr.len;
+    if (hdr.nversions > 0)  /* not catching up */
+        lag_note(&sub->stats, hdr.stamp_ns);
+    (void) pthread_mutex_unlock(&sub->stats_lock);
+    return 0;
+}
+
+static void *
+sub_thread(void *data)
+{
+    tsv_repl_sub sub = data;
+    int err;
+
+    while ((err = sub_apply(sub)) == 0)
+        ;
+    (void) pthread_mutex_lock(&sub->stats_lock);
+    sub->stats.err = err;
+    (void) pthread_mutex_unlock(&sub->stats_lock);
+    return NULL;
+}
+
+/**
+ * Start replicating a publisher's values onto a local var
+ *
+ * @param [out] subp The new subscriber
+ * @param [in] vp The var to set values on
+ * @param [in] path The publisher's socket path
+ * @param [in] codec The codec (copied) to decode values with; it must
+ *                   have decode and destroy
+ *
+ * @return Zero on success, else a system error number (e.g., ENOENT or
+ *         ECONNREFUSED if there's no publisher)
+ */
+int
+tsv_repl_sub_create(tsv_repl_sub *subp, thread_safe_var vp,
+                    const char *path, const struct tsv_repl_codec *codec)
+{
+    struct sockaddr_un addr;
+    tsv_repl_sub sub;
+    int err;
+
+    *subp = NULL;
+    if (codec == NULL || codec->decode == NULL || codec->destroy == NULL)
+        return EINVAL;
+    if ((err = addr_init(&addr, path)) != 0)
+        return err;
+    if ((sub = calloc(1, sizeof(*sub))) == NULL)
+        return ENOMEM;
+    sub->vp = vp;
+    sub->codec = *codec;
+    if ((sub->fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        err = errno;
+        free(sub);
+        return err;
+    }
+    if (connect(sub->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        err = errno;
+    else if ((err = pthread_mutex_init(&sub->stats_lock, NULL)) == 0 &&
+             (err = pthread_create(&sub->thread, NULL, sub_thread,
+                                   sub)) != 0)
+        (void) pthread_mutex_destroy(&sub->stats_lock);
+    if (err != 0) {
+        (void) close(sub->fd);
+        free(sub);
+        return err;
+    }
+    *subp = sub;
+    return 0;
+}
+
+/**
+ * Stop replicating and disconnect
+ *
+ * Values already set on the var remain.
+ *
+ * @param [in] sub A subscriber
+ */
+void
+tsv_repl_sub_destroy(tsv_repl_sub sub)
+{
+    if (sub == NULL)
+        return;
+    (void) shutdown(sub->fd, SHUT_RDWR);
+    (void) pthread_join(sub->thread, NULL);
+    (void) close(sub->fd);
+    (void) pthread_mutex_destroy(&sub->stats_lock);
+    free(sub->buf);
+    free(sub);
+}
+
+/**
+ * Get a subscriber's statistics
+ *
+ * @param [in] sub A subscriber
+ * @param [out] st Its statistics
+ */
+void
+tsv_repl_sub_stats(tsv_repl_sub sub, struct tsv_repl_stats *st)
+{
+    (void) pthread_mutex_lock(&sub->stats_lock);
+    *st = sub->stats;
+    (void) pthread_mutex_unlock(&sub->stats_lock);
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TSV_REPL_H
+#define TSV_REPL_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include "thread_safe_global.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Replication of a thread_safe_var's values to other processes on the
+ * same host, over a Unix domain socket.
+ *
+ * A publisher (tsv_repl_pub_create()) listens on a socket path and
+ * watches a var.  For each new version it encodes the value with the
+ * codec, and sends it to all connected subscribers.  If the codec has
+ * a diff function, subscribers that already have the previous version
+ * get only a delta from its encoding.  Versions published faster than
+ * they can be sent are batched: only the newest is sent, standing for
+ * all of them.
+ *
+ * A subscriber (tsv_repl_sub_create()) connects to the path, decodes
+ * what it receives (applying deltas to the previous encoding), and sets
+ * the decoded values on a local var with thread_safe_var_set().  Its
+ * versions are its own; the publisher's are in its statistics.
+ *
+ * Publishers send with blocking writes, so a subscriber that stops
+ * reading stalls replication to all of them.
+ */
+typedef struct tsv_repl_pub_s *tsv_repl_pub;
+typedef struct tsv_repl_sub_s *tsv_repl_sub;
+
+/**
+ * A codec.  Buffers output by encode, diff and patch must be allocated
+ * with malloc(); the library frees them.  All get arg.
+ *
+ * encode:  serialize a value (called by the publisher)
+ * decode:  make a value for the subscriber's var from a serialization
+ * destroy: destroy a value made by decode that couldn't be set on the
+ *          subscriber's var (usually what the var's destructor does)
+ * diff:    optional; make a delta from the previous serialization to
+ *          the next (called by the publisher)
+ * patch:   needed with diff; apply a delta to the previous serialization
+ *          to get the next one (called by subscribers)
+ */
+struct tsv_repl_codec {
+    int     (*encode)(const void *, void **, size_t *, void *);
+    int     (*decode)(const void *, size_t, void **, void *);
+    void    (*destroy)(void *, void *);
+    int     (*diff)(const void *, size_t, const void *, size_t,
+                    void **, size_t *, void *);
+    int     (*patch)(const void *, size_t, const void *, size_t,
+                     void **, size_t *, void *);
+    void    *arg;
+};
+
+/**
+ * Replication statistics, from tsv_repl_pub_stats() and
+ * tsv_repl_sub_stats():
+ *
+ * version:   the publisher's version last sent or applied
+ * versions:  versions sent or applied (counting those batched together)
+ * frames:    values sent or received, full or delta
+ * deltas:    of which deltas
+ * bytes:     encoded bytes sent or received
+ * lag_ns:    time from the publisher noticing a version to its being
+ *            sent to every subscriber (publisher), or set on the local
+ *            var (subscriber), for the last version and the worst one
+ * err:       for subscribers, the error that ended replication (EPIPE
+ *            if the publisher went away), else zero
+ */
+struct tsv_repl_stats {
+    uint64_t    version;
+    uint64_t    versions;
+    uint64_t    frames;
+    uint64_t    deltas;
+    uint64_t    bytes;
+    uint64_t    lag_ns;
+    uint64_t    max_lag_ns;
+    int         err;
+};
+
+int  tsv_repl_pub_create(tsv_repl_pub *, thread_safe_var, const char *,
+                         const struct tsv_repl_codec *);
+void tsv_repl_pub_destroy(tsv_repl_pub);
+void tsv_repl_pub_stats(tsv_repl_pub, struct tsv_repl_stats *);
+
+int  tsv_repl_sub_create(tsv_repl_sub *, thread_safe_var, const char *,
+                         const struct tsv_repl_codec *);
+void tsv_repl_sub_destroy(tsv_repl_sub);
+void tsv_repl_sub_stats(tsv_repl_sub, struct tsv_repl_stats *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TSV_REPL_H */
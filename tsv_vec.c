@@ -0,0 +1,627 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * A persistent (copy-on-write) chunked array published through a
+ * thread_safe_var.
+ *
+ * Each version (a struct tsv_vec_root, the TSV's value) has a table of
+ * pointers to chunks of TSV_VEC_CHUNK elements.  Chunks are immutable
+ * once published and are reference counted, so versions share all the
+ * chunks that weren't changed between them.  Each element's value is
+ * held by a reference counted item, as an element may be in several
+ * chunks (copies of each other), and must be destroyed only when the
+ * last one goes.  Chunks also keep the values themselves in an array,
+ * so that readers index a chunk without chasing item pointers.
+ *
+ * Writes happen in batches (single-element writes are batches of one).
+ * A batch copies the current table, then copies each chunk it changes
+ * the first time it changes it; chunks created by the batch are tagged
+ * with its generation number and are changed in place.  Committing the
+ * batch publishes its table.
+ *
+ * Writers are serialized by a mutex, held from the start of a batch
+ * until it's committed or aborted, which also keeps the TSV from
+ * combining (and so dropping) updates.
+ */
+
+#include <sys/types.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tsv_vec.h"
+#include "thread_safe_global.h"
+#include "atomics.h"
+
+struct vec_item {
+    volatile uint32_t   nref;
+    void                *val;
+};
+
+struct vec_chunk {
+    volatile uint32_t   nref;
+    uint32_t            count;          /* elements in use */
+    uint64_t            gen;            /* batch that created this chunk */
+    void                *val[TSV_VEC_CHUNK];
+    struct vec_item     *item[TSV_VEC_CHUNK];
+};
+
+/* One version of an array; this is the TSV's value */
+struct tsv_vec_root {
+    size_t              size;           /* number of elements */
+    size_t              nchunks;
+    struct vec_chunk    **chunk;
+    tsv_vec_dtor_f      dtor;           /* copied so it outlives the array */
+};
+
+struct tsv_vec_batch_s {
+    tsv_vec             v;
+    struct tsv_vec_root *root;          /* being built */
+    size_t              cap;            /* size of root->chunk[] */
+};
+
+struct tsv_vec_s {
+    thread_safe_var     var;
+    pthread_mutex_t     write_lock;     /* held by the open batch */
+    struct tsv_vec_root *root;          /* writer-only; current version */
+    struct tsv_vec_batch_s batch;       /* there's only one at a time */
+    uint64_t            gen;            /* batch generation */
+    tsv_vec_dtor_f      dtor;
+};
+
+static void
+item_release(tsv_vec_dtor_f dtor, struct vec_item *item)
+{
+    if (atomic_dec_32_nv(&item->nref) > 0)
+        return;
+    /* NULL values are also how a failed tsv_vec_set() keeps its value */
+    if (dtor != NULL && item->val != NULL)
+        dtor(item->val);
+    free(item);
+}
+
+static void
+chunk_release(tsv_vec_dtor_f dtor, struct vec_chunk *c)
+{
+    uint32_t i;
+
+    if (atomic_dec_32_nv(&c->nref) > 0)
+        return;
+    for (i = 0; i < c->count; i++)
+        item_release(dtor, c->item[i]);
+    free(c);
+}
+
+/* TSV value destructor */
+static void
+root_destroy(void *data)
+{
+    struct tsv_vec_root *root = data;
+    size_t i;
+
+    for (i = 0; i < root->nchunks; i++)
+        chunk_release(root->dtor, root->chunk[i]);
+    free(root->chunk);
+    free(root);
+}
+
+static struct vec_chunk *
+chunk_alloc(uint64_t gen)
+{
+    struct vec_chunk *c;
+
+    if ((c = malloc(sizeof(*c))) == NULL)
+        return NULL;
+    c->nref = 1;
+    c->count = 0;
+    c->gen = gen;
+    return c;
+}
+
+/* Return a chunk of the batch's that it may change in place */
+static struct vec_chunk *
+batch_chunk(tsv_vec_batch b, size_t ci)
+{
+    struct vec_chunk *old = b->root->chunk[ci];
+    struct vec_chunk *c;
+    uint32_t i;
+
+    if (old->gen == b->v->gen)
+        return old;
+    if ((c = chunk_alloc(b->v->gen)) == NULL)
+        return NULL;
+    c->count = old->count;
+    for (i = 0; i < c->count; i++) {
+        c->val[i] = old->val[i];
+        c->item[i] = old->item[i];
+        (void) atomic_inc_32_nv(&c->item[i]->nref);
+    }
+    chunk_release(b->v->dtor, old);
+    b->root->chunk[ci] = c;
+    return c;
+}
+
+static struct vec_item *
+item_alloc(void *val)
+{
+    struct vec_item *item;
+
+    if ((item = malloc(sizeof(*item))) == NULL)
+        return NULL;
+    item->nref = 1;
+    item->val = val;
+    return item;
+}
+
+static int
+batch_set(tsv_vec_batch b, size_t i, void *val, struct vec_item **itemp)
+{
+    struct vec_chunk *c;
+    struct vec_item *old;
+
+    if (i >= b->root->size)
+        return ERANGE;
+    if ((*itemp = item_alloc(val)) == NULL)
+        return ENOMEM;
+    if ((c = batch_chunk(b, i / TSV_VEC_CHUNK)) == NULL) {
+        free(*itemp);
+        return ENOMEM;
+    }
+    i %= TSV_VEC_CHUNK;
+    old = c->item[i];
+    c->item[i] = *itemp;
+    c->val[i] = val;
+    item_release(b->v->dtor, old);
+    return 0;
+}
+
+static int
+batch_push(tsv_vec_batch b, void *val, struct vec_item **itemp)
+{
+    struct tsv_vec_root *root = b->root;
+    struct vec_chunk **table;
+    struct vec_chunk *c;
+    size_t ci = root->size / TSV_VEC_CHUNK;
+
+    if ((*itemp = item_alloc(val)) == NULL)
+        return ENOMEM;
+    if (ci == root->nchunks) {
+        if (root->nchunks == b->cap) {
+            table = realloc(root->chunk, 2 * b->cap * sizeof(table[0]));
+            if (table == NULL) {
+                free(*itemp);
+                return ENOMEM;
+            }
+            root->chunk = table;
+            b->cap *= 2;
+        }
+        if ((c = chunk_alloc(b->v->gen)) == NULL) {
+            free(*itemp);
+            return ENOMEM;
+        }
+        root->chunk[root->nchunks++] = c;
+    } else if ((c = batch_chunk(b, ci)) == NULL) {
+        free(*itemp);
+        return ENOMEM;
+    }
+    assert(c->count == root->size % TSV_VEC_CHUNK);
+    c->val[c->count] = val;
+    c->item[c->count] = *itemp;
+    c->count++;
+    root->size++;
+    return 0;
+}
+
+/**
+ * Initialize a tsv_vec
+ *
+ * @param [out] vp Pointer to the new array
+ * @param [in] dtor Value destructor (may be NULL)
+ *
+ * @return Returns zero on success, else a system error number
+ */
+int
+tsv_vec_init(tsv_vec *vp, tsv_vec_dtor_f dtor)
+{
+    tsv_vec_batch b;
+    tsv_vec v;
+    int err;
+
+    *vp = NULL;
+    if ((v = calloc(1, sizeof(*v))) == NULL)
+        return errno;
+    v->dtor = dtor;
+
+    if ((err = pthread_mutex_init(&v->write_lock, NULL)) != 0) {
+        free(v);
+        return err;
+    }
+    if ((err = thread_safe_var_init(&v->var, root_destroy)) != 0) {
+        pthread_mutex_destroy(&v->write_lock);
+        free(v);
+        return err;
+    }
+    /* Start with an empty version so readers needn't special-case it */
+    if ((err = tsv_vec_batch_begin(v, &b)) != 0 ||
+        (err = tsv_vec_batch_commit(b, NULL)) != 0) {
+        tsv_vec_destroy(v);
+        return err;
+    }
+    *vp = v;
+    return 0;
+}
+
+/**
+ * Destroy a tsv_vec
+ *
+ * It is the caller's responsibility to ensure that no thread is using
+ * this array and that none will use it again.
+ *
+ * @param [in] v The array to destroy
+ */
+void
+tsv_vec_destroy(tsv_vec v)
+{
+    if (v == NULL)
+        return;
+    thread_safe_var_destroy(v->var);
+    pthread_mutex_destroy(&v->write_lock);
+    free(v);
+}
+
+/**
+ * Read the current version of an array
+ *
+ * The snapshot remains valid until this thread reads the array again or
+ * calls tsv_vec_release().
+ *
+ * @param [in] v An array
+ * @param [out] snap The current version of the array
+ * @param [out] version Pointer (may be NULL) to the snapshot's version
+ *
+ * @return Zero on success, a system error code otherwise
+ */
+int
+tsv_vec_read(tsv_vec v, tsv_vec_snapshot *snap, uint64_t *version)
+{
+    void *p;
+    int err;
+
+    *snap = NULL;
+    if ((err = thread_safe_var_get(v->var, &p, version)) != 0)
+        return err;
+    *snap = p;
+    return 0;
+}
+
+/**
+ * Get an element of a snapshot of an array
+ *
+ * @param [in] snap A snapshot from tsv_vec_read()
+ * @param [in] i The element's index
+ * @param [out] val The element's value, valid as long as the snapshot is
+ *
+ * @return Zero on success, ERANGE if i is out of range
+ */
+int
+tsv_vec_at(tsv_vec_snapshot snap, size_t i, void **val)
+{
+    if (snap == NULL || i >= snap->size) {
+        *val = NULL;
+        return ERANGE;
+    }
+    *val = snap->chunk[i / TSV_VEC_CHUNK]->val[i % TSV_VEC_CHUNK];
+    return 0;
+}
+
+/* Number of elements in a snapshot of an array */
+size_t
+tsv_vec_size(tsv_vec_snapshot snap)
+{
+    return snap ? snap->size : 0;
+}
+
+/* Release this thread's reference to the version of the array it read */
+void
+tsv_vec_release(tsv_vec v)
+{
+    thread_safe_var_release(v->var);
+}
+
+/**
+ * Start a batch of changes to an array
+ *
+ * The batch starts from the current version of the array.  Other
+ * writers block until the batch is committed or aborted.
+ *
+ * @param [in] v An array
+ * @param [out] bp Pointer to the batch
+ *
+ * @return Zero on success, else a system error code such as ENOMEM
+ */
+int
+tsv_vec_batch_begin(tsv_vec v, tsv_vec_batch *bp)
+{
+    struct tsv_vec_root *root;
+    tsv_vec_batch b = &v->batch;
+    size_t i;
+    int err;
+
+    *bp = NULL;
+    if ((err = pthread_mutex_lock(&v->write_lock)) != 0)
+        return err;
+
+    b->v = v;
+    b->cap = v->root && v->root->nchunks ? v->root->nchunks : 1;
+    if ((root = calloc(1, sizeof(*root))) == NULL ||
+        (root->chunk = calloc(b->cap, sizeof(root->chunk[0]))) == NULL) {
+        free(root);
+        (void) pthread_mutex_unlock(&v->write_lock);
+        return ENOMEM;
+    }
+    root->dtor = v->dtor;
+    if (v->root != NULL) {
+        root->size = v->root->size;
+        root->nchunks = v->root->nchunks;
+        for (i = 0; i < root->nchunks; i++) {
+            root->chunk[i] = v->root->chunk[i];
+            (void) atomic_inc_32_nv(&root->chunk[i]->nref);
+        }
+    }
+    b->root = root;
+    v->gen++;
+    *bp = b;
+    return 0;
+}
+
+/**
+ * Set an element in a batch
+ *
+ * The array takes ownership of val, unless this fails.  A replaced
+ * value is destroyed once no version uses it.
+ *
+ * @param [in] b A batch
+ * @param [in] i The element's index
+ * @param [in] val The value
+ *
+ * @return Zero on success, ERANGE if i is out of range, else a system
+ *         error code such as ENOMEM
+ */
+int
+tsv_vec_batch_set(tsv_vec_batch b, size_t i, void *val)
+{
+    struct vec_item *item;
+
+    return batch_set(b, i, val, &item);
+}
+
+/**
+ * Append an element in a batch
+ *
+ * The array takes ownership of val, unless this fails.
+ *
+ * @param [in] b A batch
+ * @param [in] val The value
+ *
+ * @return Zero on success, else a system error code such as ENOMEM
+ */
+int
+tsv_vec_batch_push(tsv_vec_batch b, void *val)
+{
+    struct vec_item *item;
+
+    return batch_push(b, val, &item);
+}
+
+/**
+ * Remove the last element in a batch
+ *
+ * The removed value is destroyed once no version uses it.
+ *
+ * @param [in] b A batch
+ *
+ * @return Zero on success, ERANGE if the array is empty, else a system
+ *         error code such as ENOMEM
+ */
+int
+tsv_vec_batch_pop(tsv_vec_batch b)
+{
+    struct tsv_vec_root *root = b->root;
+    struct vec_chunk *c;
+    size_t ci;
+
+    if (root->size == 0)
+        return ERANGE;
+    ci = (root->size - 1) / TSV_VEC_CHUNK;
+    if (root->chunk[ci]->count == 1) {
+        chunk_release(b->v->dtor, root->chunk[ci]);
+        root->nchunks--;
+    } else if ((c = batch_chunk(b, ci)) == NULL) {
+        return ENOMEM;
+    } else {
+        c->count--;
+        item_release(b->v->dtor, c->item[c->count]);
+    }
+    root->size--;
+    return 0;
+}
+
+/* Number of elements in the array as changed so far by a batch */
+size_t
+tsv_vec_batch_size(tsv_vec_batch b)
+{
+    return b->root->size;
+}
+
+/**
+ * Publish a batch of changes as a new version of its array
+ *
+ * If this fails the batch remains open, and must be committed again or
+ * aborted.
+ *
+ * @param [in] b A batch
+ * @param [out] version Pointer (may be NULL) to the new version
+ *
+ * @return Zero on success, else a system error code
+ */
+int
+tsv_vec_batch_commit(tsv_vec_batch b, uint64_t *version)
+{
+    tsv_vec v = b->v;
+    int err;
+
+    if ((err = thread_safe_var_set(v->var, b->root, version)) != 0)
+        return err;
+    v->root = b->root;
+    b->root = NULL;
+    (void) pthread_mutex_unlock(&v->write_lock);
+    return 0;
+}
+
+/**
+ * Discard a batch of changes
+ *
+ * Values given to the batch are destroyed.
+ *
+ * @param [in] b A batch
+ */
+void
+tsv_vec_batch_abort(tsv_vec_batch b)
+{
+    tsv_vec v = b->v;
+
+    root_destroy(b->root);
+    b->root = NULL;
+    (void) pthread_mutex_unlock(&v->write_lock);
+}
+
+/*
+ * Commit a batch of one change; on failure the value given to the batch
+ * is handed back to the caller rather than destroyed.
+ */
+static int
+commit_one(tsv_vec_batch b, struct vec_item *item, uint64_t *version)
+{
+    int err;
+
+    if ((err = tsv_vec_batch_commit(b, version)) != 0) {
+        item->val = NULL;
+        tsv_vec_batch_abort(b);
+    }
+    return err;
+}
+
+/**
+ * Set an element of an array and publish the new version
+ *
+ * The array takes ownership of val, unless this fails.  A replaced
+ * value is destroyed once no version uses it.
+ *
+ * @param [in] v An array
+ * @param [in] i The element's index
+ * @param [in] val The value
+ * @param [out] version Pointer (may be NULL) to the new version
+ *
+ * @return Zero on success, ERANGE if i is out of range, else a system
+ *         error code such as ENOMEM
+ */
+int
+tsv_vec_set(tsv_vec v, size_t i, void *val, uint64_t *version)
+{
+    struct vec_item *item;
+    tsv_vec_batch b;
+    int err;
+
+    if ((err = tsv_vec_batch_begin(v, &b)) != 0)
+        return err;
+    if ((err = batch_set(b, i, val, &item)) != 0) {
+        tsv_vec_batch_abort(b);
+        return err;
+    }
+    return commit_one(b, item, version);
+}
+
+/**
+ * Append an element to an array and publish the new version
+ *
+ * The array takes ownership of val, unless this fails.
+ *
+ * @param [in] v An array
+ * @param [in] val The value
+ * @param [out] version Pointer (may be NULL) to the new version
+ *
+ * @return Zero on success, else a system error code such as ENOMEM
+ */
+int
+tsv_vec_push(tsv_vec v, void *val, uint64_t *version)
+{
+    struct vec_item *item;
+    tsv_vec_batch b;
+    int err;
+
+    if ((err = tsv_vec_batch_begin(v, &b)) != 0)
+        return err;
+    if ((err = batch_push(b, val, &item)) != 0) {
+        tsv_vec_batch_abort(b);
+        return err;
+    }
+    return commit_one(b, item, version);
+}
+
+/**
+ * Remove the last element of an array and publish the new version
+ *
+ * The removed value is destroyed once no version uses it.
+ *
+ * @param [in] v An array
+ * @param [out] version Pointer (may be NULL) to the new version
+ *
+ * @return Zero on success, ERANGE if the array is empty, else a system
+ *         error code such as ENOMEM
+ */
+int
+tsv_vec_pop(tsv_vec v, uint64_t *version)
+{
+    tsv_vec_batch b;
+    int err;
+
+    if ((err = tsv_vec_batch_begin(v, &b)) != 0)
+        return err;
+    if ((err = tsv_vec_batch_pop(b)) != 0 ||
+        (err = tsv_vec_batch_commit(b, version)) != 0)
+        tsv_vec_batch_abort(b);
+    return err;
+}
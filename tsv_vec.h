@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2015 Cryptonector LLC
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef TSV_VEC_H
+#define TSV_VEC_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * A tsv_vec is a read-mostly array of values built on a
+ * thread_safe_var.
+ *
+ * Each version of the array is a table of fixed-size chunks of
+ * elements.  Changing an element copies just its chunk and the table,
+ * sharing the other chunks with the previous version, then publishes
+ * the new version.  Batches of changes copy each chunk at most once and
+ * are published together.  Readers index the version they read in
+ * O(1) and without locking; it remains valid until they read the array
+ * again (or call tsv_vec_release()).
+ *
+ * Writes are serialized.
+ */
+typedef struct tsv_vec_s *tsv_vec;
+
+/* A version of an array, as read by tsv_vec_read() */
+typedef const struct tsv_vec_root *tsv_vec_snapshot;
+
+/* A set of changes to publish together; see tsv_vec_batch_begin() */
+typedef struct tsv_vec_batch_s *tsv_vec_batch;
+
+typedef void (*tsv_vec_dtor_f)(void *);
+
+/* Number of elements per chunk */
+#define TSV_VEC_CHUNK   256
+
+int  tsv_vec_init(tsv_vec *, tsv_vec_dtor_f);
+void tsv_vec_destroy(tsv_vec);
+
+int  tsv_vec_read(tsv_vec, tsv_vec_snapshot *, uint64_t *);
+int  tsv_vec_at(tsv_vec_snapshot, size_t, void **);
+size_t tsv_vec_size(tsv_vec_snapshot);
+void tsv_vec_release(tsv_vec);
+
+int  tsv_vec_set(tsv_vec, size_t, void *, uint64_t *);
+int  tsv_vec_push(tsv_vec, void *, uint64_t *);
+int  tsv_vec_pop(tsv_vec, uint64_t *);
+
+int  tsv_vec_batch_begin(tsv_vec, tsv_vec_batch *);
+int  tsv_vec_batch_set(tsv_vec_batch, size_t, void *);
+int  tsv_vec_batch_push(tsv_vec_batch, void *);
+int  tsv_vec_batch_pop(tsv_vec_batch);
+size_t tsv_vec_batch_size(tsv_vec_batch);
+int  tsv_vec_batch_commit(tsv_vec_batch, uint64_t *);
+void tsv_vec_batch_abort(tsv_vec_batch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TSV_VEC_H */